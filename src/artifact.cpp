@@ -3,74 +3,616 @@
 #include "artifact.h"
 
 #include "conf.h"
+#include "json.h"
 
 #include <stdio.h>
 
 #include <algorithm>
 
 #include <list>
+#include <vector>
 
-#include <boost/property_tree/ptree.hpp>
-#include <boost/property_tree/json_parser.hpp>
 #include <boost/lexical_cast.hpp>
-#include <boost/filesystem.hpp>
 
-using namespace boost::filesystem;
-using boost::property_tree::ptree;
+#include <fstream>
+#include <sstream>
 
-/* ubuntu 10.04 includes boost 1.40, which has boost::filesystem API
-   2. 11.10 includes API 3. rather than demand and upgraded or
-   downgraded boost, I tried to write code that works with both. this
-   wrapper is needed to get a filename from an iterator.
-*/
-
-static string filename( const vector<path>::const_iterator & i )
-{
-#if defined(BOOST_FILESYSTEM_VERSION) && BOOST_FILESYSTEM_VERSION == 3
-    return i->filename().native();
-#else
-    return i->filename();
-#endif
-}
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+#include <sys/statvfs.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
 
 
 /*! \class Artifact artifact.h
 
     The Artifact class is a namespace class to gather various
     artifact-related functions and keep them from being globals.
-    
-    At the moment list() is the only function.
+
+    Artifacts are stored by content: Each file is stored once, in the
+    sha256 subdirectory of the artifact directory, named by its
+    SHA-256 digest. The names services use (e.g. id-server-1.4.2.zip)
+    are hard links to those blobs, so the install script sees the
+    same files as before, and two artifacts with the same contents
+    share one blob no matter what they're called.
+
+    A text file called index records, for each blob, its size, MD5
+    digest, when it was first and last used, how many services use it
+    now, where it came from and what it's called. The index is
+    locked using flock() on index.lock and replaced atomically.
+    find() and intact() let Download check a file using the index
+    instead of hashing it, add() stores a new file, use() and
+    release() maintain the reference counts, and list() lists the
+    names in the index.
+
+    evict() deletes the least recently used blobs that nobody uses
+    until the store fits its budget and the disk has room, and
+    remove() deletes a single artifact on request. Sweeper and
+    Download use the former, /artifact/uninstall the latter.
 */
 
 
-/*! Returns a json object containing a list of installed artifacts.
-    Format to be decided later; I don't think this is useful, so I'll
-    just do something and if we turn out to need it, but different,
-    we'll know how by then.
+/*! Returns a json object containing a list of installed artifacts,
+    as listed in the index. Format to be decided later; I don't think
+    this is useful, so I'll just do something and if we turn out to
+    need it, but different, we'll know how by then.
 */
 
 string Artifact::list()
 {
-    ostringstream os;
-    ptree pt;
+    string r;
+    JsonWriter w( r );
+    list( w );
+    return r;
+}
+
 
-    vector<path> sorted;
+/*! Writes the object returned by list() using \a w. */
+
+void Artifact::list( Writer & w )
+{
+    string dir = directory();
+    int fd = lock( dir, false );
+    map<string,Blob> index = read( dir );
+    if ( fd >= 0 )
+	::close( fd );
 
-    copy( directory_iterator( Conf::artefactdir ),
-	  directory_iterator(),
-	  back_inserter( sorted ) );
+    vector<string> sorted;
+    map<string,Blob>::iterator i( index.begin() );
+    while ( i != index.end() ) {
+	copy( i->second.aliases.begin(), i->second.aliases.end(),
+	      back_inserter( sorted ) );
+	++i;
+    }
     sort( sorted.begin(), sorted.end() );
 
-    vector<path>::const_iterator i = sorted.begin();
+    w.reserve( 16 + 64 * sorted.size() );
+    w.startObject();
+    vector<string>::const_iterator a = sorted.begin();
     int n = 1;
-    while ( i != sorted.end() ) {
-	if ( is_regular_file( *i ) ) {
-	    pt.put( boost::lexical_cast<string>( n ), filename( i ) );
-	    n++;
+    char key[16];
+    while ( a != sorted.end() ) {
+	::snprintf( key, sizeof( key ), "%d", n );
+	w.member( key );
+	w.text( *a );
+	n++;
+	++a;
+    }
+    w.endObject();
+}
+
+
+/*! Returns the directory where artifacts are stored. */
+
+string Artifact::directory()
+{
+    if ( !Conf::artefactdir.empty() && Conf::artefactdir[0] == '/' )
+	return Conf::artefactdir;
+    return Conf::basedir + "/" + Conf::artefactdir;
+}
+
+
+static string directoryOf( const string & path )
+{
+    string::size_type slash = path.rfind( '/' );
+    if ( slash == string::npos )
+	return ".";
+    return path.substr( 0, slash );
+}
+
+
+static string aliasOf( const string & path )
+{
+    string::size_type slash = path.rfind( '/' );
+    if ( slash == string::npos )
+	return path;
+    return path.substr( slash + 1 );
+}
+
+
+/*! Locks the index in \a dir, exclusively if \a exclusive is true
+    and shared otherwise. Returns a file descriptor which the caller
+    must close to release the lock, or -1 if the lock file cannot be
+    opened.
+*/
+
+int Artifact::lock( const string & dir, bool exclusive )
+{
+    string name = dir + "/index.lock";
+    int fd = ::open( name.c_str(), O_RDWR | O_CREAT, 0644 );
+    if ( fd < 0 )
+	fd = ::open( name.c_str(), O_RDONLY );
+    if ( fd >= 0 )
+	(void)::flock( fd, exclusive ? LOCK_EX : LOCK_SH );
+    return fd;
+}
+
+
+/*! Reads and returns the index in \a dir, keyed by digest. The caller
+    must hold the lock.
+
+    The index is a text file with one line per blob: Digest, size,
+    MD5 digest, first and last use, number of references, source and
+    the aliases. A dash stands for an empty field.
+*/
+
+map<string,Artifact::Blob> Artifact::read( const string & dir )
+{
+    map<string,Blob> r;
+    ifstream f( ( dir + "/index" ).c_str() );
+    string line;
+    while ( getline( f, line ) ) {
+	istringstream l( line );
+	Blob b;
+	if ( !( l >> b.digest >> b.size >> b.md5 >> b.first >> b.last
+		  >> b.refs >> b.source ) )
+	    continue;
+	if ( b.md5 == "-" )
+	    b.md5.clear();
+	if ( b.source == "-" )
+	    b.source.clear();
+	string alias;
+	while ( l >> alias )
+	    b.aliases.push_back( alias );
+	r[b.digest] = b;
+    }
+    return r;
+}
+
+
+/*! Writes \a index to \a dir, atomically. Returns true if all went
+    well. The caller must hold an exclusive lock.
+*/
+
+bool Artifact::write( const string & dir, const map<string,Blob> & index )
+{
+    string name = dir + "/index";
+    string tmp = name + ".tmp";
+    {
+	ofstream f( tmp.c_str() );
+	map<string,Blob>::const_iterator i( index.begin() );
+	while ( i != index.end() ) {
+	    const Blob & b = i->second;
+	    f << b.digest << ' ' << b.size << ' '
+	      << ( b.md5.empty() ? "-" : b.md5 ) << ' '
+	      << b.first << ' ' << b.last << ' ' << b.refs << ' '
+	      << ( b.source.empty() ? "-" : b.source );
+	    std::list<string>::const_iterator a( b.aliases.begin() );
+	    while ( a != b.aliases.end() ) {
+		f << ' ' << *a;
+		++a;
+	    }
+	    f << '\n';
+	    ++i;
+	}
+	f.flush();
+	if ( !f )
+	    return false;
+    }
+    return ::rename( tmp.c_str(), name.c_str() ) == 0;
+}
+
+
+/*! Looks up the file \a path in the index of its directory, and
+    stores what the index knows in \a blob. Returns true if the index
+    knows the file, false if not.
+*/
+
+bool Artifact::find( const string & path, Blob & blob )
+{
+    string dir = directoryOf( path );
+    string alias = aliasOf( path );
+    int fd = lock( dir, false );
+    map<string,Blob> index = read( dir );
+    if ( fd >= 0 )
+	::close( fd );
+
+    map<string,Blob>::iterator i( index.begin() );
+    while ( i != index.end() ) {
+	std::list<string> & a = i->second.aliases;
+	if ( std::find( a.begin(), a.end(), alias ) != a.end() ) {
+	    blob = i->second;
+	    return true;
+	}
+	++i;
+    }
+    return false;
+}
+
+
+/*! Returns true if \a path still is the file \a blob describes: The
+    same file as the stored blob, with the recorded size. This is
+    what Download uses instead of hashing the file again.
+*/
+
+bool Artifact::intact( const string & path, const Blob & blob )
+{
+    string stored = directoryOf( path ) + "/sha256/" + blob.digest;
+    struct stat a;
+    struct stat b;
+    return ::stat( path.c_str(), &a ) == 0 &&
+	   ::stat( stored.c_str(), &b ) == 0 &&
+	   a.st_dev == b.st_dev && a.st_ino == b.st_ino &&
+	   b.st_size == blob.size;
+}
+
+
+/*! Adds \a file to the store in the directory of \a path, and makes
+    \a path an alias for it. \a digest is the file's SHA-256 digest,
+    \a md5 its MD5 digest and \a source the URL it came from (may be
+    empty).
+
+    If the store already contains a blob with the same digest, \a
+    file is discarded and \a path becomes a link to the existing blob,
+    so that identical artifacts are stored only once. \a file may be
+    the same as \a path.
+
+    Returns true if all went well.
+*/
+
+bool Artifact::add( const string & file, const string & path,
+		    const string & digest, const string & md5,
+		    const string & source )
+{
+    string dir = directoryOf( path );
+    string alias = aliasOf( path );
+    string stored = dir + "/sha256/" + digest;
+
+    int fd = lock( dir, true );
+    (void)::mkdir( ( dir + "/sha256" ).c_str(), 0755 );
+
+    bool ok = true;
+    struct stat st;
+    if ( ::stat( stored.c_str(), &st ) == 0 ) {
+	// we have it already
+	if ( file != path )
+	    ::unlink( file.c_str() );
+    } else if ( file == path ) {
+	ok = ::link( file.c_str(), stored.c_str() ) == 0;
+    } else {
+	ok = ::rename( file.c_str(), stored.c_str() ) == 0;
+    }
+
+    // replace the alias atomically, so it's never missing
+    string tmp = path + ".link";
+    ::unlink( tmp.c_str() );
+    if ( ok )
+	ok = ::link( stored.c_str(), tmp.c_str() ) == 0 &&
+	     ::rename( tmp.c_str(), path.c_str() ) == 0;
+    if ( ok )
+	ok = ::stat( stored.c_str(), &st ) == 0;
+
+    if ( ok ) {
+	map<string,Blob> index = read( dir );
+	map<string,Blob>::iterator i( index.begin() );
+	while ( i != index.end() ) {
+	    i->second.aliases.remove( alias );
+	    ++i;
+	}
+
+	long long now = ::time( 0 );
+	Blob & b = index[digest];
+	if ( b.digest.empty() ) {
+	    b.digest = digest;
+	    b.first = now;
+	}
+	b.size = st.st_size;
+	if ( !md5.empty() )
+	    b.md5 = md5;
+	if ( !source.empty() )
+	    b.source = source;
+	b.last = now;
+	b.aliases.push_back( alias );
+	ok = write( dir, index );
+    }
+
+    if ( fd >= 0 )
+	::close( fd );
+    return ok;
+}
+
+
+/*! Adds \a delta to the reference count of the blob \a path refers
+    to, and records the time of use.
+*/
+
+void Artifact::adjust( const string & path, int delta )
+{
+    string dir = directoryOf( path );
+    string alias = aliasOf( path );
+    int fd = lock( dir, true );
+    map<string,Blob> index = read( dir );
+    map<string,Blob>::iterator i( index.begin() );
+    while ( i != index.end() ) {
+	std::list<string> & a = i->second.aliases;
+	if ( std::find( a.begin(), a.end(), alias ) != a.end() ) {
+	    i->second.refs += delta;
+	    if ( i->second.refs < 0 )
+		i->second.refs = 0;
+	    i->second.last = ::time( 0 );
+	    (void)write( dir, index );
+	    break;
 	}
 	++i;
     }
+    if ( fd >= 0 )
+	::close( fd );
+}
+
+
+/*! Records that a service has started using the artifact at \a
+    path. Process calls this each time it starts a service or the
+    install stage that unpacks the artifact, so that evict() in a
+    Download child leaves the artifact alone.
+*/
+
+void Artifact::use( const string & path )
+{
+    adjust( path, 1 );
+}
+
+
+/*! Records that a service has stopped using the artifact at \a path.
+    The reverse of use().
+*/
+
+void Artifact::release( const string & path )
+{
+    adjust( path, -1 );
+}
+
+
+/*! Sets all reference counts in the index to 0. nodee calls this at
+    startup, since the services that used artifacts before aren't
+    managed any more.
+*/
+
+void Artifact::clearReferences()
+{
+    string dir = directory();
+    int fd = lock( dir, true );
+    map<string,Blob> index = read( dir );
+    map<string,Blob>::iterator i( index.begin() );
+    while ( i != index.end() ) {
+	i->second.refs = 0;
+	++i;
+    }
+    if ( !index.empty() )
+	(void)write( dir, index );
+    if ( fd >= 0 )
+	::close( fd );
+}
+
+
+/*! Deletes the blob \a b and its aliases from \a dir. The caller
+    must hold an exclusive lock and remove \a b from the index.
+*/
+
+static void unlinkBlob( const string & dir, const Artifact::Blob & b )
+{
+    std::list<string>::const_iterator a( b.aliases.begin() );
+    while ( a != b.aliases.end() ) {
+	::unlink( ( dir + "/" + *a ).c_str() );
+	++a;
+    }
+    ::unlink( ( dir + "/sha256/" + b.digest ).c_str() );
+}
+
+
+/*! Returns true if the blob \a b in \a dir is used, either by a
+    service according to the index, or because one of its aliases is
+    in \a busy.
+*/
+
+static bool used( const string & dir, const Artifact::Blob & b,
+		  const set<string> & busy )
+{
+    if ( b.refs > 0 )
+	return true;
+    std::list<string>::const_iterator a( b.aliases.begin() );
+    while ( a != b.aliases.end() ) {
+	if ( busy.count( dir + "/" + *a ) )
+	    return true;
+	++a;
+    }
+    return false;
+}
+
+
+/*! Removes the artifact called \a path. If no other name refers to
+    the same blob, the blob is deleted too.
+
+    Returns false if the index doesn't know \a path, or if it's used
+    as for evict(): by a service, or by a download or install stage
+    that names it in \a busy. In that case nothing is removed.
+*/
 
-    write_json( os, pt );
-    return os.str();
+bool Artifact::remove( const string & path, const set<string> & busy )
+{
+    string dir = directoryOf( path );
+    string alias = aliasOf( path );
+    int fd = lock( dir, true );
+    map<string,Blob> index = read( dir );
+
+    bool ok = false;
+    map<string,Blob>::iterator i( index.begin() );
+    while ( i != index.end() ) {
+	std::list<string> & a = i->second.aliases;
+	if ( std::find( a.begin(), a.end(), alias ) != a.end() )
+	    break;
+	++i;
+    }
+    if ( i != index.end() && !used( dir, i->second, busy ) ) {
+	Blob & b = i->second;
+	if ( b.aliases.size() > 1 ) {
+	    ::unlink( path.c_str() );
+	    b.aliases.remove( alias );
+	} else {
+	    unlinkBlob( dir, b );
+	    index.erase( i );
+	}
+	ok = write( dir, index );
+    }
+
+    if ( fd >= 0 )
+	::close( fd );
+    return ok;
+}
+
+
+/*! Returns the number of bytes available to nodee on the filesystem
+    containing \a dir, or -1 if that cannot be determined.
+*/
+
+long long Artifact::available( const string & dir )
+{
+    struct statvfs fs;
+    if ( ::statvfs( dir.c_str(), &fs ) < 0 )
+	return -1;
+    return (long long)fs.f_bavail * fs.f_frsize;
+}
+
+
+/*! Deletes blobs in \a dir, least recently used first, until the
+    blobs add up to at most \a budget bytes (0 means no limit) and
+    the filesystem has at least \a room bytes available, plus 5% of
+    its size.
+
+    Blobs that a service uses according to the index, and blobs with
+    an alias in \a busy, are never deleted. \a busy contains full
+    paths, like the arguments to use() and release().
+
+    Returns the number of bytes freed.
+*/
+
+long long Artifact::evict( const string & dir, long long budget,
+			   long long room, const set<string> & busy )
+{
+    int fd = lock( dir, true );
+    map<string,Blob> index = read( dir );
+
+    long long total = 0;
+    vector< pair<long long,string> > candidates;
+    map<string,Blob>::iterator i( index.begin() );
+    while ( i != index.end() ) {
+	const Blob & b = i->second;
+	total += b.size;
+	if ( !used( dir, b, busy ) )
+	    candidates.push_back( make_pair( b.last, b.digest ) );
+	++i;
+    }
+    sort( candidates.begin(), candidates.end() );
+
+    long long needed = 0;
+    if ( budget && total > budget )
+	needed = total - budget;
+    struct statvfs fs;
+    if ( ::statvfs( dir.c_str(), &fs ) == 0 ) {
+	long long free = (long long)fs.f_bavail * fs.f_frsize;
+	long long wanted = room + (long long)fs.f_blocks * fs.f_frsize / 20;
+	if ( free < wanted && wanted - free > needed )
+	    needed = wanted - free;
+    }
+
+    long long freed = 0;
+    vector< pair<long long,string> >::iterator c( candidates.begin() );
+    while ( freed < needed && c != candidates.end() ) {
+	Blob & b = index[c->second];
+	unlinkBlob( dir, b );
+	freed += b.size;
+	index.erase( c->second );
+	++c;
+    }
+    if ( freed )
+	(void)write( dir, index );
+
+    if ( fd >= 0 )
+	::close( fd );
+    return freed;
+}
+
+
+/*! Returns the stored blob from which another version of the same
+    artifact was unpacked, or an empty string if there is none. \a
+    dir is the artifact directory and \a tree the software directory
+    of the new version (see Process::software()), so the other
+    versions are its siblings. If there are several, the one unpacked
+    most recently is chosen.
+
+    Download uses the result as the basis for a Delta.
+*/
+
+string Artifact::earlier( const string & dir, const string & tree )
+{
+    map<string,string> blobs;
+    int fd = lock( dir, false );
+    map<string,Blob> index = read( dir );
+    if ( fd >= 0 )
+	::close( fd );
+    map<string,Blob>::iterator i( index.begin() );
+    while ( i != index.end() ) {
+	string path = dir + "/sha256/" + i->second.digest;
+	struct stat st;
+	if ( ::stat( path.c_str(), &st ) == 0 )
+	    blobs[boost::lexical_cast<string>( st.st_dev ) + ":" +
+		  boost::lexical_cast<string>( st.st_ino )] = path;
+	++i;
+    }
+
+    string versions = directoryOf( tree );
+    DIR * d = ::opendir( versions.c_str() );
+    if ( !d )
+	return "";
+    string best;
+    time_t newest = 0;
+    struct dirent * e;
+    while ( ( e = ::readdir( d ) ) != 0 ) {
+	string name = e->d_name;
+	string path = versions + "/" + name;
+	if ( name[0] == '.' || path == tree ||
+	     name.find( ".tmp." ) != string::npos ||
+	     name.find( ".old." ) != string::npos )
+	    continue;
+	// an unpacked tree names its source inside, an image beside it
+	string marker = path + ".image";
+	struct stat st;
+	if ( ::stat( marker.c_str(), &st ) < 0 ) {
+	    marker = path + "/.nodee-source";
+	    if ( ::stat( marker.c_str(), &st ) < 0 )
+		continue;
+	}
+	ifstream f( marker.c_str() );
+	string id;
+	f >> id;
+	map<string,string>::iterator b( blobs.find( id ) );
+	if ( b != blobs.end() && ( best.empty() || st.st_mtime > newest ) ) {
+	    best = b->second;
+	    newest = st.st_mtime;
+	}
+    }
+    ::closedir( d );
+    return best;
 }
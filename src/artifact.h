@@ -5,10 +5,54 @@
 
 #include "init.h"
 
+#include <list>
+#include <map>
+#include <set>
+#include <string>
+
+using namespace std;
+
+
 class Artifact
 {
 public:
+    struct Blob {
+	Blob(): size( 0 ), first( 0 ), last( 0 ), refs( 0 ) {}
+	string digest;
+	long long size;
+	string md5;
+	long long first;
+	long long last;
+	int refs;
+	string source;
+	list<string> aliases;
+    };
+
     static string list();
+    static void list( class Writer & );
+
+    static string directory();
+
+    static bool find( const string &, Blob & );
+    static bool intact( const string &, const Blob & );
+    static bool add( const string &, const string &,
+		     const string &, const string &, const string & );
+    static void use( const string & );
+    static void release( const string & );
+    static void clearReferences();
+
+    static bool remove( const string &, const set<string> & );
+    static long long evict( const string &, long long, long long,
+			    const set<string> & );
+    static long long available( const string & );
+
+    static string earlier( const string &, const string & );
+
+private:
+    static int lock( const string &, bool );
+    static map<string,Blob> read( const string & );
+    static bool write( const string &, const map<string,Blob> & );
+    static void adjust( const string &, int );
 };
 
 
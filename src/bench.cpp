@@ -0,0 +1,283 @@
+// Copyright Arnt Gulbrandsen <arnt@gulbrandsen.priv.no>; BSD-licensed.
+
+#include "serverspec.h"
+#include "process.h"
+#include "init.h"
+#include "service.h"
+#include "hoststatus.h"
+#include "cbor.h"
+#include "log.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <new>
+
+#include <fstream>
+#include <sstream>
+
+#include <boost/property_tree/ptree.hpp>
+#include <boost/property_tree/json_parser.hpp>
+
+using boost::property_tree::ptree;
+
+
+// compares ServerSpec's parse and accessor costs with those of the
+// property tree it used to wrap, counts the allocations made by the
+// copies along the launch path, and compares /service/list as it
+// used to be written with JsonWriter, the sizes of the JSON and
+// CBOR forms, and the cost of a log line with and without the
+// background writer. run using "make bench".
+
+
+static long long allocations = 0;
+
+
+void * operator new( size_t n ) throw( std::bad_alloc )
+{
+    allocations++;
+    void * p = ::malloc( n ? n : 1 );
+    if ( !p )
+	throw std::bad_alloc();
+    return p;
+}
+
+
+void operator delete( void * p ) throw()
+{
+    ::free( p );
+}
+
+
+static const char * spec =
+    "{"
+    "  \"coordinate\" : \"1.idee-prod.ideeuser.ie\","
+    "  \"artifact\" : \"com.telenor:id-server:1.4.2\","
+    "  \"filename\" : \"id-server-1.4.2-shaded.jar\","
+    "  \"url\" : \"http://depot.example.com/id-server-1.4.2-shaded.jar\","
+    "  \"md5\" : \"2c6ca63c97c04c821613f1251643c3bb\","
+    "  \"port\" : 8080,"
+    "  \"expectedram\" : 200000,"
+    "  \"expectedpeakram\" : 400000,"
+    "  \"value\" : 10,"
+    "  \"options\" : {"
+    "    \"--someoption\" : \"some value\","
+    "    \"--anotheroption\" : \"more config\""
+    "  },"
+    "  \"restart\" : {"
+    "    \"period\" : 120,"
+    "    \"maxrestarts\" : 10,"
+    "    \"leaking\" : true"
+    "  },"
+    "  \"pressure\" : {"
+    "    \"signal\" : 12,"
+    "    \"url\" : \"http://localhost:8080/dropcaches\""
+    "  }"
+    "}";
+
+
+static double now()
+{
+    struct timespec t;
+    ::clock_gettime( CLOCK_MONOTONIC, &t );
+    return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+
+static void report( const char * what, double seconds, int n )
+{
+    ::printf( "%-32s %10.1f ns\n", what, seconds * 1e9 / n );
+    ::fflush( stdout );
+}
+
+
+// Service::list() as it was before JsonWriter
+static string ptreeList( Init & init )
+{
+    ptree pt;
+    list<Process *>::iterator m( init.processes().begin() );
+    while ( m != init.processes().end() ) {
+	std::ostringstream prefix;
+	prefix << "services." << (*m)->pid();
+	pt.put( prefix.str() + ".value", (*m)->spec().value() );
+	pt.put( prefix.str() + ".rss", (*m)->currentRss() );
+	pt.put( prefix.str() + ".recentfaults", (*m)->recentPageFaults() );
+	pt.put( prefix.str() + ".cpu", (*m)->cpuUsage() );
+	pt.put( prefix.str() + ".io", (*m)->ioRate() );
+	++m;
+    }
+    std::ostringstream os;
+    write_json( os, pt );
+    return os.str();
+}
+
+
+int main()
+{
+    Init init;
+    const int parses = 20000;
+    const int lookups = 1000000;
+    long long sum = 0;
+
+    double start = now();
+    int i = 0;
+    while ( i < parses ) {
+	ptree pt;
+	std::istringstream in( spec );
+	read_json( in, pt );
+	sum += pt.get<int>( "port" );
+	i++;
+    }
+    report( "parse, property tree", now() - start, parses );
+
+    start = now();
+    i = 0;
+    while ( i < parses ) {
+	ServerSpec s = ServerSpec::parseJson( spec, init );
+	sum += s.port();
+	i++;
+    }
+    report( "parse, ServerSpec", now() - start, parses );
+
+    // the accessors ChoreKeeper uses, as they used to be and now
+    ptree pt;
+    std::istringstream in( spec );
+    read_json( in, pt );
+    start = now();
+    i = 0;
+    while ( i < lookups ) {
+	sum += pt.get<int>( "port" );
+	sum += pt.get<int>( "value", 0 );
+	sum += pt.get<int>( "expectedpeakram", 0 );
+	sum += pt.get<string>( "coordinate" ).size();
+	i++;
+    }
+    report( "four accessors, property tree", now() - start, lookups );
+
+    ServerSpec s = ServerSpec::parseJson( spec, init );
+    start = now();
+    i = 0;
+    while ( i < lookups ) {
+	sum += s.port();
+	sum += s.value();
+	sum += s.expectedPeakMemory();
+	sum += s.coordinate().size();
+	i++;
+    }
+    report( "four accessors, ServerSpec", now() - start, lookups );
+
+    // what Process::launch() and Process::download() do with the
+    // spec: three stages get a copy, two of them a different script
+    const int launches = 100000;
+    map<string,string> options;
+    options["--filename"] = "/opt/nodee/artifacts/id-server-1.4.2.jar";
+    options["--url"] = "http://depot.example.com/id-server-1.4.2.jar";
+    long long before = allocations;
+    start = now();
+    i = 0;
+    while ( i < launches ) {
+	Process useful;
+	Process install( 0, 0 );
+	Process download( 0, 0 );
+	ServerSpec u( s );
+	ServerSpec in( s );
+	in.setStartupScript( "/usr/local/lib/nodee/install", options );
+	ServerSpec d( s );
+	d.setStartupScript( "/usr/local/lib/nodee/download", options );
+	sum += u.port() + in.startupOptions().size() + d.port();
+	i++;
+    }
+    report( "spec copies per launch", now() - start, launches );
+    ::printf( "%-32s %10.1f\n", "allocations per launch",
+	      (double)( allocations - before ) / launches );
+    ::fflush( stdout );
+
+    // a host with a few hundred services
+    Init many;
+    i = 0;
+    while ( i < 300 ) {
+	Process * p = new Process;
+	p->fakefork( 100000 + i );
+	p->setCurrentRss( 200000 + i );
+	p->setPageFaults( i );
+	many.manage( p );
+	i++;
+    }
+    const int lists = 200;
+    before = allocations;
+    start = now();
+    i = 0;
+    while ( i < lists ) {
+	sum += ptreeList( many ).size();
+	i++;
+    }
+    report( "300 services, property tree", now() - start, lists );
+    ::printf( "%-32s %10.1f\n", "allocations per list",
+	      (double)( allocations - before ) / lists );
+    before = allocations;
+    start = now();
+    i = 0;
+    while ( i < lists ) {
+	sum += Service::list( many ).size();
+	i++;
+    }
+    report( "300 services, JsonWriter", now() - start, lists );
+    ::printf( "%-32s %10.1f\n", "allocations per list",
+	      (double)( allocations - before ) / lists );
+
+    string cbor;
+    CborWriter w( cbor );
+    Service::list( many, w );
+    ::printf( "%-32s %10d bytes\n", "300 services, JSON",
+	      (int)Service::list( many ).size() );
+    ::printf( "%-32s %10d bytes\n", "300 services, CBOR", (int)cbor.size() );
+    HostStatus status;
+    ::printf( "%-32s %10d bytes\n", "host status, JSON",
+	      (int)string( status ).size() );
+    ::printf( "%-32s %10d bytes\n", "host status, CBOR",
+	      (int)status.cbor().size() );
+    ::fflush( stdout );
+
+    // a log line as it used to be written, straight to the file, and
+    // as it is now, copied to a ring which another thread writes
+    const int lines = 10000;
+    const char * coordinate = "id-server.prod.ideeuser.ie";
+    std::ofstream direct( "/dev/null" );
+    start = now();
+    i = 0;
+    while ( i < lines ) {
+	direct << "nodee: Forked coordinate " << coordinate << " to pid " << i
+	       << std::endl;
+	i++;
+    }
+    report( "log line, ofstream", now() - start, lines );
+    int saved = ::dup( 1 );
+    int null = ::open( "/dev/null", O_WRONLY );
+    ::dup2( null, 1 );
+    Log::start();
+    double ring = 0;
+    i = 0;
+    while ( i < lines ) {
+	// in bursts, so the writer keeps up as it would in nodee
+	start = now();
+	int j = 0;
+	while ( j < 100 ) {
+	    debug << "nodee: Forked coordinate " << coordinate << " to pid " << i
+		  << std::endl;
+	    j++;
+	    i++;
+	}
+	ring += now() - start;
+	::usleep( 1000 );
+    }
+    Log::flush();
+    ::dup2( saved, 1 );
+    report( "log line, ring", ring, lines );
+    ::printf( "%-32s %10llu\n", "log lines dropped", Log::dropped() );
+
+    // keeps the compiler from optimising the loops away
+    return sum == 42 ? 1 : 0;
+}
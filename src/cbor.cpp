@@ -0,0 +1,468 @@
+// Copyright Arnt Gulbrandsen <arnt@gulbrandsen.priv.no>; BSD-licensed.
+
+#include "cbor.h"
+
+#include "json.h"
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+
+/*! \class CborWriter cbor.h
+
+    The CborWriter class appends CBOR (RFC 8949) to a string. It
+    implements the same Writer interface as JsonWriter, so everything
+    nodee can write as JSON it can also write as CBOR, with the same
+    structure.
+
+    Objects and arrays are written with indefinite length, so that
+    nothing needs to be counted in advance, and integers use the
+    shortest encoding. Members that nodee only passes on (see raw())
+    are translated from JSON.
+
+    CBOR is typically less than half the size of nodee's
+    pretty-printed JSON, which matters for the zookeeper node that
+    watchers fetch from every host.
+*/
+
+
+/*! Constructs a CborWriter which appends to \a output. */
+
+CborWriter::CborWriter( string & output )
+    : Writer( output )
+{
+}
+
+
+/*! Starts a map (a JSON object). */
+
+void CborWriter::startObject()
+{
+    o += (char)0xbf;
+}
+
+
+/*! Writes \a name as the key of the next map entry. */
+
+void CborWriter::member( const string & name )
+{
+    text( name );
+}
+
+
+/*! Finishes the current map. */
+
+void CborWriter::endObject()
+{
+    o += (char)0xff;
+}
+
+
+/*! Starts an array. */
+
+void CborWriter::startArray()
+{
+    o += (char)0x9f;
+}
+
+
+/*! Finishes the current array. */
+
+void CborWriter::endArray()
+{
+    o += (char)0xff;
+}
+
+
+/*! Writes \a s as a text string, replacing any invalid UTF-8 with
+    U+FFFD.
+*/
+
+void CborWriter::text( const string & s )
+{
+    string::size_type i = 0;
+    while ( i < s.size() && (unsigned char)s[i] < 0x80 )
+	i++;
+    while ( i < s.size() ) {
+	unsigned int n = utf8( s, i );
+	if ( !n )
+	    break;
+	i += n;
+    }
+    if ( i == s.size() ) {
+	head( 3, s.size() );
+	o += s;
+	return;
+    }
+
+    string clean( s, 0, i );
+    while ( i < s.size() ) {
+	unsigned int n = utf8( s, i );
+	if ( n ) {
+	    clean.append( s, i, n );
+	    i += n;
+	} else {
+	    clean += "\xef\xbf\xbd";
+	    i++;
+	}
+    }
+    head( 3, clean.size() );
+    o += clean;
+}
+
+
+/*! Writes \a n as a positive or negative integer. */
+
+void CborWriter::number( long long n )
+{
+    if ( n >= 0 )
+	head( 0, n );
+    else
+	head( 1, -1 - n );
+}
+
+
+/*! Writes \a b as true or false. */
+
+void CborWriter::boolean( bool b )
+{
+    o += (char)( b ? 0xf5 : 0xf4 );
+}
+
+
+/*! Translates the JSON value \a json to CBOR. Numbers that aren't
+    integers become doubles. If \a json is not valid, null is written
+    instead, so the output stays well-formed.
+*/
+
+void CborWriter::raw( const string & json )
+{
+    string::size_type start = o.size();
+    JsonParser j( json );
+    transcode( j );
+    if ( !j.atEnd() ) {
+	o.erase( start );
+	o += (char)0xf6;
+    }
+}
+
+
+/*! Writes the head of a data item of \a major type, with \a n as its
+    argument, using the shortest form.
+*/
+
+void CborWriter::head( int major, unsigned long long n )
+{
+    int m = major << 5;
+    int bytes = 0;
+    if ( n < 24 ) {
+	o += (char)( m | n );
+	return;
+    } else if ( n < 0x100ULL ) {
+	o += (char)( m | 24 );
+	bytes = 1;
+    } else if ( n < 0x10000ULL ) {
+	o += (char)( m | 25 );
+	bytes = 2;
+    } else if ( n < 0x100000000ULL ) {
+	o += (char)( m | 26 );
+	bytes = 4;
+    } else {
+	o += (char)( m | 27 );
+	bytes = 8;
+    }
+    while ( bytes ) {
+	bytes--;
+	o += (char)( ( n >> ( bytes * 8 ) ) & 0xff );
+    }
+}
+
+
+/*! Reads one value from \a j and writes it as CBOR. */
+
+void CborWriter::transcode( JsonParser & j )
+{
+    string t;
+    bool b;
+    switch ( j.next() ) {
+    case JsonParser::Object:
+	j.startObject();
+	startObject();
+	while ( j.member( t ) ) {
+	    member( t );
+	    transcode( j );
+	}
+	endObject();
+	break;
+    case JsonParser::Array:
+	j.startArray();
+	startArray();
+	while ( j.element() )
+	    transcode( j );
+	endArray();
+	break;
+    case JsonParser::String:
+	j.text( t );
+	text( t );
+	break;
+    case JsonParser::Number:
+	t = j.raw();
+	if ( t.find_first_of( ".eE" ) == string::npos &&
+	     t.size() < 19 ) {
+	    number( ::strtoll( t.c_str(), 0, 10 ) );
+	} else {
+	    double d = ::strtod( t.c_str(), 0 );
+	    unsigned long long u;
+	    ::memcpy( &u, &d, 8 );
+	    o += (char)0xfb;
+	    int i = 8;
+	    while ( i ) {
+		i--;
+		o += (char)( ( u >> ( i * 8 ) ) & 0xff );
+	    }
+	}
+	break;
+    case JsonParser::Boolean:
+	j.boolean( b );
+	boolean( b );
+	break;
+    case JsonParser::Null:
+    case JsonParser::Invalid:
+	j.skip();
+	o += (char)0xf6;
+	break;
+    }
+}
+
+
+/*! \class CborReader cbor.h
+
+    The CborReader class decodes CBOR and writes it out again using
+    any Writer. Given a JsonWriter, it turns CBOR from nodee (or
+    anything else) into JSON:
+
+    \code
+    string json;
+    JsonWriter w( json );
+    CborReader r( cbor );
+    if ( !r.read( w ) )
+	...
+    \endcode
+
+    Maps must have text keys. Byte strings become text strings, tags
+    are ignored, undefined becomes null, and floating-point numbers
+    are passed on using Writer::raw().
+*/
+
+
+/*! Constructs a CborReader for \a cbor, which must remain valid as
+    long as the reader is used.
+*/
+
+CborReader::CborReader( const string & cbor )
+    : s( cbor ), i( 0 )
+{
+}
+
+
+/*! Decodes a single data item and writes it using \a w. Returns
+    true if the input was a single well-formed data item, false if
+    not. \a w may have received part of the value in the latter case.
+*/
+
+bool CborReader::read( Writer & w )
+{
+    i = 0;
+    return item( w, 0 ) && i == s.size();
+}
+
+
+/*! Decodes a data item at nesting level \a depth and writes it using
+    \a w. Returns false in case of error.
+*/
+
+bool CborReader::item( Writer & w, int depth )
+{
+    if ( depth > 64 )
+	return false;
+
+    int major, info;
+    unsigned long long n;
+    if ( !head( major, info, n ) )
+	return false;
+
+    string t;
+    switch ( major ) {
+    case 0:
+	if ( n > 0x7fffffffffffffffULL ) {
+	    char tmp[24];
+	    ::snprintf( tmp, sizeof( tmp ), "%llu", n );
+	    w.raw( tmp );
+	} else {
+	    w.number( (long long)n );
+	}
+	return true;
+    case 1:
+	if ( n > 0x7fffffffffffffffULL ) {
+	    char tmp[24];
+	    ::snprintf( tmp, sizeof( tmp ), "-%llu", n );
+	    w.raw( tmp );
+	} else {
+	    w.number( -1 - (long long)n );
+	}
+	return true;
+    case 2:
+    case 3:
+	if ( !bytes( t, major, info, n ) )
+	    return false;
+	w.text( t );
+	return true;
+    case 4:
+	w.startArray();
+	while ( info == 31 ? i < s.size() && (unsigned char)s[i] != 0xff
+			   : n-- > 0 ) {
+	    if ( !item( w, depth + 1 ) )
+		return false;
+	}
+	if ( info == 31 ) {
+	    if ( i >= s.size() )
+		return false;
+	    i++;
+	}
+	w.endArray();
+	return true;
+    case 5:
+	w.startObject();
+	while ( info == 31 ? i < s.size() && (unsigned char)s[i] != 0xff
+			   : n-- > 0 ) {
+	    int km, ki;
+	    unsigned long long kn;
+	    if ( !head( km, ki, kn ) || km != 3 || !bytes( t, km, ki, kn ) )
+		return false;
+	    w.member( t );
+	    if ( !item( w, depth + 1 ) )
+		return false;
+	}
+	if ( info == 31 ) {
+	    if ( i >= s.size() )
+		return false;
+	    i++;
+	}
+	w.endObject();
+	return true;
+    case 6:
+	return item( w, depth + 1 );
+    }
+
+    // major type 7: simple values and floats
+    double d;
+    if ( info == 20 || info == 21 ) {
+	w.boolean( info == 21 );
+	return true;
+    } else if ( info == 22 || info == 23 ) {
+	w.raw( "null" );
+	return true;
+    } else if ( info == 25 ) {
+	int e = ( n >> 10 ) & 0x1f;
+	double m = n & 0x3ff;
+	if ( e == 0 )
+	    d = ::ldexp( m, -24 );
+	else
+	    d = ::ldexp( m + 1024, e - 25 );
+	if ( n & 0x8000 )
+	    d = -d;
+	if ( e == 31 ) {
+	    w.raw( "null" );
+	    return true;
+	}
+    } else if ( info == 26 ) {
+	float f;
+	unsigned int u = n;
+	::memcpy( &f, &u, 4 );
+	d = f;
+    } else if ( info == 27 ) {
+	::memcpy( &d, &n, 8 );
+    } else {
+	return false;
+    }
+    if ( d != d || d - d != 0 ) {
+	// NaN and the infinities have no JSON form
+	w.raw( "null" );
+    } else {
+	char tmp[32];
+	::snprintf( tmp, sizeof( tmp ), "%.17g", d );
+	w.raw( tmp );
+    }
+    return true;
+}
+
+
+/*! Reads the head of a data item, storing its \a major type, the
+    additional \a info and the argument \a n. Returns false if the
+    input ends too early or uses a reserved value.
+*/
+
+bool CborReader::head( int & major, int & info, unsigned long long & n )
+{
+    if ( i >= s.size() )
+	return false;
+    unsigned char c = s[i++];
+    major = c >> 5;
+    info = c & 0x1f;
+    n = 0;
+    int bytes = 0;
+    if ( info < 24 )
+	n = info;
+    else if ( info == 24 )
+	bytes = 1;
+    else if ( info == 25 )
+	bytes = 2;
+    else if ( info == 26 )
+	bytes = 4;
+    else if ( info == 27 )
+	bytes = 8;
+    else if ( info != 31 || major == 0 || major == 1 || major == 6 )
+	return false;
+    if ( i + bytes > s.size() )
+	return false;
+    while ( bytes ) {
+	n = ( n << 8 ) | (unsigned char)s[i++];
+	bytes--;
+    }
+    return true;
+}
+
+
+/*! Reads the content of a byte or text string of \a major type into
+    \a r, whose head had the additional \a info and argument \a n.
+    Handles both definite and indefinite lengths.
+*/
+
+bool CborReader::bytes( string & r, int major, int info,
+			unsigned long long n )
+{
+    if ( info != 31 ) {
+	if ( n > s.size() - i )
+	    return false;
+	r.assign( s, i, n );
+	i += n;
+	return true;
+    }
+
+    r.clear();
+    while ( i < s.size() && (unsigned char)s[i] != 0xff ) {
+	int cm, ci;
+	unsigned long long cn;
+	if ( !head( cm, ci, cn ) || cm != major || ci == 31 ||
+	     cn > s.size() - i )
+	    return false;
+	r.append( s, i, cn );
+	i += cn;
+    }
+    if ( i >= s.size() )
+	return false;
+    i++;
+    return true;
+}
@@ -0,0 +1,54 @@
+// Copyright Arnt Gulbrandsen <arnt@gulbrandsen.priv.no>; BSD-licensed.
+
+#ifndef CBOR_H
+#define CBOR_H
+
+#include "writer.h"
+
+#include <string>
+
+using namespace std;
+
+
+class CborWriter
+    : public Writer
+{
+public:
+    CborWriter( string & );
+
+    void startObject();
+    void member( const string & );
+    void endObject();
+    void startArray();
+    void endArray();
+
+    void text( const string & );
+    void number( long long );
+    void boolean( bool );
+    void raw( const string & );
+
+private:
+    void head( int, unsigned long long );
+    void transcode( class JsonParser & );
+};
+
+
+class CborReader
+{
+public:
+    CborReader( const string & );
+
+    bool read( Writer & );
+
+private:
+    bool item( Writer &, int );
+    bool head( int &, int &, unsigned long long & );
+    bool bytes( string &, int, int, unsigned long long );
+
+private:
+    const string & s;
+    string::size_type i;
+};
+
+
+#endif
@@ -0,0 +1,249 @@
+// Copyright Arnt Gulbrandsen <arnt@gulbrandsen.priv.no>; BSD-licensed.
+
+#include "cgroup.h"
+
+#include "conf.h"
+#include "log.h"
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include <stdio.h>
+#include <string.h>
+
+
+static bool usable = false;
+
+
+/*! \class Cgroup cgroup.h
+
+    The Cgroup class is a thin wrapper around a linux cgroup v2
+    directory below Conf::cgroupdir. Each managed service gets one,
+    named after its coordinate and port, and all of the service's
+    processes (including the download and install helpers) live in it.
+
+    ChoreKeeper uses it to protect valuable services (memory.low) and
+    to squeeze less valuable ones (memory.high and memory.reclaim)
+    before it resorts to killing anything, and to throttle CPU and I/O
+    hogs (cpu.max and io.weight).
+
+    If the host has no cgroup v2 hierarchy, or nodee isn't allowed to
+    write to it, setup() returns false and every function here quietly
+    does nothing. ChoreKeeper then behaves as it did before cgroups,
+    ie. it kills.
+*/
+
+
+/*! Constructs a Cgroup called \a name. Nothing is created on disk
+    until create() is called.
+*/
+
+Cgroup::Cgroup( const string & name )
+    : n( name )
+{
+}
+
+
+/*! Creates Conf::cgroupdir if necessary and enables the memory, cpu
+    and io controllers for nodee's children. Returns true if cgroups
+    can be used, false if not. Only the memory controller is
+    required.
+
+    Called once, from main().
+*/
+
+bool Cgroup::setup()
+{
+    usable = false;
+    if ( Conf::cgroupdir.empty() )
+	return false;
+
+    string parent = Conf::cgroupdir;
+    while ( parent.size() > 1 && parent[parent.size()-1] == '/' )
+	parent.erase( parent.size() - 1 );
+    string::size_type slash = parent.rfind( '/' );
+    if ( slash == string::npos || slash == 0 )
+	return false;
+    parent = parent.substr( 0, slash );
+
+    if ( ::access( ( parent + "/cgroup.subtree_control" ).c_str(),
+		   W_OK ) < 0 ) {
+	info << "nodee: No writable cgroup v2 hierarchy at "
+	     << parent
+	     << ", will kill rather than squeeze"
+	     << endl;
+	return false;
+    }
+
+    (void)::mkdir( Conf::cgroupdir.c_str(), 0755 );
+
+    // the parent has to delegate memory to us, and we to the
+    // per-service groups. either may already be done; we ignore
+    // errors and look at the result instead.
+    int fd = ::open( ( parent + "/cgroup.subtree_control" ).c_str(),
+		     O_WRONLY );
+    if ( fd >= 0 ) {
+	(void)::write( fd, "+memory", 7 );
+	(void)::write( fd, "+cpu", 4 );
+	(void)::write( fd, "+io", 3 );
+	::close( fd );
+    }
+    Cgroup p( "" );
+    usable = p.write( "cgroup.subtree_control", "+memory" );
+    // cpu and io are nice to have; ChoreKeeper copes without them
+    (void)p.write( "cgroup.subtree_control", "+cpu" );
+    (void)p.write( "cgroup.subtree_control", "+io" );
+    if ( !usable )
+	info << "nodee: Cannot enable the memory controller in "
+	     << Conf::cgroupdir
+	     << ", will kill rather than squeeze"
+	     << endl;
+    return usable;
+}
+
+
+/*! Returns true if setup() succeeded. */
+
+bool Cgroup::available()
+{
+    return usable;
+}
+
+
+/*! Returns true if this Cgroup has a name and cgroups are available(). */
+
+bool Cgroup::valid() const
+{
+    return usable && !n.empty();
+}
+
+
+/*! Returns the full path to the cgroup directory. */
+
+string Cgroup::path() const
+{
+    if ( n.empty() )
+	return Conf::cgroupdir;
+    return Conf::cgroupdir + "/" + n;
+}
+
+
+/*! Creates the cgroup directory. Returns true if the directory exists
+    afterwards.
+*/
+
+bool Cgroup::create() const
+{
+    if ( !valid() )
+	return false;
+    if ( ::mkdir( path().c_str(), 0755 ) < 0 && errno != EEXIST )
+	return false;
+    return true;
+}
+
+
+/*! Moves \a pid into this cgroup. Called by the child itself, right
+    after fork().
+*/
+
+bool Cgroup::adopt( int pid ) const
+{
+    if ( !valid() )
+	return false;
+    char tmp[24];
+    ::snprintf( tmp, sizeof( tmp ), "%d", pid );
+    return write( "cgroup.procs", tmp );
+}
+
+
+/*! Removes the cgroup directory. The kernel refuses while any process
+    remains in the group, which is fine; then the directory stays
+    until a later attempt.
+*/
+
+void Cgroup::remove() const
+{
+    if ( !valid() )
+	return;
+    (void)::rmdir( path().c_str() );
+}
+
+
+/*! Sets memory.low to \a kb kilobytes, or to 0 if \a kb is 0 or
+    negative. Memory below memory.low is reclaimed from this group
+    only if there's nothing else to reclaim.
+*/
+
+bool Cgroup::setMemoryLow( int kb ) const
+{
+    if ( kb < 0 )
+	kb = 0;
+    return writeKb( "memory.low", kb );
+}
+
+
+/*! Sets memory.high to \a kb kilobytes. If \a kb is 0 or negative,
+    memory.high is lifted entirely. A group above memory.high is
+    throttled and reclaimed from aggressively, but nothing is killed.
+*/
+
+bool Cgroup::setMemoryHigh( int kb ) const
+{
+    if ( kb <= 0 )
+	return write( "memory.high", "max" );
+    return writeKb( "memory.high", kb );
+}
+
+
+/*! Asks the kernel to reclaim \a kb kilobytes from this group right
+    now. Older kernels lack memory.reclaim; then this returns false
+    and memory.high has to do the job alone.
+*/
+
+bool Cgroup::reclaim( int kb ) const
+{
+    if ( kb <= 0 )
+	return true;
+    return writeKb( "memory.reclaim", kb );
+}
+
+
+/*! Writes \a value to the control file \a file in this cgroup.
+    Returns true if the kernel accepted the value, false otherwise.
+
+    This allocates no memory, since ChoreKeeper calls it when memory
+    is short.
+*/
+
+bool Cgroup::write( const char * file, const char * value ) const
+{
+    if ( !usable && !n.empty() )
+	return false;
+    char f[4096];
+    if ( n.empty() )
+	::snprintf( f, sizeof( f ), "%s/%s",
+		    Conf::cgroupdir.c_str(), file );
+    else
+	::snprintf( f, sizeof( f ), "%s/%s/%s",
+		    Conf::cgroupdir.c_str(), n.c_str(), file );
+    int fd = ::open( f, O_WRONLY );
+    if ( fd < 0 )
+	return false;
+    int l = ::strlen( value );
+    int r = ::write( fd, value, l );
+    ::close( fd );
+    return r == l;
+}
+
+
+/*! Writes \a kb kilobytes, in bytes, to \a file. */
+
+bool Cgroup::writeKb( const char * file, int kb ) const
+{
+    char tmp[32];
+    ::snprintf( tmp, sizeof( tmp ), "%lld", 1024LL * kb );
+    return write( file, tmp );
+}
@@ -0,0 +1,40 @@
+// Copyright Arnt Gulbrandsen <arnt@gulbrandsen.priv.no>; BSD-licensed.
+
+#ifndef CGROUP_H
+#define CGROUP_H
+
+#include <string>
+
+using namespace std;
+
+
+class Cgroup
+{
+public:
+    Cgroup( const string & );
+
+    static bool setup();
+    static bool available();
+
+    bool valid() const;
+    string path() const;
+
+    bool create() const;
+    bool adopt( int ) const;
+    void remove() const;
+
+    bool setMemoryLow( int ) const;
+    bool setMemoryHigh( int ) const;
+    bool reclaim( int ) const;
+
+    bool write( const char *, const char * ) const;
+
+private:
+    bool writeKb( const char *, int ) const;
+
+private:
+    string n;
+};
+
+
+#endif
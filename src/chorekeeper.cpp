@@ -2,19 +2,31 @@
 
 #include "chorekeeper.h"
 #include "log.h"
+#include "conf.h"
+#include "metrics.h"
+#include "hoststatus.h"
+#include "recorder.h"
+#include "probes.h"
+#include "kernel.h"
 
 #include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
 #include <signal.h>
 #include <unistd.h>
 #include <sysexits.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <string.h>
+#include <dirent.h>
+#include <time.h>
 
 #include <iostream>
 #include <fstream>
 
-#include <map>
 #include <list>
 
-#include <boost/tokenizer.hpp>
 #include <boost/filesystem.hpp>
 #include <boost/lexical_cast.hpp>
 
@@ -22,11 +34,35 @@
 using namespace std;
 
 
+// the kernel's struct for getdents64; glibc doesn't export it
+struct Dirent64 {
+    unsigned long long d_ino;
+    long long d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[1];
+};
+
+
+// one entry in ChoreKeeper's process table. r is what the kernel
+// told us about the process itself, rss, majflt, cpu and io include
+// all descendants. mother is the pid of the ancestor nodee started.
+struct ProcessSlot {
+    int generation;
+    RunningProcess r;
+    int rss;
+    int majflt;
+    long long cpu;
+    long long io;
+    int mother;
+};
+
+
 /*! \class ChoreKeeper chorekeeper.h
 
     The ChoreKeeper class regularly performs various chores. At the
-    moment, the only chore is to check for RAM/CPU overload and kill a
-    suitable service.
+    moment, the only chore is to check for RAM/CPU overload and make
+    the overload go away, killing a service if need be.
 
     The implementation is highly linux-specific; it gathers almost all
     of its data from the /proc file system.
@@ -56,6 +92,36 @@ using namespace std;
     segregating services, we enable nodee to gather data per service,
     not per process.
 
+    Killing is the last resort. When cgroups are available (see
+    Cgroup), ChoreKeeper responds in three steps. All the time, it
+    uses memory.low to protect the most valuable services (by
+    ServerSpec::value()) up to their expected typical memory usage.
+    As soon as a scan looks like thrashing, it squeezes the less
+    valuable services using memory.high and memory.reclaim, and
+    tells them about it using the signal or URL in their ServerSpec
+    (if any) so they can drop caches. Only if the thrashing goes on
+    for eight seconds in spite of that does it kill. When the host
+    has been calm for a few seconds, the squeeze is lifted.
+
+    The interval between scans adapts to the host's state: Several
+    seconds when there's plenty of RAM, a tenth of a second when
+    the host is thrashing. /metrics shows both the interval, the CPU
+    time spent scanning and how long ChoreKeeper took to react.
+
+    ChoreKeeper also looks ahead. Each Process keeps a few minutes of
+    RSS history, and forecast() estimates when the host will run out
+    of memory. A service that will reach its expected peak within
+    the hour is listed as leaking, and if its ServerSpec permits,
+    restartLeaker() restarts it while the host is quiet.
+
+    CPU and disk I/O get gentler treatment, since overloading them
+    slows the host down but doesn't break it. Each scan computes each
+    service's CPU and I/O rates (see Process::cpuUsage() and
+    Process::ioRate()). When the host's CPU or I/O is saturated,
+    throttle() throttles the less valuable services that use much
+    more than their share, and when the load drops the throttle is
+    lifted again.
+
     There is no configuration; the class just does the right thing
     based on the ServerSpec json supplied by the cloudname users.
 */
@@ -68,13 +134,23 @@ using namespace std;
 */
 
 ChoreKeeper::ChoreKeeper( Init & i )
-    : init( i )
+    : squeezing( false ),
+      slots( 0 ), capacity( 0 ), used( 0 ), generation( 0 ),
+      overflow( false ), buffer( new char[BufferSize + DirectorySize] ),
+      directory( buffer + BufferSize ), procfd( -1 ), proc( "/proc" ),
+      lastScan( 0 ), interval( 0 ),
+      ticks( ::sysconf( _SC_CLK_TCK ) ),
+      cores( HostStatus::cores( "/proc/cpuinfo" ) ),
+      cpuSaturated( false ), ioSaturated( false ),
+      hostBusy( 0 ), hostIowait( 0 ), hostTotal( 0 ),
+      thrashingNow( false ), thrashingSince( 0 ),
+      lastThrashed( 0 ), lastCalm( 0 ), unsaturatedSince( 0 ),
+      vmstatTime( 0 ), lastMajfault( 0 ), startupFaults( 0 ),
+      lastPgpgout( 0 ),
+      availablePages( 0 ), memoryPressure( -1 ), lastRestart( 0 ),
+      physicalPages( ::sysconf( _SC_PHYS_PAGES ) ),
+      init( i )
 {
-    int n = 7;
-    while ( n > 0 ) {
-	thrashing[n] = false;
-	n--;
-    }
 }
 
 
@@ -94,38 +170,17 @@ void ChoreKeeper::start()
 	    ::sleep( 31415926 );
     }
 
+    if ( Conf::lockmemory )
+	harden();
+
+    int ms = 1000;
     while( true ) {
 	try {
-	    ::sleep( 1 );
-	    scanProcesses( "/proc", getpid() );
-	    detectThrashing();
-	    if ( isThrashing() ) {
-		Process * jesus = 0;
-		jesus = furthestOverPeak();
-		if ( !jesus )
-		    jesus = furthestOverExpected();
-		if ( !jesus )
-		    jesus = thrashingMost();
-		if ( !jesus )
-		    jesus = leastValuable();
-		if ( !jesus )
-		    jesus = biggest();
-		if ( jesus ) {
-		    // we kill with signal 9, since we're already in a
-		    // bad state.
-		    ::kill( jesus->pid(), 9 );
-		    // come to think of it, should we use
-		    // Process::stop()?
-
-		    // but once that's done, we record that we're NOT
-		    // thrashing, since it's quite likely that even
-		    // after we've killed a process, others will need
-		    // to page in their data, and we don't want to
-		    // react to that activity by killing more
-		    // processes.
-		    thrashing[0] = false;
-		}
-	    }
+	    struct timespec t;
+	    t.tv_sec = ms / 1000;
+	    t.tv_nsec = ( ms % 1000 ) * 1000000;
+	    ::nanosleep( &t, 0 );
+	    ms = scan();
 	} catch (...) {
 	    // if any exceptions are thrown, the chorekeeper cannot
 	    // die, that would be horrible but it's perhaps best to
@@ -138,10 +193,216 @@ void ChoreKeeper::start()
 }
 
 
-/*! Just a dummy to please the linker. Yes, really. */
+/*! Performs one round of chores: Scans the processes, looks for
+    thrashing and overload, and squeezes, kills, throttles or relaxes
+    as needed. Returns the number of milliseconds start() should
+    sleep before the next round.
+
+    This does no heap allocation once harden() or the first scan has
+    sized the process table, so it works when the host is out of
+    memory.
+*/
+
+int ChoreKeeper::scan()
+{
+    struct timespec before;
+    ::clock_gettime( CLOCK_THREAD_CPUTIME_ID, &before );
+    NODEE_PROBE( scan__start );
+
+    scanProcesses( proc.c_str(), getpid() );
+    detectThrashing();
+    detectOverload();
+    protect();
+    throttle();
+    if ( thrashingNow )
+	Metrics::add( Metrics::StallMilliseconds, interval );
+    if ( isThrashing() ) {
+	Process * jesus = victim();
+	if ( jesus ) {
+	    // Init may reap the child and delete jesus as soon
+	    // as it's dead, so note what we want to record first
+	    int pid = jesus->pid();
+	    unsigned int id = jesus->spec().coordinateId();
+	    int rss = jesus->currentRss();
+	    // we kill with signal 9, since we're already in a
+	    // bad state.
+	    ::kill( pid, 9 );
+	    long long reaction = milliseconds() - lastCalm;
+	    Metrics::add( Metrics::Kills );
+	    Metrics::set( Metrics::KillReactionMilliseconds,
+			  reaction );
+	    Recorder::record( Recorder::Killed, pid, id, rss,
+			      reaction );
+	    NODEE_PROBE4( kill, pid, id, rss, reaction );
+	    // come to think of it, should we use
+	    // Process::stop()?
+
+	    // but once that's done, we record that we're NOT
+	    // thrashing, since it's quite likely that even
+	    // after we've killed a process, others will need
+	    // to page in their data, and we don't want to
+	    // react to that activity by killing more
+	    // processes.
+	    thrashingNow = false;
+	    thrashingSince = 0;
+	}
+    } else if ( thrashingNow ) {
+	if ( !squeezing )
+	    Metrics::set( Metrics::ReactionMilliseconds,
+			  milliseconds() - lastCalm );
+	squeeze();
+    } else if ( isCalm() ) {
+	relax();
+	if ( !cpuSaturated && !ioSaturated )
+	    restartLeaker();
+    }
+    forecast();
+
+    int ms = scanInterval( thrashingNow,
+			   physicalPages > 0
+			   ? availablePages * 1000 / physicalPages
+			   : 1000,
+			   memoryPressure,
+			   squeezing || cpuSaturated || ioSaturated );
+
+    struct timespec after;
+    ::clock_gettime( CLOCK_THREAD_CPUTIME_ID, &after );
+    long long cpu = ( after.tv_sec - before.tv_sec ) * 1000000LL +
+		    ( after.tv_nsec - before.tv_nsec ) / 1000;
+    Metrics::add( Metrics::Scans );
+    Metrics::add( Metrics::ScanCpuMicroseconds, cpu );
+    Metrics::set( Metrics::ScanIntervalMilliseconds, ms );
+    NODEE_PROBE3( scan__end, cpu, ms, thrashingNow );
+    return ms;
+}
+
+
+/*! Returns the number of milliseconds ChoreKeeper should sleep
+    before the next scan. \a thrashing is true if the last scan
+    looked like thrashing, \a available is the amount of easily
+    available RAM in thousandths of the total, \a pressure is the
+    kernel's memory pressure stall number as returned by
+    readPressure(), and \a busy is true if ChoreKeeper is squeezing or
+    throttling something.
+
+    When the host is in trouble, scans are frequent so ChoreKeeper
+    reacts quickly. When all is quiet, they're rare, since scanning
+    a host with thousands of processes costs a little.
+*/
+
+int ChoreKeeper::scanInterval( bool thrashing, int available,
+			       int pressure, bool busy )
+{
+    if ( thrashing || pressure > 1000 || available < 10 )
+	return 100;
+    if ( pressure > 100 || available < 50 )
+	return 250;
+    if ( busy || pressure > 0 || available < 200 )
+	return 1000;
+    return 5000;
+}
+
+
+/*! Frees the process table and buffers. */
 
 ChoreKeeper::~ChoreKeeper()
 {
+    if ( procfd >= 0 )
+	::close( procfd );
+    delete[] slots;
+    delete[] buffer;
+}
+
+
+/*! Makes the ChoreKeeper fit to work when the host is thrashing:
+    Locks all of nodee into RAM, makes sure the kernel's oomkiller
+    leaves nodee alone, preallocates what scanProcesses() needs, and
+    raises the calling thread's scheduling priority, so that
+    ChoreKeeper isn't starved of CPU by the processes it's supposed to
+    rein in.
+
+    Called by start() if Conf::lockmemory is set. Each step may fail
+    (most need root), in which case nodee logs and carries on.
+*/
+
+void ChoreKeeper::harden()
+{
+    // size the process table for four times as many processes as
+    // there are now. one scan finds out how many that is.
+    scanProcesses( proc.c_str(), getpid() );
+    reserve( 4 * used );
+
+    if ( ::mlockall( MCL_CURRENT | MCL_FUTURE ) < 0 )
+	info << "nodee: Unable to lock nodee into RAM" << endl;
+
+    int fd = ::open( procFile( "self/oom_score_adj" ), O_WRONLY );
+    if ( fd >= 0 ) {
+	(void)::write( fd, "-1000", 5 );
+	::close( fd );
+    }
+
+    // SCHED_FIFO, but only just, and children such as the notify
+    // script run with ordinary priority.
+    struct sched_param sp;
+    sp.sched_priority = ::sched_get_priority_min( SCHED_FIFO ) + 1;
+    int policy = SCHED_FIFO;
+#if defined(SCHED_RESET_ON_FORK)
+    policy |= SCHED_RESET_ON_FORK;
+#endif
+    if ( ::sched_setscheduler( 0, policy, &sp ) < 0 )
+	info << "nodee: Unable to raise ChoreKeeper's priority" << endl;
+
+    // fault in some stack now rather than during an emergency
+    volatile char stack[65536];
+    int i = 0;
+    while ( i < (int)sizeof( stack ) ) {
+	stack[i] = 0;
+	i += 1024;
+    }
+
+    // and do a scan, so that everything's been touched once
+    scanProcesses( proc.c_str(), getpid() );
+}
+
+
+/*! Makes ChoreKeeper read \a dir instead of /proc, so the tests can
+    feed it a made-up host.
+*/
+
+void ChoreKeeper::setProc( const string & dir )
+{
+    proc = dir;
+}
+
+
+/*! Returns the name of \a name in /proc (or setProc()'s replacement),
+    e.g. /proc/vmstat for "vmstat". The result is overwritten by the
+    next call. Doesn't allocate.
+*/
+
+const char * ChoreKeeper::procFile( const char * name )
+{
+    ::snprintf( file, sizeof( file ), "%s/%s", proc.c_str(), name );
+    return file;
+}
+
+
+/*! Returns the Process ChoreKeeper should kill if the host is
+    thrashing, or a null pointer if there is nothing to kill.
+*/
+
+Process * ChoreKeeper::victim() const
+{
+    Process * jesus = furthestOverPeak();
+    if ( !jesus )
+	jesus = furthestOverExpected();
+    if ( !jesus )
+	jesus = thrashingMost();
+    if ( !jesus )
+	jesus = leastValuable();
+    if ( !jesus )
+	jesus = biggest();
+    return jesus;
 }
 
 
@@ -157,30 +418,58 @@ ChoreKeeper::~ChoreKeeper()
     number of cores. But any one of these can also be true briefly at
     times when my human judgment is that the machine isn't thrashing.
 
-    This function does a heuristic momentary test. If eight
-    consecutive tests indicate thrashing, isThrashing() returns true.
+    This function does a heuristic momentary test. If every test
+    during the last eight seconds indicated thrashing, isThrashing()
+    returns true. The window is measured in time, not in tests, since
+    the interval between tests varies (see scanInterval()).
 */
 
 void ChoreKeeper::detectThrashing()
 {
-    int nr_free_pages = 0; // pages currently unused
-    int pgmajfault = 0; // times a process has had to wait for a page from disk
-    int pgpgout = 0; // times something has been written to disk
-
-    readProcVmstat( "/proc/vmstat", nr_free_pages, pgmajfault, pgpgout );
-
-    int n = 7;
-    while ( n > 0 ) {
-	thrashing[n] = thrashing[n-1];
-	n--;
+    long long nr_free_pages = 0; // pages currently unused
+    long long pgmajfault = 0; // times a process has had to wait for a page from disk
+    long long pgpgout = 0; // times something has been written to disk
+    long long nr_inactive_file = 0; // file pages that are easy to drop
+
+    readProcVmstat( procFile( "vmstat" ), nr_free_pages, pgmajfault,
+		    pgpgout, nr_inactive_file );
+    memoryPressure = readPressure( procFile( "pressure/memory" ) );
+
+    // the kernel counts since boot, oneBitOfThrashing() wants per
+    // second. services that are starting fault in their code, which
+    // isn't thrashing, so scanProcesses() counts those faults and we
+    // don't.
+    long long now = milliseconds();
+    int faults = 0;
+    int writes = 0;
+    long long majfaults = pgmajfault - lastMajfault - startupFaults;
+    if ( majfaults < 0 )
+	majfaults = 0;
+    startupFaults = 0;
+    if ( vmstatTime && now > vmstatTime ) {
+	faults = majfaults * 1000 / ( now - vmstatTime );
+	writes = ( pgpgout - lastPgpgout ) * 1000 / ( now - vmstatTime );
+    }
+    vmstatTime = now;
+    lastMajfault = pgmajfault;
+    lastPgpgout = pgpgout;
+    availablePages = nr_free_pages + nr_inactive_file;
+
+    thrashingNow = oneBitOfThrashing( nr_free_pages, faults, writes );
+    if ( thrashingNow ) {
+	if ( !thrashingSince )
+	    thrashingSince = now;
+	lastThrashed = now;
+    } else {
+	thrashingSince = 0;
+	lastCalm = now;
     }
-
-    thrashing[0] = oneBitOfThrashing( nr_free_pages, pgmajfault, pgpgout );
 }
 
 
 /*! Returns true or false depending on whether \a nr_free_pages, \a
     pgmajfault and \a pgpgout indicate that there may be thrashing.
+    \a pgmajfault and \a pgpgout are per second.
 
     The algorithm used is highly heuristic. It's intended to return
     true a little too often, so ChoreKeeper only takes action if
@@ -220,152 +509,287 @@ bool ChoreKeeper::oneBitOfThrashing( int nr_free_pages, int pgmajfault, int pgpg
 }
 
 
-/*! Returns true if the machine appears to thrash, and has been for a
-    few seconds. Returns false in all other cases (including in the
+/*! Returns true if the machine appears to thrash, and has been for
+    eight seconds. Returns false in all other cases (including in the
     first few seconds after start).
 */
 
 bool ChoreKeeper::isThrashing() const
 {
-    int n = 8;
-    while ( n > 0 )
-	if ( !thrashing[--n] )
-	    return false;
-    return true;
+    return thrashingSince && milliseconds() - thrashingSince >= 8000;
+}
+
+
+/*! Returns true if no scan during the last four seconds looked like
+    thrashing, and false otherwise.
+*/
+
+bool ChoreKeeper::isCalm() const
+{
+    return milliseconds() - lastThrashed >= 4000;
+}
+
+
+/*! Moves the start of the current bout of thrashing \a ms
+    milliseconds back, so isThrashing() can be tested without waiting
+    for eight seconds. Does nothing unless the last scan looked like
+    thrashing.
+*/
+
+void ChoreKeeper::backdate( int ms )
+{
+    if ( thrashingSince )
+	thrashingSince -= ms;
 }
 
 
 /*! Opens and reads \a fileName, storing the eponymous variables in \a
     nr_free_pages, \a pgmajfault and \a pgpgout.
+
+    This uses the ChoreKeeper's preallocated buffer rather than
+    iostreams, so it allocates no memory.
+*/
+
+void ChoreKeeper::readProcVmstat( const char * fileName,
+				  long long & nr_free_pages,
+				  long long & pgmajfault,
+				  long long & pgpgout )
+{
+    long long nr_inactive_file;
+    readProcVmstat( fileName, nr_free_pages, pgmajfault, pgpgout,
+		    nr_inactive_file );
+}
+
+
+/*! Opens and reads \a fileName, storing the eponymous variables in \a
+    nr_free_pages, \a pgmajfault, \a pgpgout and \a nr_inactive_file.
 */
 
 void ChoreKeeper::readProcVmstat( const char * fileName,
-				  int & nr_free_pages,
-				  int & pgmajfault,
-				  int & pgpgout )
+				  long long & nr_free_pages,
+				  long long & pgmajfault,
+				  long long & pgpgout,
+				  long long & nr_inactive_file )
 {
-    ifstream vmstat( fileName );
     nr_free_pages = 0; // pages currently unused
     pgmajfault = 0; // times a process has had to wait for a page from disk
     pgpgout = 0; // times something has been written to disk
-    boost::char_separator<char> space( " " );
-    while ( vmstat ) {
-	string line;
-	getline( vmstat, line );
-	if ( !line.empty() ) {
-	    boost::tokenizer<boost::char_separator<char> > t( line, space );
-	    boost::tokenizer<boost::char_separator<char> >::iterator i
-		= t.begin();
-	    string n = *i;
-	    ++i;
-	    int v = boost::lexical_cast<int>( *i );
-
-	    // nr_free_pages is the number of RAM pages that are
-	    // completely unused.
-	    if ( n == "nr_free_pages" )
-		nr_free_pages = v;
-	    // pgmajfault is the number of times a process has had to wait
-	    // for a page to be read from either swap or the executable
-	    if ( n == "pgmajfault" )
-		pgmajfault = v;
-	    // pgpgout is the number of things that have been written to
-	    // disk, including swap but also including everything else
-	    if ( n == "pgpgout" )
-		pgpgout = v;
-
-	    // I use pgmajfault for input since that's about waiting, and
-	    // waiting is the most important effect of thrashing
-        }
+    nr_inactive_file = 0; // file pages not used recently
+
+    int fd = ::open( fileName, O_RDONLY );
+    if ( fd < 0 )
+	return;
+    int l = 0;
+    int r = 0;
+    while ( l < BufferSize - 1 &&
+	    ( r = ::read( fd, buffer + l, BufferSize - 1 - l ) ) > 0 )
+	l += r;
+    ::close( fd );
+
+    const char * p = buffer;
+    const char * end = buffer + l;
+    while ( p < end ) {
+	const char * n = p;
+	while ( p < end && *p != ' ' && *p != '\n' )
+	    p++;
+	int nl = p - n;
+	long long v = 0;
+	if ( !field( p, end, v ) )
+	    v = 0;
+	while ( p < end && *p != '\n' )
+	    p++;
+	p++;
+
+	// nr_free_pages is the number of RAM pages that are
+	// completely unused.
+	if ( nl == 13 && !::strncmp( n, "nr_free_pages", nl ) )
+	    nr_free_pages = v;
+	// pgmajfault is the number of times a process has had to wait
+	// for a page to be read from either swap or the executable
+	else if ( nl == 10 && !::strncmp( n, "pgmajfault", nl ) )
+	    pgmajfault = v;
+	// pgpgout is the number of things that have been written to
+	// disk, including swap but also including everything else
+	else if ( nl == 7 && !::strncmp( n, "pgpgout", nl ) )
+	    pgpgout = v;
+	// nr_inactive_file is page cache that can be dropped quickly
+	else if ( nl == 16 && !::strncmp( n, "nr_inactive_file", nl ) )
+	    nr_inactive_file = v;
+
+	// I use pgmajfault for input since that's about waiting, and
+	// waiting is the most important effect of thrashing
     }
 }
 
 
 /*! Parses \a line as though it were a /proc/<pid>/stat line, and returns
-    a RunningProcess with all the right fields filled in.
+    a RunningProcess with all the right fields filled in. If \a line
+    cannot be parsed, the returned RunningProcess has pid 0.
+
+    This is a convenience wrapper for the unit tests; ChoreKeeper
+    itself uses the other parseProcStat(), which doesn't allocate.
 */
 
 RunningProcess ChoreKeeper::parseProcStat( string line )
     throw ( boost::bad_lexical_cast )
 {
-    // the first four fields are pid, filename in parens,
-    // state and ppid. we have to get rid of the filename
-    // so it won't confuse the tokenizer (which wants
-    // space-separated thingies).
+    RunningProcess r;
+    if ( !parseProcStat( line.data(), line.size(), r ) )
+	return RunningProcess();
+    return r;
+}
+
+
+/*! Parses the \a length bytes at \a line as though they were a
+    /proc/<pid>/stat line, and stores the result in \a r. Returns true
+    if all went well and false if not.
+*/
+
+bool ChoreKeeper::parseProcStat( const char * line, int length,
+				 RunningProcess & r )
+{
+    const char * p = line;
+    const char * end = line + length;
+    r = RunningProcess();
 
-    int i = 0;
-    while ( i < line.length() && line[i] != '(' )
-        i++;
-    while ( i < line.length() && line[i] != ')' ) {
-        if ( line[i] == '\\' ) // the kernel escapes rightparens
-	    line[i++] = '0';
-        line[i++] = '0';
+    long long v = 0;
+    if ( !field( p, end, v ) )
+	return false;
+    r.pid = v;
+
+    // the second field is the filename in parens. the kernel does
+    // not escape it, so it may contain spaces and parens. we have to
+    // look for the last rightparen.
+    const char * rp = end;
+    while ( rp > p && rp[-1] != ')' )
+	rp--;
+    if ( rp == p )
+	return false;
+    p = rp;
+
+    // then the state ('D', 'R' or whatever), which isn't a number
+    while ( p < end && *p == ' ' )
+	p++;
+    while ( p < end && *p != ' ' )
+	p++;
+
+    int n = 4;
+    while ( n <= 24 ) {
+	if ( !field( p, end, v ) )
+	    return false;
+	switch ( n ) {
+	case 4: // ppid
+	    r.ppid = v;
+	    break;
+	case 12: // majflt
+	case 13: // cmajflt
+	    r.majflt += v;
+	    break;
+	case 14: // user time ticks
+	case 15: // kernel time ticks
+	case 16: // waited-for child user time ticks
+	case 17: // waited-for child kernel time ticks
+	    r.cpu += v;
+	    break;
+	case 24: // rss in pages
+	    r.rss = v;
+	    break;
+	default:
+	    // process group, session id, tty number, process group
+	    // controller, kernel flags, minflt, cminflt, kernel
+	    // real-time priority, niceness, numthreads, null, start
+	    // time and vsize
+	    break;
+	}
+	n++;
     }
-    if ( line[i] == ')' )
-        line[i] = '0';
+    return true;
+}
 
-    boost::tokenizer<> tokens( line );
-    boost::tokenizer<>::iterator t = tokens.begin();
-    boost::tokenizer<>::iterator end = tokens.end();
 
+/*! Skips spaces at \a p, then parses a possibly negative decimal
+    number, stores it in \a v and advances \a p past it. Returns false
+    if there is no number before \a end.
+*/
 
-    RunningProcess r;
-    if ( t == end )
-	return RunningProcess();
-    r.pid = boost::lexical_cast<int>( *t );
-    ++t; // points to the nulls from above
-    ++t; // points to the state ('D', 'R' or whatever)
-    ++t; // points to the ppid
-    if ( t == end )
-	return RunningProcess();
-    r.ppid = boost::lexical_cast<int>( *t );
-    ++t; // points to the process group
-    ++t; // points to the session id
-    ++t; // points to the tty number
-    ++t; // points to the process group controller
-    ++t; // points to the kernel flags
-    ++t; // points to minflt
-    ++t; // points to cminflt
-    ++t; // points to majflt
-    if ( t == end )
-	return RunningProcess();
-    r.majflt = boost::lexical_cast<int>( *t );
-    ++t; // points to cmajflt
-    if ( t == end )
-	return RunningProcess();
-    r.majflt += boost::lexical_cast<int>( *t );
-    ++t; // points to user time ticks
-    ++t; // points to kernel time ticks
-    ++t; // points to waited-for child user time
-    ++t; // points to waited-for child kernel time ticks
-    ++t; // points to kernel real-time priority
-    ++t; // points to niceness
-    ++t; // points to numthreads
-    ++t; // points to null
-    ++t; // points to the process' start time
-    ++t; // points to vsize
-    ++t; // points to rss in pages
-    if ( t == end )
-	return RunningProcess();
-    r.rss = boost::lexical_cast<int>( *t );
-    return r;
+bool ChoreKeeper::field( const char * & p, const char * end,
+			 long long & v )
+{
+    while ( p < end && ( *p == ' ' || *p == '\t' ) )
+	p++;
+    bool minus = false;
+    if ( p < end && *p == '-' ) {
+	minus = true;
+	p++;
+    }
+    if ( p >= end || *p < '0' || *p > '9' )
+	return false;
+    v = 0;
+    while ( p < end && *p >= '0' && *p <= '9' )
+	v = v * 10 + *p++ - '0';
+    if ( minus )
+	v = -v;
+    return true;
+}
+
+
+/*! This private helper returns the process table entry for \a pid,
+    or a null pointer if there is none. If \a create is true, an
+    empty entry is created if necessary and possible.
+
+    The table is an open-addressing hash table preallocated by
+    reserve(). An entry belongs to the current scan if its generation
+    matches, so the table never needs to be cleared.
+*/
+
+ProcessSlot * ChoreKeeper::slot( int pid, bool create )
+{
+    if ( !capacity )
+	return 0;
+    unsigned int i = ( (unsigned int)pid * 2654435761U ) & ( capacity - 1 );
+    while ( slots[i].generation == generation ) {
+	if ( slots[i].r.pid == pid )
+	    return slots + i;
+	i = ( i + 1 ) & ( capacity - 1 );
+    }
+    if ( !create || used >= capacity / 2 )
+	return 0;
+    used++;
+    slots[i].generation = generation;
+    slots[i].r = RunningProcess();
+    slots[i].r.pid = pid;
+    slots[i].rss = 0;
+    slots[i].majflt = 0;
+    slots[i].cpu = 0;
+    slots[i].io = 0;
+    slots[i].mother = pid;
+    return slots + i;
 }
 
 
-/* ubuntu 10.04 includes boost 1.40, which has boost::filesystem API
-   2. 11.10 includes API 3. rather than demand and upgraded or
-   downgraded boost, I tried to write code that works with both. this
-   wrapper is needed to get a filename from an iterator.
+/*! Makes room for at least \a n processes in the process table, so
+    that scanProcesses() doesn't allocate memory. Discards the result
+    of the last scan.
 */
 
-static string filename( const boost::filesystem::directory_iterator & i )
+void ChoreKeeper::reserve( int n )
 {
-#if defined(BOOST_FILESYSTEM_VERSION) && BOOST_FILESYSTEM_VERSION == 3
-    return i->path().native();
-#else
-    return i->string();
-#endif
+    int c = 1024;
+    while ( c < 2 * n )
+	c *= 2;
+    if ( c <= capacity )
+	return;
+    delete[] slots;
+    slots = new ProcessSlot[c];
+    capacity = c;
+    used = 0;
+    int i = 0;
+    while ( i < c )
+	slots[i++].generation = 0;
+    generation = 1;
 }
 
+
 /*! Scans the Process table and the /proc/<pid>/stat files and finds out
     how much memory each of our processes is using (including all children)
     and how badly it is suffering from thrashing.
@@ -373,58 +797,112 @@ static string filename( const boost::filesystem::directory_iterator & i )
     \a proc is /proc (or another value for testing) and \a me is
     nodee's pid (or another value for testing). I dislike this,
     can't tell why.
+
+    scanProcesses() uses only memory allocated in advance, unless it
+    finds more processes than ever before. In that case it grows the
+    table at the start of the next scan.
 */
 
 void ChoreKeeper::scanProcesses( const char * proc, int me )
 {
-    using namespace boost::filesystem;
-
-    path p ( proc );
-    map<int,RunningProcess> observed;
-    try {
+    if ( overflow || !capacity )
+	reserve( used + 1024 );
+    overflow = false;
+
+    if ( procfd < 0 || procName != proc ) {
+	if ( procfd >= 0 )
+	    ::close( procfd );
+	procfd = ::open( proc, O_RDONLY | O_DIRECTORY );
+	procName = proc;
+    }
+    if ( procfd < 0 ) {
+	// kill all processes or just fail?
+	::exit( EX_SOFTWARE );
+    }
 
-	directory_iterator i = directory_iterator( p );
-	while ( i != directory_iterator() ) {
-	    if ( *filename( i ).rbegin() <= '9' ) {
-		string x = filename( i );
-		x.append( "/stat" );
-		ifstream stat( x.data() );
-		string line;
-		getline( stat, line );
-		try {
-		    RunningProcess r( parseProcStat( line ) );
-		    observed[r.pid] = r;
-		} catch (  boost::bad_lexical_cast ) {
-		    // if parseProcStat throws, then we just don't
-		    // manage that process
-		}
+    generation++;
+    used = 0;
+
+    long long now = milliseconds();
+    interval = lastScan ? now - lastScan : 0;
+    lastScan = now;
+
+    (void)::lseek( procfd, 0, SEEK_SET );
+    int n;
+    while ( ( n = ::syscall( SYS_getdents64, procfd,
+			     directory, DirectorySize ) ) > 0 ) {
+	int o = 0;
+	while ( o < n ) {
+	    const Dirent64 * d = (const Dirent64 *)( directory + o );
+	    o += d->d_reclen;
+	    const char * c = d->d_name;
+	    while ( *c >= '0' && *c <= '9' )
+		c++;
+	    if ( *c || c == d->d_name || c - d->d_name > 10 )
+		continue;
+	    char name[32];
+	    ::memcpy( name, d->d_name, c - d->d_name );
+	    ::memcpy( name + ( c - d->d_name ), "/stat", 6 );
+	    int fd = ::openat( procfd, name, O_RDONLY );
+	    if ( fd < 0 )
+		continue;
+	    int l = ::read( fd, buffer, BufferSize - 1 );
+	    ::close( fd );
+	    RunningProcess r;
+	    if ( l <= 0 || !parseProcStat( buffer, l, r ) || !r.pid ) {
+		// if parseProcStat fails, then we just don't manage
+		// that process
+	    } else {
+		ProcessSlot * s = slot( r.pid, true );
+		if ( s )
+		    s->r = r;
+		else
+		    overflow = true;
 	    }
-	    ++i;
 	}
-    } catch (const filesystem_error& ex) {
-	// kill all processes or just fail?
-	::exit( EX_SOFTWARE );
     }
 
-    map<int,RunningProcess>::iterator i = observed.begin();
-    while ( i != observed.end() ) {
-	pid_t mother = i->second.pid;
-	while ( mother &&
-	        observed[mother].ppid &&
-	        observed[mother].ppid != me )
-	    mother = observed[mother].ppid;
-	if ( observed[mother].pid != i->second.pid ) {
-	    observed[mother].rss += i->second.rss;
-	    observed[mother].majflt += i->second.majflt;
+    // add each process' numbers to those of its mother, ie. the
+    // ancestor nodee started. I/O is looked at only for nodee's
+    // descendants, since reading /proc/<pid>/io costs a little.
+    char name[32];
+    int i = 0;
+    while ( i < capacity ) {
+	if ( slots[i].generation == generation ) {
+	    ProcessSlot * mother = slots + i;
+	    int depth = 0;
+	    while ( mother->r.ppid && mother->r.ppid != me && depth < 256 ) {
+		ProcessSlot * up = slot( mother->r.ppid, false );
+		if ( !up )
+		    break;
+		mother = up;
+		depth++;
+	    }
+	    mother->rss += slots[i].r.rss;
+	    mother->majflt += slots[i].r.majflt;
+	    mother->cpu += slots[i].r.cpu;
+	    slots[i].mother = mother->r.pid;
+	    if ( mother->r.ppid == me ) {
+		::snprintf( name, sizeof( name ), "%d/io", slots[i].r.pid );
+		slots[i].r.io = readProcIo( name );
+		mother->io += slots[i].r.io;
+	    }
 	}
-	++i;
+	i++;
     }
 
+    // /proc/<pid>/stat counts pages, Process wants kilobytes
+    int pageKb = ::getpagesize() / 1024;
+
     list<Process *> & pl = init.processes();
     list<Process *>::iterator m( pl.begin() );
     while ( m != pl.end() ) {
-	(*m)->setCurrentRss( observed[(*m)->pid()].rss );
-	(*m)->setPageFaults( observed[(*m)->pid()].majflt );
+	ProcessSlot * s = slot( (*m)->pid(), false );
+	(*m)->setCurrentRss( s ? s->rss * pageKb : 0 );
+	(*m)->setPageFaults( s ? s->majflt : 0 );
+	startupFaults += (*m)->startupPageFaults();
+	(*m)->setUsage( s ? s->cpu : 0, s ? s->io : 0, interval );
+	(*m)->recordHistory( lastScan );
 	++m;
     }
 }
@@ -547,6 +1025,565 @@ Process * ChoreKeeper::biggest() const
 }
 
 
+/*! Uses memory.low to protect the most valuable services against
+    reclaim, up to their expected typical memory usage (or their
+    current size, if they didn't specify any expectation).
+
+    If all services are equally valuable, none is protected, since
+    protecting everyone is the same as protecting no one.
+*/
+
+void ChoreKeeper::protect()
+{
+    if ( !Cgroup::available() )
+	return;
+
+    int min = INT_MAX;
+    int max = INT_MIN;
+    list<Process *> & pl = init.processes();
+    list<Process *>::iterator m( pl.begin() );
+    while ( m != pl.end() ) {
+	if ( (*m)->valid() ) {
+	    int v = (*m)->spec().value();
+	    if ( v < min )
+		min = v;
+	    if ( v > max )
+		max = v;
+	}
+	++m;
+    }
+
+    m = pl.begin();
+    while ( m != pl.end() ) {
+	Process * p = *m;
+	++m;
+	if ( !p->valid() )
+	    continue;
+	int want = 0;
+	if ( max > min && p->spec().value() == max ) {
+	    want = p->spec().expectedTypicalMemory();
+	    if ( !want )
+		want = p->memoryLow() ? p->memoryLow() : p->currentRss();
+	}
+	if ( want != p->memoryLow() && p->cgroup().setMemoryLow( want ) )
+	    p->setMemoryLow( want );
+    }
+}
+
+
+/*! Squeezes the less valuable services: Their memory.high is set a
+    little below their current size (but not below their expected
+    typical size), the kernel is asked to reclaim the difference right
+    away, and they're notified so they can help. On subsequent calls,
+    squeezed services are asked to give up a little more.
+
+    If all services are equally valuable, the one furthest over its
+    expected size is squeezed.
+*/
+
+void ChoreKeeper::squeeze()
+{
+    int max = INT_MIN;
+    list<Process *> & pl = init.processes();
+    list<Process *>::iterator m( pl.begin() );
+    while ( m != pl.end() ) {
+	if ( (*m)->valid() && (*m)->spec().value() > max )
+	    max = (*m)->spec().value();
+	++m;
+    }
+
+    bool first = !squeezing;
+    squeezing = true;
+
+    // no list of victims, since this runs when RAM is short
+    bool any = false;
+    m = pl.begin();
+    while ( m != pl.end() ) {
+	Process * p = *m;
+	++m;
+	if ( p->valid() && p->spec().value() < max ) {
+	    squeeze( p, first );
+	    any = true;
+	}
+    }
+    if ( !any ) {
+	Process * p = furthestOverExpected();
+	if ( p && p->valid() )
+	    squeeze( p, first );
+    }
+}
+
+
+/*! Squeezes \a p as described for squeeze(), and notifies it if \a
+    first is true.
+*/
+
+void ChoreKeeper::squeeze( Process * p, bool first )
+{
+    if ( first )
+	notify( p );
+    int rss = p->currentRss();
+    if ( !Cgroup::available() || rss <= 0 )
+	return;
+    const Cgroup & c = p->cgroup();
+    if ( !p->memoryHigh() ) {
+	int target = rss - rss / 8;
+	if ( target < p->spec().expectedTypicalMemory() )
+	    target = p->spec().expectedTypicalMemory();
+	if ( target >= rss || !c.setMemoryHigh( target ) )
+	    return;
+	p->setMemoryHigh( target );
+	Metrics::add( Metrics::Squeezes );
+	Recorder::record( Recorder::Squeezed, p->pid(),
+			  p->spec().coordinateId(), rss, target );
+	if ( c.reclaim( rss - target ) )
+	    Metrics::add( Metrics::ReclaimedKb, rss - target );
+    } else if ( c.reclaim( rss / 16 ) ) {
+	Metrics::add( Metrics::ReclaimedKb, rss / 16 );
+    }
+}
+
+
+/*! Lifts whatever squeeze() did, once the host has calmed down. */
+
+void ChoreKeeper::relax()
+{
+    if ( !squeezing )
+	return;
+    squeezing = false;
+
+    list<Process *> & pl = init.processes();
+    list<Process *>::iterator m( pl.begin() );
+    while ( m != pl.end() ) {
+	Process * p = *m;
+	++m;
+	if ( p->memoryHigh() && p->cgroup().setMemoryHigh( 0 ) ) {
+	    p->setMemoryHigh( 0 );
+	    Metrics::add( Metrics::Releases );
+	    Recorder::record( Recorder::Released, p->pid(),
+			      p->spec().coordinateId() );
+	}
+    }
+}
+
+
+/*! Estimates how many seconds remain until the host runs out of
+    memory, given the current amount of available memory and the
+    growth of the services that are growing, and publishes it as a
+    metric. Returns the estimate, or -1 if nothing is growing.
+*/
+
+int ChoreKeeper::forecast()
+{
+    long long growth = 0; // kB per minute
+    list<Process *> & pl = init.processes();
+    list<Process *>::iterator m( pl.begin() );
+    while ( m != pl.end() ) {
+	int t = (*m)->rssTrend();
+	if ( t > 0 )
+	    growth += t;
+	++m;
+    }
+
+    int seconds = -1;
+    if ( growth > 0 ) {
+	long long kb = availablePages * ( ::getpagesize() / 1024 );
+	long long s = kb * 60 / growth;
+	seconds = s > INT_MAX ? INT_MAX : (int)s;
+    }
+    Metrics::set( Metrics::ExhaustionSeconds, seconds );
+    return seconds;
+}
+
+
+/*! Restarts one leaking() service whose ServerSpec permits it, if
+    any. ChoreKeeper calls this only when the host is quiet, since a
+    planned restart then is much cheaper than a kill when the host
+    is busy and thrashing.
+
+    At most one service is restarted per minute. If the service
+    ignored the SIGTERM the last time, Process::restart() kills it.
+    Download, install and warmup stages share the service's
+    ServerSpec but cannot be restarted, so they don't count.
+*/
+
+void ChoreKeeper::restartLeaker()
+{
+    long long now = milliseconds();
+    if ( lastRestart && now - lastRestart < 60000 )
+	return;
+
+    Process * worst = 0;
+    list<Process *> & pl = init.processes();
+    list<Process *>::iterator m( pl.begin() );
+    while ( m != pl.end() ) {
+	Process * p = *m;
+	++m;
+	if ( p->spec().restartWhenLeaking() && p->leaking() &&
+	     !::strcmp( p->stage(), "service" ) &&
+	     ( !worst || p->secondsUntilPeak() < worst->secondsUntilPeak() ) )
+	    worst = p;
+    }
+    if ( !worst || !worst->restart() )
+	return;
+
+    lastRestart = now;
+    Metrics::add( Metrics::PlannedRestarts );
+}
+
+
+/*! Tells \a p that the host is short of memory, using the signal
+    and/or URL in its ServerSpec. Does nothing if the ServerSpec
+    specifies neither.
+
+    The URL is POSTed to by the notify script in Conf::scriptdir, in
+    a child process nobody waits for. Init reaps it. The script runs
+    as the service's user and group, with only stdin, stdout and
+    stderr open, since the URL comes from the ServerSpec.
+*/
+
+void ChoreKeeper::notify( Process * p )
+{
+    int sig = p->spec().pressureSignal();
+    string url = p->spec().pressureUrl();
+    if ( !sig && url.empty() )
+	return;
+
+    if ( sig )
+	::kill( p->pid(), sig );
+    Recorder::record( Recorder::Notified, p->pid(),
+		      p->spec().coordinateId(), sig );
+
+    if ( !url.empty() ) {
+	string script = Conf::scriptdir + "/notify";
+	int u = p->uid();
+	int g = p->gid();
+	int pid = ::fork();
+	if ( pid == 0 ) {
+	    int fd = ::getdtablesize();
+	    while ( fd > 3 )
+		::close( --fd );
+	    // as in Process::fork(), these fail only if nodee isn't root
+	    if ( g )
+		(void)::setregid( g, g );
+	    if ( u )
+		(void)::setreuid( u, u );
+	    ::execl( script.c_str(), script.c_str(),
+		     "--url", url.c_str(), (char *)0 );
+	    ::_exit( EX_NOINPUT );
+	}
+    }
+
+    Metrics::add( Metrics::Notifications );
+    debug << "nodee: Told pid "
+	  << p->pid()
+	  << " that memory is short"
+	  << endl;
+}
+
+
+/*! Reads \a fileName, relative to the directory scanProcesses()
+    uses, as though it were /proc/<pid>/io, and returns the number of
+    bytes the process has read from and written to storage. Returns 0
+    if the file cannot be read, which is normal for processes that
+    don't belong to nodee's user when nodee doesn't run as root.
+*/
+
+long long ChoreKeeper::readProcIo( const char * fileName )
+{
+    int fd = ::openat( procfd, fileName, O_RDONLY );
+    if ( fd < 0 )
+	return 0;
+    int l = ::read( fd, buffer, BufferSize - 1 );
+    ::close( fd );
+
+    long long r = 0;
+    const char * p = buffer;
+    const char * end = buffer + ( l > 0 ? l : 0 );
+    while ( p < end ) {
+	const char * n = p;
+	while ( p < end && *p != ':' && *p != '\n' )
+	    p++;
+	int nl = p - n;
+	if ( p < end && *p == ':' )
+	    p++;
+	long long v = 0;
+	if ( ( ( nl == 10 && !::strncmp( n, "read_bytes", nl ) ) ||
+	       ( nl == 11 && !::strncmp( n, "write_bytes", nl ) ) ) &&
+	     field( p, end, v ) )
+	    r += v;
+	while ( p < end && *p != '\n' )
+	    p++;
+	p++;
+    }
+    return r;
+}
+
+
+/*! Reads \a fileName as though it were /proc/stat and stores the
+    number of clock ticks the host has spent on work in \a busy, on
+    waiting for I/O in \a iowait, and in total in \a total. All three
+    count since boot.
+*/
+
+void ChoreKeeper::readProcStat( const char * fileName,
+				long long & busy, long long & iowait,
+				long long & total )
+{
+    busy = 0;
+    iowait = 0;
+    total = 0;
+
+    int fd = ::open( fileName, O_RDONLY );
+    if ( fd < 0 )
+	return;
+    int l = ::read( fd, buffer, 1024 );
+    ::close( fd );
+    if ( l < 4 || ::strncmp( buffer, "cpu ", 4 ) )
+	return;
+
+    // cpu  user nice system idle iowait irq softirq steal ...
+    const char * p = buffer + 4;
+    const char * end = buffer + l;
+    int n = 1;
+    long long v;
+    while ( n <= 8 && field( p, end, v ) ) {
+	total += v;
+	if ( n == 4 )
+	    ; // idle
+	else if ( n == 5 )
+	    iowait = v;
+	else
+	    busy += v;
+	n++;
+    }
+}
+
+
+/*! Reads \a fileName as though it were one of the files in
+    /proc/pressure and returns the "some" avg10 number in hundredths
+    of a percent; 4012 means that something was stalled 40.12% of the
+    time during the last ten seconds. Returns -1 if the kernel doesn't
+    provide pressure stall information.
+*/
+
+int ChoreKeeper::readPressure( const char * fileName )
+{
+    int fd = ::open( fileName, O_RDONLY );
+    if ( fd < 0 )
+	return -1;
+    int l = ::read( fd, buffer, 1024 );
+    ::close( fd );
+    if ( l < 0 )
+	return -1;
+    buffer[l] = 0;
+
+    // some avg10=40.12 avg60=...
+    const char * p = ::strstr( buffer, "some avg10=" );
+    if ( !p )
+	return -1;
+    p += 11;
+    const char * end = buffer + l;
+    long long whole = 0;
+    long long fraction = 0;
+    if ( !field( p, end, whole ) )
+	return -1;
+    if ( p < end && *p == '.' ) {
+	p++;
+	if ( p < end && *p >= '0' && *p <= '9' )
+	    fraction = 10 * ( *p++ - '0' );
+	if ( p < end && *p >= '0' && *p <= '9' )
+	    fraction += *p - '0';
+    }
+    return whole * 100 + fraction;
+}
+
+
+/*! Decides whether the host's CPU and I/O capacity is saturated. The
+    kernel's pressure stall information is used if available;
+    otherwise, the CPU is saturated if less than 5% is idle and I/O is
+    saturated if the CPUs spend more than 30% of their time waiting
+    for I/O.
+*/
+
+void ChoreKeeper::detectOverload()
+{
+    long long busy, iowait, total;
+    readProcStat( procFile( "stat" ), busy, iowait, total );
+    long long dbusy = busy - hostBusy;
+    long long diowait = iowait - hostIowait;
+    long long dtotal = total - hostTotal;
+    bool first = !hostTotal;
+    hostBusy = busy;
+    hostIowait = iowait;
+    hostTotal = total;
+
+    int cpu = readPressure( procFile( "pressure/cpu" ) );
+    if ( cpu >= 0 )
+	cpuSaturated = cpu > 4000;
+    else
+	cpuSaturated = !first && dtotal > 0 && dbusy * 100 > dtotal * 95;
+
+    int io = readPressure( procFile( "pressure/io" ) );
+    if ( io >= 0 )
+	ioSaturated = io > 4000;
+    else
+	ioSaturated = !first && dtotal > 0 && diowait * 100 > dtotal * 30;
+
+    if ( cpuSaturated || ioSaturated )
+	unsaturatedSince = 0;
+    else if ( !unsaturatedSince )
+	unsaturatedSince = milliseconds();
+}
+
+
+/*! Throttles the less valuable services that use much more than
+    their share of whatever resource is saturated. Each service's
+    share is an equal part of the host's cores or of the I/O done by
+    all services; more than twice that is too much.
+
+    Only services less valuable than the most valuable ones are
+    throttled; the point is to keep the valuable services' latency
+    good when a batch job goes wild.
+
+    When nothing has been saturated for five seconds, the throttles
+    are lifted.
+*/
+
+void ChoreKeeper::throttle()
+{
+    if ( !cpuSaturated && !ioSaturated ) {
+	if ( unsaturatedSince &&
+	     milliseconds() - unsaturatedSince >= 5000 )
+	    unthrottle();
+	return;
+    }
+
+    int n = 0;
+    int max = INT_MIN;
+    long long io = 0;
+    list<Process *> & pl = init.processes();
+    list<Process *>::iterator m( pl.begin() );
+    while ( m != pl.end() ) {
+	if ( (*m)->valid() ) {
+	    n++;
+	    io += (*m)->ioRate();
+	    if ( (*m)->spec().value() > max )
+		max = (*m)->spec().value();
+	}
+	++m;
+    }
+    if ( n < 2 )
+	return;
+
+    int cpuShare = cores * 100 / n;
+    long long ioShare = io / n;
+
+    m = pl.begin();
+    while ( m != pl.end() ) {
+	Process * p = *m;
+	++m;
+	if ( !p->valid() || p->throttled() || p->spec().value() >= max )
+	    continue;
+	if ( ( cpuSaturated && p->cpuUsage() > 2 * cpuShare ) ||
+	     ( ioSaturated && p->ioRate() > 2 * ioShare &&
+	       p->ioRate() > 1024 * 1024 ) )
+	    setThrottled( p, true );
+    }
+}
+
+
+/*! Lifts all throttles imposed by throttle(). */
+
+void ChoreKeeper::unthrottle()
+{
+    list<Process *> & pl = init.processes();
+    list<Process *>::iterator m( pl.begin() );
+    while ( m != pl.end() ) {
+	Process * p = *m;
+	++m;
+	if ( p->throttled() )
+	    setThrottled( p, false );
+    }
+}
+
+
+/*! Throttles or unthrottles \a p, depending on \a throttled.
+
+    If \a p has a cgroup, its cpu.max is set to the share of the CPU
+    throttle() thinks is fair, and its io.weight to the minimum.
+    Otherwise, each thread of each of its processes is moved to
+    SCHED_IDLE and the idle I/O class, which has much the same effect
+    when the host is saturated and none at all when it isn't.
+*/
+
+void ChoreKeeper::setThrottled( Process * p, bool throttled )
+{
+    p->setThrottled( throttled );
+    if ( throttled )
+	Metrics::add( Metrics::Throttles );
+    else
+	Metrics::add( Metrics::Unthrottles );
+    Recorder::record( throttled ? Recorder::Throttled : Recorder::Unthrottled,
+		      p->pid(), p->spec().coordinateId(),
+		      p->cpuUsage(), p->ioRate() );
+
+    const Cgroup & c = p->cgroup();
+    if ( c.valid() ) {
+	char quota[32];
+	int n = 0;
+	list<Process *> & pl = init.processes();
+	list<Process *>::iterator m( pl.begin() );
+	while ( m != pl.end() ) {
+	    if ( (*m)->valid() )
+		n++;
+	    ++m;
+	}
+	::snprintf( quota, sizeof( quota ), "%d 100000",
+		    1000 * cores * 100 / ( n ? n : 1 ) );
+	bool cpu = c.write( "cpu.max", throttled ? quota : "max 100000" );
+	bool io = c.write( "io.weight",
+			   throttled ? "default 1" : "default 100" );
+	if ( cpu && io )
+	    return;
+    }
+
+    struct sched_param sp;
+    sp.sched_priority = 0;
+    int policy = throttled ? SCHED_IDLE : SCHED_OTHER;
+    int ioprio = throttled ? IoprioClassIdle << IoprioClassShift : 0;
+
+    int i = 0;
+    while ( i < capacity ) {
+	if ( slots[i].generation == generation &&
+	     slots[i].mother == p->pid() ) {
+	    char task[sizeof( file ) + 32];
+	    ::snprintf( task, sizeof( task ), "%s/%d/task",
+			proc.c_str(), slots[i].r.pid );
+	    DIR * d = ::opendir( task );
+	    struct dirent * e;
+	    while ( d && ( e = ::readdir( d ) ) != 0 ) {
+		int tid = ::atoi( e->d_name );
+		if ( tid > 0 ) {
+		    (void)::sched_setscheduler( tid, policy, &sp );
+		    (void)::syscall( SYS_ioprio_set,
+				     IoprioWhoProcess, tid, ioprio );
+		}
+	    }
+	    if ( d )
+		::closedir( d );
+	}
+	i++;
+    }
+
+    debug << "nodee: "
+	  << ( throttled ? "Throttled" : "Unthrottled" )
+	  << " pid "
+	  << p->pid()
+	  << endl;
+}
+
+
 /*! Returns true if the ChoreKeeper is able to work effectively on
     this OS, and false if not.
 */
@@ -9,12 +9,18 @@
 #include <boost/lexical_cast.hpp>
 
 
+struct ProcessSlot;
+
+
 struct RunningProcess {
-    RunningProcess(): pid( 0 ), ppid( 0 ), rss( 0 ), majflt( 0 ) {}
+    RunningProcess()
+	: pid( 0 ), ppid( 0 ), rss( 0 ), majflt( 0 ), cpu( 0 ), io( 0 ) {}
     int pid;
     int ppid;
     int rss;
     int majflt;
+    long long cpu;
+    long long io;
 };
 
 
@@ -27,10 +33,16 @@ public:
     bool valid() const;
 
     void start();
+    int scan();
+    void harden();
+    void setProc( const string & );
 
     void detectThrashing();
     bool isThrashing() const;
+    bool isCalm() const;
+    void backdate( int );
     static bool oneBitOfThrashing( int, int, int );
+    static int scanInterval( bool, int, int, bool );
 
     void scanProcesses( const char *, int );
 
@@ -39,14 +51,79 @@ public:
     Process * leastValuable() const;
     Process * thrashingMost() const;
     Process * biggest() const;
-
-    void readProcVmstat( const char *, int &, int &, int & );
+    Process * victim() const;
+
+    void protect();
+    void squeeze();
+    void relax();
+    void notify( Process * );
+    int forecast();
+    void restartLeaker();
+
+    void detectOverload();
+    bool isCpuSaturated() const { return cpuSaturated; }
+    bool isIoSaturated() const { return ioSaturated; }
+    void throttle();
+    void unthrottle();
+
+    void readProcStat( const char *, long long &, long long &, long long & );
+    int readPressure( const char * );
+    long long readProcIo( const char * );
+
+    void readProcVmstat( const char *,
+			 long long &, long long &, long long & );
+    void readProcVmstat( const char *,
+			 long long &, long long &, long long &, long long & );
 
     RunningProcess parseProcStat( string line )
 	throw ( boost::bad_lexical_cast );
+    static bool parseProcStat( const char *, int, RunningProcess & );
+
+private:
+    static bool field( const char * &, const char *, long long & );
+    ProcessSlot * slot( int, bool );
+    void reserve( int );
+    void setThrottled( Process *, bool );
+    void squeeze( Process *, bool );
+    const char * procFile( const char * );
+
+    enum { BufferSize = 65536, DirectorySize = 32768 };
 
 private:
-    bool thrashing[8];
+    bool squeezing;
+    ProcessSlot * slots;
+    int capacity;
+    int used;
+    int generation;
+    bool overflow;
+    char * buffer;
+    char * directory;
+    int procfd;
+    string procName;
+    string proc;
+    char file[256];
+    long long lastScan;
+    int interval;
+    int ticks;
+    int cores;
+    bool cpuSaturated;
+    bool ioSaturated;
+    long long hostBusy;
+    long long hostIowait;
+    long long hostTotal;
+    bool thrashingNow;
+    long long thrashingSince;
+    long long lastThrashed;
+    long long lastCalm;
+    long long unsaturatedSince;
+    long long vmstatTime;
+    long long lastMajfault;
+    long long startupFaults;
+    long long lastPgpgout;
+    long long availablePages;
+    int memoryPressure;
+    long long lastRestart;
+    long long physicalPages;
     Init & init;
 };
 
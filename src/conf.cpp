@@ -19,7 +19,15 @@ string Conf::scriptdir;
 string Conf::basedir;
 string Conf::workdir;
 string Conf::artefactdir;
+string Conf::softwaredir;
+string Conf::cgroupdir;
 string Conf::zk;
+bool Conf::zkcbor;
+bool Conf::lockmemory;
+int Conf::prefetchrate;
+int Conf::diskbudget;
+int Conf::workexpiry;
+int Conf::servicelogsize;
 
 
 /*! Writes default values into the configuration values. The default
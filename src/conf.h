@@ -21,7 +21,15 @@ public:
     static string basedir;
     static string workdir;
     static string artefactdir;
+    static string softwaredir;
+    static string cgroupdir;
     static string zk;
+    static bool zkcbor;
+    static bool lockmemory;
+    static int prefetchrate;
+    static int diskbudget;
+    static int workexpiry;
+    static int servicelogsize;
 };
 
 
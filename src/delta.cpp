@@ -0,0 +1,370 @@
+// Copyright Arnt Gulbrandsen <arnt@gulbrandsen.priv.no>; BSD-licensed.
+
+#include "delta.h"
+
+#include "digest.h"
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <sstream>
+
+
+/*! \class Delta delta.h
+
+    The Delta class reconstructs a new version of an artifact from an
+    older one, so that Download only has to fetch the blocks that
+    changed.
+
+    The depot publishes a block index next to each artifact, with
+    ".blocks" appended to its name. index() makes such an index, and
+    the nodeeblocks program writes one for a file. It's a small text
+    file, in the spirit of zsync's control files:
+
+    \code
+    nodee-blocks 1
+    size 1234567
+    block-size 4096
+    sha256 <hex digest of the entire file>
+    <weak checksum> <strong checksum>
+    ...
+    \endcode
+
+    There is one line per block; the last block is padded with
+    zeroes. The weak checksum is rsync's rolling checksum, and the
+    strong checksum is the first 64 bits of the block's MD5 digest.
+
+    parse() reads an index, and reuse() slides a window over the old
+    file, looking for blocks whose weak checksum matches. The weak
+    checksum can be moved one byte in constant time, so this finds
+    blocks that have moved as well as those that stay put. At most
+    offsets, a megabit table of checksum hashes says that there's no
+    candidate, and only the rest are looked up in a sorted vector.
+    Each candidate is confirmed with the strong checksum and copied
+    into place. missing() then says which byte ranges have to be
+    fetched.
+
+    Delta doesn't verify the result; the caller checks the digest of
+    the entire file against sha256() and discards it if wrong.
+*/
+
+
+/*! Constructs an empty Delta. parse() must be called before it's
+    useful.
+*/
+
+Delta::Delta()
+    : total( 0 ), bs( 0 )
+{
+}
+
+
+/*! Returns the block index for \a file, using blocks of \a blockSize
+    bytes, or an empty string if \a file cannot be read.
+*/
+
+string Delta::index( const string & file, int blockSize )
+{
+    int fd = ::open( file.c_str(), O_RDONLY );
+    if ( fd < 0 || blockSize < 1 )
+	return "";
+
+    vector<char> block( blockSize );
+    Sha256 sha;
+    long long size = 0;
+    ostringstream blocks;
+    bool done = false;
+    while ( !done ) {
+	int used = 0;
+	int n = 0;
+	while ( used < blockSize &&
+		( n = ::read( fd, &block[used], blockSize - used ) ) > 0 )
+	    used += n;
+	if ( n < 0 ) {
+	    ::close( fd );
+	    return "";
+	}
+	if ( !used )
+	    break;
+	sha.add( &block[0], used );
+	size += used;
+	done = used < blockSize;
+	::memset( &block[used], 0, blockSize - used );
+	char line[32];
+	::snprintf( line, sizeof( line ), "%08x",
+		    weak( &block[0], blockSize ) );
+	blocks << line << " " << strong( &block[0], blockSize ) << "\n";
+    }
+    ::close( fd );
+
+    ostringstream r;
+    r << "nodee-blocks 1\n"
+      << "size " << size << "\n"
+      << "block-size " << blockSize << "\n"
+      << "sha256 " << sha.hex() << "\n"
+      << blocks.str();
+    return r.str();
+}
+
+
+/*! Parses the block index \a text. Returns true if it's well-formed,
+    false if not.
+*/
+
+bool Delta::parse( const string & text )
+{
+    istringstream in( text );
+    string line;
+    if ( !getline( in, line ) || line != "nodee-blocks 1" )
+	return false;
+
+    total = -1;
+    bs = 0;
+    digest.clear();
+    while ( ( total < 0 || !bs || digest.empty() ) && getline( in, line ) ) {
+	string::size_type space = line.find( ' ' );
+	if ( space == string::npos )
+	    return false;
+	string name = line.substr( 0, space );
+	string value = line.substr( space + 1 );
+	if ( name == "size" )
+	    total = ::atoll( value.c_str() );
+	else if ( name == "block-size" )
+	    bs = ::atoi( value.c_str() );
+	else if ( name == "sha256" )
+	    digest = value;
+	else
+	    return false;
+    }
+    if ( total < 0 || bs < 1 || bs > 16 * 1024 * 1024 ||
+	 digest.size() != 64 )
+	return false;
+
+    weaks.clear();
+    strongs.clear();
+    while ( getline( in, line ) ) {
+	if ( line.size() != 25 || line[8] != ' ' )
+	    return false;
+	weaks.push_back( ::strtoul( line.substr( 0, 8 ).c_str(), 0, 16 ) );
+	strongs.push_back( line.substr( 9 ) );
+    }
+    if ( (long long)weaks.size() != ( total + bs - 1 ) / bs )
+	return false;
+    have.assign( weaks.size(), false );
+    return true;
+}
+
+
+/*! Returns the size of the new file, as given by the index. */
+
+long long Delta::size() const
+{
+    return total;
+}
+
+
+/*! Returns the block size used by the index. */
+
+int Delta::blockSize() const
+{
+    return bs;
+}
+
+
+/*! Returns the SHA-256 digest of the new file, as given by the index. */
+
+string Delta::sha256() const
+{
+    return digest;
+}
+
+
+/*! Looks for the new file's blocks in \a basis, and writes each one
+    it finds to its place in \a fd, which should be size() bytes
+    long. Returns the number of bytes written, or -1 if \a basis
+    cannot be read or \a fd cannot be written.
+*/
+
+long long Delta::reuse( const string & basis, int fd )
+{
+    vector< pair<unsigned int,int> > blocks;
+    vector<bool> tags( 1 << 20 );
+    blocks.reserve( weaks.size() );
+    unsigned int i = 0;
+    while ( i < weaks.size() ) {
+	blocks.push_back( make_pair( weaks[i], (int)i ) );
+	tags[tag( weaks[i] )] = true;
+	i++;
+    }
+    sort( blocks.begin(), blocks.end() );
+
+    int b = ::open( basis.c_str(), O_RDONLY );
+    if ( b < 0 )
+	return -1;
+    struct stat st;
+    if ( ::fstat( b, &st ) < 0 ) {
+	::close( b );
+	return -1;
+    }
+    long long length = st.st_size;
+    if ( !length || !bs ) {
+	::close( b );
+	return 0;
+    }
+    void * m = ::mmap( 0, length, PROT_READ, MAP_PRIVATE, b, 0 );
+    ::close( b );
+    if ( m == MAP_FAILED )
+	return -1;
+    ::madvise( m, length, MADV_SEQUENTIAL );
+    const unsigned char * data = (const unsigned char *)m;
+
+    // the window may extend past the end of the basis, which is
+    // treated as zeroes, like the padding of the last block.
+    vector<char> window( bs );
+    long long reused = 0;
+    long long p = 0;
+    unsigned int a = 0;
+    unsigned int c = 0;
+    bool fresh = true;
+    bool ok = true;
+    while ( ok && p < length ) {
+	if ( fresh ) {
+	    long long n = length - p;
+	    if ( n > bs )
+		n = bs;
+	    ::memcpy( &window[0], data + p, n );
+	    ::memset( &window[n], 0, bs - n );
+	    unsigned int w = weak( &window[0], bs );
+	    a = w & 0xffff;
+	    c = w >> 16;
+	    fresh = false;
+	}
+
+	bool matched = false;
+	unsigned int w = a | ( c << 16 );
+	vector< pair<unsigned int,int> >::iterator j( blocks.end() );
+	if ( tags[tag( w )] )
+	    j = lower_bound( blocks.begin(), blocks.end(),
+			     make_pair( w, 0 ) );
+	if ( j != blocks.end() && j->first == w ) {
+	    long long n = length - p;
+	    if ( n > bs )
+		n = bs;
+	    ::memcpy( &window[0], data + p, n );
+	    ::memset( &window[n], 0, bs - n );
+	    string s = strong( &window[0], bs );
+	    while ( ok && j != blocks.end() && j->first == w ) {
+		int k = j->second;
+		if ( strongs[k] == s ) {
+		    matched = true;
+		    if ( !have[k] ) {
+			long long offset = (long long)k * bs;
+			long long l = total - offset;
+			if ( l > bs )
+			    l = bs;
+			ok = ::pwrite( fd, &window[0], l, offset ) == l;
+			have[k] = true;
+			reused += l;
+		    }
+		}
+		++j;
+	    }
+	}
+
+	if ( matched ) {
+	    p += bs;
+	    fresh = true;
+	} else {
+	    unsigned int out = data[p];
+	    unsigned int in = p + bs < length ? data[p + bs] : 0;
+	    a = ( a - out + in ) & 0xffff;
+	    c = ( c - bs * out + a ) & 0xffff;
+	    p++;
+	}
+    }
+
+    ::munmap( m, length );
+    if ( !ok )
+	return -1;
+    return reused;
+}
+
+
+/*! Returns the byte ranges of the new file that reuse() didn't find,
+    as pairs of first and last byte, ready for a Range request.
+    Adjacent blocks are merged, and so are ranges separated by at
+    most \a slack bytes, since fetching a few bytes again costs less
+    than another request.
+*/
+
+list< pair<long long,long long> > Delta::missing( long long slack ) const
+{
+    list< pair<long long,long long> > r;
+    unsigned int i = 0;
+    while ( i < have.size() ) {
+	if ( have[i] ) {
+	    i++;
+	    continue;
+	}
+	long long from = (long long)i * bs;
+	while ( i < have.size() && !have[i] )
+	    i++;
+	long long to = (long long)i * bs;
+	if ( to > total )
+	    to = total;
+	if ( !r.empty() && from - 1 - r.back().second <= slack )
+	    r.back().second = to - 1;
+	else
+	    r.push_back( make_pair( from, to - 1 ) );
+    }
+    return r;
+}
+
+
+/*! Returns rsync's weak checksum of the \a n bytes at \a data: The
+    low 16 bits are the sum of the bytes, the high 16 bits the sum
+    of the running sums. reuse() rolls it along a byte at a time.
+*/
+
+unsigned int Delta::weak( const char * data, int n )
+{
+    const unsigned char * p = (const unsigned char *)data;
+    unsigned int a = 0;
+    unsigned int b = 0;
+    int i = 0;
+    while ( i < n ) {
+	a += p[i];
+	b += ( n - i ) * p[i];
+	i++;
+    }
+    return ( a & 0xffff ) | ( ( b & 0xffff ) << 16 );
+}
+
+
+/*! Returns the 20-bit hash of the weak checksum \a w that reuse()
+    uses to rule out most offsets without a lookup.
+*/
+
+unsigned int Delta::tag( unsigned int w )
+{
+    return ( w * 2654435761U ) >> 12;
+}
+
+
+/*! Returns the strong checksum of the \a n bytes at \a data, as 16
+    hex digits.
+*/
+
+string Delta::strong( const char * data, int n )
+{
+    Md5 m;
+    m.add( data, n );
+    return m.hex().substr( 0, 16 );
+}
@@ -0,0 +1,47 @@
+// Copyright Arnt Gulbrandsen <arnt@gulbrandsen.priv.no>; BSD-licensed.
+
+#ifndef DELTA_H
+#define DELTA_H
+
+#include <list>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+
+class Delta
+{
+public:
+    Delta();
+
+    static string index( const string &, int );
+
+    bool parse( const string & );
+
+    long long size() const;
+    int blockSize() const;
+    string sha256() const;
+
+    long long reuse( const string &, int );
+    list< pair<long long,long long> > missing( long long ) const;
+
+    static unsigned int weak( const char *, int );
+
+    enum { DefaultBlockSize = 4096 };
+
+private:
+    static string strong( const char *, int );
+    static unsigned int tag( unsigned int );
+
+private:
+    long long total;
+    int bs;
+    string digest;
+    vector<unsigned int> weaks;
+    vector<string> strongs;
+    vector<bool> have;
+};
+
+
+#endif
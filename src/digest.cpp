@@ -0,0 +1,367 @@
+// Copyright Arnt Gulbrandsen <arnt@gulbrandsen.priv.no>; BSD-licensed.
+
+#include "digest.h"
+
+#include <string.h>
+
+
+/*! \class Md5 digest.h
+
+    The Md5 class computes an MD5 digest incrementally, so that data
+    can be hashed while it streams in instead of being read back from
+    disk afterwards.
+
+    Feed it data using add(), in as many pieces as convenient, then
+    call hex() to get the digest in the same form as md5sum prints
+    it. reset() makes the object ready to start over.
+
+    MD5 is not a secure hash, but it's what ServerSpec::md5() uses.
+*/
+
+
+/*! Constructs an Md5 object that has seen no data yet. */
+
+Md5::Md5()
+{
+    reset();
+}
+
+
+/*! Forgets all data seen so far. */
+
+void Md5::reset()
+{
+    h[0] = 0x67452301;
+    h[1] = 0xefcdab89;
+    h[2] = 0x98badcfe;
+    h[3] = 0x10325476;
+    used = 0;
+    length = 0;
+}
+
+
+static const unsigned int k[64] = {
+    0xd76aa478, 0xe8c7b756, 0x242070db, 0xc1bdceee,
+    0xf57c0faf, 0x4787c62a, 0xa8304613, 0xfd469501,
+    0x698098d8, 0x8b44f7af, 0xffff5bb1, 0x895cd7be,
+    0x6b901122, 0xfd987193, 0xa679438e, 0x49b40821,
+    0xf61e2562, 0xc040b340, 0x265e5a51, 0xe9b6c7aa,
+    0xd62f105d, 0x02441453, 0xd8a1e681, 0xe7d3fbc8,
+    0x21e1cde6, 0xc33707d6, 0xf4d50d87, 0x455a14ed,
+    0xa9e3e905, 0xfcefa3f8, 0x676f02d9, 0x8d2a4c8a,
+    0xfffa3942, 0x8771f681, 0x6d9d6122, 0xfde5380c,
+    0xa4beea44, 0x4bdecfa9, 0xf6bb4b60, 0xbebfbc70,
+    0x289b7ec6, 0xeaa127fa, 0xd4ef3085, 0x04881d05,
+    0xd9d4d039, 0xe6db99e5, 0x1fa27cf8, 0xc4ac5665,
+    0xf4292244, 0x432aff97, 0xab9423a7, 0xfc93a039,
+    0x655b59c3, 0x8f0ccc92, 0xffeff47d, 0x85845dd1,
+    0x6fa87e4f, 0xfe2ce6e0, 0xa3014314, 0x4e0811a1,
+    0xf7537e82, 0xbd3af235, 0x2ad7d2bb, 0xeb86d391
+};
+
+
+static const int r[64] = {
+    7, 12, 17, 22, 7, 12, 17, 22, 7, 12, 17, 22, 7, 12, 17, 22,
+    5, 9, 14, 20, 5, 9, 14, 20, 5, 9, 14, 20, 5, 9, 14, 20,
+    4, 11, 16, 23, 4, 11, 16, 23, 4, 11, 16, 23, 4, 11, 16, 23,
+    6, 10, 15, 21, 6, 10, 15, 21, 6, 10, 15, 21, 6, 10, 15, 21
+};
+
+
+/*! Processes one 64-byte block at \a p. */
+
+void Md5::block( const unsigned char * p )
+{
+    unsigned int w[16];
+    int i = 0;
+    while ( i < 16 ) {
+	w[i] = p[i*4] | ( p[i*4+1] << 8 ) |
+	       ( p[i*4+2] << 16 ) | ( (unsigned int)p[i*4+3] << 24 );
+	i++;
+    }
+
+    unsigned int a = h[0];
+    unsigned int b = h[1];
+    unsigned int c = h[2];
+    unsigned int d = h[3];
+
+    i = 0;
+    while ( i < 64 ) {
+	unsigned int f;
+	int g;
+	if ( i < 16 ) {
+	    f = ( b & c ) | ( ~b & d );
+	    g = i;
+	} else if ( i < 32 ) {
+	    f = ( d & b ) | ( ~d & c );
+	    g = ( 5 * i + 1 ) % 16;
+	} else if ( i < 48 ) {
+	    f = b ^ c ^ d;
+	    g = ( 3 * i + 5 ) % 16;
+	} else {
+	    f = c ^ ( b | ~d );
+	    g = ( 7 * i ) % 16;
+	}
+	unsigned int t = d;
+	d = c;
+	c = b;
+	unsigned int x = a + f + k[i] + w[g];
+	b = b + ( ( x << r[i] ) | ( x >> ( 32 - r[i] ) ) );
+	a = t;
+	i++;
+    }
+
+    h[0] += a;
+    h[1] += b;
+    h[2] += c;
+    h[3] += d;
+}
+
+
+/*! Adds the \a n bytes at \a data to the digest. */
+
+void Md5::add( const char * data, int n )
+{
+    const unsigned char * p = (const unsigned char *)data;
+    length += n;
+
+    if ( used ) {
+	int l = 64 - used;
+	if ( l > n )
+	    l = n;
+	::memcpy( pending + used, p, l );
+	used += l;
+	p += l;
+	n -= l;
+	if ( used < 64 )
+	    return;
+	block( pending );
+	used = 0;
+    }
+
+    while ( n >= 64 ) {
+	block( p );
+	p += 64;
+	n -= 64;
+    }
+
+    ::memcpy( pending, p, n );
+    used = n;
+}
+
+
+/*! Returns the digest of the data seen as 32 lowercase hex digits,
+    and resets the object.
+*/
+
+string Md5::hex()
+{
+    long long bits = length * 8;
+    unsigned char pad[72];
+    int n = ( used < 56 ? 56 : 120 ) - used;
+    ::memset( pad, 0, sizeof( pad ) );
+    pad[0] = 0x80;
+    int i = 0;
+    while ( i < 8 ) {
+	pad[n+i] = ( bits >> ( i * 8 ) ) & 0xff;
+	i++;
+    }
+    add( (const char *)pad, n + 8 );
+
+    static const char digits[] = "0123456789abcdef";
+    string result;
+    i = 0;
+    while ( i < 16 ) {
+	unsigned int v = ( h[i/4] >> ( ( i % 4 ) * 8 ) ) & 0xff;
+	result += digits[v >> 4];
+	result += digits[v & 15];
+	i++;
+    }
+
+    reset();
+    return result;
+}
+
+
+/*! \class Sha256 digest.h
+
+    The Sha256 class computes a SHA-256 digest incrementally. Its API
+    is the same as that of Md5.
+
+    Artifact uses SHA-256 digests to identify the files it stores.
+*/
+
+
+/*! Constructs a Sha256 object that has seen no data yet. */
+
+Sha256::Sha256()
+{
+    reset();
+}
+
+
+/*! Forgets all data seen so far. */
+
+void Sha256::reset()
+{
+    h[0] = 0x6a09e667;
+    h[1] = 0xbb67ae85;
+    h[2] = 0x3c6ef372;
+    h[3] = 0xa54ff53a;
+    h[4] = 0x510e527f;
+    h[5] = 0x9b05688c;
+    h[6] = 0x1f83d9ab;
+    h[7] = 0x5be0cd19;
+    used = 0;
+    length = 0;
+}
+
+
+static const unsigned int k256[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5,
+    0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+    0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc,
+    0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7,
+    0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+    0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3,
+    0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5,
+    0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+    0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+
+static inline unsigned int ror( unsigned int x, int n )
+{
+    return ( x >> n ) | ( x << ( 32 - n ) );
+}
+
+
+/*! Processes one 64-byte block at \a p. */
+
+void Sha256::block( const unsigned char * p )
+{
+    unsigned int w[64];
+    int i = 0;
+    while ( i < 16 ) {
+	w[i] = ( (unsigned int)p[i*4] << 24 ) | ( p[i*4+1] << 16 ) |
+	       ( p[i*4+2] << 8 ) | p[i*4+3];
+	i++;
+    }
+    while ( i < 64 ) {
+	unsigned int s0 = ror( w[i-15], 7 ) ^ ror( w[i-15], 18 ) ^
+			  ( w[i-15] >> 3 );
+	unsigned int s1 = ror( w[i-2], 17 ) ^ ror( w[i-2], 19 ) ^
+			  ( w[i-2] >> 10 );
+	w[i] = w[i-16] + s0 + w[i-7] + s1;
+	i++;
+    }
+
+    unsigned int a = h[0];
+    unsigned int b = h[1];
+    unsigned int c = h[2];
+    unsigned int d = h[3];
+    unsigned int e = h[4];
+    unsigned int f = h[5];
+    unsigned int g = h[6];
+    unsigned int hh = h[7];
+
+    i = 0;
+    while ( i < 64 ) {
+	unsigned int s1 = ror( e, 6 ) ^ ror( e, 11 ) ^ ror( e, 25 );
+	unsigned int ch = ( e & f ) ^ ( ~e & g );
+	unsigned int t1 = hh + s1 + ch + k256[i] + w[i];
+	unsigned int s0 = ror( a, 2 ) ^ ror( a, 13 ) ^ ror( a, 22 );
+	unsigned int maj = ( a & b ) ^ ( a & c ) ^ ( b & c );
+	unsigned int t2 = s0 + maj;
+	hh = g;
+	g = f;
+	f = e;
+	e = d + t1;
+	d = c;
+	c = b;
+	b = a;
+	a = t1 + t2;
+	i++;
+    }
+
+    h[0] += a;
+    h[1] += b;
+    h[2] += c;
+    h[3] += d;
+    h[4] += e;
+    h[5] += f;
+    h[6] += g;
+    h[7] += hh;
+}
+
+
+/*! Adds the \a n bytes at \a data to the digest. */
+
+void Sha256::add( const char * data, int n )
+{
+    const unsigned char * p = (const unsigned char *)data;
+    length += n;
+
+    if ( used ) {
+	int l = 64 - used;
+	if ( l > n )
+	    l = n;
+	::memcpy( pending + used, p, l );
+	used += l;
+	p += l;
+	n -= l;
+	if ( used < 64 )
+	    return;
+	block( pending );
+	used = 0;
+    }
+
+    while ( n >= 64 ) {
+	block( p );
+	p += 64;
+	n -= 64;
+    }
+
+    ::memcpy( pending, p, n );
+    used = n;
+}
+
+
+/*! Returns the digest of the data seen as 64 lowercase hex digits,
+    and resets the object.
+*/
+
+string Sha256::hex()
+{
+    long long bits = length * 8;
+    unsigned char pad[72];
+    int n = ( used < 56 ? 56 : 120 ) - used;
+    ::memset( pad, 0, sizeof( pad ) );
+    pad[0] = 0x80;
+    int i = 0;
+    while ( i < 8 ) {
+	pad[n+i] = ( bits >> ( ( 7 - i ) * 8 ) ) & 0xff;
+	i++;
+    }
+    add( (const char *)pad, n + 8 );
+
+    static const char digits[] = "0123456789abcdef";
+    string result;
+    i = 0;
+    while ( i < 32 ) {
+	unsigned int v = ( h[i/4] >> ( ( 3 - i % 4 ) * 8 ) ) & 0xff;
+	result += digits[v >> 4];
+	result += digits[v & 15];
+	i++;
+    }
+
+    reset();
+    return result;
+}
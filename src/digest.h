@@ -0,0 +1,53 @@
+// Copyright Arnt Gulbrandsen <arnt@gulbrandsen.priv.no>; BSD-licensed.
+
+#ifndef DIGEST_H
+#define DIGEST_H
+
+#include <string>
+
+using namespace std;
+
+
+class Md5
+{
+public:
+    Md5();
+
+    void add( const char *, int );
+    string hex();
+
+    void reset();
+
+private:
+    void block( const unsigned char * );
+
+private:
+    unsigned int h[4];
+    unsigned char pending[64];
+    int used;
+    long long length;
+};
+
+
+class Sha256
+{
+public:
+    Sha256();
+
+    void add( const char *, int );
+    string hex();
+
+    void reset();
+
+private:
+    void block( const unsigned char * );
+
+private:
+    unsigned int h[8];
+    unsigned char pending[64];
+    int used;
+    long long length;
+};
+
+
+#endif
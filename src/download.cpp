@@ -0,0 +1,1477 @@
+// Copyright Arnt Gulbrandsen <arnt@gulbrandsen.priv.no>; BSD-licensed.
+
+#include "download.h"
+
+#include "log.h"
+#include "init.h"
+#include "artifact.h"
+#include "prefetch.h"
+#include "mount.h"
+#include "delta.h"
+#include "probes.h"
+#include "kernel.h"
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/file.h>
+#include <sys/syscall.h>
+#include <netdb.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <sysexits.h>
+#include <sched.h>
+#include <dirent.h>
+#include <time.h>
+
+#include <vector>
+#include <set>
+#include <fstream>
+
+#include <boost/bind.hpp>
+#include <boost/filesystem.hpp>
+#include <boost/lexical_cast.hpp>
+
+
+/*! \class Download download.h
+
+    The Download class is the Process that fetches a service's
+    artifact before it's installed. Process::launch() creates one for
+    each service; the download runs in the forked child, like the
+    scripts do.
+
+    For http URLs Download does the work itself: It asks the depot
+    for the size using HEAD, splits the file into up to MaxParts
+    parts and fetches them in parallel using Range requests, each
+    part in its own thread. The bytes go to a .part file next to the
+    final file, and a small .state file records how far each part
+    has come, so that a later attempt resumes where this one
+    stopped. When everything is there, the .part file is handed to
+    Artifact::add(), which moves it into the content-addressed store
+    and links it into place, so the install stage never sees half a
+    file.
+
+    The MD5 and SHA-256 digests are computed while the data arrives:
+    Whichever part contains the first unhashed byte feeds its data to
+    the hashers as it's written, and when a part is complete the hasher catches up
+    on the next part from the page cache. So the file is not read
+    through again after the download. If setSoftware() has been
+    called, tar files go to an Extractor along with the hashers, so
+    the software tree is ready soon after the last byte arrives; zip
+    files are unpacked in parallel once they're complete. Either way
+    the tree is only put in place once the digest is known to be
+    right. Filesystem images (see Mount) aren't unpacked at all, but
+    mounted on the software directory.
+
+    If another version of the same artifact has been unpacked (see
+    Artifact::earlier()) and the depot publishes a block index for
+    the new file, Download builds the new file from the old one using
+    Delta and fetches only the blocks that changed, using Range
+    requests. The result is checked against the digests like any
+    other download, and if anything goes wrong, or if little of the
+    old file can be used, Download fetches the entire file instead.
+
+    A connection that breaks is retried with exponential backoff.
+    Since each retry continues from the last byte received, a flaky
+    depot costs little more than a good one.
+
+    For other URLs (https, ftp) Download falls back to the download
+    script, which uses wget.
+
+    The parent can see the progress using received() and size(),
+    which read the .state file. Service::list() includes that.
+
+    Downloads are single-flight: If a second service needs an
+    artifact that is being downloaded, Process::launch() uses find()
+    to get the running Download and follow() to make the second
+    service's install stage wait for it. handleExit() starts all the
+    waiting stages once the file is in place. All three hold
+    Init::lock() while they look at the Download, since Init deletes
+    it once it's done. Downloads in separate
+    nodee processes (or from before a restart) are serialised by an
+    flock() on a .lock file, and the second one finds the file ready.
+
+    Prefetch uses setRate() to make a Download run in the background:
+    It's limited to a number of bytes per second and runs at idle CPU
+    and I/O priority. hurry() lifts both restrictions when a service
+    needs the file after all. The parent tells the child by creating
+    a .hurry file, which the child looks for about once per second.
+*/
+
+
+/*! Constructs a Download which will fetch \a url to \a filename and
+    check that the result has MD5 digest \a md5 (if nonempty). The
+    child process will use \a uid and \a gid.
+*/
+
+Download::Download( int uid, int gid,
+		    const string & u, const string & f, const string & m )
+    : Process( uid, gid ),
+      url( u ), filename( f ), md5( m ),
+      partName( f + ".part" ), stateName( f + ".state" ),
+      file( -1 ), stateFile( -1 ), total( 0 ),
+      numParts( 0 ), hashed( 0 ), failed( false ), extractor( 0 ),
+      drained( false ),
+      rate( 0 ), throttleStart( 0 ), throttled( 0 ), hurryChecked( 0 ),
+      hurryName( f + ".hurry" ),
+      maxFailures( 5 ), retryDelay( 1000 )
+{
+    string::iterator i( md5.begin() );
+    while ( i != md5.end() ) {
+	*i = ::tolower( *i );
+	++i;
+    }
+}
+
+
+/*! Discards any unfinished extraction. */
+
+Download::~Download()
+{
+    stopExtraction();
+}
+
+
+/*! Makes fetch() give up after \a failures attempts in a row that
+    make no progress, and wait \a ms milliseconds after the first
+    failure, twice that after the second, and so on.
+*/
+
+void Download::setRetries( int failures, int ms )
+{
+    maxFailures = failures;
+    retryDelay = ms;
+}
+
+
+/*! Makes fetch() unpack the file into the shared software directory
+    \a dir once it's verified, as the install script would. Tar
+    files are unpacked while they're being downloaded.
+
+    If this isn't called, or if the Extractor can't handle the file,
+    the install script does the unpacking.
+*/
+
+void Download::setSoftware( const string & dir )
+{
+    tree = dir;
+}
+
+
+/*! Limits this Download to \a bytesPerSecond, and makes it run at
+    idle priority. 0 (the default) means no limit and normal
+    priority.
+*/
+
+void Download::setRate( long long bytesPerSecond )
+{
+    rate = bytesPerSecond;
+}
+
+
+/*! Makes a Download limited by setRate() proceed at full speed,
+    because a service is waiting for it. Does nothing if it's not
+    limited. Called in the parent.
+*/
+
+void Download::hurry()
+{
+    if ( !rate )
+	return;
+    int fd = ::open( hurryName.c_str(), O_WRONLY | O_CREAT, 0644 );
+    if ( fd >= 0 )
+	::close( fd );
+}
+
+
+/*! Sets the CPU and I/O priority of all threads in this process to
+    idle if \a background is true, and to normal if not.
+*/
+
+static void prioritise( bool background )
+{
+    struct sched_param sp;
+    sp.sched_priority = 0;
+    int policy = background ? SCHED_IDLE : SCHED_OTHER;
+    int ioprio = background ? IoprioClassIdle << IoprioClassShift : 0;
+
+    DIR * d = ::opendir( "/proc/self/task" );
+    struct dirent * e;
+    while ( d && ( e = ::readdir( d ) ) != 0 ) {
+	int tid = ::atoi( e->d_name );
+	if ( tid > 0 ) {
+	    (void)::sched_setscheduler( tid, policy, &sp );
+	    (void)::syscall( SYS_ioprio_set, IoprioWhoProcess, tid, ioprio );
+	}
+    }
+    if ( d )
+	::closedir( d );
+}
+
+
+struct Url {
+    string host;
+    string port;
+    string path;
+    string auth;
+};
+
+
+static string base64( const string & in )
+{
+    static const char alphabet[] =
+	"ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    string r;
+    unsigned int i = 0;
+    while ( i < in.size() ) {
+	unsigned int v = (unsigned char)in[i] << 16;
+	if ( i + 1 < in.size() )
+	    v |= (unsigned char)in[i+1] << 8;
+	if ( i + 2 < in.size() )
+	    v |= (unsigned char)in[i+2];
+	r += alphabet[( v >> 18 ) & 63];
+	r += alphabet[( v >> 12 ) & 63];
+	r += i + 1 < in.size() ? alphabet[( v >> 6 ) & 63] : '=';
+	r += i + 2 < in.size() ? alphabet[v & 63] : '=';
+	i += 3;
+    }
+    return r;
+}
+
+
+/*! Parses the http URL \a u into \a r. Returns false if \a u isn't
+    an http URL, or at least not one we handle.
+*/
+
+static bool parseUrl( const string & u, Url & r )
+{
+    if ( u.size() < 8 || ::strncasecmp( u.c_str(), "http://", 7 ) )
+	return false;
+
+    string rest = u.substr( 7 );
+    string::size_type slash = rest.find( '/' );
+    string host = rest.substr( 0, slash );
+    r.path = slash == string::npos ? "/" : rest.substr( slash );
+
+    string::size_type at = host.rfind( '@' );
+    if ( at != string::npos ) {
+	r.auth = base64( host.substr( 0, at ) );
+	host = host.substr( at + 1 );
+    }
+
+    r.port = "80";
+    if ( !host.empty() && host[0] == '[' ) {
+	string::size_type close = host.find( ']' );
+	if ( close == string::npos )
+	    return false;
+	if ( close + 2 < host.size() && host[close+1] == ':' )
+	    r.port = host.substr( close + 2 );
+	r.host = host.substr( 1, close - 1 );
+    } else {
+	string::size_type colon = host.rfind( ':' );
+	if ( colon != string::npos && colon + 1 < host.size() )
+	    r.port = host.substr( colon + 1 );
+	r.host = host.substr( 0, colon );
+    }
+
+    return !r.host.empty();
+}
+
+
+/*! Connects to \a u's host and returns the socket, or -1. */
+
+static int connectTo( const Url & u )
+{
+    struct addrinfo hints;
+    ::memset( &hints, 0, sizeof( hints ) );
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+
+    struct addrinfo * result = 0;
+    if ( ::getaddrinfo( u.host.c_str(), u.port.c_str(), &hints, &result ) )
+	return -1;
+
+    int fd = -1;
+    struct addrinfo * ai = result;
+    while ( ai && fd < 0 ) {
+	fd = ::socket( ai->ai_family, ai->ai_socktype, ai->ai_protocol );
+	if ( fd >= 0 ) {
+	    // a depot that stops talking counts as a broken connection
+	    struct timeval tv;
+	    tv.tv_sec = 30;
+	    tv.tv_usec = 0;
+	    ::setsockopt( fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof( tv ) );
+	    ::setsockopt( fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof( tv ) );
+	    if ( ::connect( fd, ai->ai_addr, ai->ai_addrlen ) < 0 ) {
+		::close( fd );
+		fd = -1;
+	    }
+	}
+	ai = ai->ai_next;
+    }
+    ::freeaddrinfo( result );
+    return fd;
+}
+
+
+struct Response {
+    Response()
+	: status( 0 ), length( -1 ), from( -1 ),
+	  ranges( false ), keepAlive( false ) {}
+    int status;
+    long long length;
+    long long from;
+    bool ranges;
+    bool keepAlive;
+    string location;
+    string body;
+};
+
+
+static bool header( const char * line, const char * name,
+		    const char * & value )
+{
+    int l = ::strlen( name );
+    if ( ::strncasecmp( line, name, l ) || line[l] != ':' )
+	return false;
+    value = line + l + 1;
+    while ( *value == ' ' || *value == '\t' )
+	value++;
+    return true;
+}
+
+
+/*! Sends a \a method request for \a u, asking for the bytes from \a
+    from to \a to (inclusive) unless \a from is negative, and reads
+    the response header into \a r. Any body bytes read along with the
+    header are left in r.body.
+
+    If \a connection is nonzero, the request asks the depot to keep
+    the connection open, and uses *\a connection if that's an open
+    socket from an earlier request. The depot may have closed it
+    meanwhile, so if that fails, this connects again. The caller
+    reads the body and then decides whether to keep the socket (see
+    Response::keepAlive).
+
+    Returns the socket, positioned at the body, or -1 in case of
+    error.
+*/
+
+static int request( const Url & u, const char * method,
+		    long long from, long long to, Response & r,
+		    int * connection = 0 )
+{
+    int fd = -1;
+    bool reused = false;
+    if ( connection && *connection >= 0 ) {
+	fd = *connection;
+	*connection = -1;
+	reused = true;
+    } else {
+	fd = connectTo( u );
+    }
+    if ( fd < 0 )
+	return -1;
+
+    char req[4096];
+    int n = ::snprintf( req, sizeof( req ),
+			"%s %s HTTP/1.0\r\n"
+			"Host: %s%s%s\r\n"
+			"User-Agent: nodee\r\n",
+			method, u.path.c_str(), u.host.c_str(),
+			u.port == "80" ? "" : ":",
+			u.port == "80" ? "" : u.port.c_str() );
+    if ( n > 0 && n < (int)sizeof( req ) && !u.auth.empty() )
+	n += ::snprintf( req + n, sizeof( req ) - n,
+			 "Authorization: Basic %s\r\n", u.auth.c_str() );
+    if ( n > 0 && n < (int)sizeof( req ) && from >= 0 )
+	n += ::snprintf( req + n, sizeof( req ) - n,
+			 "Range: bytes=%lld-%lld\r\n", from, to );
+    if ( n > 0 && n < (int)sizeof( req ) && connection )
+	n += ::snprintf( req + n, sizeof( req ) - n,
+			 "Connection: keep-alive\r\n" );
+    if ( n > 0 && n < (int)sizeof( req ) )
+	n += ::snprintf( req + n, sizeof( req ) - n, "\r\n" );
+    if ( n <= 0 || n >= (int)sizeof( req ) ||
+	 ::send( fd, req, n, MSG_NOSIGNAL ) != n ) {
+	::close( fd );
+	if ( reused )
+	    return request( u, method, from, to, r, connection );
+	return -1;
+    }
+
+    // read until the end of the header
+    char buffer[16384];
+    int used = 0;
+    char * end = 0;
+    while ( !end ) {
+	int l = ::read( fd, buffer + used, sizeof( buffer ) - 1 - used );
+	if ( l <= 0 ) {
+	    ::close( fd );
+	    if ( reused && !used )
+		return request( u, method, from, to, r, connection );
+	    return -1;
+	}
+	used += l;
+	buffer[used] = 0;
+	end = ::strstr( buffer, "\r\n\r\n" );
+	if ( !end && used >= (int)sizeof( buffer ) - 1 ) {
+	    ::close( fd );
+	    return -1;
+	}
+    }
+    r.body.assign( end + 4, buffer + used - ( end + 4 ) );
+    *end = 0;
+
+    char * line = buffer;
+    if ( ::strncmp( line, "HTTP/1.", 7 ) || ::strlen( line ) < 12 ) {
+	::close( fd );
+	return -1;
+    }
+    r.status = ::atoi( line + 9 );
+
+    while ( line ) {
+	char * next = ::strstr( line, "\r\n" );
+	if ( next ) {
+	    *next = 0;
+	    next += 2;
+	}
+	const char * v;
+	if ( header( line, "Content-Length", v ) )
+	    r.length = ::atoll( v );
+	else if ( header( line, "Accept-Ranges", v ) )
+	    r.ranges = ::strstr( v, "bytes" ) != 0;
+	else if ( header( line, "Content-Range", v ) &&
+		  !::strncmp( v, "bytes ", 6 ) )
+	    r.from = ::atoll( v + 6 );
+	else if ( header( line, "Location", v ) )
+	    r.location = v;
+	else if ( header( line, "Connection", v ) )
+	    r.keepAlive = ::strcasestr( v, "keep-alive" ) != 0;
+	line = next;
+    }
+
+    return fd;
+}
+
+
+/*! Called in the child process; fetches the file and exits. URLs
+    other than http are left to the download script.
+*/
+
+void Download::start()
+{
+    if ( !inChild() )
+	return;
+
+    Url u;
+    if ( !parseUrl( url, u ) ) {
+	Process::start();
+	return;
+    }
+
+    if ( rate && ::access( hurryName.c_str(), F_OK ) < 0 )
+	prioritise( true );
+    else
+	rate = 0;
+
+    NODEE_PROBE2( download__start, url.c_str(), filename.c_str() );
+    bool ok = fetch();
+    NODEE_PROBE3( download__done, url.c_str(), total, ok );
+    if ( ok ) {
+	debug << "nodee: Downloaded " << url << endl;
+	::exit( 0 );
+    }
+    debug << "nodee: Unable to download " << url << endl;
+    ::exit( EX_TEMPFAIL );
+}
+
+
+/*! Notifies this Download that its process has exited, with \a
+    status and \a signal as for Process::handleExit(), and starts
+    the next stage for each service that was waiting for it.
+*/
+
+void Download::handleExit( int status, int signal )
+{
+    Process::handleExit( status, signal );
+    if ( valid() )
+	return;
+
+    Prefetch::finished( this );
+
+    list<Process *> waiting;
+    {
+	boost::lock_guard<boost::mutex> l( Init::lock() );
+	waiting.swap( followers );
+	drained = true;
+    }
+    list<Process *>::iterator i( waiting.begin() );
+    while ( i != waiting.end() ) {
+	(*i)->fork();
+	++i;
+    }
+}
+
+
+/*! Returns the running Download that is fetching \a filename with
+    MD5 digest \a md5, or a null pointer if there is none in \a init.
+
+    The caller must hold Init::lock() until it's done with the
+    Download.
+*/
+
+Download * Download::find( Init & init, const string & filename,
+			   const string & md5 )
+{
+    string digest = md5;
+    string::iterator c( digest.begin() );
+    while ( c != digest.end() ) {
+	*c = ::tolower( *c );
+	++c;
+    }
+
+    list<Process *> & pl = init.processes();
+    list<Process *>::iterator i( pl.begin() );
+    while ( i != pl.end() ) {
+	Download * d = dynamic_cast<Download *>( *i );
+	if ( d && d->valid() && !d->drained &&
+	     d->filename == filename && d->md5 == digest )
+	    return d;
+	++i;
+    }
+    return 0;
+}
+
+
+/*! Makes \a p wait for this Download; handleExit() will fork() \a p
+    once the download is done. Returns false if the download is
+    already done, in which case the caller has to fork() \a p.
+
+    The caller must hold Init::lock().
+*/
+
+bool Download::follow( Process * p )
+{
+    if ( drained )
+	return false;
+    followers.push_back( p );
+    return true;
+}
+
+
+/*! Downloads the file, resuming an earlier attempt if possible.
+    Returns true if the file is in place and has the right digest,
+    false if not. This is the function start() calls in the child;
+    it's separate so it can be tested.
+*/
+
+bool Download::fetch()
+{
+    if ( verified( filename ) ) {
+	unpack();
+	return true;
+    }
+
+    // if someone else is fetching the same file, wait for them to
+    // finish. they may well have done our work for us.
+    string lockName = filename + ".lock";
+    int lockFile = ::open( lockName.c_str(), O_RDWR | O_CREAT, 0644 );
+    if ( lockFile >= 0 && ::flock( lockFile, LOCK_EX ) < 0 ) {
+	::close( lockFile );
+	lockFile = -1;
+    }
+    bool ok = verified( filename ) || fetchUnverified();
+    if ( lockFile >= 0 )
+	::close( lockFile );
+    if ( ok )
+	unpack();
+    else
+	stopExtraction();
+    ::unlink( hurryName.c_str() );
+    return ok;
+}
+
+
+/*! Does the real work for fetch(), once it's known that the file
+    isn't there and nobody else is fetching it.
+*/
+
+bool Download::fetchUnverified()
+{
+
+    long long size = -1;
+    bool ranges = false;
+    if ( !probe( size, ranges ) || size < 0 )
+	return fetchPlain();
+
+    // make room first, so a full disk doesn't cause odd failures
+    // halfway through
+    long long needed = size;
+    struct stat st;
+    if ( ::stat( partName.c_str(), &st ) == 0 )
+	needed -= st.st_blocks * 512LL;
+    // this child can't see what Init's Processes use, but the index
+    // counts each running service and install stage, and evict()
+    // leaves those alone.
+    string dir = filename.substr( 0, filename.rfind( '/' ) );
+    set<string> keep;
+    keep.insert( filename );
+    Artifact::evict( dir, 0, needed, keep );
+    long long available = Artifact::available( dir );
+    if ( available >= 0 && available < needed ) {
+	debug << "nodee: Not enough disk space to download " << url << endl;
+	return false;
+    }
+
+    // a delta doesn't mix with a half-done full download
+    if ( ranges && !tree.empty() &&
+	 ::access( stateName.c_str(), F_OK ) < 0 && fetchDelta( size ) )
+	return true;
+
+    file = ::open( partName.c_str(), O_RDWR | O_CREAT, 0644 );
+    if ( file < 0 )
+	return false;
+
+    if ( !ranges || !resume( size ) ) {
+	numParts = 1;
+	if ( ranges )
+	    numParts = size / MinPartSize;
+	if ( numParts > MaxParts )
+	    numParts = MaxParts;
+	if ( numParts < 1 )
+	    numParts = 1;
+	int i = 0;
+	while ( i < numParts ) {
+	    parts[i].start = size * i / numParts;
+	    parts[i].next = parts[i].start;
+	    parts[i].end = size * ( i + 1 ) / numParts;
+	    i++;
+	}
+	if ( ::ftruncate( file, size ) < 0 ) {
+	    forget();
+	    return false;
+	}
+    }
+    total = size;
+    failed = false;
+
+    stateFile = ::open( stateName.c_str(), O_RDWR | O_CREAT, 0644 );
+    hasher.reset();
+    sha.reset();
+    hashed = 0;
+    startExtraction();
+    {
+	boost::lock_guard<boost::mutex> l( lock );
+	writeState();
+	catchUp();
+    }
+
+    boost::thread_group workers;
+    int i = 0;
+    while ( i < numParts ) {
+	workers.create_thread( boost::bind( &Download::fetchPart, this, i ) );
+	i++;
+    }
+    workers.join_all();
+
+    {
+	boost::lock_guard<boost::mutex> l( lock );
+	catchUp();
+    }
+    if ( stateFile >= 0 )
+	::close( stateFile );
+    stateFile = -1;
+
+    if ( failed || hashed < total ) {
+	// keep the .part and .state files for the next attempt
+	::close( file );
+	file = -1;
+	return false;
+    }
+
+    string digest = hasher.hex();
+    if ( !md5.empty() && digest != md5 ) {
+	debug << "nodee: Wrong MD5 digest for " << url << endl;
+	forget();
+	return false;
+    }
+
+    ::fsync( file );
+    ::close( file );
+    file = -1;
+    if ( !Artifact::add( partName, filename, sha.hex(), digest, url ) )
+	return false;
+    ::unlink( stateName.c_str() );
+    return true;
+}
+
+
+/*! Returns true if \a name exists and has the right digest. If it
+    exists but has the wrong digest, it's deleted.
+
+    If the Artifact index knows \a name, the index is trusted and the
+    file isn't read. Otherwise the file is hashed and, if it's
+    right, added to the store.
+*/
+
+bool Download::verified( const string & name )
+{
+    Artifact::Blob b;
+    if ( Artifact::find( name, b ) && Artifact::intact( name, b ) &&
+	 ( md5.empty() || b.md5 == md5 ) )
+	return true;
+
+    int fd = ::open( name.c_str(), O_RDONLY );
+    if ( fd < 0 )
+	return false;
+
+    Md5 m;
+    Sha256 s;
+    vector<char> buffer( BufferSize );
+    int n;
+    while ( ( n = ::read( fd, &buffer[0], BufferSize ) ) > 0 ) {
+	m.add( &buffer[0], n );
+	s.add( &buffer[0], n );
+    }
+    ::close( fd );
+    string digest = m.hex();
+    if ( n == 0 && ( md5.empty() || digest == md5 ) ) {
+	(void)Artifact::add( name, name, s.hex(), digest, "" );
+	return true;
+    }
+    ::unlink( name.c_str() );
+    return false;
+}
+
+
+/*! Asks the depot for the size of the file and stores it in \a size,
+    and whether it can serve parts of it in \a ranges. Follows
+    redirects. Returns true if the depot answered, false if not.
+*/
+
+bool Download::probe( long long & size, bool & ranges )
+{
+    int redirects = 0;
+    int failures = 0;
+    while ( redirects < 5 ) {
+	Url u;
+	if ( !parseUrl( url, u ) )
+	    return false;
+	Response r;
+	int fd = request( u, "HEAD", -1, -1, r );
+	if ( fd < 0 ) {
+	    if ( ++failures > maxFailures )
+		return false;
+	    ::usleep( retryDelay * 1000 << ( failures - 1 ) );
+	    continue;
+	}
+	::close( fd );
+	if ( r.status >= 300 && r.status < 400 && !r.location.empty() ) {
+	    url = r.location;
+	    redirects++;
+	} else if ( r.status == 200 ) {
+	    size = r.length;
+	    ranges = r.ranges;
+	    return true;
+	} else {
+	    // some depots don't do HEAD. fetchPlain() can cope.
+	    return true;
+	}
+    }
+    return false;
+}
+
+
+/*! Reads the .state file left by an earlier attempt and sets up the
+    parts to continue from there. Returns false if there is no usable
+    state for a file of \a size bytes.
+*/
+
+bool Download::resume( long long size )
+{
+    long long s = 0;
+    int n = 0;
+    if ( !readState( s, n, parts ) || s != size )
+	return false;
+
+    struct stat st;
+    if ( ::fstat( file, &st ) < 0 || st.st_size != size )
+	return false;
+
+    int i = 0;
+    while ( i < n ) {
+	if ( parts[i].start > parts[i].next ||
+	     parts[i].next > parts[i].end ||
+	     parts[i].start != ( i ? parts[i-1].end : 0 ) )
+	    return false;
+	i++;
+    }
+    if ( parts[n-1].end != size )
+	return false;
+
+    numParts = n;
+    debug << "nodee: Resuming download of " << url << endl;
+    return true;
+}
+
+
+/*! Fetches part \a i, retrying as needed. Runs in a thread of its
+    own; sets failed if it gives up.
+*/
+
+void Download::fetchPart( int i )
+{
+    Part & p = parts[i];
+    vector<char> buffer( BufferSize );
+    Url u;
+    if ( !parseUrl( url, u ) ) {
+	failed = true;
+	return;
+    }
+
+    int failures = 0;
+    while ( p.next < p.end && !failed ) {
+	if ( failures > maxFailures ) {
+	    failed = true;
+	    return;
+	}
+	if ( failures ) {
+	    long long ms = (long long)retryDelay << ( failures - 1 );
+	    if ( ms > 30000 )
+		ms = 30000;
+	    ::usleep( ms * 1000 );
+	}
+
+	Response r;
+	bool ranged = p.next > 0 || numParts > 1;
+	int fd = request( u, "GET", ranged ? p.next : -1, p.end - 1, r );
+	if ( fd < 0 ) {
+	    failures++;
+	    continue;
+	}
+
+	if ( r.status == 200 && numParts == 1 ) {
+	    // the depot sends the whole file, so we start over
+	    boost::lock_guard<boost::mutex> l( lock );
+	    p.next = 0;
+	    hashed = 0;
+	    hasher.reset();
+	    sha.reset();
+	    startExtraction();
+	} else if ( r.status != 206 || r.from != p.next ) {
+	    ::close( fd );
+	    failures++;
+	    continue;
+	}
+
+	long long before = p.next;
+	bool ok = store( i, r.body.data(), r.body.size() );
+	throttle( r.body.size() );
+	while ( ok && p.next < p.end ) {
+	    int n = ::read( fd, &buffer[0], BufferSize );
+	    if ( n <= 0 )
+		break;
+	    ok = store( i, &buffer[0], n );
+	    throttle( n );
+	}
+	::close( fd );
+
+	if ( !ok )
+	    return;
+	if ( p.next > before )
+	    failures = 0;
+	if ( p.next < p.end )
+	    failures++;
+    }
+}
+
+
+/*! Writes the \a n bytes at \a data to part \a i of the file, and
+    feeds them to the digest if possible. Returns false and sets
+    failed if the data cannot be written.
+*/
+
+bool Download::store( int i, const char * data, int n )
+{
+    Part & p = parts[i];
+    if ( n > p.end - p.next )
+	n = p.end - p.next;
+    int done = 0;
+    while ( done < n ) {
+	int l = ::pwrite( file, data + done, n - done, p.next + done );
+	if ( l <= 0 ) {
+	    failed = true;
+	    return false;
+	}
+	done += l;
+    }
+
+    boost::lock_guard<boost::mutex> l( lock );
+    if ( hashed == p.next ) {
+	hasher.add( data, n );
+	sha.add( data, n );
+	if ( extractor )
+	    extractor->feed( data, n );
+	hashed += n;
+    }
+    p.next += n;
+    catchUp();
+    writeState();
+    return true;
+}
+
+
+/*! Sleeps as long as needed to keep this Download within the rate
+    set by setRate(), given that \a n more bytes have arrived. Looks
+    for the .hurry file now and then, and if it's there, returns to
+    normal priority and stops limiting.
+
+    Never sleeps more than a second at a time, so hurry() takes
+    effect quickly.
+*/
+
+void Download::throttle( int n )
+{
+    long long now = milliseconds();
+    long long wait = 0;
+    {
+	boost::lock_guard<boost::mutex> l( lock );
+	if ( !rate )
+	    return;
+	if ( now - hurryChecked >= 1000 ) {
+	    hurryChecked = now;
+	    if ( ::access( hurryName.c_str(), F_OK ) == 0 ) {
+		rate = 0;
+		prioritise( false );
+		debug << "nodee: Hurrying download of " << url << endl;
+		return;
+	    }
+	}
+	if ( !throttleStart )
+	    throttleStart = now;
+	throttled += n;
+	wait = throttleStart + throttled * 1000 / rate - now;
+    }
+    if ( wait > 1000 )
+	wait = 1000;
+    if ( wait > 0 )
+	::usleep( wait * 1000 );
+}
+
+
+/*! Feeds the digest whatever contiguous data is available after the
+    bytes hashed so far, reading it back from the .part file. The
+    lock must be held.
+*/
+
+void Download::catchUp()
+{
+    char buffer[4096];
+    while ( hashed < total ) {
+	int i = 0;
+	while ( i < numParts && parts[i].end <= hashed )
+	    i++;
+	if ( i >= numParts || parts[i].next <= hashed )
+	    return;
+	long long n = parts[i].next - hashed;
+	if ( n > (long long)sizeof( buffer ) )
+	    n = sizeof( buffer );
+	int l = ::pread( file, buffer, n, hashed );
+	if ( l <= 0 )
+	    return;
+	hasher.add( buffer, l );
+	sha.add( buffer, l );
+	if ( extractor )
+	    extractor->feed( buffer, l );
+	hashed += l;
+    }
+}
+
+
+/*! Records the progress of each part in the .state file. The lock
+    must be held.
+*/
+
+void Download::writeState()
+{
+    if ( stateFile < 0 )
+	return;
+    char buffer[64 * ( MaxParts + 1 )];
+    int n = ::snprintf( buffer, sizeof( buffer ),
+			"nodee-download %020lld %d\n", total, numParts );
+    int i = 0;
+    while ( i < numParts ) {
+	n += ::snprintf( buffer + n, sizeof( buffer ) - n,
+			 "%020lld %020lld %020lld\n",
+			 parts[i].start, parts[i].next, parts[i].end );
+	i++;
+    }
+    // the length never changes, so overwriting is enough
+    (void)::pwrite( stateFile, buffer, n, 0 );
+}
+
+
+/*! Reads the .state file, storing the file size in \a size, the
+    number of parts in \a n and the parts themselves in \a p. Returns
+    true if the file exists and makes sense, and false otherwise.
+*/
+
+bool Download::readState( long long & size, int & n, Part * p ) const
+{
+    FILE * f = ::fopen( stateName.c_str(), "r" );
+    if ( !f )
+	return false;
+    bool ok = ::fscanf( f, "nodee-download %lld %d\n", &size, &n ) == 2 &&
+	      n >= 1 && n <= MaxParts;
+    int i = 0;
+    while ( ok && i < n ) {
+	ok = ::fscanf( f, "%lld %lld %lld\n",
+		       &p[i].start, &p[i].next, &p[i].end ) == 3;
+	i++;
+    }
+    ::fclose( f );
+    return ok;
+}
+
+
+/*! Fetches the file in a single request, for depots that won't say
+    how big it is. This cannot resume, but it does retry.
+*/
+
+bool Download::fetchPlain()
+{
+    Url u;
+    if ( !parseUrl( url, u ) )
+	return false;
+
+    vector<char> buffer( BufferSize );
+    int failures = 0;
+    while ( failures <= maxFailures ) {
+	if ( failures )
+	    ::usleep( retryDelay * 1000 << ( failures - 1 ) );
+	failures++;
+
+	Response r;
+	int fd = request( u, "GET", -1, -1, r );
+	if ( fd < 0 )
+	    continue;
+	if ( r.status != 200 ) {
+	    ::close( fd );
+	    continue;
+	}
+
+	file = ::open( partName.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644 );
+	if ( file < 0 ) {
+	    ::close( fd );
+	    return false;
+	}
+	Md5 m;
+	Sha256 s;
+	long long got = r.body.size();
+	bool ok = ::write( file, r.body.data(), got ) == got;
+	m.add( r.body.data(), got );
+	s.add( r.body.data(), got );
+	int n = 0;
+	while ( ok && ( n = ::read( fd, &buffer[0], BufferSize ) ) > 0 ) {
+	    ok = ::write( file, &buffer[0], n ) == n;
+	    m.add( &buffer[0], n );
+	    s.add( &buffer[0], n );
+	    got += n;
+	    throttle( n );
+	}
+	::close( fd );
+	ok = ok && n == 0 && ( r.length < 0 || got == r.length );
+	string digest = m.hex();
+	if ( ok && ( md5.empty() || digest == md5 ) ) {
+	    ::fsync( file );
+	    ::close( file );
+	    file = -1;
+	    return Artifact::add( partName, filename, s.hex(), digest, url );
+	}
+	forget();
+    }
+    return false;
+}
+
+
+/*! Tries to build the file from an earlier version of the artifact
+    and the blocks that differ, as described by the depot's block
+    index. The file should be \a size bytes long. Returns true if
+    the result is verified and in place, and false if the caller
+    should download the entire file instead.
+*/
+
+bool Download::fetchDelta( long long size )
+{
+    string basis = Artifact::earlier(
+	filename.substr( 0, filename.rfind( '/' ) ), tree );
+    Url u;
+    if ( basis.empty() || !parseUrl( url + ".blocks", u ) )
+	return false;
+
+    Response r;
+    int fd = request( u, "GET", -1, -1, r );
+    if ( fd < 0 )
+	return false;
+    string text = r.body;
+    vector<char> buffer( BufferSize );
+    int n = 0;
+    while ( r.status == 200 && text.size() < (string::size_type)MaxIndexSize &&
+	    ( n = ::read( fd, &buffer[0], BufferSize ) ) > 0 )
+	text.append( &buffer[0], n );
+    ::close( fd );
+    Delta d;
+    if ( r.status != 200 || n < 0 || !d.parse( text ) || d.size() != size )
+	return false;
+
+    file = ::open( partName.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644 );
+    if ( file < 0 )
+	return false;
+    long long reused = -1;
+    if ( ::ftruncate( file, size ) == 0 )
+	reused = d.reuse( basis, file );
+    // a full download runs in parallel and can resume, so it's
+    // better unless most of the file is there already
+    if ( reused * 2 < size ) {
+	forget();
+	return false;
+    }
+    debug << "nodee: Reusing " << reused << " of " << size
+	  << " bytes of " << url << " from " << basis << endl;
+
+    // the ranges are fetched one after another on one connection
+    list< pair<long long,long long> > missing( d.missing( RangeSlack ) );
+    list< pair<long long,long long> >::iterator m( missing.begin() );
+    int connection = -1;
+    bool fetched = true;
+    while ( fetched && m != missing.end() ) {
+	fetched = fetchRange( m->first, m->second, connection );
+	++m;
+    }
+    if ( connection >= 0 )
+	::close( connection );
+    if ( !fetched ) {
+	forget();
+	return false;
+    }
+
+    Md5 m5;
+    Sha256 s;
+    ::lseek( file, 0, SEEK_SET );
+    while ( ( n = ::read( file, &buffer[0], BufferSize ) ) > 0 ) {
+	m5.add( &buffer[0], n );
+	s.add( &buffer[0], n );
+    }
+    string digest = m5.hex();
+    if ( n < 0 || s.hex() != d.sha256() ||
+	 ( !md5.empty() && digest != md5 ) ) {
+	debug << "nodee: Wrong digest after delta update of " << url << endl;
+	forget();
+	return false;
+    }
+
+    ::fsync( file );
+    ::close( file );
+    file = -1;
+    return Artifact::add( partName, filename, d.sha256(), digest, url );
+}
+
+
+/*! Fetches bytes \a from to \a to (inclusive) into the .part file
+    using a Range request, retrying as fetchPart() does. Returns true
+    if all the bytes arrived, false if not.
+
+    \a connection is a socket kept open from the previous call, or
+    -1. If the depot agrees, this leaves the socket open there for
+    the next call; the caller closes it at the end.
+*/
+
+bool Download::fetchRange( long long from, long long to, int & connection )
+{
+    Url u;
+    if ( !parseUrl( url, u ) )
+	return false;
+
+    vector<char> buffer( BufferSize );
+    long long next = from;
+    int failures = 0;
+    while ( next <= to ) {
+	if ( failures > maxFailures )
+	    return false;
+	if ( failures ) {
+	    long long ms = (long long)retryDelay << ( failures - 1 );
+	    if ( ms > 30000 )
+		ms = 30000;
+	    ::usleep( ms * 1000 );
+	}
+
+	Response r;
+	int fd = request( u, "GET", next, to, r, &connection );
+	if ( fd < 0 ) {
+	    failures++;
+	    continue;
+	}
+	if ( r.status != 206 || r.from != next ) {
+	    ::close( fd );
+	    failures++;
+	    continue;
+	}
+
+	long long before = next;
+	const char * data = r.body.data();
+	long long n = r.body.size();
+	bool ok = true;
+	bool extra = false;
+	while ( ok && n > 0 ) {
+	    if ( n > to + 1 - next ) {
+		n = to + 1 - next;
+		extra = true;
+	    }
+	    ok = ::pwrite( file, data, n, next ) == n;
+	    next += n;
+	    throttle( n );
+	    if ( next > to )
+		break;
+	    n = ::read( fd, &buffer[0], BufferSize );
+	    data = &buffer[0];
+	}
+	// the socket can be used again only if the response ended
+	// exactly where we stopped reading
+	if ( ok && next > to && !extra && r.keepAlive &&
+	     r.length == to + 1 - before )
+	    connection = fd;
+	else
+	    ::close( fd );
+
+	if ( !ok )
+	    return false;
+	if ( next > before )
+	    failures = 0;
+	if ( next <= to )
+	    failures++;
+    }
+    return true;
+}
+
+
+/*! Discards the .part and .state files. */
+
+void Download::forget()
+{
+    if ( file >= 0 )
+	::close( file );
+    file = -1;
+    ::unlink( partName.c_str() );
+    ::unlink( stateName.c_str() );
+}
+
+
+static string temporary( const string & software )
+{
+    return software + ".tmp." + boost::lexical_cast<string>( ::getpid() );
+}
+
+
+/*! Starts unpacking the file into a temporary directory as it's
+    hashed, discarding anything unpacked earlier. Does nothing unless
+    setSoftware() has been called and the file is a tar file (or
+    a jar).
+*/
+
+void Download::startExtraction()
+{
+    stopExtraction();
+    if ( tree.empty() )
+	return;
+    Extractor * e = new Extractor( filename, temporary( tree ) );
+    if ( e->streaming() ) {
+	extractor = e;
+    } else {
+	delete e;
+	::rmdir( temporary( tree ).c_str() );
+    }
+}
+
+
+/*! Discards the Extractor and the temporary directory, if any. */
+
+void Download::stopExtraction()
+{
+    if ( !extractor )
+	return;
+    delete extractor;
+    extractor = 0;
+    boost::system::error_code ignored;
+    boost::filesystem::remove_all( temporary( tree ), ignored );
+}
+
+
+/*! Makes sure the software directory contains the verified file,
+    unpacked. If it was unpacked during the download, this just
+    completes the job; otherwise the whole file is unpacked now.
+
+    The tree is swapped into place under the same lock and with the
+    same .nodee-source marker as the install script uses, so the
+    script sees that it has nothing to unpack. Returns true if the
+    tree is in place, and false if the script has to do the job.
+
+    A filesystem image is mounted instead, using mountImage().
+*/
+
+bool Download::unpack()
+{
+    if ( tree.empty() )
+	return false;
+
+    struct stat st;
+    if ( ::stat( filename.c_str(), &st ) < 0 ) {
+	stopExtraction();
+	return false;
+    }
+    string id = boost::lexical_cast<string>( st.st_dev ) + ":" +
+		boost::lexical_cast<string>( st.st_ino );
+
+    boost::system::error_code ignored;
+    boost::filesystem::create_directories(
+	boost::filesystem::path( tree ).parent_path(), ignored );
+    int lockFile = ::open( ( tree + ".lock" ).c_str(),
+			   O_RDWR | O_CREAT, 0644 );
+    if ( lockFile < 0 || ::flock( lockFile, LOCK_EX ) < 0 ) {
+	if ( lockFile >= 0 )
+	    ::close( lockFile );
+	stopExtraction();
+	return false;
+    }
+
+    if ( !Mount::type( filename ).empty() ) {
+	stopExtraction();
+	bool ok = mountImage( id );
+	::close( lockFile );
+	return ok;
+    }
+
+    string current;
+    std::ifstream marker( ( tree + "/.nodee-source" ).c_str() );
+    std::getline( marker, current );
+    if ( current == id ) {
+	::close( lockFile );
+	stopExtraction();
+	return true;
+    }
+
+    string tmp = temporary( tree );
+    bool ok = false;
+    if ( extractor ) {
+	ok = extractor->finish( filename );
+    } else {
+	extractor = new Extractor( filename, tmp );
+	ok = extractor->extract( filename );
+    }
+    delete extractor;
+    extractor = 0;
+
+    if ( ok ) {
+	std::ofstream source( ( tmp + "/.nodee-source" ).c_str() );
+	source << id << "\n";
+	source.close();
+	// services installed from an older tree keep their links to it
+	string old = tree + ".old." +
+		     boost::lexical_cast<string>( ::getpid() );
+	bool moved = ::rename( tree.c_str(), old.c_str() ) == 0;
+	ok = !source.fail() && ::rename( tmp.c_str(), tree.c_str() ) == 0;
+	if ( moved )
+	    boost::filesystem::remove_all( old, ignored );
+    }
+    if ( !ok )
+	boost::filesystem::remove_all( tmp, ignored );
+    ::close( lockFile );
+
+    if ( ok ) {
+	debug << "nodee: Unpacked " << filename << endl;
+	// services use the tree, so the archive only wastes page cache
+	int fd = ::open( filename.c_str(), O_RDONLY );
+	if ( fd >= 0 ) {
+	    (void)::posix_fadvise( fd, 0, 0, POSIX_FADV_DONTNEED );
+	    ::close( fd );
+	}
+    }
+    return ok;
+}
+
+
+/*! Mounts the filesystem image on the software directory, unless
+    the image with \a id is mounted there already. The caller must
+    hold the lock. Returns true if the image is mounted.
+
+    The .image file next to the software directory records which
+    image is mounted, since nothing can be written inside it. If a
+    different image is mounted (because the artifact changed
+    without a new version number), that is unmounted lazily, so
+    running services keep what they have open.
+*/
+
+bool Download::mountImage( const string & id )
+{
+    string current;
+    std::ifstream marker( ( tree + ".image" ).c_str() );
+    std::getline( marker, current );
+    bool mounted = Mount::mounted( tree );
+    if ( mounted && current == id )
+	return true;
+
+    if ( mounted && !Mount::unmount( tree ) )
+	return false;
+    boost::system::error_code ignored;
+    boost::filesystem::create_directories( tree, ignored );
+    if ( !Mount::mount( filename, tree ) ) {
+	debug << "nodee: Unable to mount " << filename << endl;
+	return false;
+    }
+    std::ofstream image( ( tree + ".image" ).c_str() );
+    image << id << "\n";
+    debug << "nodee: Mounted " << filename << endl;
+    return true;
+}
+
+
+/*! Returns the number of bytes received so far, as recorded in the
+    .state file, or 0 if nothing is known. Works in the parent.
+*/
+
+long long Download::received() const
+{
+    long long s = 0;
+    int n = 0;
+    Part p[MaxParts];
+    if ( !readState( s, n, p ) )
+	return 0;
+    long long r = 0;
+    int i = 0;
+    while ( i < n ) {
+	r += p[i].next - p[i].start;
+	i++;
+    }
+    return r;
+}
+
+
+/*! Returns the size of the file being downloaded, or 0 if it's not
+    (yet) known. Works in the parent.
+*/
+
+long long Download::size() const
+{
+    long long s = 0;
+    int n = 0;
+    Part p[MaxParts];
+    if ( !readState( s, n, p ) )
+	return 0;
+    return s;
+}
@@ -0,0 +1,98 @@
+// Copyright Arnt Gulbrandsen <arnt@gulbrandsen.priv.no>; BSD-licensed.
+
+#ifndef DOWNLOAD_H
+#define DOWNLOAD_H
+
+#include "process.h"
+#include "digest.h"
+#include "extract.h"
+
+#include <boost/thread.hpp>
+
+#include <list>
+
+
+class Download: public Process
+{
+public:
+    Download( int, int,
+	      const string &, const string &, const string & );
+    ~Download();
+
+    void start();
+    void handleExit( int, int );
+
+    static Download * find( Init &, const string &, const string & );
+    bool follow( Process * );
+
+    bool fetch();
+
+    void setRetries( int, int );
+    void setSoftware( const string & );
+    void setRate( long long );
+    void hurry();
+
+    long long received() const;
+    long long size() const;
+
+    enum { MaxParts = 4, MinPartSize = 1024 * 1024, BufferSize = 65536,
+	   MaxIndexSize = 64 * 1024 * 1024, RangeSlack = 65536 };
+
+private:
+    struct Part {
+	Part(): start( 0 ), next( 0 ), end( 0 ) {}
+	long long start;
+	long long next;
+	long long end;
+    };
+
+    bool fetchUnverified();
+    bool verified( const string & );
+    bool probe( long long &, bool & );
+    bool resume( long long );
+    void fetchPart( int );
+    bool fetchPlain();
+    bool fetchDelta( long long );
+    bool fetchRange( long long, long long, int & );
+    bool store( int, const char *, int );
+    void catchUp();
+    void writeState();
+    bool readState( long long &, int &, Part * ) const;
+    void forget();
+    void throttle( int );
+    void startExtraction();
+    void stopExtraction();
+    bool unpack();
+    bool mountImage( const string & );
+
+private:
+    string url;
+    string filename;
+    string md5;
+    string partName;
+    string stateName;
+    int file;
+    int stateFile;
+    long long total;
+    Part parts[MaxParts];
+    int numParts;
+    long long hashed;
+    Md5 hasher;
+    Sha256 sha;
+    bool failed;
+    string tree;
+    Extractor * extractor;
+    list<Process *> followers;
+    bool drained;
+    long long rate;
+    long long throttleStart;
+    long long throttled;
+    long long hurryChecked;
+    string hurryName;
+    int maxFailures;
+    int retryDelay;
+    boost::mutex lock;
+};
+
+
+#endif
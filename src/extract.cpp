@@ -0,0 +1,735 @@
+// Copyright Arnt Gulbrandsen <arnt@gulbrandsen.priv.no>; BSD-licensed.
+
+#include "extract.h"
+
+#include "hoststatus.h"
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <vector>
+
+#include <boost/thread.hpp>
+#include <boost/bind.hpp>
+
+
+/*! \class Extractor extract.h
+
+    The Extractor class unpacks an artifact into a directory, without
+    running unzip or tar.
+
+    For tar and tar.gz files, and for jar files (which are copied,
+    not unpacked), extraction is streaming: feed() accepts the
+    archive in pieces of any size, so Download can unpack while the
+    rest of the archive still is arriving. Zip files have their
+    directory at the end, so finish() unpacks them once the file is
+    complete, using one thread per core. extract() is a convenience
+    function to unpack a complete file.
+
+    Files and directories are created with their final modes
+    directly, read-only and owned by whoever runs the Extractor,
+    since the result is the shared tree Process::software() points
+    to. There is no chown -R or second walk over the tree. finish()
+    syncs the filesystem once, at the end.
+
+    Entries with absolute names or .. in the name make extraction
+    fail, as do symbolic links that point out of the tree. So do
+    corrupt archives and zip64, in which case the install script
+    does the job instead.
+*/
+
+
+/*! Constructs an Extractor to unpack \a archive into \a directory.
+    The format is guessed from the file name (see guess()). \a
+    directory is created if necessary.
+*/
+
+Extractor::Extractor( const string & archive, const string & directory )
+    : dir( directory ), f( guess( archive ) ),
+      inflating( false ), gzipDone( false ),
+      headerUsed( 0 ), remaining( 0 ), padding( 0 ), out( -1 ),
+      type( 0 ), ended( false ), failed( false )
+{
+    ::memset( &z, 0, sizeof( z ) );
+    if ( f == TarGz ) {
+	inflating = ::inflateInit2( &z, 16 + MAX_WBITS ) == Z_OK;
+	failed = !inflating;
+    } else if ( f == Unknown ) {
+	failed = true;
+    }
+    plainName = archive.substr( archive.rfind( '/' ) + 1 );
+    if ( !failed && !makeDirectory( dir ) )
+	failed = true;
+}
+
+
+/*! Frees zlib's state and closes the file being written, if any. */
+
+Extractor::~Extractor()
+{
+    if ( inflating )
+	::inflateEnd( &z );
+    if ( out >= 0 )
+	::close( out );
+}
+
+
+static bool endsWith( const string & s, const char * suffix )
+{
+    string::size_type l = ::strlen( suffix );
+    return s.size() > l && s.compare( s.size() - l, l, suffix ) == 0;
+}
+
+
+/*! Returns the format of the archive called \a name, judging by its
+    name. Jar files are Plain, since the install script always
+    copied them instead of unpacking them.
+*/
+
+Extractor::Format Extractor::guess( const string & name )
+{
+    if ( endsWith( name, ".tar.gz" ) || endsWith( name, ".tgz" ) )
+	return TarGz;
+    if ( endsWith( name, ".tar" ) )
+	return Tar;
+    if ( endsWith( name, ".zip" ) )
+	return Zip;
+    if ( endsWith( name, ".jar" ) )
+	return Plain;
+    return Unknown;
+}
+
+
+/*! Returns true if feed() does any work for this format, and false
+    if all the work happens in finish().
+*/
+
+bool Extractor::streaming() const
+{
+    return f == Plain || f == Tar || f == TarGz;
+}
+
+
+/*! Processes the next \a n bytes of the archive, at \a data. Returns
+    false if something is wrong, true if all is well so far.
+
+    Does nothing for zip files.
+*/
+
+bool Extractor::feed( const char * data, int n )
+{
+    if ( failed )
+	return false;
+
+    if ( f == Plain ) {
+	if ( out < 0 )
+	    out = ::open( ( dir + "/" + plainName ).c_str(),
+			  O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW, 0444 );
+	while ( out >= 0 && n > 0 ) {
+	    int l = ::write( out, data, n );
+	    if ( l <= 0 )
+		break;
+	    data += l;
+	    n -= l;
+	}
+	failed = out < 0 || n > 0;
+    } else if ( f == Tar ) {
+	return tar( data, n );
+    } else if ( f == TarGz ) {
+	char buffer[65536];
+	z.next_in = (Bytef *)data;
+	z.avail_in = n;
+	while ( !failed ) {
+	    z.next_out = (Bytef *)buffer;
+	    z.avail_out = sizeof( buffer );
+	    int r = ::inflate( &z, Z_NO_FLUSH );
+	    int produced = sizeof( buffer ) - z.avail_out;
+	    if ( produced && !tar( buffer, produced ) )
+		return false;
+	    if ( r == Z_STREAM_END ) {
+		gzipDone = true;
+		if ( !z.avail_in )
+		    return true;
+		// another gzip member follows
+		::inflateReset( &z );
+		gzipDone = false;
+	    } else if ( r == Z_BUF_ERROR ||
+			( r == Z_OK && !z.avail_in && z.avail_out ) ) {
+		return true;
+	    } else if ( r != Z_OK ) {
+		failed = true;
+	    }
+	}
+    }
+    return !failed;
+}
+
+
+/*! Parses the \a n bytes of tar data at \a data. */
+
+bool Extractor::tar( const char * data, int n )
+{
+    while ( n > 0 && !failed && !ended ) {
+	if ( remaining > 0 ) {
+	    int l = n < remaining ? n : remaining;
+	    if ( out >= 0 ) {
+		int done = 0;
+		while ( done < l ) {
+		    int w = ::write( out, data + done, l - done );
+		    if ( w <= 0 ) {
+			failed = true;
+			return false;
+		    }
+		    done += w;
+		}
+	    } else if ( type == 'L' || type == 'x' ) {
+		meta.append( data, l );
+	    }
+	    data += l;
+	    n -= l;
+	    remaining -= l;
+	    if ( remaining )
+		continue;
+	    if ( out >= 0 )
+		::close( out );
+	    out = -1;
+	    if ( type == 'L' ) {
+		longName = meta.c_str();
+	    } else if ( type == 'x' ) {
+		// records look like "27 path=some/long/name\n"
+		string::size_type p = 0;
+		while ( p < meta.size() ) {
+		    int l = ::atoi( meta.c_str() + p );
+		    string::size_type kv = meta.find( ' ', p );
+		    if ( l <= 0 || kv == string::npos || kv >= p + l )
+			break;
+		    string record = meta.substr( kv + 1, p + l - kv - 2 );
+		    if ( record.compare( 0, 5, "path=" ) == 0 )
+			paxPath = record.substr( 5 );
+		    p += l;
+		}
+	    }
+	} else if ( padding > 0 ) {
+	    int l = n < padding ? n : padding;
+	    data += l;
+	    n -= l;
+	    padding -= l;
+	} else {
+	    int l = 512 - headerUsed;
+	    if ( l > n )
+		l = n;
+	    ::memcpy( header + headerUsed, data, l );
+	    headerUsed += l;
+	    data += l;
+	    n -= l;
+	    if ( headerUsed == 512 ) {
+		headerUsed = 0;
+		if ( !entry() )
+		    failed = true;
+	    }
+	}
+    }
+    return !failed;
+}
+
+
+static long long number( const char * p, int n )
+{
+    long long v = 0;
+    if ( (unsigned char)*p & 0x80 ) {
+	// GNU base-256, for files over 8GB
+	v = *p & 0x7f;
+	int i = 1;
+	while ( i < n )
+	    v = ( v << 8 ) | (unsigned char)p[i++];
+	return v;
+    }
+    int i = 0;
+    while ( i < n && ( p[i] == ' ' || p[i] == 0 ) )
+	i++;
+    while ( i < n && p[i] >= '0' && p[i] <= '7' )
+	v = v * 8 + p[i++] - '0';
+    return v;
+}
+
+
+static string field( const char * p, int n )
+{
+    int l = 0;
+    while ( l < n && p[l] )
+	l++;
+    return string( p, l );
+}
+
+
+/*! Acts on the tar header now in the header buffer. Returns false if
+    the archive is corrupt or unsafe.
+*/
+
+bool Extractor::entry()
+{
+    int i = 0;
+    unsigned int sum = 0;
+    bool zero = true;
+    while ( i < 512 ) {
+	if ( header[i] )
+	    zero = false;
+	sum += ( i >= 148 && i < 156 ) ? ' ' : (unsigned char)header[i];
+	i++;
+    }
+    if ( zero ) {
+	ended = true;
+	return true;
+    }
+    if ( sum != number( header + 148, 8 ) )
+	return false;
+
+    long long size = number( header + 124, 12 );
+    int mode = number( header + 100, 8 );
+    type = header[156];
+    remaining = size;
+    padding = ( 512 - size % 512 ) % 512;
+    meta.clear();
+
+    if ( type == 'L' || type == 'x' || type == 'K' || type == 'g' )
+	return true;
+
+    string name;
+    if ( !paxPath.empty() )
+	name = paxPath;
+    else if ( !longName.empty() )
+	name = longName;
+    else if ( !::memcmp( header + 257, "ustar", 5 ) && header[345] )
+	name = field( header + 345, 155 ) + "/" + field( header, 100 );
+    else
+	name = field( header, 100 );
+    paxPath.clear();
+    longName.clear();
+    string link = field( header + 157, 100 );
+
+    if ( !safe( name ) )
+	return false;
+    string path = dir + "/" + name;
+
+    if ( type == '5' )
+	return name.empty() || ( makeParents( name ) && makeDirectory( path ) );
+    if ( name.empty() || !makeParents( name ) )
+	return false;
+
+    if ( type == '2' ) {
+	if ( link.empty() || link[0] == '/' || !safe( link ) )
+	    return false;
+	::unlink( path.c_str() );
+	return ::symlink( link.c_str(), path.c_str() ) == 0;
+    } else if ( type == '1' ) {
+	if ( !safe( link ) )
+	    return false;
+	::unlink( path.c_str() );
+	return ::link( ( dir + "/" + link ).c_str(), path.c_str() ) == 0;
+    } else if ( type == '0' || type == 0 || type == '7' ) {
+	out = ::open( path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW,
+		      ( mode & 0111 ) ? 0555 : 0444 );
+	if ( out < 0 )
+	    return false;
+	if ( !remaining ) {
+	    ::close( out );
+	    out = -1;
+	}
+    }
+    // devices, fifos and so on are skipped.
+    return true;
+}
+
+
+/*! Makes \a name relative and returns true, or returns false if it
+    refers outside the tree.
+*/
+
+bool Extractor::safe( string & name )
+{
+    while ( !name.empty() && ( name[0] == '/' ||
+			       name.compare( 0, 2, "./" ) == 0 ) )
+	name.erase( 0, name[0] == '/' ? 1 : 2 );
+    while ( !name.empty() && name[name.size()-1] == '/' )
+	name.erase( name.size() - 1 );
+    if ( name == "." )
+	name.clear();
+
+    string::size_type p = 0;
+    while ( p <= name.size() ) {
+	string::size_type e = name.find( '/', p );
+	if ( e == string::npos )
+	    e = name.size();
+	if ( name.compare( p, e - p, ".." ) == 0 )
+	    return false;
+	p = e + 1;
+    }
+    return true;
+}
+
+
+/*! Creates the directories leading to \a name (relative to the
+    extraction directory).
+*/
+
+bool Extractor::makeParents( const string & name )
+{
+    string::size_type p = name.find( '/' );
+    while ( p != string::npos ) {
+	if ( !makeDirectory( dir + "/" + name.substr( 0, p ) ) )
+	    return false;
+	p = name.find( '/', p + 1 );
+    }
+    return true;
+}
+
+
+/*! Creates the directory \a path, unless it exists already, and
+    remembers it so finish() can make it read-only.
+*/
+
+bool Extractor::makeDirectory( const string & path )
+{
+    if ( dirs.find( path ) != dirs.end() )
+	return true;
+    struct stat st;
+    if ( ::mkdir( path.c_str(), 0755 ) < 0 &&
+	 ( errno != EEXIST || ::lstat( path.c_str(), &st ) < 0 ||
+	   !S_ISDIR( st.st_mode ) ) )
+	return false;
+    dirs.insert( path );
+    return true;
+}
+
+
+/*! Completes the extraction. \a file is the complete archive, which
+    is used only for zip files. Returns true if the archive was
+    complete and correct, and the tree is in place and synced to disk.
+*/
+
+bool Extractor::finish( const string & file )
+{
+    if ( f == Zip && !failed )
+	failed = !extractZip( file );
+    else if ( f == Plain && out < 0 && !failed )
+	feed( "", 0 );
+    else if ( remaining || padding || headerUsed ||
+	      ( f == TarGz && !gzipDone ) )
+	failed = true;
+
+    if ( out >= 0 )
+	::close( out );
+    out = -1;
+    if ( failed )
+	return false;
+
+    set<string>::reverse_iterator i( dirs.rbegin() );
+    while ( i != dirs.rend() ) {
+	::chmod( i->c_str(), 0555 );
+	++i;
+    }
+
+    int fd = ::open( dir.c_str(), O_RDONLY | O_DIRECTORY );
+    if ( fd >= 0 ) {
+	::syncfs( fd );
+	::close( fd );
+    }
+    return true;
+}
+
+
+/*! Unpacks the complete archive \a file. Returns true if all went
+    well.
+*/
+
+bool Extractor::extract( const string & file )
+{
+    if ( streaming() ) {
+	int fd = ::open( file.c_str(), O_RDONLY );
+	if ( fd < 0 )
+	    return false;
+	vector<char> buffer( 65536 );
+	int n;
+	while ( ( n = ::read( fd, &buffer[0], buffer.size() ) ) > 0 &&
+		feed( &buffer[0], n ) )
+	    ;
+	::close( fd );
+	if ( n < 0 )
+	    return false;
+    }
+    return finish( file );
+}
+
+
+struct ZipEntry {
+    ZipEntry()
+	: offset( 0 ), csize( 0 ), usize( 0 ), method( 0 ), crc( 0 ),
+	  mode( 0644 ), directory( false ), link( false ) {}
+    string name;
+    long long offset;
+    long long csize;
+    long long usize;
+    int method;
+    unsigned long crc;
+    int mode;
+    bool directory;
+    bool link;
+};
+
+
+static unsigned int u16( const char * p )
+{
+    return (unsigned char)p[0] | ( (unsigned char)p[1] << 8 );
+}
+
+
+static unsigned int u32( const char * p )
+{
+    return u16( p ) | ( u16( p + 2 ) << 16 );
+}
+
+
+/*! Unpacks \a e from the zip file \a fd, writing to \a out if that's
+    a file descriptor and appending to \a data otherwise. Returns
+    true if the entry was intact.
+*/
+
+static bool unzip( int fd, const ZipEntry & e, int out, string & data )
+{
+    char h[30];
+    if ( ::pread( fd, h, 30, e.offset ) != 30 || u32( h ) != 0x04034b50 )
+	return false;
+    long long pos = e.offset + 30 + u16( h + 26 ) + u16( h + 28 );
+
+    z_stream s;
+    ::memset( &s, 0, sizeof( s ) );
+    if ( e.method == 8 && ::inflateInit2( &s, -MAX_WBITS ) != Z_OK )
+	return false;
+    else if ( e.method != 0 && e.method != 8 )
+	return false;
+
+    vector<char> in( 65536 );
+    vector<char> decoded( 65536 );
+    unsigned long crc = ::crc32( 0, 0, 0 );
+    long long left = e.csize;
+    long long produced = 0;
+    bool ok = true;
+    bool done = false;
+    while ( ok && !done ) {
+	int n = left < (long long)in.size() ? left : in.size();
+	if ( n > 0 && ::pread( fd, &in[0], n, pos ) != n ) {
+	    ok = false;
+	    break;
+	}
+	pos += n;
+	left -= n;
+
+	const char * result = &in[0];
+	int l = n;
+	int r = Z_OK;
+	if ( e.method == 8 ) {
+	    s.next_in = (Bytef *)&in[0];
+	    s.avail_in = n;
+	}
+	do {
+	    if ( e.method == 8 ) {
+		s.next_out = (Bytef *)&decoded[0];
+		s.avail_out = decoded.size();
+		r = ::inflate( &s, Z_NO_FLUSH );
+		if ( r != Z_OK && r != Z_STREAM_END &&
+		     ( r != Z_BUF_ERROR || !left ) ) {
+		    ok = false;
+		    break;
+		}
+		result = &decoded[0];
+		l = decoded.size() - s.avail_out;
+	    }
+	    crc = ::crc32( crc, (const Bytef *)result, l );
+	    produced += l;
+	    if ( out >= 0 ) {
+		int w = 0;
+		while ( ok && w < l ) {
+		    int x = ::write( out, result + w, l - w );
+		    if ( x <= 0 )
+			ok = false;
+		    else
+			w += x;
+		}
+	    } else {
+		data.append( result, l );
+	    }
+	} while ( ok && e.method == 8 && r == Z_OK && !s.avail_out );
+
+	if ( e.method == 8 ? r == Z_STREAM_END : !left )
+	    done = true;
+	else if ( !left && e.method == 8 && r != Z_OK )
+	    ok = false;
+    }
+    if ( e.method == 8 )
+	::inflateEnd( &s );
+    return ok && crc == e.crc && produced == e.usize;
+}
+
+
+/*! Unpacks every \a n'th entry in \a entries from the zip file \a
+    file into \a dir, starting with entry \a t. Sets \a failed if
+    anything goes wrong.
+*/
+
+static void unzipSome( const string & file, const string & dir,
+		       const vector<ZipEntry> * entries, int t, int n,
+		       bool * failed )
+{
+    int fd = ::open( file.c_str(), O_RDONLY );
+    if ( fd < 0 ) {
+	*failed = true;
+	return;
+    }
+    string unused;
+    unsigned int i = t;
+    while ( i < entries->size() && !*failed ) {
+	const ZipEntry & e = (*entries)[i];
+	i += n;
+	if ( e.directory || e.link )
+	    continue;
+	int out = ::open( ( dir + "/" + e.name ).c_str(),
+			  O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW,
+			  ( e.mode & 0111 ) ? 0555 : 0444 );
+	if ( out < 0 || !unzip( fd, e, out, unused ) )
+	    *failed = true;
+	if ( out >= 0 )
+	    ::close( out );
+    }
+    ::close( fd );
+}
+
+
+/*! Unpacks the zip file \a file, using one thread per core. Returns
+    true if all went well.
+*/
+
+bool Extractor::extractZip( const string & file )
+{
+    int fd = ::open( file.c_str(), O_RDONLY );
+    if ( fd < 0 )
+	return false;
+    struct stat st;
+    if ( ::fstat( fd, &st ) < 0 || st.st_size < 22 ) {
+	::close( fd );
+	return false;
+    }
+
+    // find the end of central directory record
+    long long tail = st.st_size < 65536 + 22 ? st.st_size : 65536 + 22;
+    vector<char> buffer( tail );
+    if ( ::pread( fd, &buffer[0], tail, st.st_size - tail ) != tail ) {
+	::close( fd );
+	return false;
+    }
+    long long p = tail - 22;
+    while ( p >= 0 && u32( &buffer[p] ) != 0x06054b50 )
+	p--;
+    if ( p < 0 || u32( &buffer[p+16] ) == 0xffffffff ) {
+	// not a zip file, or zip64
+	::close( fd );
+	return false;
+    }
+    unsigned int count = u16( &buffer[p+10] );
+    long long cdSize = u32( &buffer[p+12] );
+    long long cdOffset = u32( &buffer[p+16] );
+
+    vector<char> cd( cdSize + 1 );
+    if ( cdOffset + cdSize > st.st_size ||
+	 ::pread( fd, &cd[0], cdSize, cdOffset ) != cdSize ) {
+	::close( fd );
+	return false;
+    }
+    string symlinkData;
+    vector<ZipEntry> entries;
+    p = 0;
+    while ( entries.size() < count && p + 46 <= cdSize ) {
+	const char * c = &cd[p];
+	if ( u32( c ) != 0x02014b50 )
+	    break;
+	ZipEntry e;
+	e.method = u16( c + 10 );
+	e.crc = u32( c + 16 );
+	e.csize = u32( c + 20 );
+	e.usize = u32( c + 24 );
+	unsigned int nl = u16( c + 28 );
+	e.offset = u32( c + 42 );
+	if ( p + 46 + nl > cdSize )
+	    break;
+	e.name = string( c + 46, nl );
+	e.directory = !e.name.empty() && e.name[e.name.size()-1] == '/';
+	if ( ( u16( c + 4 ) >> 8 ) == 3 ) {
+	    // made on unix, so the external attributes hold the mode
+	    int mode = u32( c + 38 ) >> 16;
+	    e.mode = mode & 0777;
+	    e.link = S_ISLNK( mode );
+	    e.directory = e.directory || S_ISDIR( mode );
+	}
+	if ( !safe( e.name ) ) {
+	    ::close( fd );
+	    return false;
+	}
+	entries.push_back( e );
+	p += 46 + nl + u16( c + 30 ) + u16( c + 32 );
+    }
+    if ( entries.size() != count ) {
+	::close( fd );
+	return false;
+    }
+
+    // the directories first, so the threads needn't create any
+    vector<ZipEntry>::iterator e( entries.begin() );
+    while ( e != entries.end() ) {
+	if ( !makeParents( e->name ) ||
+	     ( e->directory && !e->name.empty() &&
+	       !makeDirectory( dir + "/" + e->name ) ) ) {
+	    ::close( fd );
+	    return false;
+	}
+	++e;
+    }
+
+    int threads = HostStatus::cores( "/proc/cpuinfo" );
+    if ( threads > 8 )
+	threads = 8;
+    if ( threads > (int)entries.size() )
+	threads = entries.size();
+    if ( threads < 1 )
+	threads = 1;
+    bool broken = false;
+    boost::thread_group workers;
+    int t = 0;
+    while ( t < threads ) {
+	workers.create_thread( boost::bind( unzipSome, file, dir, &entries,
+					    t, threads, &broken ) );
+	t++;
+    }
+    workers.join_all();
+
+    // symbolic links last, so none of them can redirect a file
+    e = entries.begin();
+    while ( e != entries.end() && !broken ) {
+	if ( e->link ) {
+	    string target;
+	    if ( !unzip( fd, *e, -1, target ) || target.empty() ||
+		 target[0] == '/' || !safe( target ) )
+		broken = true;
+	    else if ( ::symlink( target.c_str(),
+				 ( dir + "/" + e->name ).c_str() ) < 0 )
+		broken = true;
+	}
+	++e;
+    }
+
+    ::close( fd );
+    return !broken;
+}
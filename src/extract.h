@@ -0,0 +1,62 @@
+// Copyright Arnt Gulbrandsen <arnt@gulbrandsen.priv.no>; BSD-licensed.
+
+#ifndef EXTRACT_H
+#define EXTRACT_H
+
+#include <set>
+#include <string>
+
+#include <zlib.h>
+
+using namespace std;
+
+
+class Extractor
+{
+public:
+    enum Format { Unknown, Plain, Tar, TarGz, Zip };
+
+    Extractor( const string &, const string & );
+    ~Extractor();
+
+    Format format() const { return f; }
+    bool streaming() const;
+
+    bool feed( const char *, int );
+    bool finish( const string & );
+
+    bool extract( const string & );
+
+    static Format guess( const string & );
+
+private:
+    bool tar( const char *, int );
+    bool entry();
+    bool extractZip( const string & );
+    bool makeParents( const string & );
+    bool makeDirectory( const string & );
+    static bool safe( string & );
+
+private:
+    string dir;
+    string plainName;
+    Format f;
+    z_stream z;
+    bool inflating;
+    bool gzipDone;
+    char header[512];
+    int headerUsed;
+    long long remaining;
+    long long padding;
+    int out;
+    char type;
+    string meta;
+    string longName;
+    string paxPath;
+    bool ended;
+    bool failed;
+    set<string> dirs;
+};
+
+
+#endif
@@ -2,14 +2,16 @@
 
 #include "hoststatus.h"
 
+#include "json.h"
+#include "cbor.h"
+
 #include <unistd.h>
 
-#include <boost/property_tree/json_parser.hpp>
-#include <boost/property_tree/ptree.hpp>
+#include <fstream>
+
 #include <boost/lexical_cast.hpp>
 #include <boost/tokenizer.hpp>
 
-using boost::property_tree::ptree;
 using namespace std;
 
 
@@ -28,31 +30,44 @@ using namespace std;
 
 HostStatus::HostStatus()
 {
-    ostringstream os;
-
-    ptree pt;
-
     char tmp[1025];
     tmp[1024] = 0;
     ::gethostname( tmp, 1024 );
+    host = tmp;
 
-    int total, available;
     readProcMeminfo( "/proc/meminfo", total, available );
-    int uptime = readProcUptime( "/proc/uptime" );
+    uptime = readProcUptime( "/proc/uptime" );
+    cpus = cores( "/proc/cpuinfo" );
+}
 
-    // do I really want that prefix? no? not sure.
-    string prefix = string("hosts.") + tmp;
-    if ( total )
-	pt.put( prefix + ".totalmemory", total );
-    if ( available )
-	pt.put( prefix + ".available", available );
-    if ( uptime )
-	pt.put( prefix + ".uptime", uptime );
-    pt.put( prefix + ".cores", cores( "/proc/cpuinfo" ) );
 
-    write_json( os, pt );
+/*! Writes the status using \a w. */
 
-    j = os.str();
+void HostStatus::write( Writer & w ) const
+{
+    w.startObject();
+    // do I really want that level? no? not sure.
+    w.member( "hosts" );
+    w.startObject();
+    w.member( host );
+    w.startObject();
+    if ( total ) {
+	w.member( "totalmemory" );
+	w.number( total );
+    }
+    if ( available ) {
+	w.member( "available" );
+	w.number( available );
+    }
+    if ( uptime ) {
+	w.member( "uptime" );
+	w.number( uptime );
+    }
+    w.member( "cores" );
+    w.number( cpus );
+    w.endObject();
+    w.endObject();
+    w.endObject();
 }
 
 
@@ -60,7 +75,21 @@ HostStatus::HostStatus()
 
 HostStatus::operator string() const
 {
-    return j;
+    string r;
+    JsonWriter w( r );
+    write( w );
+    return r;
+}
+
+
+/*! Returns the status in CBOR format. */
+
+string HostStatus::cbor() const
+{
+    string r;
+    CborWriter w( r );
+    write( w );
+    return r;
 }
 
 
@@ -11,6 +11,9 @@ class HostStatus
 public:
     HostStatus();
     operator std::string() const;
+    std::string cbor() const;
+
+    void write( class Writer & ) const;
 
     static int cores( const char * );
 
@@ -19,7 +22,11 @@ public:
     static void readProcMeminfo( const char *, int &, int & );
 
 private:
-    std::string j;
+    std::string host;
+    int total;
+    int available;
+    int uptime;
+    int cpus;
 };
 
 #endif
@@ -3,6 +3,7 @@
 #include "httplistener.h"
 
 #include "httpserver.h"
+#include "probes.h"
 
 #include <boost/thread.hpp>
 
@@ -98,8 +99,10 @@ void HttpListener::start()
 {
     while( f >= 0 ) {
 	int i = ::accept( f, 0, 0 );
-	if ( i >= 0 )
+	if ( i >= 0 ) {
+	    NODEE_PROBE1( accept, i );
 	    boost::thread( HttpServer( i, init ) );
+	}
 	else if ( errno != EAGAIN )
 	    f = -1;
     }
@@ -7,12 +7,23 @@
 #include "service.h"
 #include "artifact.h"
 #include "process.h"
-
+#include "metrics.h"
+#include "prefetch.h"
+#include "json.h"
+#include "cbor.h"
+#include "log.h"
+#include "recorder.h"
+#include "servicelog.h"
+#include "probes.h"
+
+#include <poll.h>
 #include <stdio.h>
+#include <stdlib.h>
 
 #include <algorithm>
 
 #include <boost/lexical_cast.hpp>
+#include <boost/scoped_ptr.hpp>
 
 
 /*! \class HttpServer httpserver.h
@@ -35,8 +46,8 @@
   do-it-all function (operator()() is a wrapper for start()),
   readRequest(), parseRequest(), readBody() and respond() contain the
   bulk of the code and are separated out for proper testing, and the
-  four accessors operation(), path(), body() and and contentLength()
-  exist for testing.
+  accessors operation(), path(), body(), contentLength() and
+  wantsCbor() exist for testing.
 */
 
 
@@ -44,7 +55,8 @@
 */
 
 HttpServer::HttpServer( int fd, Init & i )
-    : init( i ), o( Invalid ), cl( 0 ), f ( fd )
+    : init( i ), o( Invalid ), cl( 0 ), f ( fd ), cbor( false ),
+      status( 0 ), sent( 0 )
 {
     // nothing needed (yet?)
 }
@@ -52,6 +64,9 @@ HttpServer::HttpServer( int fd, Init & i )
 
 /*! Parses input, acts on it. Returns only in case of error.
 
+    Each request fires the request__start and request__end probes,
+    so a tracer can time it.
+
     This function is not testable.
 */
 
@@ -66,7 +81,9 @@ void HttpServer::start()
 	    if ( f < 0 )
 		return;
 
+	    NODEE_PROBE2( request__start, o, p.c_str() );
 	    respond();
+	    NODEE_PROBE2( request__end, status, sent );
 	}
     } catch (...) {
 	close();
@@ -138,14 +155,18 @@ string HttpServer::readRequest()
     mostly it doesn't. The client can tell us what Content-Type it
     wants for the report about its RESTfulness, but we're don't
     atually care what it says, so we don't even parse its sayings. As
-    I write these words, the only header field we really parse is
-    Content-Length, which is necessary for POST.
+    I write these words, the header fields we really parse are
+    Content-Length, which is necessary for POST, and Accept, which
+    chooses between JSON and CBOR.
 */
 
 void HttpServer::parseRequest( string h )
 {
     o = Invalid;
     cl = 0;
+    cbor = false;
+    status = 0;
+    sent = 0;
     p.erase();
     b.erase();
 
@@ -169,13 +190,51 @@ void HttpServer::parseRequest( string h )
 
     p = h.substr( s, n-s );
 
+    // the header fields we look at are entirely case-insensitive, so
+    // we can smash case and ignore non-ascii.
+    std::transform( h.begin(), h.end(), h.begin(), ::tolower );
+
+    // we answer in CBOR if the client prefers that to JSON. a
+    // wildcard matches both, and then JSON wins.
+    size_t pos = h.find( "\naccept:" );
+    if ( pos != string::npos ) {
+	size_t end = h.find( '\n', pos + 8 );
+	string accept = h.substr( pos + 8, end - pos - 8 );
+	double json = 0;
+	double binary = 0;
+	size_t t = 0;
+	while ( t < accept.size() ) {
+	    size_t next = accept.find( ',', t );
+	    if ( next == string::npos )
+		next = accept.size();
+	    string type = accept.substr( t, next - t );
+	    double q = 1;
+	    size_t semicolon = type.find( ';' );
+	    if ( semicolon != string::npos ) {
+		size_t qp = type.find( "q=", semicolon );
+		if ( qp != string::npos )
+		    q = ::strtod( type.c_str() + qp + 2, 0 );
+		type.erase( semicolon );
+	    }
+	    type.erase( 0, type.find_first_not_of( " \t" ) );
+	    type.erase( type.find_last_not_of( " \t\r" ) + 1 );
+	    if ( type == "application/json" )
+		json = q;
+	    else if ( type == "application/cbor" )
+		binary = q;
+	    else if ( ( type == "*/*" || type == "application/*" ) &&
+		      json == 0 && q > json )
+		json = q;
+	    t = next + 1;
+	}
+	cbor = binary > 0 && binary > json;
+    }
+
     if ( o != Post )
 	return;
 
-    // we need content-length. it's entirely case-insensitive, so we
-    // can smash case and ignore non-ascii.
-    std::transform( h.begin(), h.end(), h.begin(), ::tolower );
-    size_t pos = h.find( "\ncontent-length:" );
+    // we need content-length.
+    pos = h.find( "\ncontent-length:" );
     if ( pos == string::npos )
 	return;
     n = pos + 16;
@@ -241,9 +300,11 @@ void HttpServer::respond()
 	    send( httpResponse( 400, "text/plain", e ) );
 	} else {
 	    Process::launch( s, init );
-	    send( httpResponse( 200, "application/json",
-				"Will launch, or try to",
-				s.json() ) );
+	    string r;
+	    boost::scoped_ptr<Writer> w( writer( r ) );
+	    s.write( *w );
+	    send( httpResponse( 200, dataType(),
+				"Will launch, or try to", r ) );
 	}
 	return;
     }
@@ -256,9 +317,11 @@ void HttpServer::respond()
 	}
 	if ( s ) {
 	    s->stop();
-	    send( httpResponse( 200, "application/json",
-				"Will stop, or try to",
-				s->spec().json() ) );
+	    string r;
+	    boost::scoped_ptr<Writer> w( writer( r ) );
+	    s->spec().write( *w );
+	    send( httpResponse( 200, dataType(),
+				"Will stop, or try to", r ) );
 	} else {
 	    send( httpResponse( 400, "text/plain",
 				"No such service" ) );
@@ -266,24 +329,43 @@ void HttpServer::respond()
 	return;
     }
 
-    if ( o == Post && p.substr( 18 ) == "/artifact/install/" ) {
-	ServerSpec s = ServerSpec::parseJson( b, init );
-	if ( !s.valid() ) {
-	    send( httpResponse( 400, "text/plain",
-				"Parse error for the JSON body" ) );
+    if ( o == Post && p == "/artifact/install" ) {
+	if ( Prefetch::add( b, init ) ) {
+	    string r;
+	    boost::scoped_ptr<Writer> w( writer( r ) );
+	    Prefetch::list( *w );
+	    send( httpResponse( 200, dataType(),
+				"Will prefetch, or try to", r ) );
 	} else {
-	    Process::launch( s, init );
-	    send( httpResponse( 200, "text/plain",
-				"Will launch, or try to" ) );
+	    send( httpResponse( 400, "text/plain",
+				"No valid artifact specification" ) );
 	}
 	return;
     }
 
     if ( o == Post && p.substr( 0, 20 ) == "/artifact/uninstall/" ) {
-	string artifact = p.substr( 21 );
-	// ARNT
-	send( httpResponse( 200, "text/plain",
-			    "Will uninstall, or try to" ) );
+	string artifact = p.substr( 20 );
+	if ( artifact.empty() || artifact[0] == '.' ||
+	     artifact.find( '/' ) != string::npos )
+	    send( httpResponse( 400, "text/plain",
+				"Bad artifact name" ) );
+	else if ( Artifact::remove( Artifact::directory() + "/" + artifact,
+				    init.artifactFiles() ) )
+	    send( httpResponse( 200, "text/plain",
+				"Uninstalled" ) );
+	else
+	    send( httpResponse( 400, "text/plain",
+				"No such artifact, or it is in use" ) );
+	return;
+    }
+
+    if ( o == Post && p.substr( 0, 17 ) == "/nodee/log-level/" ) {
+	if ( Log::setLevel( p.substr( 17 ) ) )
+	    send( httpResponse( 200, "text/plain",
+				"Log level changed" ) );
+	else
+	    send( httpResponse( 400, "text/plain",
+				"No such log level" ) );
 	return;
     }
 
@@ -295,20 +377,60 @@ void HttpServer::respond()
 
     // it's Get
 
-    if ( p == "/service/list" )
-	send( httpResponse( 200, "application/json",
-			    "Service list follows",
-			    Service::list( init ) ) );
+    if ( p == "/service/list" ) {
+	string r;
+	boost::scoped_ptr<Writer> w( writer( r ) );
+	Service::list( init, *w );
+	send( httpResponse( 200, dataType(),
+			    "Service list follows", r ) );
+    }
 
-    if ( p == "/artifact/list" )
-	send( httpResponse( 200, "application/json",
-			    "Artifact list follows",
-			    Artifact::list() ) );
+    if ( p.substr( 0, 9 ) == "/service/" ) {
+	string rest = p.substr( 9 );
+	bool follow = false;
+	size_t q = rest.find( '?' );
+	if ( q != string::npos ) {
+	    follow = rest.substr( q + 1, 6 ) == "follow";
+	    rest.erase( q );
+	}
+	if ( rest.size() > 4 && rest.substr( rest.size() - 4 ) == "/log" ) {
+	    try {
+		sendLog( boost::lexical_cast<int>(
+			     rest.substr( 0, rest.size() - 4 ) ), follow );
+		return;
+	    } catch ( boost::bad_lexical_cast ) {
+	    }
+	}
+    }
+
+    if ( p == "/artifact/list" ) {
+	string r;
+	boost::scoped_ptr<Writer> w( writer( r ) );
+	Artifact::list( *w );
+	send( httpResponse( 200, dataType(),
+			    "Artifact list follows", r ) );
+    }
+
+    if ( p == "/artifact/queue" ) {
+	string r;
+	boost::scoped_ptr<Writer> w( writer( r ) );
+	Prefetch::list( *w );
+	send( httpResponse( 200, dataType(),
+			    "Prefetch queue follows", r ) );
+    }
+
+    if ( p == "/nodee/status" ) {
+	string r;
+	boost::scoped_ptr<Writer> w( writer( r ) );
+	HostStatus().write( *w );
+	send( httpResponse( 200, dataType(),
+			    "Let me tell you how I feel", r ) );
+    }
 
-    if ( p == "/nodee/status" )
-	send( httpResponse( 200, "application/json",
-			    "Let me tell you how I feel",
-			    HostStatus() ) );
+    if ( p == "/metrics" )
+	send( httpResponse( 200, "text/plain",
+			    "Counting is fun",
+			    Metrics::text() ) );
 
     if ( p == "/" )
 	send( httpResponse( 200, "text/html",
@@ -361,13 +483,21 @@ void HttpServer::close()
 
     This function does most of what send() ought to do, but this is
     easily testable and the same logic in send() would not be.
+
+    The response is noted in the flight recorder.
 */
 
 string HttpServer::httpResponse( int numeric, const string & contentType,
 				 const string & textual,
 				 const string & body )
 {
-    string r = "HTTP/1.0 ";
+    Recorder::record( Recorder::Responded, 0, 0,
+		      o, numeric, body.size() );
+    status = numeric;
+
+    string r;
+    r.reserve( 128 + textual.size() + body.size() );
+    r = "HTTP/1.0 ";
     // we blithely assume that 100<=numeric<=999
     r += boost::lexical_cast<string>( numeric );
     r += " ";
@@ -390,22 +520,97 @@ string HttpServer::httpResponse( int numeric, const string & contentType,
 }
 
 
+/*! Returns a new Writer that appends to \a output, in the format
+    the client asked for. The caller must delete it.
+*/
+
+Writer * HttpServer::writer( string & output ) const
+{
+    if ( cbor )
+	return new CborWriter( output );
+    return new JsonWriter( output );
+}
+
+
+/*! Returns the Content-Type matching writer(). */
+
+string HttpServer::dataType() const
+{
+    if ( cbor )
+	return "application/cbor";
+    return "application/json";
+}
+
+
 /*! Sends \a response. This function is untested, borderline
     untestable, which is why it's simple.
 */
 
-void HttpServer::send( string response )
+void HttpServer::send( const string & response )
+{
+    stream( response );
+    close();
+}
+
+
+/*! Writes \a data to the client without closing the connection.
+    Returns true if successful, and closes the connection and returns
+    false if not.
+*/
+
+bool HttpServer::stream( const string & data )
 {
     int o = 0;
-    int l = response.length();
+    int l = data.length();
     while ( o < l ) {
-	int r = ::write( f, o + response.data(), l - o );
+	int r = ::write( f, o + data.data(), l - o );
 	if ( r <= 0 ) {
 	    close();
-	    return;
+	    return false;
 	}
 	o += r;
+	sent += r;
+    }
+    return true;
+}
+
+
+/*! Sends the end of the console log of the service whose pid is \a
+    pid. If \a follow is true, the connection stays open and
+    receives what the service writes until it exits, or until the
+    client closes the connection or sends anything.
+*/
+
+void HttpServer::sendLog( int pid, bool follow )
+{
+    Process * s = init.find( pid );
+    if ( !s ) {
+	send( httpResponse( 404, "text/plain", "No such service" ) );
+	return;
+    }
+
+    ServiceLog log( s->consoleLog() );
+    if ( !follow ) {
+	send( httpResponse( 200, "text/plain", "Log follows",
+			    log.tail( 65536 ) ) );
+	return;
+    }
+
+    string r = httpResponse( 200, "text/plain", "Log follows" ) +
+	       log.tail( 65536 );
+    bool running = true;
+    while ( running && stream( r ) ) {
+	struct pollfd client;
+	client.fd = f;
+	client.events = POLLIN;
+	client.revents = 0;
+	if ( ::poll( &client, 1, 250 ) != 0 )
+	    break;
+	running = init.find( pid ) != 0;
+	r = log.more();
     }
+    if ( !running )
+	stream( r );
     close();
 }
 
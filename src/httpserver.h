@@ -29,15 +29,22 @@ public:
     int contentLength() const { return cl; }
     Operation operation() const { return o; }
     string path() const { return p; }
+    bool wantsCbor() const { return cbor; }
 
     void respond();
-    void send( string );
+    void send( const string & );
+    bool stream( const string & );
 
     string httpResponse( int, const string &, const string &,
 			 const string & = "" );
 
     void close();
 
+private:
+    class Writer * writer( string & ) const;
+    string dataType() const;
+    void sendLog( int, bool );
+
 private:
     Init & init;
     string p;
@@ -45,6 +52,9 @@ private:
     Operation o;
     int cl;
     int f;
+    bool cbor;
+    int status;
+    long long sent;
 };
 
 
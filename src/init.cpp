@@ -2,11 +2,16 @@
 
 #include "init.h"
 #include "log.h"
+#include "recorder.h"
+#include "probes.h"
+#include "artifact.h"
 
 #include <boost/thread.hpp>
 
 #include <sys/types.h>
 #include <sys/wait.h>
+#include <errno.h>
+#include <unistd.h>
 
 
 static std::list<Process *> l;
@@ -57,19 +62,32 @@ void Init::start()
 }
 
 
-/*! Waits for and processes a single child event. */
+/*! Waits for and processes a single child event.
+
+    The lock is held only while looking up and removing the Process,
+    not while waiting or while the Process handles the event, so
+    other threads (and the Process itself) can call manage()
+    meanwhile.
+*/
 
 void Init::check()
 {
-    boost::unique_lock<boost::mutex> lock( mutex );
-    while ( l.empty() )
-	managing.wait( lock );
+    {
+	boost::unique_lock<boost::mutex> lock( mutex );
+	while ( l.empty() )
+	    managing.wait( lock );
+    }
 
     int status;
     int pid = ::wait( &status );
 
-    if ( pid <= 0 )
+    if ( pid <= 0 ) {
+	// nothing has been forked yet, perhaps because everything
+	// waits for a download that's being fetched elsewhere
+	if ( errno == ECHILD )
+	    ::usleep( 100000 );
 	return;
+    }
 
     // we now have a pid. find out what happened to it.
     int exitStatus = -1;
@@ -79,18 +97,19 @@ void Init::check()
     int signal = 0;
     if ( signalled )
 	signal = WTERMSIG( status );
+    NODEE_PROBE3( reap, pid, exitStatus, signal );
 
     // find the relevant Process object, ping it and forget about it.
-    std::list<Process *>::iterator i = l.begin();
-    while ( i != l.end() && (*i)->pid() != pid )
-	++i;
-    if ( i != l.end() && (*i)->pid() == pid ) {
-	(*i)->handleExit( exitStatus, signal );
-	if ( !(*i)->pid() ) {
-	    Process * tbd = *i;
-	    l.remove( *i );
-	    delete tbd;
-	}
+    Process * p = find( pid );
+    if ( !p )
+	return;
+    Recorder::record( Recorder::Exited, pid, p->spec().coordinateId(),
+		      exitStatus, signal );
+    p->handleExit( exitStatus, signal );
+    if ( !p->pid() ) {
+	boost::lock_guard<boost::mutex> lock( mutex );
+	l.remove( p );
+	delete p;
     }
 }
 
@@ -105,6 +124,19 @@ std::list<Process *> & Init::processes()
 }
 
 
+/*! Returns the mutex that guards the list of managed processes. Init
+    holds it while adding and removing Processes, so other threads
+    that look at processes() and use what they find should hold it
+    too. manage(), find() and artifactFiles() take it themselves, so
+    don't call those meanwhile.
+*/
+
+boost::mutex & Init::lock()
+{
+    return mutex;
+}
+
+
 /*! Starts managing \a p. This is a copy operation; the managed object
     is not yours.
 
@@ -125,10 +157,14 @@ void Init::manage( Process * p )
 
 /*! Returns a pointer to the Process object for \a pid, or an null
     pointer if \a pid is not the pid of a managed service.
+
+    Holds the lock while looking, since manage() may be adding to the
+    list in another thread.
 */
 
 Process * Init::find( int pid ) const
 {
+    boost::lock_guard<boost::mutex> lock( mutex );
     std::list<Process *>::const_iterator i = l.begin();
     while ( i != l.end() && (*i)->pid() != pid )
 	++i;
@@ -146,3 +182,26 @@ void Init::operator()()
 {
     start();
 }
+
+
+/*! Returns the full names of the artifact files that the managed
+    Processes use, including those that are still being downloaded
+    or installed, for Artifact::evict() and Artifact::remove().
+*/
+
+std::set<std::string> Init::artifactFiles() const
+{
+    std::string dir = Artifact::directory();
+    std::set<std::string> files;
+    boost::lock_guard<boost::mutex> lock( mutex );
+    std::list<Process *>::const_iterator i = l.begin();
+    while ( i != l.end() ) {
+	try {
+	    files.insert( dir + "/" + (*i)->spec().artifactFilename() );
+	} catch ( ... ) {
+	    // a Process without a complete ServerSpec uses nothing
+	}
+	++i;
+    }
+    return files;
+}
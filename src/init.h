@@ -4,7 +4,10 @@
 #define INIT_H
 
 #include "process.h"
+#include <boost/thread/mutex.hpp>
 #include <list>
+#include <set>
+#include <string>
 
 
 class Init
@@ -19,10 +22,13 @@ public:
     void check();
 
     std::list<Process *>& processes();
+    static boost::mutex & lock();
 
     void manage( Process * p );
 
     Process * find( int ) const;
+
+    std::set<std::string> artifactFiles() const;
 };
 
 #endif
@@ -0,0 +1,664 @@
+// Copyright Arnt Gulbrandsen <arnt@gulbrandsen.priv.no>; BSD-licensed.
+
+#include "json.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <boost/lexical_cast.hpp>
+
+
+/*! \class JsonParser json.h
+
+    The JsonParser class reads JSON in one pass, without building a
+    tree. The caller drives it, asking for what it expects next, so
+    the values go straight into typed variables. ServerSpec uses it.
+
+    startObject() and member() step through an object, startArray()
+    and element() through an array:
+
+    \code
+    if ( j.startObject() ) {
+	string name;
+	while ( j.member( name ) ) {
+	    if ( name == "port" )
+		j.number( port );
+	    else
+		j.skip();
+	}
+    }
+    \endcode
+
+    text(), number() and boolean() read a value of the right type,
+    and return false without reading anything if the next value has
+    another type, so the caller can report that and skip() or raw()
+    it. raw() returns the JSON source of a value, so unknown values
+    can be passed on unchanged.
+
+    Syntax errors are sticky: After the first, every function
+    returns false or Invalid, ok() returns false and error() says
+    what was wrong and where.
+*/
+
+
+/*! Constructs a JsonParser for \a json, which must remain valid as
+    long as the parser is used.
+*/
+
+JsonParser::JsonParser( const string & json )
+    : s( json ), i( 0 )
+{
+}
+
+
+/*! Returns the type of the next value, without reading it. Returns
+    Invalid if there is no value or an error has occured.
+*/
+
+JsonParser::Type JsonParser::next()
+{
+    space();
+    if ( !e.empty() || i >= s.size() )
+	return Invalid;
+    char c = s[i];
+    if ( c == '{' )
+	return Object;
+    if ( c == '[' )
+	return Array;
+    if ( c == '"' )
+	return String;
+    if ( c == '-' || ( c >= '0' && c <= '9' ) )
+	return Number;
+    if ( c == 't' || c == 'f' )
+	return Boolean;
+    if ( c == 'n' )
+	return Null;
+    return Invalid;
+}
+
+
+/*! Reads the start of an object. Returns true if the next value is
+    an object, and false (without reading anything) if not.
+*/
+
+bool JsonParser::startObject()
+{
+    if ( next() != Object )
+	return false;
+    if ( later.size() >= 64 ) {
+	fail( "Too deeply nested" );
+	return false;
+    }
+    i++;
+    later.push_back( false );
+    return true;
+}
+
+
+/*! Reads the name of the next member of the current object into \a
+    name, and the colon after it, so the caller can read the value.
+    Returns false at the end of the object (which is then read) or
+    in case of error.
+*/
+
+bool JsonParser::member( string & name )
+{
+    if ( !comma( '}' ) )
+	return false;
+    if ( !text( name ) ) {
+	fail( "Expected member name" );
+	return false;
+    }
+    space();
+    if ( i >= s.size() || s[i] != ':' ) {
+	fail( "Expected :" );
+	return false;
+    }
+    i++;
+    return true;
+}
+
+
+/*! Reads the start of an array. Returns true if the next value is
+    an array, and false (without reading anything) if not.
+*/
+
+bool JsonParser::startArray()
+{
+    if ( next() != Array )
+	return false;
+    if ( later.size() >= 64 ) {
+	fail( "Too deeply nested" );
+	return false;
+    }
+    i++;
+    later.push_back( false );
+    return true;
+}
+
+
+/*! Returns true if the current array has another element, which the
+    caller must then read. Returns false at the end of the array
+    (which is then read) or in case of error.
+*/
+
+bool JsonParser::element()
+{
+    return comma( ']' );
+}
+
+
+/*! Reads a string into \a r, decoding escapes. Returns false if the
+    next value isn't a string.
+*/
+
+bool JsonParser::text( string & r )
+{
+    if ( next() != String )
+	return false;
+    i++;
+    r.clear();
+    while ( i < s.size() && s[i] != '"' ) {
+	char c = s[i++];
+	if ( (unsigned char)c < 32 ) {
+	    fail( "Control character in string" );
+	    return false;
+	}
+	if ( c != '\\' ) {
+	    r += c;
+	    continue;
+	}
+	if ( i >= s.size() )
+	    break;
+	c = s[i++];
+	switch ( c ) {
+	case '"':
+	case '\\':
+	case '/':
+	    r += c;
+	    break;
+	case 'b':
+	    r += '\b';
+	    break;
+	case 'f':
+	    r += '\f';
+	    break;
+	case 'n':
+	    r += '\n';
+	    break;
+	case 'r':
+	    r += '\r';
+	    break;
+	case 't':
+	    r += '\t';
+	    break;
+	case 'u':
+	    {
+		unsigned long u = 0;
+		if ( i + 4 <= s.size() )
+		    u = ::strtoul( s.substr( i, 4 ).c_str(), 0, 16 );
+		i += 4;
+		if ( u >= 0xd800 && u < 0xdc00 && i + 6 <= s.size() &&
+		     s[i] == '\\' && s[i+1] == 'u' ) {
+		    unsigned long low =
+			::strtoul( s.substr( i + 2, 4 ).c_str(), 0, 16 );
+		    if ( low >= 0xdc00 && low < 0xe000 ) {
+			u = 0x10000 + ( ( u - 0xd800 ) << 10 ) +
+			    ( low - 0xdc00 );
+			i += 6;
+		    }
+		}
+		if ( u < 0x80 ) {
+		    r += (char)u;
+		} else if ( u < 0x800 ) {
+		    r += (char)( 0xc0 | ( u >> 6 ) );
+		    r += (char)( 0x80 | ( u & 0x3f ) );
+		} else if ( u < 0x10000 ) {
+		    r += (char)( 0xe0 | ( u >> 12 ) );
+		    r += (char)( 0x80 | ( ( u >> 6 ) & 0x3f ) );
+		    r += (char)( 0x80 | ( u & 0x3f ) );
+		} else {
+		    r += (char)( 0xf0 | ( u >> 18 ) );
+		    r += (char)( 0x80 | ( ( u >> 12 ) & 0x3f ) );
+		    r += (char)( 0x80 | ( ( u >> 6 ) & 0x3f ) );
+		    r += (char)( 0x80 | ( u & 0x3f ) );
+		}
+	    }
+	    break;
+	default:
+	    fail( "Bad escape in string" );
+	    return false;
+	}
+    }
+    if ( i >= s.size() ) {
+	fail( "Unterminated string" );
+	return false;
+    }
+    i++;
+    return true;
+}
+
+
+/*! Reads a number into \a r. Returns false if the next value isn't a
+    number, or if it's a number but not an integer that fits in \a
+    r. In the latter case the number is read.
+*/
+
+bool JsonParser::number( long long & r )
+{
+    if ( next() != Number )
+	return false;
+    string::size_type start = i;
+    if ( s[i] == '-' )
+	i++;
+    string::size_type digits = i;
+    while ( i < s.size() && s[i] >= '0' && s[i] <= '9' )
+	i++;
+    if ( i == digits ) {
+	fail( "Expected digits" );
+	return false;
+    }
+    bool integer = true;
+    if ( i < s.size() && s[i] == '.' ) {
+	integer = false;
+	i++;
+	while ( i < s.size() && s[i] >= '0' && s[i] <= '9' )
+	    i++;
+    }
+    if ( i < s.size() && ( s[i] == 'e' || s[i] == 'E' ) ) {
+	integer = false;
+	i++;
+	if ( i < s.size() && ( s[i] == '+' || s[i] == '-' ) )
+	    i++;
+	while ( i < s.size() && s[i] >= '0' && s[i] <= '9' )
+	    i++;
+    }
+    if ( !integer )
+	return false;
+    try {
+	r = boost::lexical_cast<long long>( s.substr( start, i - start ) );
+    } catch ( boost::bad_lexical_cast & ) {
+	return false;
+    }
+    return true;
+}
+
+
+/*! Reads true or false into \a r. Returns false if the next value
+    isn't a boolean.
+*/
+
+bool JsonParser::boolean( bool & r )
+{
+    if ( next() != Boolean )
+	return false;
+    if ( !s.compare( i, 4, "true" ) ) {
+	r = true;
+	i += 4;
+    } else if ( !s.compare( i, 5, "false" ) ) {
+	r = false;
+	i += 5;
+    } else {
+	fail( "Expected true or false" );
+	return false;
+    }
+    return true;
+}
+
+
+/*! Reads the next value, whatever it is, and returns its JSON
+    source. Returns an empty string in case of error.
+*/
+
+string JsonParser::raw()
+{
+    space();
+    string::size_type start = i;
+    skip();
+    if ( !e.empty() )
+	return "";
+    return s.substr( start, i - start );
+}
+
+
+/*! Reads and discards the next value, whatever it is. */
+
+void JsonParser::skip()
+{
+    string t;
+    long long n;
+    bool b;
+    switch ( next() ) {
+    case Object:
+	startObject();
+	while ( member( t ) )
+	    skip();
+	break;
+    case Array:
+	startArray();
+	while ( element() )
+	    skip();
+	break;
+    case String:
+	text( t );
+	break;
+    case Number:
+	number( n );
+	break;
+    case Boolean:
+	boolean( b );
+	break;
+    case Null:
+	if ( s.compare( i, 4, "null" ) )
+	    fail( "Expected null" );
+	else
+	    i += 4;
+	break;
+    case Invalid:
+	fail( "Expected a value" );
+	break;
+    }
+}
+
+
+/*! Returns true if everything has been read, apart from trailing
+    white space, and there were no errors.
+*/
+
+bool JsonParser::atEnd()
+{
+    space();
+    return e.empty() && i == s.size();
+}
+
+
+/*! Returns true if no error has occured so far. */
+
+bool JsonParser::ok() const
+{
+    return e.empty();
+}
+
+
+/*! Returns a description of the first error, including its position,
+    or an empty string if there hasn't been any.
+*/
+
+string JsonParser::error() const
+{
+    return e;
+}
+
+
+/*! Skips white space. */
+
+void JsonParser::space()
+{
+    while ( i < s.size() &&
+	    ( s[i] == ' ' || s[i] == '\t' || s[i] == '\n' || s[i] == '\r' ) )
+	i++;
+}
+
+
+/*! Handles the comma before each member or element, and the \a close
+    character that ends the object or array. Returns true if another
+    member or element follows.
+*/
+
+bool JsonParser::comma( char close )
+{
+    space();
+    if ( !e.empty() || later.empty() )
+	return false;
+    if ( i < s.size() && s[i] == close ) {
+	i++;
+	later.pop_back();
+	return false;
+    }
+    if ( later.back() ) {
+	if ( i >= s.size() || s[i] != ',' ) {
+	    fail( string( "Expected , or " ) + close );
+	    return false;
+	}
+	i++;
+    }
+    later.back() = true;
+    return true;
+}
+
+
+/*! Records the error \a message, unless an error has been recorded
+    already.
+*/
+
+void JsonParser::fail( const string & message )
+{
+    if ( e.empty() )
+	e = message + " at offset " + boost::lexical_cast<string>( i );
+}
+
+
+/*! \class JsonWriter json.h
+
+    The JsonWriter class appends JSON to a string as the caller
+    produces it, without building a tree first. It implements the
+    Writer interface, as does CborWriter. Numbers and booleans
+    are written as such, strings are escaped as RFC 8259 requires,
+    and nothing but the output string is allocated.
+
+    The calls mirror JsonParser's:
+
+    \code
+    string r;
+    JsonWriter w( r );
+    w.startObject();
+    w.member( "port" );
+    w.number( 8080 );
+    w.endObject();
+    \endcode
+
+    Objects are written with one member per line and four spaces of
+    indentation per level, arrays on a single line, and a newline
+    follows the outermost value. The caller is responsible for
+    calling the functions in a sensible order; JsonWriter doesn't
+    check that each member has a value.
+*/
+
+
+/*! Constructs a JsonWriter which appends to \a output. */
+
+JsonWriter::JsonWriter( string & output )
+    : Writer( output ), named( false )
+{
+}
+
+
+/*! Starts an object. Each member must then be written using member()
+    and a value, and the object finished using endObject().
+*/
+
+void JsonWriter::startObject()
+{
+    separate();
+    o += '{';
+    nesting += '{';
+    later.push_back( false );
+}
+
+
+/*! Writes the name of the next member of the current object. The
+    next call must write its value.
+*/
+
+void JsonWriter::member( const string & name )
+{
+    separate();
+    quote( name );
+    o += ": ";
+    named = true;
+}
+
+
+/*! Finishes the current object. */
+
+void JsonWriter::endObject()
+{
+    nesting.erase( nesting.size() - 1 );
+    later.pop_back();
+    o += '\n';
+    o.append( nesting.size() * 4, ' ' );
+    o += '}';
+    finish();
+}
+
+
+/*! Starts an array. Each element must then be written using one of
+    the value functions, and the array finished using endArray().
+*/
+
+void JsonWriter::startArray()
+{
+    separate();
+    o += '[';
+    nesting += '[';
+    later.push_back( false );
+}
+
+
+/*! Finishes the current array. */
+
+void JsonWriter::endArray()
+{
+    if ( later.back() )
+	o += ' ';
+    nesting.erase( nesting.size() - 1 );
+    later.pop_back();
+    o += ']';
+    finish();
+}
+
+
+/*! Writes \a s as a JSON string. Control characters, quotes and
+    backslashes are escaped, and bytes that aren't part of valid
+    UTF-8 are replaced by U+FFFD, so the output is always valid JSON
+    even if a file name isn't.
+*/
+
+void JsonWriter::text( const string & s )
+{
+    separate();
+    quote( s );
+    finish();
+}
+
+
+/*! Appends \a s as a quoted, escaped JSON string. */
+
+void JsonWriter::quote( const string & s )
+{
+    o += '"';
+    string::size_type i = 0;
+    while ( i < s.size() ) {
+	unsigned char c = s[i];
+	if ( c >= 0x80 ) {
+	    unsigned int n = utf8( s, i );
+	    if ( n ) {
+		o.append( s, i, n );
+		i += n;
+	    } else {
+		o += "\xef\xbf\xbd";
+		i++;
+	    }
+	    continue;
+	}
+	if ( c == '"' || c == '\\' ) {
+	    o += '\\';
+	    o += c;
+	} else if ( c == '\n' ) {
+	    o += "\\n";
+	} else if ( c == '\t' ) {
+	    o += "\\t";
+	} else if ( c == '\r' ) {
+	    o += "\\r";
+	} else if ( c < 32 ) {
+	    char u[8];
+	    ::snprintf( u, sizeof( u ), "\\u%04x", c );
+	    o += u;
+	} else {
+	    o += c;
+	}
+	i++;
+    }
+    o += '"';
+}
+
+
+/*! Writes \a n as a JSON number. */
+
+void JsonWriter::number( long long n )
+{
+    separate();
+    char tmp[24];
+    ::snprintf( tmp, sizeof( tmp ), "%lld", n );
+    o += tmp;
+    finish();
+}
+
+
+/*! Writes \a b as true or false. */
+
+void JsonWriter::boolean( bool b )
+{
+    separate();
+    o += b ? "true" : "false";
+    finish();
+}
+
+
+/*! Writes \a json, which must be a complete JSON value, such as one
+    returned by JsonParser::raw().
+*/
+
+void JsonWriter::raw( const string & json )
+{
+    separate();
+    o += json;
+    finish();
+}
+
+
+/*! Writes whatever must precede the next member or element: A comma
+    if it isn't the first, and a line break and indentation in an
+    object. Does nothing for the value that follows member().
+*/
+
+void JsonWriter::separate()
+{
+    if ( named ) {
+	named = false;
+	return;
+    }
+    if ( later.empty() )
+	return;
+    if ( nesting[nesting.size() - 1] == '[' ) {
+	o += later.back() ? ", " : " ";
+    } else {
+	if ( later.back() )
+	    o += ',';
+	o += '\n';
+	o.append( nesting.size() * 4, ' ' );
+    }
+    later.back() = true;
+}
+
+
+/*! Ends the output with a line break once the outermost value has
+    been written.
+*/
+
+void JsonWriter::finish()
+{
+    if ( nesting.empty() )
+	o += '\n';
+}
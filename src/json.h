@@ -0,0 +1,80 @@
+// Copyright Arnt Gulbrandsen <arnt@gulbrandsen.priv.no>; BSD-licensed.
+
+#ifndef JSON_H
+#define JSON_H
+
+#include "writer.h"
+
+#include <string>
+#include <vector>
+
+using namespace std;
+
+
+class JsonParser
+{
+public:
+    JsonParser( const string & );
+
+    enum Type { Object, Array, String, Number, Boolean, Null, Invalid };
+    Type next();
+
+    bool startObject();
+    bool member( string & );
+    bool startArray();
+    bool element();
+
+    bool text( string & );
+    bool number( long long & );
+    bool boolean( bool & );
+    string raw();
+    void skip();
+
+    bool atEnd();
+
+    bool ok() const;
+    string error() const;
+
+private:
+    void space();
+    bool comma( char );
+    void fail( const string & );
+
+private:
+    const string & s;
+    string::size_type i;
+    vector<bool> later;
+    string e;
+};
+
+
+class JsonWriter
+    : public Writer
+{
+public:
+    JsonWriter( string & );
+
+    void startObject();
+    void member( const string & );
+    void endObject();
+    void startArray();
+    void endArray();
+
+    void text( const string & );
+    void number( long long );
+    void boolean( bool );
+    void raw( const string & );
+
+private:
+    void separate();
+    void quote( const string & );
+    void finish();
+
+private:
+    string nesting;
+    vector<bool> later;
+    bool named;
+};
+
+
+#endif
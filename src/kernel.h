@@ -0,0 +1,24 @@
+// Copyright Arnt Gulbrandsen <arnt@gulbrandsen.priv.no>; BSD-licensed.
+
+#ifndef KERNEL_H
+#define KERNEL_H
+
+#include <time.h>
+
+
+// the ioprio syscall has no glibc wrapper, so these are from
+// linux/ioprio.h. use them with syscall( SYS_ioprio_set, ... ).
+enum { IoprioWhoProcess = 1, IoprioClassIdle = 3, IoprioClassShift = 13 };
+
+
+// returns a count of milliseconds that only ever increases, for
+// measuring intervals. the starting point is arbitrary.
+inline long long milliseconds()
+{
+    struct timespec t;
+    ::clock_gettime( CLOCK_MONOTONIC, &t );
+    return t.tv_sec * 1000LL + t.tv_nsec / 1000000;
+}
+
+
+#endif
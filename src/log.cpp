@@ -2,28 +2,496 @@
 
 #include "log.h"
 
-std::ofstream info( "/dev/stderr" );
-std::ofstream debug( "/dev/stdout" );
+#include "metrics.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <list>
+#include <vector>
+
+#include <boost/lexical_cast.hpp>
+#include <boost/thread.hpp>
+
+using namespace std;
+
+
+// one line being composed by one thread; longer lines are truncated.
+class LineBuffer: public streambuf
+{
+public:
+    LineBuffer() { reset(); }
+
+    void reset() { setp( b, b + sizeof( b ) ); }
+    const char * data() const { return pbase(); }
+    int length() const { return pptr() - pbase(); }
+    void truncate( int n ) { reset(); pbump( n ); }
+
+private:
+    char b[4096];
+};
+
+
+struct Line {
+    Line(): s( &b ) {}
+
+    LineBuffer b;
+    ostream s;
+};
+
+
+struct Record {
+    unsigned int length;
+    int level;
+    struct timespec when;
+};
+
+
+enum { RingSize = 65536 };
+
+
+// a single-producer, single-consumer ring. head is written only by
+// the thread that owns the ring, tail only by whoever holds the drain
+// lock.
+struct Ring {
+    Ring(): head( 0 ), tail( 0 ), drops( 0 ), reported( 0 ), dead( false ) {}
+
+    volatile unsigned long head;
+    volatile unsigned long tail;
+    volatile unsigned long drops;
+    unsigned long reported;
+    volatile bool dead;
+    Line lines[2];
+    char data[RingSize];
+};
+
+
+struct Entry {
+    struct timespec when;
+    int level;
+    string text;
+};
+
+
+static bool earlier( const Entry & a, const Entry & b )
+{
+    if ( a.when.tv_sec != b.when.tv_sec )
+	return a.when.tv_sec < b.when.tv_sec;
+    return a.when.tv_nsec < b.when.tv_nsec;
+}
+
+
+static void retire( Ring * r )
+{
+    __sync_synchronize();
+    r->dead = true;
+}
+
+
+static boost::thread_specific_ptr<Ring> * current;
+static list<Ring*> * rings;
+static boost::mutex * registry;
+static boost::mutex * draining;
+static volatile bool running;
+static unsigned long long drops;
+
+volatile int Log::minimum = Log::Debug;
+
+Log info( Log::Info );
+Log debug( Log::Debug );
 
 
 /*! \class Log log.h
 
-  Log is Nodee's logging helper; a set of ostreams to be used for logging.
+  Log is Nodee's logging helper. There are two global Log objects,
+  info and debug, and one writes to them as though they were ostreams:
+  debug << a << b << endl.
+
+  Each thread composes its lines in a buffer of its own, and endl
+  copies the finished line into that thread's ring buffer. A
+  background thread started by start() collects the lines from all
+  the rings and writes them, info to stderr and debug to stdout. The
+  thread that logs never locks and never waits for the log consumer,
+  so ChoreKeeper can log in the middle of an emergency. If a ring is
+  full, the line is dropped and counted, and the writer reports the
+  count later.
+
+  The line is the unit of output, so debug << a << b is never
+  interleaved with another thread's output.
+
+  Structured data can be added to a line using kv(), e.g. debug <<
+  "nodee: Forked" << Log::kv( "pid", p ) << endl, which appends
+  pid=1234 to the line. Values are quoted if necessary.
+
+  setLevel() can change the level at any time. Lines below the level
+  cost only a comparison per <<.
+*/
+
+
+/*! Constructs a Log for lines at level \a level. Only used for info
+    and debug, during static initialisation.
+*/
+
+Log::Log( Level level )
+    : l( level )
+{
+    if ( registry )
+	return;
+    current = new boost::thread_specific_ptr<Ring>( retire );
+    rings = new list<Ring*>;
+    registry = new boost::mutex;
+    draining = new boost::mutex;
+}
+
+
+/*! Returns the stream in which the current thread composes its next
+    line, creating the thread's ring if necessary.
+*/
+
+ostream & Log::line()
+{
+    Ring * r = current->get();
+    if ( !r ) {
+	r = new Ring;
+	current->reset( r );
+	boost::mutex::scoped_lock lock( *registry );
+	rings->push_back( r );
+    }
+    return r->lines[l].s;
+}
+
+
+/*! Starts a key/value field named \a key and returns the position at
+    which its value starts, for quote().
+*/
+
+int Log::field( const char * key )
+{
+    ostream & s = line();
+    s << ' ' << key << '=';
+    return static_cast<LineBuffer*>( s.rdbuf() )->length();
+}
+
+
+/*! Puts quotes around the field value that starts at \a from, if it
+    contains anything that would make the line ambiguous.
+*/
+
+void Log::quote( int from )
+{
+    LineBuffer * b = static_cast<LineBuffer*>( line().rdbuf() );
+    int n = b->length() - from;
+    const char * v = b->data() + from;
+    bool needed = n == 0;
+    int i = 0;
+    while ( i < n && !needed ) {
+	if ( (unsigned char)v[i] <= ' ' ||
+	     v[i] == '"' || v[i] == '=' || v[i] == '\\' )
+	    needed = true;
+	i++;
+    }
+    if ( !needed )
+	return;
+
+    char tmp[4096];
+    memcpy( tmp, v, n );
+    b->truncate( from );
+    b->sputc( '"' );
+    i = 0;
+    while ( i < n ) {
+	if ( tmp[i] == '"' || tmp[i] == '\\' )
+	    b->sputc( '\\' );
+	b->sputc( tmp[i] );
+	i++;
+    }
+    b->sputc( '"' );
+}
+
+
+/*! Handles endl by finishing the current line, and passes other
+    manipulators such as hex to the line.
+*/
+
+Log & Log::operator<<( ostream & (*f)( ostream & ) )
+{
+    if ( l < minimum )
+	return *this;
+    if ( f == static_cast<ostream & (*)( ostream & )>( endl ) )
+	commit();
+    else
+	line() << f;
+    return *this;
+}
+
+
+/*! Passes \a f, e.g. hex or dec, to the line being composed. */
+
+Log & Log::operator<<( ios_base & (*f)( ios_base & ) )
+{
+    if ( l >= minimum )
+	line() << f;
+    return *this;
+}
+
 
-  One can write to the debug logger merely by using the ostream
-  debug. At the moment that's cerr, but it can be something else.
+/*! Copies the current thread's line into its ring and starts a new
+    line. If the ring is full, the line is dropped.
 
-  An implementation note: By playing around with two ostream classes,
-  it's possible to gather the output from composite operations such as
-  debug << a << b and send them to the log server as one string.
-  Slightly tricky, but doable, so I think this design is right.
+    If the background writer isn't running, this flushes the line at
+    once.
 */
 
+void Log::commit()
+{
+    Ring * r = current->get();
+    if ( !r )
+	return;
+
+    Line & c = r->lines[l];
+    Record h;
+    h.length = c.b.length();
+    h.level = l;
+    ::clock_gettime( CLOCK_REALTIME, &h.when );
+    unsigned long need = sizeof( h ) + h.length;
+
+    __sync_synchronize();
+    if ( need > RingSize - ( r->head - r->tail ) ) {
+	r->drops++;
+    } else {
+	const char * from[2] = { (const char *)&h, c.b.data() };
+	unsigned long size[2] = { sizeof( h ), h.length };
+	unsigned long p = r->head;
+	int i = 0;
+	while ( i < 2 ) {
+	    unsigned long o = p % RingSize;
+	    unsigned long first = min( size[i], RingSize - o );
+	    memcpy( r->data + o, from[i], first );
+	    memcpy( r->data, from[i] + first, size[i] - first );
+	    p += size[i];
+	    i++;
+	}
+	__sync_synchronize();
+	r->head = p;
+    }
+    c.b.reset();
+    c.s.clear();
+
+    if ( !running )
+	flush();
+}
+
+
+/*! Copies \a n bytes at position \a p in \a r to \a to. */
+
+static void fetch( const Ring * r, unsigned long p, char * to, unsigned long n )
+{
+    unsigned long o = p % RingSize;
+    unsigned long first = min( n, RingSize - o );
+    memcpy( to, r->data + o, first );
+    memcpy( to + first, r->data, n - first );
+}
+
+
+/*! Writes all of \a s to \a fd, retrying as necessary. */
+
+static void output( int fd, const string & s )
+{
+    unsigned int i = 0;
+    while ( i < s.size() ) {
+	int n = ::write( fd, s.data() + i, s.size() - i );
+	if ( n > 0 )
+	    i += n;
+	else if ( n < 0 && errno != EINTR )
+	    return;
+    }
+}
+
+
+/*! Collects the lines from all threads and writes them, oldest
+    first. Threads that have exited and whose lines are written lose
+    their rings.
+
+    Returns the number of lines written.
+*/
+
+static unsigned int drain()
+{
+    boost::mutex::scoped_lock lock( *draining );
+
+    vector<Ring*> all;
+    {
+	boost::mutex::scoped_lock lock( *registry );
+	all.insert( all.end(), rings->begin(), rings->end() );
+    }
+
+    vector<Entry> entries;
+    vector<Ring*>::iterator r( all.begin() );
+    while ( r != all.end() ) {
+	Ring * ring = *r;
+	bool dead = ring->dead;
+	unsigned long h = ring->head;
+	__sync_synchronize();
+	unsigned long t = ring->tail;
+	while ( t < h ) {
+	    Record record;
+	    fetch( ring, t, (char *)&record, sizeof( record ) );
+	    Entry e;
+	    e.when = record.when;
+	    e.level = record.level;
+	    e.text.resize( record.length );
+	    if ( record.length )
+		fetch( ring, t + sizeof( record ), &e.text[0], record.length );
+	    entries.push_back( e );
+	    t += sizeof( record ) + record.length;
+	}
+	__sync_synchronize();
+	ring->tail = t;
+
+	unsigned long d = ring->drops;
+	if ( d != ring->reported ) {
+	    Entry e;
+	    ::clock_gettime( CLOCK_REALTIME, &e.when );
+	    e.level = Log::Info;
+	    e.text = "nodee: Dropped log messages count=" +
+		     boost::lexical_cast<string>( d - ring->reported );
+	    entries.push_back( e );
+	    Metrics::add( Metrics::LogDrops, d - ring->reported );
+	    drops += d - ring->reported;
+	    ring->reported = d;
+	}
+
+	if ( dead && t == ring->head ) {
+	    boost::mutex::scoped_lock lock( *registry );
+	    rings->remove( ring );
+	    delete ring;
+	}
+	++r;
+    }
+
+    if ( entries.empty() )
+	return 0;
+
+    stable_sort( entries.begin(), entries.end(), earlier );
+    string out[2];
+    vector<Entry>::iterator e( entries.begin() );
+    while ( e != entries.end() ) {
+	out[e->level].append( e->text );
+	out[e->level].append( "\n" );
+	++e;
+    }
+    output( 1, out[Log::Debug] );
+    output( 2, out[Log::Info] );
+    return entries.size();
+}
+
+
+/*! Writes all complete lines now. This is called at exit, and
+    whenever a line is complete if the background writer isn't
+    running.
+*/
+
+void Log::flush()
+{
+    drain();
+}
+
+
+/*! The background writer's main loop. It looks for lines often
+    while there are some, so that a burst doesn't fill the rings, and
+    seldom when there are none.
+*/
+
+static void writer()
+{
+    while ( true ) {
+	int ms = drain() ? 1 : 10;
+	boost::this_thread::sleep( boost::posix_time::milliseconds( ms ) );
+    }
+}
+
+
+/*! Starts the background writer, and arranges for the last lines to
+    be written at exit. Until this is called, each line is written as
+    soon as it's complete.
+*/
+
+void Log::start()
+{
+    if ( running )
+	return;
+    running = true;
+    boost::thread t( writer );
+    ::atexit( flush );
+}
+
+
+/*! Prepares the log system for use in a child process after fork().
+
+    The child has a copy of each ring, but the parent writes those
+    lines, so this discards them. The child has no background writer,
+    and the locks may have been copied while held, so this replaces
+    them, and lines are written synchronously from now on.
+*/
+
+void Log::forked()
+{
+    running = false;
+    registry = new boost::mutex;
+    draining = new boost::mutex;
+    list<Ring*>::iterator r( rings->begin() );
+    while ( r != rings->end() ) {
+	(*r)->tail = (*r)->head;
+	(*r)->reported = (*r)->drops;
+	++r;
+    }
+}
+
+
+/*! Sets the lowest level that's logged to \a level. Lines below it
+    are discarded as cheaply as possible.
+*/
+
+void Log::setLevel( Level level )
+{
+    minimum = level;
+}
+
+
+/*! Sets the lowest level that's logged to that named \a name, which
+    may be "debug" or "info". Returns false and does nothing if \a
+    name is not a level.
+*/
+
+bool Log::setLevel( const string & name )
+{
+    if ( name == "debug" )
+	setLevel( Debug );
+    else if ( name == "info" )
+	setLevel( Info );
+    else
+	return false;
+    return true;
+}
+
+
+/*! Returns the lowest level that's logged. */
+
+Log::Level Log::level()
+{
+    return (Level)minimum;
+}
+
 
-/*! This static function initialises the log system to write
-    everything to stderr.
+/*! Returns the number of lines that have been dropped and reported
+    so far because a thread's ring was full.
 */
 
-void Log::setupStderr()
+unsigned long long Log::dropped()
 {
+    boost::mutex::scoped_lock lock( *draining );
+    return drops;
 }
@@ -4,15 +4,70 @@
 #define LOG_H
 
 #include <iostream>
-#include <fstream>
+#include <string>
 
 
-extern std::ofstream info;
-extern std::ofstream debug;
-
-class Log {
+class Log
+{
 public:
-    static void setupStderr();
+    enum Level { Debug, Info };
+
+    Log( Level );
+
+    template<typename T>
+    struct Field {
+	Field( const char * k, const T & v ): key( k ), value( v ) {}
+	const char * key;
+	const T & value;
+    };
+
+    template<typename T>
+    static Field<T> kv( const char * key, const T & value ) {
+	return Field<T>( key, value );
+    }
+
+    template<typename T>
+    Log & operator<<( const T & t ) {
+	if ( l >= minimum )
+	    line() << t;
+	return *this;
+    }
+
+    template<typename T>
+    Log & operator<<( const Field<T> & f ) {
+	if ( l >= minimum ) {
+	    int n = field( f.key );
+	    line() << f.value;
+	    quote( n );
+	}
+	return *this;
+    }
+
+    Log & operator<<( std::ostream & (*)( std::ostream & ) );
+    Log & operator<<( std::ios_base & (*)( std::ios_base & ) );
+
+    static void start();
+    static void flush();
+    static void forked();
+
+    static void setLevel( Level );
+    static bool setLevel( const std::string & );
+    static Level level();
+
+    static unsigned long long dropped();
+
+private:
+    std::ostream & line();
+    int field( const char * );
+    void quote( int );
+    void commit();
+
+    Level l;
+    static volatile int minimum;
 };
 
+
+extern Log info;
+extern Log debug;
+
 #endif
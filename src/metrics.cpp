@@ -0,0 +1,83 @@
+// Copyright Arnt Gulbrandsen <arnt@gulbrandsen.priv.no>; BSD-licensed.
+
+#include "metrics.h"
+
+#include <sstream>
+
+
+static long long counters[Metrics::NumCounters];
+
+static const char * names[Metrics::NumCounters] = {
+    "nodee_kills_total",
+    "nodee_squeezes_total",
+    "nodee_releases_total",
+    "nodee_notifications_total",
+    "nodee_reclaimed_kb_total",
+    "nodee_stall_milliseconds_total",
+    "nodee_throttles_total",
+    "nodee_unthrottles_total",
+    "nodee_scans_total",
+    "nodee_scan_cpu_microseconds_total",
+    "nodee_scan_interval_milliseconds",
+    "nodee_reaction_milliseconds",
+    "nodee_kill_reaction_milliseconds",
+    "nodee_memory_exhaustion_seconds",
+    "nodee_planned_restarts_total",
+    "nodee_launch_milliseconds",
+    "nodee_evicted_bytes_total",
+    "nodee_expired_directories_total",
+    "nodee_log_drops_total",
+    "nodee_service_log_drops_total"
+};
+
+
+/*! \class Metrics metrics.h
+
+    The Metrics class is a namespace class for a handful of counters
+    that nodee exposes on /metrics, one "name value" pair per line.
+
+    The counters are a fixed array indexed by the Counter enum, and
+    add() and set() are single atomic instructions, so ChoreKeeper
+    can count things in the middle of an emergency without locking or
+    allocating. Only text() allocates.
+*/
+
+
+/*! Adds \a n (by default 1) to \a c. */
+
+void Metrics::add( Counter c, long long n )
+{
+    __sync_fetch_and_add( &counters[c], n );
+}
+
+
+/*! Sets \a c to \a v, for counters that are really gauges. */
+
+void Metrics::set( Counter c, long long v )
+{
+    __sync_lock_test_and_set( &counters[c], v );
+}
+
+
+/*! Returns the current value of \a c. */
+
+long long Metrics::get( Counter c )
+{
+    return __sync_fetch_and_add( &counters[c], 0 );
+}
+
+
+/*! Returns all counters in the plain-text format monitoring systems
+    tend to like.
+*/
+
+string Metrics::text()
+{
+    ostringstream os;
+    int i = 0;
+    while ( i < NumCounters ) {
+	os << names[i] << " " << get( (Counter)i ) << "\n";
+	i++;
+    }
+    return os.str();
+}
@@ -0,0 +1,33 @@
+// Copyright Arnt Gulbrandsen <arnt@gulbrandsen.priv.no>; BSD-licensed.
+
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <string>
+
+using namespace std;
+
+
+class Metrics
+{
+public:
+    enum Counter {
+	Kills, Squeezes, Releases, Notifications, ReclaimedKb,
+	StallMilliseconds, Throttles, Unthrottles,
+	Scans, ScanCpuMicroseconds, ScanIntervalMilliseconds,
+	ReactionMilliseconds, KillReactionMilliseconds,
+	ExhaustionSeconds, PlannedRestarts,
+	LaunchMilliseconds, EvictedBytes, ExpiredDirectories, LogDrops,
+	ServiceLogDrops,
+	NumCounters
+    };
+
+    static void add( Counter, long long = 1 );
+    static void set( Counter, long long );
+    static long long get( Counter );
+
+    static string text();
+};
+
+
+#endif
@@ -0,0 +1,263 @@
+// Copyright Arnt Gulbrandsen <arnt@gulbrandsen.priv.no>; BSD-licensed.
+
+#include "mount.h"
+
+#include "log.h"
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <sys/mount.h>
+#include <sys/wait.h>
+#include <linux/loop.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sysexits.h>
+
+#include <fstream>
+#include <sstream>
+
+
+/*! \class Mount mount.h
+
+    The Mount class is a namespace class for mounting artifacts that
+    are filesystem images, so that installing a large artifact is a
+    digest check and a mount instead of unpacking.
+
+    type() recognises squashfs and erofs images by their magic
+    numbers. mount() attaches an image to a loop device and mounts it
+    read-only; if nodee isn't allowed to do that, it uses squashfuse
+    or erofsfuse instead. unmount() is the reverse, and mounted() and
+    below() tell Download and Sweeper what's mounted. The loop devices
+    are set to detach automatically when unmounted.
+*/
+
+
+/*! Returns "squashfs" or "erofs" if \a file is a filesystem image of
+    that type, and an empty string otherwise.
+*/
+
+string Mount::type( const string & file )
+{
+    int fd = ::open( file.c_str(), O_RDONLY );
+    if ( fd < 0 )
+	return "";
+    unsigned char b[4];
+    string r;
+    if ( ::pread( fd, b, 4, 0 ) == 4 && !::memcmp( b, "hsqs", 4 ) )
+	r = "squashfs";
+    else if ( ::pread( fd, b, 4, 1024 ) == 4 &&
+	      b[0] == 0xe2 && b[1] == 0xe1 && b[2] == 0xf5 && b[3] == 0xe0 )
+	r = "erofs";
+    ::close( fd );
+    return r;
+}
+
+
+/*! Mounts the image \a file read-only on \a dir, which must exist.
+    Returns true if successful.
+*/
+
+bool Mount::mount( const string & file, const string & dir )
+{
+    string t = type( file );
+    if ( t.empty() )
+	return false;
+    if ( loop( file, dir, t ) )
+	return true;
+    return run( t == "squashfs" ? "squashfuse" : "erofsfuse", file, dir );
+}
+
+
+/*! Attaches \a file to a free loop device and mounts that on \a dir
+    as filesystem type \a t. Returns true if successful.
+*/
+
+bool Mount::loop( const string & file, const string & dir, const string & t )
+{
+    int image = ::open( file.c_str(), O_RDONLY );
+    int control = ::open( "/dev/loop-control", O_RDWR );
+    if ( image < 0 || control < 0 ) {
+	if ( image >= 0 )
+	    ::close( image );
+	if ( control >= 0 )
+	    ::close( control );
+	return false;
+    }
+
+    bool ok = false;
+    int attempts = 0;
+    // another process may grab the device we're offered
+    while ( !ok && attempts++ < 5 ) {
+	int n = ::ioctl( control, LOOP_CTL_GET_FREE );
+	if ( n < 0 )
+	    break;
+	char device[32];
+	::snprintf( device, sizeof( device ), "/dev/loop%d", n );
+	int l = ::open( device, O_RDONLY );
+	if ( l < 0 )
+	    break;
+	if ( ::ioctl( l, LOOP_SET_FD, image ) < 0 ) {
+	    ::close( l );
+	    if ( errno == EBUSY )
+		continue;
+	    break;
+	}
+	struct loop_info64 info;
+	::memset( &info, 0, sizeof( info ) );
+	info.lo_flags = LO_FLAGS_READ_ONLY | LO_FLAGS_AUTOCLEAR;
+	::strncpy( (char *)info.lo_file_name, file.c_str(),
+		   LO_NAME_SIZE - 1 );
+	ok = ::ioctl( l, LOOP_SET_STATUS64, &info ) == 0 &&
+	     ::mount( device, dir.c_str(), t.c_str(),
+		      MS_RDONLY | MS_NODEV | MS_NOSUID, 0 ) == 0;
+	if ( !ok ) {
+	    (void)::ioctl( l, LOOP_CLR_FD, 0 );
+	    attempts = 5;
+	}
+	::close( l );
+    }
+
+    ::close( control );
+    ::close( image );
+    return ok;
+}
+
+
+/*! Runs \a helper with \a file and \a dir as arguments and returns
+    true if it succeeds.
+*/
+
+bool Mount::run( const char * helper, const string & file,
+		 const string & dir )
+{
+    pid_t p = ::fork();
+    if ( p < 0 )
+	return false;
+    if ( p == 0 ) {
+	::execlp( helper, helper, "-o", "ro", file.c_str(), dir.c_str(),
+		  (char *)0 );
+	::_exit( 127 );
+    }
+    int status = 0;
+    if ( ::waitpid( p, &status, 0 ) != p )
+	return false;
+    return WIFEXITED( status ) && WEXITSTATUS( status ) == 0;
+}
+
+
+/*! Unmounts \a dir, lazily so that processes still using it don't
+    prevent it. Returns true if successful.
+
+    A FUSE mount made without privileges can't be unmounted this way;
+    Unmounter runs fusermount for those.
+*/
+
+bool Mount::unmount( const string & dir )
+{
+    return ::umount2( dir.c_str(), MNT_DETACH ) == 0;
+}
+
+
+/*! Returns true if something is mounted on \a dir. */
+
+bool Mount::mounted( const string & dir )
+{
+    struct stat d;
+    struct stat parent;
+    return ::stat( dir.c_str(), &d ) == 0 &&
+	   ::stat( ( dir + "/.." ).c_str(), &parent ) == 0 &&
+	   d.st_dev != parent.st_dev;
+}
+
+
+/*! Parses \a filename as though it were /proc/self/mountinfo and
+    returns the mount points below \a dir, deepest first.
+*/
+
+list<string> Mount::below( const string & dir, const char * filename )
+{
+    list<string> r;
+    ifstream mountinfo( filename );
+    string line;
+    while ( getline( mountinfo, line ) ) {
+	istringstream fields( line );
+	string id, parent, device, root, point;
+	if ( !( fields >> id >> parent >> device >> root >> point ) )
+	    continue;
+
+	// the kernel escapes space, tab, newline and backslash
+	string unescaped;
+	string::size_type i = 0;
+	while ( i < point.size() ) {
+	    if ( point[i] == '\\' && i + 3 < point.size() ) {
+		unescaped += (char)::strtol( point.substr( i + 1, 3 ).c_str(),
+					     0, 8 );
+		i += 4;
+	    } else {
+		unescaped += point[i++];
+	    }
+	}
+
+	if ( unescaped.size() > dir.size() &&
+	     unescaped.compare( 0, dir.size(), dir ) == 0 &&
+	     unescaped[dir.size()] == '/' )
+	    r.push_front( unescaped );
+    }
+    return r;
+}
+
+
+/*! \class Unmounter mount.h
+
+    The Unmounter class runs fusermount to unmount an image that
+    Mount::unmount() could not, typically because it was mounted
+    using squashfuse or erofsfuse without privileges.
+
+    fusermount is a child process like any other, so Init has to
+    reap it: A waitpid() in another thread would race with Init's
+    wait(). Sweeper creates an Unmounter and hands it to Init, and
+    handleExit() cleans up if fusermount succeeds.
+*/
+
+
+/*! Constructs an Unmounter for the image mounted on \a dir. */
+
+Unmounter::Unmounter( const string & dir )
+    : Process( 0, 0 ), tree( dir )
+{
+}
+
+
+/*! Called in the child process; runs fusermount. The child inherits
+    the lock on the tree's .lock file from Sweeper, and keeps it until
+    fusermount is done.
+*/
+
+void Unmounter::start()
+{
+    if ( !inChild() )
+	return;
+    ::execlp( "fusermount", "fusermount", "-u", "-z", tree.c_str(),
+	      (char *)0 );
+    ::exit( EX_UNAVAILABLE );
+}
+
+
+/*! Notes that fusermount has exited with \a status and \a signal,
+    and deletes the image link and mount point if it succeeded.
+*/
+
+void Unmounter::handleExit( int status, int signal )
+{
+    Process::handleExit( status, signal );
+    if ( status != 0 || signal != 0 )
+	return;
+    ::unlink( ( tree + ".image" ).c_str() );
+    ::rmdir( tree.c_str() );
+    debug << "nodee: Unmounted the unused image on " << tree << endl;
+}
@@ -0,0 +1,44 @@
+// Copyright Arnt Gulbrandsen <arnt@gulbrandsen.priv.no>; BSD-licensed.
+
+#ifndef MOUNT_H
+#define MOUNT_H
+
+#include "process.h"
+
+#include <list>
+#include <string>
+
+using namespace std;
+
+
+class Mount
+{
+public:
+    static string type( const string & );
+
+    static bool mount( const string &, const string & );
+    static bool unmount( const string & );
+    static bool mounted( const string & );
+
+    static list<string> below( const string &, const char * );
+
+private:
+    static bool loop( const string &, const string &, const string & );
+    static bool run( const char *, const string &, const string & );
+};
+
+
+class Unmounter: public Process
+{
+public:
+    Unmounter( const string & );
+
+    void start();
+    void handleExit( int, int );
+
+private:
+    string tree;
+};
+
+
+#endif
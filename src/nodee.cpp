@@ -7,10 +7,15 @@
 
 #include "httplistener.h"
 #include "chorekeeper.h"
+#include "cgroup.h"
+#include "sweeper.h"
+#include "artifact.h"
 #include "zkclient.h"
 #include "init.h"
 #include "conf.h"
 #include "log.h"
+#include "port.h"
+#include "recorder.h"
 
 #include <iostream>
 #include <fstream>
@@ -38,7 +43,9 @@ int main( int argc, char ** argv )
 
     int port;
     vector<string> depots;
+    vector<string> portRanges;
     string cf( CONFFILE );
+    string level;
 
     options_description cli( "Command-line options" );
     cli.add_options()
@@ -54,6 +61,9 @@ int main( int argc, char ** argv )
 	  "set nodee TCP port" )
 	( "depot", value<vector<string> >( &depots )->composing(),
 	  "add artefact depot (e.g. example=http://artefactory.example.com/)" )
+	( "port-range", value<vector<string> >( &portRanges )->composing(),
+	  "assign ports from a range, optionally for a coordinate group "
+	  "(e.g. ideeuser.ie=20000-20999)" )
 	( "dir",
 	  value<string>( &Conf::basedir )->default_value( "/usr/local/nodee" ),
 	  "specify base directory" )
@@ -63,11 +73,35 @@ int main( int argc, char ** argv )
 	( "artefact-dir",
 	  value<string>( &Conf::artefactdir )->default_value( "artefacts" ),
 	  "specify where to store artefacts, relative to the base directory" )
+	( "software-dir",
+	  value<string>( &Conf::softwaredir )->default_value( "software" ),
+	  "specify where to unpack artefacts, relative to the base directory" )
 	( "script-dir",
 	  value<string>( &Conf::scriptdir )->default_value( "/etc/nodee/scripts" ),
 	  "specify where the download and install scripts live" )
+	( "cgroup-dir",
+	  value<string>( &Conf::cgroupdir )->default_value( "/sys/fs/cgroup/nodee" ),
+	  "specify the cgroup v2 directory for managed services" )
+	( "lock-memory", bool_switch( &Conf::lockmemory ),
+	  "lock nodee into RAM and give the RAM watcher realtime priority" )
+	( "prefetch-rate",
+	  value<int>( &Conf::prefetchrate )->default_value( 10240 ),
+	  "limit prefetching to this many kilobytes per second" )
+	( "disk-budget",
+	  value<int>( &Conf::diskbudget )->default_value( 0 ),
+	  "keep at most this many megabytes of artefacts (0: no limit)" )
+	( "work-expiry",
+	  value<int>( &Conf::workexpiry )->default_value( 1440 ),
+	  "delete work directories unused for this many minutes" )
+	( "service-log-size",
+	  value<int>( &Conf::servicelogsize )->default_value( 10240 ),
+	  "rotate each service's console log at this many kilobytes" )
 	( "zookeeper", value<string>( &Conf::zk ),
-	  "zookeeper location (e.g. FIXME)" );
+	  "zookeeper location (e.g. FIXME)" )
+	( "zookeeper-cbor", bool_switch( &Conf::zkcbor ),
+	  "store the host status in zookeeper as CBOR rather than JSON" )
+	( "log-level", value<string>( &level )->default_value( "debug" ),
+	  "log only messages at this level or above (debug or info)" );
 
     variables_map vm;
 
@@ -128,6 +162,22 @@ int main( int argc, char ** argv )
 	}
     }
 
+    vector<string>::const_iterator r( portRanges.begin() );
+    while ( r != portRanges.end() ) {
+	if ( !Port::addRange( *r ) ) {
+	    cerr << "nodee: Syntax error in port range: "
+		 << *r << endl;
+	    exit( 1 );
+	}
+	++r;
+    }
+
+    if ( !Log::setLevel( level ) ) {
+	cerr << "nodee: Unknown log level: "
+	     << level << endl;
+	exit( 1 );
+    }
+
     bool fail = false;
 
     if ( !boost::filesystem::is_directory( Conf::basedir ) ) {
@@ -145,6 +195,11 @@ int main( int argc, char ** argv )
 	     << endl;
 	fail = true;
     }
+    if ( !boost::filesystem::is_directory( Conf::basedir + "/" + Conf::softwaredir ) ) {
+	cerr << "Nodee: Cannot start up, software directory does not exist"
+	     << endl;
+	fail = true;
+    }
 
 
     if ( fail || vm.count( "show-config" ) ) {
@@ -155,6 +210,16 @@ int main( int argc, char ** argv )
 	     << Conf::workdir << "'" << endl
 	     << "nodee: artefactdir is '" << Conf::basedir << '/'
 	     << Conf::artefactdir <<  "'" << endl
+	     << "nodee: softwaredir is '" << Conf::basedir << '/'
+	     << Conf::softwaredir <<  "'" << endl
+	     << "nodee: cgroupdir is '" << Conf::cgroupdir <<  "'" << endl
+	     << "nodee: prefetchrate is " << Conf::prefetchrate
+	     << "kB/s" << endl
+	     << "nodee: diskbudget is " << Conf::diskbudget << "MB" << endl
+	     << "nodee: workexpiry is " << Conf::workexpiry
+	     << " minutes" << endl
+	     << "nodee: servicelogsize is " << Conf::servicelogsize
+	     << "kB" << endl
 	     << "nodee: zk is '" << Conf::zk <<  "'" << endl;
     }
 
@@ -185,13 +250,27 @@ int main( int argc, char ** argv )
     if ( fail )
 	::exit( EX_USAGE );
 
+    Log::start();
+
     if ( geteuid() )
 	info << "Nodee: Running as non-root. "
 	        "All services will use the same UID as nodee."
 	     << endl;
 
+    if ( !Recorder::open( Conf::basedir + "/flightrecorder" ) )
+	info << "nodee: Unable to open the flight recorder in "
+	     << Conf::basedir
+	     << endl;
+    Recorder::record( Recorder::Started, ::getpid(), 0, port );
+
     ZkClient zk( Conf::zk );
 
+    // the listeners accept launches as soon as they exist, so the
+    // cgroups and the artifact index have to be ready before. the
+    // references in the index are those of an earlier nodee.
+    (void)Cgroup::setup();
+    Artifact::clearReferences();
+
     Init i;
 
     HttpListener h6( HttpListener::V6, port, i );
@@ -205,12 +284,14 @@ int main( int argc, char ** argv )
 	exit( 1 );
     }
 
+    Sweeper s( i );
+
     ChoreKeeper k( i );
     k.start();
 }
 
 /*! \chapter index
-    \introduces ChoreKeeper HostStatus HttpServer HttpListener Init Process ServerSpec ZkClient
+    \introduces ChoreKeeper HostStatus HttpServer HttpListener Init Process ServerSpec Sweeper ZkClient
 
     Nodee uses eight main classes, plus some adjuncts.
 
@@ -0,0 +1,29 @@
+// Copyright Arnt Gulbrandsen <arnt@gulbrandsen.priv.no>; BSD-licensed.
+
+#include "delta.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <sysexits.h>
+
+// writes the block index for a file to stdout, so the depot can
+// publish it as file.blocks (see Delta).
+
+int main( int argc, char ** argv )
+{
+    if ( argc < 2 || argc > 3 ) {
+	fprintf( stderr, "usage: nodeeblocks file [blocksize]\n" );
+	exit( EX_USAGE );
+    }
+
+    int blockSize = Delta::DefaultBlockSize;
+    if ( argc == 3 )
+	blockSize = atoi( argv[2] );
+    string index = Delta::index( argv[1], blockSize );
+    if ( index.empty() ) {
+	perror( argv[1] );
+	exit( EX_NOINPUT );
+    }
+    fwrite( index.data(), 1, index.size(), stdout );
+    return 0;
+}
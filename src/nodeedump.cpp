@@ -0,0 +1,35 @@
+// Copyright Arnt Gulbrandsen <arnt@gulbrandsen.priv.no>; BSD-licensed.
+
+#include "recorder.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <sysexits.h>
+
+// prints the events in nodee's flight recorder (see Recorder),
+// oldest first, e.g. after a crash or reboot.
+
+int main( int argc, char ** argv )
+{
+    if ( argc > 2 ) {
+	fprintf( stderr, "usage: nodeedump [file]\n" );
+	exit( EX_USAGE );
+    }
+
+    string filename = "/usr/local/nodee/flightrecorder";
+    if ( argc == 2 )
+	filename = argv[1];
+    list<Recorder::Record> records = Recorder::read( filename );
+    if ( records.empty() ) {
+	fprintf( stderr, "nodeedump: No events in %s\n", filename.c_str() );
+	exit( EX_NOINPUT );
+    }
+
+    map<unsigned int,string> names;
+    list<Recorder::Record>::iterator i( records.begin() );
+    while ( i != records.end() ) {
+	printf( "%s\n", Recorder::describe( *i, names ).c_str() );
+	++i;
+    }
+    return 0;
+}
@@ -1,6 +1,7 @@
 // Copyright Arnt Gulbrandsen <arnt@gulbrandsen.priv.no>; BSD-licensed.
 
 #include <set>
+#include <list>
 
 #include <iostream>
 #include <fstream>
@@ -8,27 +9,61 @@
 #include <string>
 
 #include <boost/tokenizer.hpp>
+#include <boost/thread.hpp>
 
 #include "port.h"
 
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <linux/netlink.h>
+#include <linux/sock_diag.h>
+#include <linux/inet_diag.h>
+
 using namespace std;
 
 
+struct Range {
+    string group;
+    int first;
+    int last;
+    int next;
+};
+
+static bitset<65536> reserved;
+static list<Range> ranges;
+
+// allocated once and never destroyed, since ServerSpec objects may
+// release their ports while static objects are being destroyed
+static boost::mutex & lock()
+{
+    static boost::mutex * m = new boost::mutex;
+    return *m;
+}
 
 
 /*! \class Port port.h
 
-    The Port class contains a couple of static functions to find free
+    The Port class contains static functions to find and lease free
     TCP ports on this system.
 
     Nodee needs to find free TCP ports, and cannot use the normal
     approach since it has to know the port number much earlier.
-    Therefore this class contains some linux-specific /proc parsing to
-    supply the numbers we need.
+    Therefore lease() asks the kernel which ports are in use
+    (inUse() uses NETLINK_SOCK_DIAG, or parses /proc if that fails)
+    and also avoids the ports it has leased, which are kept in a
+    bitmap until release(). This way, two services started at the
+    same time get different ports even though neither has bound its
+    port yet.
+
+    Each range of ports is used round-robin, so a port that's just
+    been released, and which may still have connections in TIME_WAIT,
+    isn't reused at once. Ranges can be configured for groups of
+    coordinates using addRange(). By default, 1025-65535 is used.
 
-    Now that I write this, I notice a bug. assignFree() should also
-    look at all the Process objects and consider any ports assigned
-    but not yet used as occupied.
+    ServerSpec leases and releases ports; nothing else should need to.
 */
 
 /*! Parses \a filename as though it were linux' /proc/net/tcp and
@@ -85,32 +120,224 @@ set<int> Port::busy( const char * filename )
 }
 
 
-/*! Returns a free port on this host, avoiding \a avoid (which is an
-    empty set by default).
+// asks the kernel for all TCP sockets of one address family and
+// marks their local ports in taken. returns false on failure.
+static bool diag( int family, bitset<65536> & taken )
+{
+    int fd = ::socket( AF_NETLINK, SOCK_DGRAM, NETLINK_SOCK_DIAG );
+    if ( fd < 0 )
+	return false;
+
+    struct {
+	struct nlmsghdr h;
+	struct inet_diag_req_v2 r;
+    } req;
+    ::memset( &req, 0, sizeof( req ) );
+    req.h.nlmsg_len = sizeof( req );
+    req.h.nlmsg_type = SOCK_DIAG_BY_FAMILY;
+    req.h.nlmsg_flags = NLM_F_REQUEST | NLM_F_DUMP;
+    req.r.sdiag_family = family;
+    req.r.sdiag_protocol = IPPROTO_TCP;
+    req.r.idiag_states = ~0U; // every state, including TIME_WAIT
 
-    Ports used for any purpose are assumed to be used; if a process
-    opens a TCP connection from TCP6 port 1025, this function will
-    never return 1025, even though listening would be legal in most
-    cases.
+    struct sockaddr_nl kernel;
+    ::memset( &kernel, 0, sizeof( kernel ) );
+    kernel.nl_family = AF_NETLINK;
+    if ( ::sendto( fd, &req, sizeof( req ), 0,
+		   (struct sockaddr *)&kernel, sizeof( kernel ) ) < 0 ) {
+	::close( fd );
+	return false;
+    }
+
+    long buffer[8192];
+    bool ok = true;
+    bool done = false;
+    while ( !done ) {
+	int n = ::recv( fd, buffer, sizeof( buffer ), 0 );
+	if ( n <= 0 ) {
+	    ok = false;
+	    break;
+	}
+	struct nlmsghdr * h = (struct nlmsghdr *)buffer;
+	while ( !done && NLMSG_OK( h, (unsigned int)n ) ) {
+	    if ( h->nlmsg_type == NLMSG_DONE ) {
+		done = true;
+	    } else if ( h->nlmsg_type == NLMSG_ERROR ) {
+		ok = false;
+		done = true;
+	    } else {
+		struct inet_diag_msg * m =
+		    (struct inet_diag_msg *)NLMSG_DATA( h );
+		taken.set( ntohs( m->id.idiag_sport ) );
+		h = NLMSG_NEXT( h, n );
+	    }
+	}
+    }
+    ::close( fd );
+    return ok;
+}
 
-    The range used is 1025-65535; 65535 is returned as a last resort.
+
+/*! Sets a bit in \a taken for each local TCP port that's in use on
+    this host, for any purpose and in any state, as busy() explains.
+
+    This uses NETLINK_SOCK_DIAG, which is cheap even with many
+    thousands of connections, and falls back to parsing /proc/net if
+    that fails.
 */
 
-int Port::assignFree( const set<int> & avoid )
+void Port::inUse( bitset<65536> & taken )
 {
-    set<int> taken4;
-    set<int> taken6;
+    if ( diag( AF_INET, taken ) && diag( AF_INET6, taken ) )
+	return;
+
+    set<int> s;
     try {
-	taken4 = busy( "/proc/net/tcp" );
-	taken6 = busy( "/proc/net/tcp6" );
+	s = busy( "/proc/net/tcp" );
+	set<int> s6 = busy( "/proc/net/tcp6" );
+	s.insert( s6.begin(), s6.end() );
     } catch ( ... ) {
 	// we may not have /proc/net. ignore that.
     }
-    int p = 1025;
-    while ( p < 65535 &&
-	    ( taken4.find( p ) != taken4.end() ||
-	      taken6.find( p ) != taken6.end() ||
-	      avoid.find( p ) != avoid.end() ) )
+    set<int>::const_iterator i( s.begin() );
+    while ( i != s.end() ) {
+	if ( *i > 0 && *i < 65536 )
+	    taken.set( *i );
+	++i;
+    }
+}
+
+
+/*! Parses \a spec, which is either "first-last" or
+    "group=first-last", and calls addRange() with the result.
+    Returns false if \a spec is not syntactically valid.
+*/
+
+bool Port::addRange( const string & spec )
+{
+    string group;
+    string::size_type eq = spec.find( '=' );
+    if ( eq != string::npos )
+	group = spec.substr( 0, eq );
+    string numbers = spec.substr( eq == string::npos ? 0 : eq + 1 );
+
+    const char * s = numbers.c_str();
+    char * end = 0;
+    long first = ::strtol( s, &end, 10 );
+    if ( end == s || *end != '-' )
+	return false;
+    s = end + 1;
+    long last = ::strtol( s, &end, 10 );
+    if ( end == s || *end ||
+	 first < 1 || last > 65535 || first > last )
+	return false;
+    addRange( group, first, last );
+    return true;
+}
+
+
+/*! Makes lease() use ports from \a first to \a last, inclusive, for
+    the coordinates in \a group. A coordinate is in \a group if it
+    ends with \a group and a dot precedes that, so the group
+    "ideeuser.ie" contains "1.idee-prod.ideeuser.ie". If a coordinate
+    is in several groups, the longest group name wins. An empty \a
+    group contains all coordinates.
+
+    If \a group already has a range, this replaces it.
+*/
+
+void Port::addRange( const string & group, int first, int last )
+{
+    boost::lock_guard<boost::mutex> l( lock() );
+    list<Range>::iterator i( ranges.begin() );
+    while ( i != ranges.end() && i->group != group )
+	++i;
+    if ( i == ranges.end() )
+	i = ranges.insert( ranges.end(), Range() );
+    i->group = group;
+    i->first = first;
+    i->last = last;
+    i->next = first;
+}
+
+
+/*! Finds a free port for \a coordinate, reserves it and returns it.
+    The port stays reserved until release() is called. Returns 0 if
+    every port in the coordinate's range is either in use or
+    reserved.
+*/
+
+int Port::lease( const string & coordinate )
+{
+    bitset<65536> taken;
+    inUse( taken );
+
+    boost::lock_guard<boost::mutex> l( lock() );
+
+    Range fallback;
+    fallback.first = 1025;
+    fallback.last = 65535;
+    fallback.next = 1025;
+    Range * r = 0;
+    list<Range>::iterator i( ranges.begin() );
+    while ( i != ranges.end() ) {
+	string::size_type g = i->group.size();
+	string::size_type c = coordinate.size();
+	if ( ( g == 0 ||
+	       ( c == g && coordinate == i->group ) ||
+	       ( c > g && coordinate[c-g-1] == '.' &&
+		 !coordinate.compare( c - g, g, i->group ) ) ) &&
+	     ( !r || g > r->group.size() ) )
+	    r = &*i;
+	++i;
+    }
+    if ( !r ) {
+	// the first lease without any configured range adds the default
+	ranges.push_back( fallback );
+	r = &ranges.back();
+    }
+
+    int n = r->last - r->first + 1;
+    int p = r->next;
+    while ( n > 0 ) {
+	if ( p > r->last || p < r->first )
+	    p = r->first;
+	if ( !taken.test( p ) && !reserved.test( p ) ) {
+	    reserved.set( p );
+	    r->next = p + 1;
+	    return p;
+	}
 	p++;
-    return p;
+	n--;
+    }
+    return 0;
+}
+
+
+/*! Reserves \a port, which the caller has chosen, so that lease()
+    won't hand it out. Returns true if it was reserved by this call,
+    and false if it was reserved already (or isn't a valid port), in
+    which case the caller shouldn't release() it.
+*/
+
+bool Port::reserve( int port )
+{
+    if ( port < 1 || port > 65535 )
+	return false;
+    boost::lock_guard<boost::mutex> l( lock() );
+    if ( reserved.test( port ) )
+	return false;
+    reserved.set( port );
+    return true;
+}
+
+
+/*! Releases \a port, which lease() or reserve() has reserved. */
+
+void Port::release( int port )
+{
+    if ( port < 1 || port > 65535 )
+	return;
+    boost::lock_guard<boost::mutex> l( lock() );
+    reserved.reset( port );
 }
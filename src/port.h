@@ -3,7 +3,9 @@
 #ifndef PORT_H
 #define PORT_H
 
+#include <bitset>
 #include <set>
+#include <string>
 
 using namespace std;
 
@@ -12,7 +14,14 @@ class Port
 {
 public:
     static set<int> busy( const char * );
-    static int assignFree( const std::set<int> & = set<int>() );
+    static void inUse( bitset<65536> & );
+
+    static bool addRange( const string & );
+    static void addRange( const string &, int, int );
+
+    static int lease( const string & );
+    static bool reserve( int );
+    static void release( int );
 };
 
 #endif
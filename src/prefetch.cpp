@@ -0,0 +1,273 @@
+// Copyright Arnt Gulbrandsen <arnt@gulbrandsen.priv.no>; BSD-licensed.
+
+#include "prefetch.h"
+
+#include "init.h"
+#include "conf.h"
+#include "artifact.h"
+#include "download.h"
+#include "serverspec.h"
+#include "json.h"
+
+#include <stdio.h>
+#include <time.h>
+
+#include <list>
+#include <sstream>
+
+#include <boost/thread.hpp>
+#include <boost/property_tree/ptree.hpp>
+#include <boost/property_tree/json_parser.hpp>
+
+using boost::property_tree::ptree;
+
+
+struct Entry {
+    ServerSpec spec;
+    string filename;
+    int priority;
+    time_t queued;
+};
+
+
+static std::list<Entry> queue;
+static Download * active;
+static Init * manager;
+static boost::mutex mutex;
+
+
+/*! \class Prefetch prefetch.h
+
+    The Prefetch class is a namespace class that downloads artifacts
+    before any service needs them, so that a large rollout is limited
+    by how quickly services start, not by the depot.
+
+    add() queues one or more artifacts, ordered by priority and then
+    by age. One prefetch Download runs at a time, limited to
+    Conf::prefetchrate kilobytes per second and at idle priority, so
+    the running services don't notice. When it's done, finished()
+    starts the next.
+
+    When a service is launched, Process::launch() calls hurry(),
+    which removes the service's artifact from the queue (the launch
+    downloads it at full speed instead), and if the artifact is being
+    prefetched right now, Process::launch() waits for that download
+    and lifts its limits using Download::hurry().
+
+    list() returns the queue as JSON, for GET /artifact/queue.
+*/
+
+
+/*! Parses \a body and queues the artifacts it specifies. \a body is
+    either a single specification, in the same format as for
+    /service/start, or an object whose "artifacts" member is an array
+    of such specifications. The coordinate may be omitted. Each may
+    have a "priority"; higher priorities are fetched first, and the
+    default is 0.
+
+    Returns the number of artifacts queued, which is 0 if \a body
+    cannot be parsed. \a init manages the downloads.
+*/
+
+int Prefetch::add( const string & body, Init & init )
+{
+    ptree pt;
+    try {
+	istringstream i( body );
+	read_json( i, pt );
+    } catch ( ... ) {
+	return 0;
+    }
+
+    std::list<ptree> specs;
+    if ( pt.count( "artifacts" ) ) {
+	ptree & a = pt.get_child( "artifacts" );
+	ptree::iterator i( a.begin() );
+	while ( i != a.end() ) {
+	    specs.push_back( i->second );
+	    ++i;
+	}
+    } else {
+	specs.push_back( pt );
+    }
+
+    int n = 0;
+    std::list<ptree>::iterator i( specs.begin() );
+    while ( i != specs.end() ) {
+	int priority = 0;
+	try {
+	    priority = i->get<int>( "priority", 0 );
+	} catch ( ... ) {
+	}
+	if ( !i->count( "coordinate" ) )
+	    i->put( "coordinate", "prefetch" );
+	ostringstream os;
+	write_json( os, *i );
+	ServerSpec s = ServerSpec::parseJson( os.str(), init, false );
+	if ( s.valid() ) {
+	    enqueue( s, priority );
+	    n++;
+	}
+	++i;
+    }
+
+    {
+	boost::lock_guard<boost::mutex> l( mutex );
+	manager = &init;
+    }
+    next();
+    return n;
+}
+
+
+/*! Queues \a s with \a priority, unless it's queued or being fetched
+    already. If it's queued, its priority is raised to \a priority if
+    that's higher.
+*/
+
+void Prefetch::enqueue( const ServerSpec & s, int priority )
+{
+    boost::lock_guard<boost::mutex> l( mutex );
+
+    Entry e;
+    e.spec = s;
+    e.filename = Artifact::directory() + "/" + s.artifactFilename();
+    e.priority = priority;
+    e.queued = ::time( 0 );
+
+    if ( active && active->spec().artifactFilename() == s.artifactFilename() )
+	return;
+
+    std::list<Entry>::iterator i( queue.begin() );
+    while ( i != queue.end() && i->filename != e.filename )
+	++i;
+    if ( i != queue.end() ) {
+	if ( i->priority >= priority )
+	    return;
+	e.queued = i->queued;
+	queue.erase( i );
+    }
+
+    i = queue.begin();
+    while ( i != queue.end() && i->priority >= priority )
+	++i;
+    queue.insert( i, e );
+}
+
+
+/*! Removes \a filename from the queue, since a service needs it now
+    and will download it at full speed.
+*/
+
+void Prefetch::hurry( const string & filename )
+{
+    boost::lock_guard<boost::mutex> l( mutex );
+    std::list<Entry>::iterator i( queue.begin() );
+    while ( i != queue.end() ) {
+	if ( i->filename == filename )
+	    i = queue.erase( i );
+	else
+	    ++i;
+    }
+}
+
+
+/*! Records that \a d is done, and starts the next prefetch if \a d
+    was a prefetch. Download::handleExit() calls this for every
+    Download.
+*/
+
+void Prefetch::finished( Download * d )
+{
+    {
+	boost::lock_guard<boost::mutex> l( mutex );
+	if ( d != active )
+	    return;
+	active = 0;
+    }
+    next();
+}
+
+
+/*! Starts the first queued download, unless one is running already. */
+
+void Prefetch::next()
+{
+    boost::lock_guard<boost::mutex> l( mutex );
+    if ( active || !manager || queue.empty() )
+	return;
+
+    Entry e = queue.front();
+    queue.pop_front();
+
+    Download * d = Process::download( e.spec );
+    d->setRate( Conf::prefetchrate * 1024LL );
+    active = d;
+    manager->manage( d );
+    d->fork();
+    if ( !d->valid() )
+	active = 0;
+}
+
+
+/*! Returns a JSON object describing the running prefetch and the
+    queue, in order.
+*/
+
+string Prefetch::list()
+{
+    string r;
+    JsonWriter w( r );
+    list( w );
+    return r;
+}
+
+
+/*! Writes the object returned by list() using \a w. */
+
+void Prefetch::list( Writer & w )
+{
+    int n = 1;
+    char key[16];
+    time_t now = ::time( 0 );
+
+    boost::lock_guard<boost::mutex> l( mutex );
+    w.reserve( 256 * ( queue.size() + 1 ) );
+    w.startObject();
+    if ( active ) {
+	w.member( "1" );
+	w.startObject();
+	w.member( "artifact" );
+	w.text( active->spec().artifact() );
+	w.member( "url" );
+	w.text( active->spec().artifactUrl() );
+	w.member( "state" );
+	w.text( "downloading" );
+	w.member( "downloaded" );
+	w.number( active->received() );
+	w.member( "size" );
+	w.number( active->size() );
+	w.endObject();
+	n++;
+    }
+    std::list<Entry>::const_iterator i( queue.begin() );
+    while ( i != queue.end() ) {
+	::snprintf( key, sizeof( key ), "%d", n );
+	w.member( key );
+	w.startObject();
+	w.member( "artifact" );
+	w.text( i->spec.artifact() );
+	w.member( "url" );
+	w.text( i->spec.artifactUrl() );
+	w.member( "state" );
+	w.text( "queued" );
+	w.member( "priority" );
+	w.number( i->priority );
+	w.member( "waiting" );
+	w.number( now - i->queued );
+	w.endObject();
+	n++;
+	++i;
+    }
+    w.endObject();
+}
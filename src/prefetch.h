@@ -0,0 +1,27 @@
+// Copyright Arnt Gulbrandsen <arnt@gulbrandsen.priv.no>; BSD-licensed.
+
+#ifndef PREFETCH_H
+#define PREFETCH_H
+
+#include <string>
+
+using namespace std;
+
+
+class Prefetch
+{
+public:
+    static int add( const string &, class Init & );
+    static void hurry( const string & );
+    static void finished( class Download * );
+
+    static string list();
+    static void list( class Writer & );
+
+private:
+    static void enqueue( const class ServerSpec &, int );
+    static void next();
+};
+
+
+#endif
@@ -0,0 +1,42 @@
+// Copyright Arnt Gulbrandsen <arnt@gulbrandsen.priv.no>; BSD-licensed.
+
+#ifndef PROBES_H
+#define PROBES_H
+
+// USDT probes for bpftrace, perf and systemtap, e.g.
+//
+//     bpftrace -e 'usdt:/usr/local/sbin/nodee:nodee:launch
+//                  { printf("%x %s\n", arg0, str(arg1)); }'
+//
+// the probes and their arguments are listed in nodee(8). each probe
+// is a nop, but its arguments are evaluated whether or not anything
+// is attached, so they must be cheap: no strings built, no calls
+// that allocate. services are identified by ServerSpec::coordinateId(),
+// and the launch probe maps that to the coordinate. the Makefile
+// defines HAVE_SYS_SDT_H if <sys/sdt.h> exists; without it, the
+// probes compile to nothing, and their arguments aren't evaluated.
+
+#if defined(HAVE_SYS_SDT_H)
+
+#include <sys/sdt.h>
+
+#define NODEE_PROBE( n ) DTRACE_PROBE( nodee, n )
+#define NODEE_PROBE1( n, a ) DTRACE_PROBE1( nodee, n, a )
+#define NODEE_PROBE2( n, a, b ) DTRACE_PROBE2( nodee, n, a, b )
+#define NODEE_PROBE3( n, a, b, c ) DTRACE_PROBE3( nodee, n, a, b, c )
+#define NODEE_PROBE4( n, a, b, c, d ) DTRACE_PROBE4( nodee, n, a, b, c, d )
+#define NODEE_PROBE5( n, a, b, c, d, e ) \
+    DTRACE_PROBE5( nodee, n, a, b, c, d, e )
+
+#else
+
+#define NODEE_PROBE( n ) do {} while ( 0 )
+#define NODEE_PROBE1( n, a ) do {} while ( 0 )
+#define NODEE_PROBE2( n, a, b ) do {} while ( 0 )
+#define NODEE_PROBE3( n, a, b, c ) do {} while ( 0 )
+#define NODEE_PROBE4( n, a, b, c, d ) do {} while ( 0 )
+#define NODEE_PROBE5( n, a, b, c, d, e ) do {} while ( 0 )
+
+#endif
+
+#endif
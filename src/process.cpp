@@ -4,16 +4,28 @@
 
 #include "log.h"
 
+#include <fcntl.h>
 #include <unistd.h>
 #include <stdlib.h>
 #include <signal.h>
 #include <sysexits.h>
+#include <limits.h>
+#include <time.h>
 
 #include <boost/lexical_cast.hpp>
 
 #include "conf.h"
 #include "init.h"
 #include "uid.h"
+#include "download.h"
+#include "artifact.h"
+#include "metrics.h"
+#include "prefetch.h"
+#include "warmup.h"
+#include "recorder.h"
+#include "servicelog.h"
+#include "probes.h"
+#include "kernel.h"
 
 
 /*! \class Process process.h
@@ -31,6 +43,11 @@
 
     setCurrentRss() and setPageFaults() are used by the ChoreKeeper to
     store information for the later use by the ChoreKeeper itself.
+    recordHistory() keeps a few minutes' worth of those in a ring,
+    so that rssTrend(), secondsUntilPeak() and leaking() can say
+    where the process is heading. restart() is used by ChoreKeeper
+    to restart a leaking process while the host is quiet, rather
+    than kill it in a hurry later.
 
     There's a testing helper called fakefork(), which should never be
     used in production, and a static function called launch() to
@@ -52,14 +69,20 @@
 Process::Process()
     : p( 0 ), mp( ::getpid() ),
       faults( 0 ), prevFaults( 0 ),
-      rss( 0 ), next( 0 ),
-      starts( 0 ), waitUntil( 0 )
+      rss( 0 ), samples( 0 ), cpuTicks( 0 ), ioBytes( 0 ),
+      cpuPercent( 0 ), ioPerSecond( 0 ), slow( false ),
+      low( 0 ), high( 0 ), cg( "" ), next( 0 ),
+      starts( 0 ), planned( 0 ), launched( 0 ), forked( 0 ),
+      waitUntil( 0 )
 {
 }
 
 
 /*! Fork a child process, redirect its stdin/stdout/stderr
     appriopriately, and call start() in the child.
+
+    A service's stdout and stderr are captured by ServiceLog into
+    consoleLog().
 */
 
 void Process::fork()
@@ -70,14 +93,50 @@ void Process::fork()
     time_t now = time( 0 );
     starts++;
 
+    // the unit tests use Processes without a ServerSpec
+    if ( !s.coordinate().empty() )
+	cg = Cgroup( s.coordinate() + "-" +
+		     boost::lexical_cast<string>( s.port() ) );
+    cg.create();
+
+    // the service's stdout and stderr go to its console log. the
+    // download and install stages, and the unit tests' processes,
+    // keep nodee's.
+    int output[2] = { -1, -1 };
+    if ( !next && !s.coordinate().empty() &&
+	 ::pipe2( output, O_CLOEXEC ) < 0 ) {
+	output[0] = -1;
+	output[1] = -1;
+    }
+
+    // the reference is taken before forking, so there's no moment
+    // when the child uses the artifact and the index doesn't say so.
+    if ( !artifactFile.empty() )
+	Artifact::use( artifactFile );
+
     int tmp = ::fork();
     if ( tmp < 0 ) {
 	debug << "nodee: unknown error: fork failed" << endl;
 	// an error. record the problem somehow, then just return.
+	if ( !artifactFile.empty() )
+	    Artifact::release( artifactFile );
+	if ( output[0] >= 0 ) {
+	    ::close( output[0] );
+	    ::close( output[1] );
+	}
 	p = 0;
 	return;
     } else if ( tmp == 0 ) {
 	// we're in the child.
+	Log::forked();
+
+	if ( output[1] >= 0 ) {
+	    ::dup2( output[1], 1 );
+	    ::dup2( output[1], 2 );
+	}
+
+	// join the service's cgroup while we still are root.
+	cg.adopt( ::getpid() );
 
 	// the setregid and setreuid calls will return failure if
 	// nodee is being debugged as non-root. I think that's
@@ -97,12 +156,25 @@ void Process::fork()
     } else {
 	// we're in the parent.
 	p = tmp;
+	if ( output[0] >= 0 ) {
+	    ::close( output[1] );
+	    ServiceLog::capture( output[0], consoleLog() );
+	}
+	Recorder::record( Recorder::Forked, p, s.coordinateId(),
+			  u, starts );
+	NODEE_PROBE4( fork, p, s.coordinateId(), u, stage() );
 	debug << "nodee: Forked coordinate "
 	      << s.coordinate()
 	      << " to pid "
 	      << p
 	      << endl;
 	waitUntil = now + s.restartPeriod();
+	forked = milliseconds();
+	if ( launched ) {
+	    Metrics::set( Metrics::LaunchMilliseconds,
+			  milliseconds() - launched );
+	    launched = 0;
+	}
     }
 }
 
@@ -122,19 +194,44 @@ void Process::handleExit( int status, int signal )
 {
     status = status;
     signal = signal;
+    NODEE_PROBE5( exit, p, s.coordinateId(), status, signal,
+		  milliseconds() - forked );
 
     debug << "nodee: Process "
 	  << p
 	  << " exited with code "
 	  << status
+	  << Log::kv( "coordinate", s.coordinate() )
+	  << Log::kv( "signal", signal )
 	  << endl;
 
     p = 0;
+    samples = 0;
+    if ( !artifactFile.empty() )
+	Artifact::release( artifactFile );
 
-    if ( next )
+    // an exit long after restart() asked for it isn't the one we
+    // asked for
+    bool restarting = planned && milliseconds() - planned < RestartTimeout;
+    planned = 0;
+
+    if ( next ) {
 	next->fork();
-    else if ( starts < s.maxRestarts() )
+    } else if ( restarting ) {
+	// a restart we asked for doesn't count against maxrestarts,
+	// and there's no reason to wait
+	starts--;
+	waitUntil = 0;
+	fork();
+    } else if ( starts < s.maxRestarts() ) {
         fork();
+    } else {
+	cgroup().remove();
+	if ( !::getuid() ) {
+	    IdPool::uids().release( u );
+	    IdPool::gids().release( g );
+	}
+    }
 }
 
 
@@ -160,8 +257,8 @@ void Process::start()
     char * args[1025];
     args[0] = const_cast<char*>(script.c_str());
     int n = 1;
-    map<string,string> o( s.startupOptions() );
-    map<string,string>::iterator i( o.begin() );
+    const map<string,string> & o( s.startupOptions() );
+    map<string,string>::const_iterator i( o.begin() );
     while ( i != o.end() && n < 1023 ) {
 	args[n++] = const_cast<char*>( i->first.c_str() );
 	args[n++] = const_cast<char*>( i->second.c_str() );
@@ -174,6 +271,7 @@ void Process::start()
 	  << ::getpid()
 	  << endl;
 
+    NODEE_PROBE2( exec, ::getpid(), script.c_str() );
     ::execv( script.c_str(), args );
 
     ::exit( EX_NOINPUT );
@@ -185,7 +283,12 @@ void Process::start()
     Returns quickly; the new Process will go on its way.
 
     This may/will also start some helper processes to download and/or
-    install the software specified by \a what.
+    install the software specified by \a what. If the same artifact
+    is already being downloaded for another service, the new service
+    waits for that download rather than starting its own.
+
+    The time from here until the service itself is forked is
+    recorded as the LaunchMilliseconds metric.
 */
 
 void Process::launch( const ServerSpec & what, Init & init )
@@ -195,53 +298,110 @@ void Process::launch( const ServerSpec & what, Init & init )
     // it snuck its way in, I'll be more disciplined from now on)
     Process * useful = new Process;
     useful->assignUidGid();
-
-    Process * install = new Process( useful->u, useful->g );
-    Process * download = new Process( useful->u, useful->g );
+    useful->launched = milliseconds();
+    string coordinate = what.coordinate();
+    Recorder::name( coordinate );
+    NODEE_PROBE2( launch, what.coordinateId(), coordinate.c_str() );
+    Recorder::record( Recorder::Launched, 0, what.coordinateId(),
+		      what.port(), useful->u );
+
+    string filename = Artifact::directory() + "/" + what.artifactFilename();
+    // the helpers run as root, since the software tree they build
+    // is shared and must not belong to any one service.
+    Process * install = new Process( 0, 0 );
 
     // each of them receive basically the same spec
     useful->s = what;
-    download->s = what;
     install->s = what;
 
     install->next = useful;
-    download->next = install;
+    useful->artifactFile = filename;
+    // the install stage unpacks the artifact, so it uses it too, and
+    // a Download in another launch mustn't evict it meanwhile
+    install->artifactFile = filename;
 
     // but we change the prelimiaries so they'll do their chores
     // instead of trying to start the real thing
     map<string,string> options;
-    options["--url"] = what.artifactUrl();
-    options["--filename"] = Conf::basedir + "/" + Conf::artefactdir + "/" +
-			    what.artifactFilename();
-    if ( !what.md5().empty() )
-	options["--md5"] = what.md5();
-    download->s.setStartupScript( Conf::scriptdir + "/download", options );
-    options.erase( "--url" );
-    options.erase( "--md5" );
+    options["--filename"] = filename;
     options["--uid"] = boost::lexical_cast<string>( useful->u );
-    options["--gid"] = boost::lexical_cast<string>( useful->u );
+    options["--gid"] = boost::lexical_cast<string>( useful->g );
     options["--rootdir"] = useful->root();
+    options["--software"] = useful->software();
     install->s.setStartupScript( Conf::scriptdir + "/install", options );
 
-    // all three are managed by init.
+    // if the spec asks for it, the files the service needs are read
+    // into RAM before it starts. that's done as the service's user,
+    // since the root is the service's to change.
+    Process * warmup = 0;
+    if ( what.warmupLimit() > 0 || !what.warmupFiles().empty() ) {
+	warmup = new Warmup( useful->u, useful->g );
+	warmup->s = what;
+	warmup->next = useful;
+	install->next = warmup;
+    }
+
+    // if the same artifact is being downloaded already, perhaps by
+    // Prefetch, we wait for that download instead of starting
+    // another, and make sure it's not held back. Init may finish and
+    // delete the Download meanwhile, so we hold its lock while using
+    // the Download.
+    Prefetch::hurry( filename );
+    bool found = false;
+    bool following = false;
+    {
+	boost::lock_guard<boost::mutex> lock( Init::lock() );
+	Download * d = Download::find( init, filename, what.md5() );
+	if ( d ) {
+	    found = true;
+	    d->hurry();
+	    following = d->follow( install );
+	}
+    }
+    if ( found ) {
+	init.manage( install );
+	if ( warmup )
+	    init.manage( warmup );
+	init.manage( useful );
+	if ( !following )
+	    install->fork();
+	return;
+    }
+
+    Download * download = Process::download( what );
+    download->next = install;
+
+    // all of them are managed by init.
     init.manage( download );
     init.manage( install );
+    if ( warmup )
+	init.manage( warmup );
     init.manage( useful );
     download->fork();
 }
 
 
-/*! Constructs a copy of \a other. Deep copy, no sharing. */
+/*! Constructs a copy of \a other. Deep copy, except that the
+    immutable ServerSpec is shared.
+*/
 
 Process::Process( const Process & other )
     : p( other.p ), mp( other.mp ), s( other.s ),
       faults( other.faults ),
       prevFaults( other.prevFaults ),
-      rss( other.rss ),
+      rss( other.rss ), samples( other.samples ),
+      cpuTicks( other.cpuTicks ), ioBytes( other.ioBytes ),
+      cpuPercent( other.cpuPercent ), ioPerSecond( other.ioPerSecond ),
+      slow( other.slow ),
+      low( other.low ), high( other.high ), cg( other.cg ),
+      artifactFile( other.artifactFile ),
       u( other.u ), g( other.g ),
       next( other.next ),
-      starts( other.starts ), waitUntil( other.waitUntil )
+      starts( other.starts ), planned( other.planned ),
+      launched( other.launched ), forked( other.forked ),
+      waitUntil( other.waitUntil )
 {
+    copyHistory( other );
 }
 
 
@@ -255,9 +415,12 @@ Process::Process( const Process & other )
 Process::Process( int uid, int gid )
     : p( 0 ), mp( ::getpid() ),
       faults( 0 ), prevFaults( 0 ),
-      rss( 0 ), u( uid ), g( gid ),
+      rss( 0 ), samples( 0 ), cpuTicks( 0 ), ioBytes( 0 ),
+      cpuPercent( 0 ), ioPerSecond( 0 ), slow( false ),
+      low( 0 ), high( 0 ), cg( "" ), u( uid ), g( gid ),
       next( 0 ),
-      starts( 0 ), waitUntil( 0 )
+      starts( 0 ), planned( 0 ), launched( 0 ), forked( 0 ),
+      waitUntil( 0 )
 {
 }
 
@@ -271,8 +434,22 @@ void Process::operator=( const Process & other )
     faults = other.faults;
     prevFaults = other.prevFaults;
     rss = other.rss;
+    samples = other.samples;
+    copyHistory( other );
+    cpuTicks = other.cpuTicks;
+    ioBytes = other.ioBytes;
+    cpuPercent = other.cpuPercent;
+    ioPerSecond = other.ioPerSecond;
+    slow = other.slow;
+    low = other.low;
+    high = other.high;
+    cg = other.cg;
+    artifactFile = other.artifactFile;
     next = other.next;
     starts = other.starts;
+    planned = other.planned;
+    launched = other.launched;
+    forked = other.forked;
     waitUntil = other.waitUntil;
 }
 
@@ -301,15 +478,42 @@ void Process::setPageFaults( int f )
 
 
 /*! Returns how many faults have occured between the last and second-to-last
-    calls to setPageFaults().
+    calls to setPageFaults(), or 0 if the process is starting(), since
+    a service that's starting has to fault in its code and that
+    doesn't say anything about the host.
 */
 
 int Process::recentPageFaults() const
 {
+    if ( starting() )
+	return 0;
     return faults - prevFaults;
 }
 
 
+/*! Returns what recentPageFaults() would return if the process
+    weren't starting(), or 0 if it's not. ChoreKeeper subtracts these
+    from the host's faults.
+*/
+
+int Process::startupPageFaults() const
+{
+    if ( !starting() || faults < prevFaults )
+	return 0;
+    return faults - prevFaults;
+}
+
+
+/*! Returns true if the process was forked less than StartupPeriod
+    milliseconds ago, and false otherwise.
+*/
+
+bool Process::starting() const
+{
+    return p > 0 && forked && milliseconds() - forked < StartupPeriod;
+}
+
+
 /*! Sets the object's state to look as though it has forked and the
     child's pid is \a fakepid. Used only for testing.
 */
@@ -332,10 +536,11 @@ void Process::stop()
 	return;
 
     starts = INT_MAX;
+    Recorder::record( Recorder::Stopped, p, s.coordinateId() );
 
     string script = s.shutdownScript();
     if ( script.empty() ) {
-	::kill( 9, p );
+	::kill( p, SIGKILL );
     } else {
 	// trouble here. need new functionality.  the uid used needs
 	// to be visible to the c++, not assigned by sh at startup
@@ -344,6 +549,48 @@ void Process::stop()
 }
 
 
+/*! Asks the process to exit so that handleExit() can start it again
+    at once. This is meant for planned restarts, so it uses SIGTERM
+    and lets the process shut down cleanly; the restart does not
+    count against ServerSpec::maxRestarts().
+
+    Does nothing if the Process is not valid(), is a download,
+    install or warmup stage, or was asked to restart less than
+    RestartTimeout milliseconds ago. If it was asked longer ago than
+    that and still hasn't exited, it's killed with SIGKILL.
+
+    Returns true if it signalled the process, false if it did nothing.
+*/
+
+bool Process::restart()
+{
+    if ( !valid() || next )
+	return false;
+
+    if ( planned ) {
+	if ( milliseconds() - planned < RestartTimeout )
+	    return false;
+	debug << "nodee: Pid "
+	      << p
+	      << " ignored SIGTERM, killing it"
+	      << endl;
+	planned = milliseconds();
+	::kill( p, SIGKILL );
+	return true;
+    }
+
+    debug << "nodee: Restarting pid "
+	  << p
+	  << " in a quiet moment"
+	  << endl;
+    planned = milliseconds();
+    Recorder::record( Recorder::Restarted, p, s.coordinateId(),
+		      currentRss() );
+    ::kill( p, SIGTERM );
+    return true;
+}
+
+
 /*! Returns the UID used by this child, or 0 if the Process is not
     valid(). In theory, even valid() processes may run as root, but in
     practice that should not happen.
@@ -366,7 +613,10 @@ int Process::gid() const
 }
 
 
-/*! Picks otherwise unused UID and GID for this process. */
+/*! Picks otherwise unused UID and GID for this process, leasing
+    them from IdPool. handleExit() releases them when the process
+    has exited for good.
+*/
 
 void Process::assignUidGid()
 {
@@ -374,12 +624,38 @@ void Process::assignUidGid()
 	u = ::geteuid();
 	g = ::getegid();
     } else {
-	u = chooseFreeUid();
-	g = chooseFreeGid();
+	u = IdPool::uids().lease();
+	g = IdPool::gids().lease();
     }
 }
 
 
+/*! Returns a new Download to fetch the artifact \a what needs and
+    unpack it into the shared software directory. The caller has to
+    manage() and fork() it.
+
+    The download runs as root, for the same reason as the install
+    stage.
+*/
+
+Download * Process::download( const ServerSpec & what )
+{
+    string filename = Artifact::directory() + "/" + what.artifactFilename();
+    Download * d = new Download( 0, 0,
+				 what.artifactUrl(), filename, what.md5() );
+    d->s = what;
+    d->setSoftware( d->software() );
+
+    map<string,string> options;
+    options["--url"] = what.artifactUrl();
+    options["--filename"] = filename;
+    if ( !what.md5().empty() )
+	options["--md5"] = what.md5();
+    d->s.setStartupScript( Conf::scriptdir + "/download", options );
+    return d;
+}
+
+
 /*! Returns the root directory used by this Process. Automatically
     computed so as to be unique for each Process.
 */
@@ -391,6 +667,307 @@ string Process::root() const
 }
 
 
+/*! Returns the name of the file to which the service's stdout and
+    stderr are written (see ServiceLog).
+*/
+
+string Process::consoleLog() const
+{
+    return root() + "/console.log";
+}
+
+
+/*! Returns the name of the stage this Process is: "download",
+    "install", "warmup" or "service". Used by the fork probe and by
+    ChoreKeeper.
+*/
+
+const char * Process::stage() const
+{
+    if ( dynamic_cast<const Download *>( this ) )
+	return "download";
+    if ( dynamic_cast<const Warmup *>( this ) )
+	return "warmup";
+    if ( next )
+	return "install";
+    return "service";
+}
+
+
+/*! Returns the directory where this Process' artifact is unpacked.
+    This directory is shared by all services that use the same
+    artifact, and follows the group/artifact/version structure
+    of the artifact name, e.g. software/com.telenor/id-server/1.4.2.
+
+    The install script unpacks each artifact there once and builds
+    root() from it using hard links, so the tree must be treated as
+    read-only.
+*/
+
+string Process::software() const
+{
+    string a = s.artifact();
+    string::iterator i( a.begin() );
+    while ( i != a.end() ) {
+	if ( *i == '/' || ( *i == '.' && i + 1 != a.end() && i[1] == '.' ) )
+	    *i = '_';
+	else if ( *i == ':' )
+	    *i = '/';
+	++i;
+    }
+    return Conf::basedir + "/" + Conf::softwaredir + "/" + a;
+}
+
+
+/*! Returns the Cgroup used by this Process. All the Process objects
+    for a service (download, install and the service itself) share the
+    same cgroup, since they're motivated by the same ServerSpec.
+
+    The Cgroup is named by fork(), so that ChoreKeeper can use it
+    without allocating anything. Before fork(), or if the host has no
+    usable cgroups, the returned Cgroup is not valid().
+*/
+
+const Cgroup & Process::cgroup() const
+{
+    return cg;
+}
+
+
+/*! Records that the process (including its children) has used \a
+    cpu clock ticks and done \a io bytes of disk I/O since it
+    started, and that \a ms milliseconds have passed since the last
+    call. cpuUsage() and ioRate() are computed from the difference.
+*/
+
+void Process::setUsage( long long cpu, long long io, int ms )
+{
+    static int hz = ::sysconf( _SC_CLK_TCK );
+    if ( ms > 0 && cpuTicks <= cpu && ioBytes <= io &&
+	 ( cpuTicks || ioBytes ) ) {
+	cpuPercent = ( cpu - cpuTicks ) * 100 * 1000 / ( hz * ms );
+	ioPerSecond = ( io - ioBytes ) * 1000 / ms;
+    } else {
+	cpuPercent = 0;
+	ioPerSecond = 0;
+    }
+    cpuTicks = cpu;
+    ioBytes = io;
+}
+
+
+/*! Returns the CPU used recently, in percent of one core. A process
+    that keeps four cores busy uses 400.
+*/
+
+int Process::cpuUsage() const
+{
+    return cpuPercent;
+}
+
+
+/*! Returns the recent rate of disk I/O in bytes per second, reads
+    and writes combined.
+*/
+
+long long Process::ioRate() const
+{
+    return ioPerSecond;
+}
+
+
+/*! Records whether ChoreKeeper is throttling this Process' CPU and
+    I/O, as specified by \a throttled.
+*/
+
+void Process::setThrottled( bool throttled )
+{
+    slow = throttled;
+}
+
+
+/*! Returns whatever setThrottled() recorded, initially false. */
+
+bool Process::throttled() const
+{
+    return slow;
+}
+
+
+/*! Records the current RSS and fault count in the history, if at
+    least SampleInterval milliseconds have passed since the last
+    sample. \a now is the current time in milliseconds.
+
+    The history holds HistorySize samples, a little over five minutes.
+    It's a fixed array, since ChoreKeeper calls this while the host
+    may be short of memory.
+*/
+
+void Process::recordHistory( long long now )
+{
+    if ( samples &&
+	 now - sampleTime[(samples-1) % HistorySize] < SampleInterval )
+	return;
+    int i = samples % HistorySize;
+    rssHistory[i] = rss;
+    faultHistory[i] = faults;
+    sampleTime[i] = now;
+    samples++;
+    // keep the counter from wrapping, without losing the position
+    if ( samples >= 2 * HistorySize )
+	samples -= HistorySize;
+}
+
+
+/*! Returns the least-squares slope of the RSS history, in kilobytes
+    per minute, or 0 if there isn't enough history to say anything.
+    A negative number means that the process is shrinking.
+*/
+
+int Process::rssTrend() const
+{
+    int n = samples < HistorySize ? samples : HistorySize;
+    if ( n < 6 )
+	return 0;
+
+    double mx = 0;
+    double my = 0;
+    int i = 0;
+    while ( i < n ) {
+	mx += sampleTime[i];
+	my += rssHistory[i];
+	i++;
+    }
+    mx /= n;
+    my /= n;
+
+    double sxy = 0;
+    double sxx = 0;
+    i = 0;
+    while ( i < n ) {
+	double dx = sampleTime[i] - mx;
+	sxy += dx * ( rssHistory[i] - my );
+	sxx += dx * dx;
+	i++;
+    }
+    if ( sxx <= 0 )
+	return 0;
+    return (int)( sxy / sxx * 60000 );
+}
+
+
+/*! Returns the number of major page faults per minute over the
+    history, or 0 if there isn't enough history.
+*/
+
+int Process::faultTrend() const
+{
+    int n = samples < HistorySize ? samples : HistorySize;
+    if ( n < 2 )
+	return 0;
+    int first = samples < HistorySize ? 0 : samples % HistorySize;
+    int last = ( samples - 1 ) % HistorySize;
+    long long ms = sampleTime[last] - sampleTime[first];
+    if ( ms <= 0 || faultHistory[last] < faultHistory[first] )
+	return 0;
+    return (int)( ( faultHistory[last] - faultHistory[first] ) *
+		  60000LL / ms );
+}
+
+
+/*! Returns the number of seconds until the process reaches its
+    ServerSpec::expectedPeakMemory() at the rate given by rssTrend(),
+    0 if it already is there, and -1 if it isn't growing or has no
+    peak.
+*/
+
+int Process::secondsUntilPeak() const
+{
+    int peak = s.expectedPeakMemory();
+    int trend = rssTrend();
+    if ( !peak || trend <= 0 )
+	return -1;
+    if ( rss >= peak )
+	return 0;
+    long long seconds = ( peak - rss ) * 60LL / trend;
+    return seconds > INT_MAX ? INT_MAX : (int)seconds;
+}
+
+
+/*! Returns true if the process is growing steadily and will reach its
+    expected peak within an hour, and false otherwise.
+*/
+
+bool Process::leaking() const
+{
+    int seconds = secondsUntilPeak();
+    return seconds >= 0 && seconds <= 3600;
+}
+
+
+/*! Copies the RSS and fault history from \a other. */
+
+void Process::copyHistory( const Process & other )
+{
+    int i = 0;
+    while ( i < HistorySize ) {
+	rssHistory[i] = other.rssHistory[i];
+	faultHistory[i] = other.faultHistory[i];
+	sampleTime[i] = other.sampleTime[i];
+	i++;
+    }
+}
+
+
+/*! Records that memory.low for this Process' cgroup is \a kb
+    kilobytes. ChoreKeeper does the actual work.
+*/
+
+void Process::setMemoryLow( int kb )
+{
+    low = kb;
+}
+
+
+/*! Returns whatever setMemoryLow() recorded, initially 0. */
+
+int Process::memoryLow() const
+{
+    return low;
+}
+
+
+/*! Records that memory.high for this Process' cgroup is \a kb
+    kilobytes, or that it has no limit if \a kb is 0. ChoreKeeper
+    does the actual work.
+*/
+
+void Process::setMemoryHigh( int kb )
+{
+    high = kb;
+}
+
+
+/*! Returns whatever setMemoryHigh() recorded, initially 0. A nonzero
+    value means that ChoreKeeper is squeezing the Process.
+*/
+
+int Process::memoryHigh() const
+{
+    return high;
+}
+
+
+/*! Returns true if this is called in the child process, after
+    fork(), and false in nodee itself. Subclasses use this in start().
+*/
+
+bool Process::inChild() const
+{
+    return ::getpid() != mp;
+}
+
+
 /*! Returns a reference to the ServerSpec that motivates the existence
     of this Process.
 
@@ -4,6 +4,9 @@
 #define PROCESS_H
 
 #include "serverspec.h"
+#include "cgroup.h"
+
+#include <time.h>
 
 
 class Process
@@ -24,24 +27,59 @@ public:
     void fakefork( int fakepid );
 
     void stop();
+    bool restart();
 
     void setCurrentRss( int );
     int currentRss() const;
     void setPageFaults( int );
     int recentPageFaults() const;
+    int startupPageFaults() const;
+    bool starting() const;
+
+    void setUsage( long long, long long, int );
+    int cpuUsage() const;
+    long long ioRate() const;
+    void setThrottled( bool );
+    bool throttled() const;
+
+    void recordHistory( long long );
+    int rssTrend() const;
+    int faultTrend() const;
+    int secondsUntilPeak() const;
+    bool leaking() const;
+
+    void setMemoryLow( int );
+    int memoryLow() const;
+    void setMemoryHigh( int );
+    int memoryHigh() const;
 
     bool operator==( const Process & other ) { return p == other.p; }
     void operator=( const Process & other );
 
     static void launch( const ServerSpec & what, class Init & );
+    static class Download * download( const ServerSpec & );
 
     int uid() const;
     int gid() const;
     void assignUidGid();
 
     string root() const;
+    string consoleLog() const;
+    string software() const;
+    const Cgroup & cgroup() const;
 
     const ServerSpec & spec() const;
+    const char * stage() const;
+
+protected:
+    bool inChild() const;
+
+public:
+    enum { HistorySize = 64, SampleInterval = 5000, StartupPeriod = 30000,
+	   RestartTimeout = 30000 };
+
+private:
+    void copyHistory( const Process & );
 
 private:
     int p;
@@ -50,11 +88,27 @@ private:
     int faults;
     int prevFaults;
     int rss;
+    int rssHistory[HistorySize];
+    int faultHistory[HistorySize];
+    long long sampleTime[HistorySize];
+    int samples;
+    long long cpuTicks;
+    long long ioBytes;
+    int cpuPercent;
+    long long ioPerSecond;
+    bool slow;
+    int low;
+    int high;
+    Cgroup cg;
+    string artifactFile;
     int u;
     int g;
     Process * next;
 
     int starts;
+    long long planned;
+    long long launched;
+    long long forked;
     time_t waitUntil;
 };
 
@@ -0,0 +1,324 @@
+// Copyright Arnt Gulbrandsen <arnt@gulbrandsen.priv.no>; BSD-licensed.
+
+#include "recorder.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <fstream>
+#include <iterator>
+#include <vector>
+
+
+struct Header {
+    char magic[8];
+    unsigned int recordSize;
+    unsigned int records;
+    unsigned long long next;
+    char reserved[40];
+};
+
+
+static const char magic[8] = { 'n', 'o', 'd', 'e', 'e', 'f', 'r', '1' };
+
+static Header * header;
+static Recorder::Record * slots;
+
+
+// the name of each event, followed by the names of its values
+static const char * const events[Recorder::NumEvents][4] = {
+    { 0, 0, 0, 0 },
+    { "started", "port", 0, 0 },
+    { "named", 0, 0, 0 },
+    { "launched", "port", "uid", 0 },
+    { "forked", "uid", "starts", 0 },
+    { "exited", "status", "signal", 0 },
+    { "stopped", 0, 0, 0 },
+    { "restarted", "rsskb", 0, 0 },
+    { "killed", "rsskb", "reactionms", 0 },
+    { "squeezed", "rsskb", "targetkb", 0 },
+    { "released", 0, 0, 0 },
+    { "notified", "signal", 0, 0 },
+    { "throttled", "cpu", "iorate", 0 },
+    { "unthrottled", 0, 0, 0 },
+    { "responded", "operation", "status", "bytes" }
+};
+
+
+/*! \class Recorder recorder.h
+
+  The Recorder class is a flight recorder: It keeps the most recent
+  few thousand lifecycle and kill events in a ring in a memory-mapped
+  file, so that the events leading up to a crash or reboot can be
+  examined afterwards using nodeedump.
+
+  Each event is a fixed-size Record containing a timestamp, a pid,
+  the coordinate's id(), the kind of Event and up to three numbers.
+  Recording an event claims a slot with one atomic add and fills it
+  in. There is no system call, no lock and no allocation, so Init,
+  Process, ChoreKeeper and HttpServer can record all the time, even
+  during an emergency. The kernel writes the pages to disk, and they
+  survive nodee's death since the mapping is shared.
+
+  A slot's sequence number is cleared while it's written and set
+  last, so a record nodee was writing when it died is ignored by
+  read().
+
+  Coordinates are recorded as a 32-bit hash; name() records the text
+  of a coordinate along with the hash, and describe() uses those
+  records to print names.
+
+  open() and close() are not thread-safe, the other functions are.
+*/
+
+
+/*! Opens or creates the ring file \a filename and maps it. Existing
+    records are kept, so the ring spans nodee restarts and reboots.
+    Returns true if successful, and false if the recorder is
+    disabled.
+*/
+
+bool Recorder::open( const string & filename )
+{
+    close();
+
+    int fd = ::open( filename.c_str(), O_RDWR | O_CREAT, 0600 );
+    if ( fd < 0 )
+	return false;
+
+    // allocate the blocks now, so that writing to the mapping can't
+    // fail later if the disk is full
+    struct stat st;
+    bool fresh = ::fstat( fd, &st ) < 0 || st.st_size != Size;
+    if ( fresh && ::posix_fallocate( fd, 0, Size ) ) {
+	::close( fd );
+	return false;
+    }
+
+    void * m = ::mmap( 0, Size, PROT_READ | PROT_WRITE, MAP_SHARED,
+		       fd, 0 );
+    ::close( fd );
+    if ( m == MAP_FAILED )
+	return false;
+
+    Header * h = (Header *)m;
+    if ( fresh || memcmp( h->magic, magic, sizeof( magic ) ) ||
+	 h->recordSize != sizeof( Record ) || h->records != Records ) {
+	memset( m, 0, Size );
+	memcpy( h->magic, magic, sizeof( magic ) );
+	h->recordSize = sizeof( Record );
+	h->records = Records;
+    }
+    slots = (Record *)( h + 1 );
+    header = h;
+    return true;
+}
+
+
+/*! Unmaps the ring file. record() does nothing afterwards. */
+
+void Recorder::close()
+{
+    if ( !header )
+	return;
+    Header * h = header;
+    header = 0;
+    slots = 0;
+    ::munmap( h, Size );
+}
+
+
+/*! Claims the next slot, clears its sequence number and fills in the
+    common fields. publish() must be called afterwards.
+*/
+
+static Recorder::Record * claim( unsigned long long & n, int event,
+				 int pid, unsigned int coordinate )
+{
+    n = __sync_fetch_and_add( &header->next, 1 );
+    Recorder::Record * r = slots + n % Recorder::Records;
+    r->sequence = 0;
+    __sync_synchronize();
+
+    struct timespec t;
+    ::clock_gettime( CLOCK_REALTIME, &t );
+    r->when = t.tv_sec * 1000000LL + t.tv_nsec / 1000;
+    r->pid = pid;
+    r->coordinate = coordinate;
+    r->event = event;
+    r->reserved1 = 0;
+    r->reserved2 = 0;
+    return r;
+}
+
+
+/*! Marks \a r, claimed as number \a n, as complete. */
+
+static void publish( Recorder::Record * r, unsigned long long n )
+{
+    __sync_synchronize();
+    r->sequence = n + 1;
+}
+
+
+/*! Records that \a event happened to \a pid, which runs the
+    coordinate whose id() is \a coordinate. \a a, \a b and \a c
+    depend on the event; see describe(). Either \a pid or \a
+    coordinate may be 0.
+
+    Does nothing unless open() has been called.
+*/
+
+void Recorder::record( Event event, int pid, unsigned int coordinate,
+		       long long a, long long b, long long c )
+{
+    if ( !header )
+	return;
+
+    unsigned long long n;
+    Record * r = claim( n, event, pid, coordinate );
+    r->values[0] = a;
+    r->values[1] = b;
+    r->values[2] = c;
+    r->values[3] = 0;
+    publish( r, n );
+}
+
+
+/*! Records the name of \a coordinate, so describe() can show it
+    instead of the id(). Names longer than 32 bytes are truncated.
+*/
+
+void Recorder::name( const string & coordinate )
+{
+    if ( !header )
+	return;
+
+    unsigned long long n;
+    Record * r = claim( n, Named, 0, id( coordinate ) );
+    memset( r->values, 0, sizeof( r->values ) );
+    memcpy( r->values, coordinate.data(),
+	    min( coordinate.size(), sizeof( r->values ) ) );
+    publish( r, n );
+}
+
+
+/*! Returns the 32-bit FNV-1a hash of \a coordinate, which is never
+    0.
+*/
+
+unsigned int Recorder::id( const string & coordinate )
+{
+    unsigned int h = 2166136261u;
+    string::const_iterator i( coordinate.begin() );
+    while ( i != coordinate.end() ) {
+	h ^= (unsigned char)*i;
+	h *= 16777619u;
+	++i;
+    }
+    return h ? h : 1;
+}
+
+
+static bool earlier( const Recorder::Record & a, const Recorder::Record & b )
+{
+    return a.sequence < b.sequence;
+}
+
+
+/*! Reads the ring file \a filename, which need not be open(), and
+    returns its complete records, oldest first. Returns an empty list
+    if \a filename isn't a ring file.
+*/
+
+list<Recorder::Record> Recorder::read( const string & filename )
+{
+    list<Record> r;
+    ifstream f( filename.c_str(), ios::binary );
+    string s( ( istreambuf_iterator<char>( f ) ),
+	      istreambuf_iterator<char>() );
+    if ( s.size() != Size )
+	return r;
+    Header h;
+    memcpy( &h, s.data(), sizeof( h ) );
+    if ( memcmp( h.magic, magic, sizeof( magic ) ) ||
+	 h.recordSize != sizeof( Record ) || h.records != Records )
+	return r;
+
+    vector<Record> v;
+    unsigned int i = 0;
+    while ( i < Records ) {
+	Record x;
+	memcpy( &x, s.data() + sizeof( h ) + i * sizeof( x ), sizeof( x ) );
+	if ( x.sequence && ( x.sequence - 1 ) % Records == i )
+	    v.push_back( x );
+	i++;
+    }
+    sort( v.begin(), v.end(), earlier );
+    r.insert( r.end(), v.begin(), v.end() );
+    return r;
+}
+
+
+/*! Returns a one-line description of \a r in the same key=value
+    format as the log. \a names maps coordinate ids to names; a Named
+    record adds to it, and other records use it.
+*/
+
+string Recorder::describe( const Record & r, map<unsigned int,string> & names )
+{
+    char buf[256];
+    time_t seconds = r.when / 1000000;
+    struct tm t;
+    ::gmtime_r( &seconds, &t );
+    int n = ::strftime( buf, sizeof( buf ), "%Y-%m-%dT%H:%M:%S", &t );
+    ::snprintf( buf + n, sizeof( buf ) - n, ".%06dZ ",
+		(int)( r.when % 1000000 ) );
+    string s( buf );
+
+    if ( r.event == Named ) {
+	string name( (const char *)r.values,
+		     strnlen( (const char *)r.values, sizeof( r.values ) ) );
+	names[r.coordinate] = name;
+    }
+
+    if ( r.event > 0 && r.event < NumEvents ) {
+	s += events[r.event][0];
+    } else {
+	::snprintf( buf, sizeof( buf ), "event=%d", r.event );
+	s += buf;
+    }
+
+    if ( r.pid ) {
+	::snprintf( buf, sizeof( buf ), " pid=%d", r.pid );
+	s += buf;
+    }
+
+    if ( r.coordinate ) {
+	map<unsigned int,string>::const_iterator i( names.find( r.coordinate ) );
+	if ( i != names.end() ) {
+	    s += " coordinate=" + i->second;
+	} else {
+	    ::snprintf( buf, sizeof( buf ), " coordinate=%08x",
+			r.coordinate );
+	    s += buf;
+	}
+    }
+
+    if ( r.event > 0 && r.event < NumEvents && r.event != Named ) {
+	int i = 0;
+	while ( i < 3 && events[r.event][i+1] ) {
+	    ::snprintf( buf, sizeof( buf ), " %s=%lld",
+			events[r.event][i+1], r.values[i] );
+	    s += buf;
+	    i++;
+	}
+    }
+    return s;
+}
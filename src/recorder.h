@@ -0,0 +1,50 @@
+// Copyright Arnt Gulbrandsen <arnt@gulbrandsen.priv.no>; BSD-licensed.
+
+#ifndef RECORDER_H
+#define RECORDER_H
+
+#include <list>
+#include <map>
+#include <string>
+
+using namespace std;
+
+
+class Recorder
+{
+public:
+    enum Event {
+	Started = 1, Named, Launched, Forked, Exited, Stopped, Restarted,
+	Killed, Squeezed, Released, Notified, Throttled, Unthrottled,
+	Responded,
+	NumEvents
+    };
+
+    struct Record {
+	unsigned long long sequence;
+	long long when;
+	int pid;
+	unsigned int coordinate;
+	unsigned short event;
+	unsigned short reserved1;
+	unsigned int reserved2;
+	long long values[4];
+    };
+
+    enum { Size = 1024 * 1024, Records = Size / sizeof( Record ) - 1 };
+
+    static bool open( const string & );
+    static void close();
+
+    static void record( Event, int, unsigned int,
+			long long = 0, long long = 0, long long = 0 );
+    static void name( const string & );
+
+    static unsigned int id( const string & );
+
+    static list<Record> read( const string & );
+    static string describe( const Record &, map<unsigned int,string> & );
+};
+
+
+#endif
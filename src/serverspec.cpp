@@ -2,13 +2,17 @@
 
 #include <string>
 
-#include <boost/property_tree/ptree.hpp>
-#include <boost/property_tree/json_parser.hpp>
+#include <limits.h>
+
+#include <boost/lexical_cast.hpp>
+#include <boost/shared_ptr.hpp>
 
 #include "serverspec.h"
 #include "conf.h"
 #include "port.h"
 #include "init.h"
+#include "json.h"
+#include "recorder.h"
 
 
 
@@ -33,99 +37,522 @@
   },
   "restart" : {
     "period" : 120,
-    "maxrestarts" : 10
+    "maxrestarts" : 10,
+    "leaking" : true
+  },
+  "pressure" : {
+    "signal" : 12,
+    "url" : "http://localhost:8080/dropcaches"
+  },
+  "warmup" : {
+    "files" : [ "lib/id-*.jar", "lib/native/libid-*.so" ],
+    "limit" : 64
   }
 }
 
     Note that you cannot specify any single option twice. -foo 1 --foo
     2 is not possible; nodee will use one of the two.
+
+    parseJson() reads the JSON once, using JsonParser, into plain
+    members, so the accessors neither search, convert nor throw.
+    ChoreKeeper calls them for every Process several times per
+    second. Numbers may also be given as strings, since older clients
+    do that. All problems with a specification are reported together
+    by error(). Members nodee doesn't know are kept as they are, and
+    json() writes them back out.
+
+    The parsed specification is immutable and shared by all copies,
+    so copying a ServerSpec (as Process::launch() does for each
+    stage) costs a reference count. setStartupScript(), which the
+    download and install stages use, stores its changes in a small
+    overlay.
 */
 
 
+/* The parsed specification. parseJson() fills one in, and from then
+   on it's shared by all copies of the ServerSpec and never changes. */
+
+struct ServerSpec::Data
+{
+    Data();
+    ~Data();
+
+    void parse( JsonParser &, list<string> & );
+    void parseObject( JsonParser &, const string &, list<string> & );
+    void parseMember( JsonParser &, const string &, const string &,
+		      list<string> & );
+    void writeUnknown( Writer &, const string & ) const;
+
+    string coord;
+    string art;
+    string artKey;
+    string url;
+    string file;
+    string sum;
+    string startup;
+    string shutdown;
+    string purl;
+    int p;
+    int typical;
+    int peak;
+    int v;
+    int period;
+    int restarts;
+    int sig;
+    int warmLimit;
+    unsigned int id;
+    bool leak;
+    bool leased;
+    bool ok;
+    list<string> warm;
+    map<string,string> options;
+    map< string, list< pair<string,string> > > unknown;
+};
+
+
+/* What setStartupScript() changes for one stage, e.g. the download
+   or install script and its options. */
+
+struct ServerSpec::Overlay
+{
+    string script;
+    map<string,string> options;
+};
+
+
+ServerSpec::Data::Data()
+    : p( 0 ), typical( 0 ), peak( 0 ), v( 0 ), period( 0 ), restarts( 0 ),
+      sig( 0 ), warmLimit( 0 ), id( 0 ), leak( false ), leased( false ),
+      ok( false )
+{
+}
+
+
+ServerSpec::Data::~Data()
+{
+    if ( leased )
+	Port::release( p );
+}
+
+
 /*! This constructor is private; the only public way to make a
     ServerSpec is to call parseJson().
 */
 
 ServerSpec::ServerSpec()
 {
-    // nothing more needed
+    // all unparsed ServerSpecs share the same empty Data
+    static boost::shared_ptr<const Data> nothing( new Data );
+    d = nothing;
 }
 
 
-/*! Parses a json \a specification and sets up an object. If the parsing
-    failed, the object's coordinate() will be a null string afterwards.
+/*! Parses a json \a specification and sets up an object. If the
+    parsing failed, valid() returns false afterwards and error()
+    describes all the problems found.
 
-    \a init is needed in order to assign defaults that do not conflict
-    with any other Process \a init currently manages.
+    If \a service is true (the default) and the specification doesn't
+    name a port, a free one is leased from Port, and it stays
+    reserved for as long as any copy of the ServerSpec exists, i.e.
+    until the Process using it is gone. A named port is reserved
+    likewise. Prefetch passes false, since an artifact that's only
+    downloaded needs no port; port() is then -1 unless the
+    specification names one. The Init argument is no longer used.
 */
 
 ServerSpec ServerSpec::parseJson( const string & specification,
-				  Init & init )
+				  Init &, bool service )
 {
-    using boost::property_tree::ptree;
+    boost::shared_ptr<Data> data( new Data );
+    data->p = -1;
+
+    list<string> errors;
+    JsonParser j( specification );
+    data->parse( j, errors );
+    if ( !j.atEnd() ) {
+	errors.clear();
+	if ( !j.ok() )
+	    errors.push_back( "JSON syntax error: " + j.error() );
+	else
+	    errors.push_back( "JSON syntax error: Garbage after the object" );
+    }
 
-    ServerSpec s;
+    if ( errors.empty() ) {
+	if ( data->coord.empty() )
+	    errors.push_back( "Problem regarding coordinate" );
+	if ( data->art.empty() )
+	    errors.push_back( "Problem regarding artifact" );
+	if ( data->file.empty() )
+	    errors.push_back( "Problem regarding filename" );
+	if ( data->url.empty() )
+	    errors.push_back( "Problem regarding url" );
+	if ( data->p != -1 && ( data->p < 1 || data->p > 65535 ) )
+	    errors.push_back( "Port must be 1-65535" );
+	if ( data->sig < 0 || data->sig > 64 || data->sig == 9 )
+	    errors.push_back( "Pressure signal must be 1-64, and not 9" );
+    }
 
-    // parse
-    try {
-	istringstream i( specification );
-	read_json( i, s.pt );
-    } catch ( boost::property_tree::json_parser::json_parser_error e ) {
-	s.pt = ptree();
-	return s;
+    if ( errors.empty() && service ) {
+	if ( data->p == -1 ) {
+	    data->p = Port::lease( data->coord );
+	    data->leased = data->p > 0;
+	    if ( !data->leased )
+		errors.push_back( "No free port for " + data->coord );
+	} else {
+	    data->leased = Port::reserve( data->p );
+	}
     }
 
-    // add default settings. this is too much work, really.
-    try {
-	int p = s.pt.get<int>( "port" );
-    } catch ( ... ) {
-	set<int> used;
-
-	list<Process *> & pl = init.processes();
-	list<Process *>::iterator m( pl.begin() );
-	while ( m != pl.end() ) {
-	    used.insert( (*m)->spec().port() );
-	    ++m;
+    if ( !errors.empty() ) {
+	string e;
+	list<string>::iterator i( errors.begin() );
+	while ( i != errors.end() ) {
+	    if ( !e.empty() )
+		e += "; ";
+	    e += *i;
+	    ++i;
 	}
-	
-	s.pt.put( "port", Port::assignFree( used ) );
+	ServerSpec invalid;
+	invalid.setError( e );
+	return invalid;
     }
 
-    // verify validity and clear the object if necessary
-    if ( !s.valid() ) {
-	s.pt = ptree();
-	return s;
+    data->ok = true;
+    data->id = Recorder::id( data->coord );
+    ServerSpec s;
+    s.d = data;
+    return s;
+}
+
+
+/*! Reads an int into \a r from \a j, which may be a number or a
+    string containing one. Returns false if it's neither, or out of
+    range. The value is read in any case.
+*/
+
+static bool readInt( JsonParser & j, int & r )
+{
+    long long n = 0;
+    bool good = false;
+    if ( j.next() == JsonParser::Number ) {
+	good = j.number( n );
+    } else if ( j.next() == JsonParser::String ) {
+	string t;
+	j.text( t );
+	try {
+	    n = boost::lexical_cast<long long>( t );
+	    good = true;
+	} catch ( boost::bad_lexical_cast & ) {
+	}
+    } else {
+	j.skip();
     }
+    if ( !good || n < INT_MIN || n > INT_MAX )
+	return false;
+    r = n;
+    return true;
+}
 
-    // options are copied to a separate map, since I don't feel like
-    // experimenting to find out how to remove things from ptree.
 
-    ptree::const_assoc_iterator i;
+/*! Reads a string into \a r from \a j. Numbers and booleans are
+    accepted and read as their JSON text. Returns false if the value
+    is something else. The value is read in any case.
+*/
 
-    try {
-	ptree options = s.pt.get_child( "options" );
-	ptree::const_iterator i = options.begin();
-	while ( i != options.end() ) {
-	    s.o[i->first] = i->second.data();
-	    ++i;
+static bool readString( JsonParser & j, string & r )
+{
+    switch ( j.next() ) {
+    case JsonParser::String:
+	return j.text( r );
+    case JsonParser::Number:
+    case JsonParser::Boolean:
+	r = j.raw();
+	return true;
+    default:
+	j.skip();
+	return false;
+    }
+}
+
+
+/*! Reads a boolean into \a r from \a j, which may be true, false or
+    a string containing either (or 1 or 0). Returns false if it's
+    neither. The value is read in any case.
+*/
+
+static bool readBool( JsonParser & j, bool & r )
+{
+    if ( j.next() == JsonParser::Boolean )
+	return j.boolean( r );
+    string t;
+    if ( !readString( j, t ) )
+	return false;
+    if ( t == "true" || t == "1" )
+	r = true;
+    else if ( t == "false" || t == "0" )
+	r = false;
+    else
+	return false;
+    return true;
+}
+
+
+/*! Reads the entire specification from \a j, and adds a message to
+    \a errors for each member that's wrong.
+*/
+
+void ServerSpec::Data::parse( JsonParser & j, list<string> & errors )
+{
+    if ( !j.startObject() ) {
+	errors.push_back( "The specification must be a JSON object" );
+	return;
+    }
+    string name;
+    while ( j.member( name ) ) {
+	if ( name == "options" || name == "restart" ||
+	     name == "pressure" || name == "warmup" )
+	    parseObject( j, name, errors );
+	else
+	    parseMember( j, "", name, errors );
+    }
+}
+
+
+/*! Reads the object called \a name from \a j, adding a message to \a
+    errors for each member that's wrong.
+*/
+
+void ServerSpec::Data::parseObject( JsonParser & j, const string & name,
+			      list<string> & errors )
+{
+    if ( !j.startObject() ) {
+	j.skip();
+	errors.push_back( "Problem regarding " + name );
+	return;
+    }
+    string member;
+    while ( j.member( member ) )
+	parseMember( j, name, member, errors );
+}
+
+
+/*! Reads the value of the member \a name of the object \a parent
+    (empty for the top level) from \a j, and adds a message to \a
+    errors if it's wrong. Unknown members are kept for json().
+*/
+
+void ServerSpec::Data::parseMember( JsonParser & j,
+			      const string & parent, const string & name,
+			      list<string> & errors )
+{
+    string path = parent.empty() ? name : parent + "." + name;
+    bool good = true;
+    if ( parent == "options" ) {
+	good = readString( j, options[name] );
+    } else if ( path == "coordinate" ) {
+	good = readString( j, coord );
+    } else if ( path == "artifact" || path == "artefact" ) {
+	good = readString( j, art );
+	artKey = path;
+    } else if ( path == "filename" ) {
+	good = readString( j, file );
+    } else if ( path == "url" ) {
+	good = readString( j, url );
+    } else if ( path == "md5" ) {
+	good = readString( j, sum );
+    } else if ( path == "startupscript" ) {
+	good = readString( j, startup );
+    } else if ( path == "shutdownscript" ) {
+	good = readString( j, shutdown );
+    } else if ( path == "port" ) {
+	good = readInt( j, p );
+    } else if ( path == "expectedram" ) {
+	good = readInt( j, typical );
+    } else if ( path == "expectedpeakram" ) {
+	good = readInt( j, peak );
+    } else if ( path == "value" ) {
+	good = readInt( j, v );
+    } else if ( path == "restart.period" ) {
+	good = readInt( j, period );
+    } else if ( path == "restart.maxrestarts" ) {
+	good = readInt( j, restarts );
+    } else if ( path == "restart.leaking" ) {
+	good = readBool( j, leak );
+    } else if ( path == "pressure.signal" ) {
+	good = readInt( j, sig );
+    } else if ( path == "pressure.url" ) {
+	good = readString( j, purl );
+    } else if ( path == "warmup.limit" ) {
+	good = readInt( j, warmLimit ) && warmLimit >= 0;
+    } else if ( path == "warmup.files" ) {
+	warm.clear();
+	if ( j.startArray() ) {
+	    while ( j.element() ) {
+		string f;
+		if ( readString( j, f ) )
+		    warm.push_back( f );
+		else
+		    good = false;
+	    }
+	} else {
+	    j.skip();
+	    good = false;
 	}
-    } catch ( ... ) {
-	s.setError( "Error using supplied options" );
+    } else {
+	unknown[parent].push_back( make_pair( name, j.raw() ) );
     }
+    if ( !good )
+	errors.push_back( "Problem regarding " + path );
+}
 
-    return s;
+
+/*! Writes the unknown members of the object \a parent using \a w. */
+
+void ServerSpec::Data::writeUnknown( Writer & w,
+				     const string & parent ) const
+{
+    map< string, list< pair<string,string> > >::const_iterator
+	u( unknown.find( parent ) );
+    if ( u == unknown.end() )
+	return;
+    list< pair<string,string> >::const_iterator i( u->second.begin() );
+    while ( i != u->second.end() ) {
+	w.member( i->first );
+	w.raw( i->second );
+	++i;
+    }
 }
 
 
-/*! Returns a json object corresponding to this ServerSpec. If this
-    object is !valid(), then the return value is "{}".
+/*! Returns a json object corresponding to this ServerSpec, including
+    any members parseJson() didn't know. If this object is !valid(),
+    then the return value is an empty object.
 */
 
 string ServerSpec::json() const
 {
-    ostringstream os;
-    write_json( os, pt );
-    return os.str();
+    string r;
+    JsonWriter w( r );
+    write( w );
+    return r;
+}
+
+
+/*! Writes the object returned by json() using \a w. */
+
+void ServerSpec::write( Writer & w ) const
+{
+    w.startObject();
+    if ( !d->ok ) {
+	w.endObject();
+	return;
+    }
+
+    w.member( "coordinate" );
+    w.text( d->coord );
+    w.member( d->artKey.empty() ? "artifact" : d->artKey );
+    w.text( d->art );
+    w.member( "filename" );
+    w.text( d->file );
+    w.member( "url" );
+    w.text( d->url );
+    if ( !d->sum.empty() ) {
+	w.member( "md5" );
+	w.text( d->sum );
+    }
+    w.member( "port" );
+    w.number( d->p );
+    if ( d->typical ) {
+	w.member( "expectedram" );
+	w.number( d->typical );
+    }
+    if ( d->peak ) {
+	w.member( "expectedpeakram" );
+	w.number( d->peak );
+    }
+    if ( d->v ) {
+	w.member( "value" );
+	w.number( d->v );
+    }
+    if ( !startupScript().empty() ) {
+	w.member( "startupscript" );
+	w.text( startupScript() );
+    }
+    if ( !d->shutdown.empty() ) {
+	w.member( "shutdownscript" );
+	w.text( d->shutdown );
+    }
+
+    if ( !d->options.empty() ) {
+	w.member( "options" );
+	w.startObject();
+	map<string,string>::const_iterator i( d->options.begin() );
+	while ( i != d->options.end() ) {
+	    w.member( i->first );
+	    w.text( i->second );
+	    ++i;
+	}
+	w.endObject();
+    }
+
+    if ( d->period || d->restarts || d->leak ||
+	 d->unknown.count( "restart" ) ) {
+	w.member( "restart" );
+	w.startObject();
+	if ( d->period ) {
+	    w.member( "period" );
+	    w.number( d->period );
+	}
+	if ( d->restarts ) {
+	    w.member( "maxrestarts" );
+	    w.number( d->restarts );
+	}
+	if ( d->leak ) {
+	    w.member( "leaking" );
+	    w.boolean( true );
+	}
+	d->writeUnknown( w, "restart" );
+	w.endObject();
+    }
+
+    if ( d->sig || !d->purl.empty() || d->unknown.count( "pressure" ) ) {
+	w.member( "pressure" );
+	w.startObject();
+	if ( d->sig ) {
+	    w.member( "signal" );
+	    w.number( d->sig );
+	}
+	if ( !d->purl.empty() ) {
+	    w.member( "url" );
+	    w.text( d->purl );
+	}
+	d->writeUnknown( w, "pressure" );
+	w.endObject();
+    }
+
+    if ( !d->warm.empty() || d->warmLimit || d->unknown.count( "warmup" ) ) {
+	w.member( "warmup" );
+	w.startObject();
+	if ( !d->warm.empty() ) {
+	    w.member( "files" );
+	    w.startArray();
+	    list<string>::const_iterator f( d->warm.begin() );
+	    while ( f != d->warm.end() ) {
+		w.text( *f );
+		++f;
+	    }
+	    w.endArray();
+	}
+	if ( d->warmLimit ) {
+	    w.member( "limit" );
+	    w.number( d->warmLimit );
+	}
+	d->writeUnknown( w, "warmup" );
+	w.endObject();
+    }
+
+    d->writeUnknown( w, "" );
+    w.endObject();
 }
 
 
@@ -137,17 +564,27 @@ string ServerSpec::json() const
 
 string ServerSpec::coordinate() const
 {
-    return pt.get<string>( "coordinate" );
+    return d->coord;
+}
+
+
+/*! Returns the Recorder::id() of coordinate(), or 0 if the object is
+    not valid().
+*/
+
+unsigned int ServerSpec::coordinateId() const
+{
+    return d->id;
 }
 
 
 /*! Returns the port specified in JSON, or the random number picked at
-    read time was specified.
+    read time was specified. Returns 0 if the object is not valid().
 */
 
 int ServerSpec::port() const
 {
-    return pt.get<int>( "port" );
+    return d->p;
 }
 
 
@@ -157,7 +594,7 @@ int ServerSpec::port() const
 
 int ServerSpec::restartPeriod() const
 {
-    return pt.get<int>( "restart.period", 0 );
+    return d->period;
 }
 
 
@@ -168,7 +605,19 @@ int ServerSpec::restartPeriod() const
 
 int ServerSpec::maxRestarts() const
 {
-    return pt.get<int>( "restart.maxrestarts", 0 );
+    return d->restarts;
+}
+
+
+/*! Returns true if nodee may restart this service when it's on track
+    to exceed its expected peak memory, and false (the default) if
+    not. Such restarts happen when the host is quiet, and don't count
+    against maxRestarts().
+*/
+
+bool ServerSpec::restartWhenLeaking() const
+{
+    return d->leak;
 }
 
 
@@ -178,7 +627,7 @@ int ServerSpec::maxRestarts() const
 
 int ServerSpec::expectedTypicalMemory() const
 {
-    return pt.get<int>( "expectedram", 0 );
+    return d->typical;
 }
 
 
@@ -188,7 +637,7 @@ int ServerSpec::expectedTypicalMemory() const
 
 int ServerSpec::expectedPeakMemory() const
 {
-    return pt.get<int>( "expectedpeakram", 0 );
+    return d->peak;
 }
 
 
@@ -200,7 +649,7 @@ int ServerSpec::expectedPeakMemory() const
 
 int ServerSpec::value() const
 {
-    return pt.get<int>( "value", 0 );
+    return d->v;
 }
 
 
@@ -213,7 +662,9 @@ int ServerSpec::value() const
 
 string ServerSpec::startupScript() const
 {
-    return pt.get<string>( "startupscript", "" );
+    if ( overlay )
+	return overlay->script;
+    return d->startup;
 }
 
 
@@ -226,7 +677,7 @@ string ServerSpec::startupScript() const
 
 string ServerSpec::shutdownScript() const
 {
-    return pt.get<string>( "shutdownscript", "" );
+    return d->shutdown;
 }
 
 
@@ -236,11 +687,7 @@ string ServerSpec::shutdownScript() const
 
 string ServerSpec::artifact() const
 {
-    try {
-	return pt.get<string>( "artifact" );
-    } catch ( ... ) {
-	return pt.get<string>( "artefact" );
-    }
+    return d->art;
 }
 
 
@@ -250,7 +697,7 @@ string ServerSpec::artifact() const
 
 string ServerSpec::artifactUrl() const
 {
-    return pt.get<string>( "url" );
+    return d->url;
 }
 
 
@@ -260,7 +707,7 @@ string ServerSpec::artifactUrl() const
 
 string ServerSpec::artifactFilename() const
 {
-    return pt.get<string>( "filename" );
+    return d->file;
 }
 
 
@@ -275,7 +722,8 @@ void ServerSpec::setError( const string & error )
 
 
 /*! Returns whatever setError() set, or an empty string if setError()
-    has not been called.
+    has not been called. If parseJson() found several problems, this
+    lists all of them, separated by semicolons.
 */
 
 string ServerSpec::error() const
@@ -286,94 +734,31 @@ string ServerSpec::error() const
 
 /*! Returns true if the ServerSpec is valid and usable, and false if
     there is any kind of error, e.g. port being a string or artifact
-    not being supplied. Throws absolutely no exceptions.
+    not being supplied. parseJson() did all the checking, so this is
+    cheap.
 */
 
-bool ServerSpec::valid()
+bool ServerSpec::valid() const
 {
-    try {
-	(void)pt.get<int>( "expectedpeakram", 0 );
-    } catch ( ... ) {
-	setError( "Problem regarding expectedpeakram" );
-	return false;
-    }
-    try {
-	(void)pt.get<int>( "expectedram", 0 );
-    } catch ( ... ) {
-	setError( "Problem regarding expectedram" );
-	return false;
-    }
-    int p = 1;
-    try {
-	p = pt.get<int>( "port" );
-    } catch ( ... ) {
-	setError( "Problem regarding port" );
-	return false;
-    }
-    if ( p < 1 || p > 65535 ) {
-	setError( "Port must be 1-65535" );
-	return false;
-    }
-    try {
-	(void)pt.get<int>( "value", 0 );
-    } catch ( ... ) {
-	setError( "Problem regarding value" );
-	return false;
-    }
-    try {
-	(void)pt.get<string>( "artifact" );
-    } catch ( ... ) {
-	try {
-	    (void)pt.get<string>( "artefact" );
-	} catch ( ... ) {
-	    setError( "Problem regarding artifact" );
-	    return false;
-	}
-    }
-    try {
-	(void)pt.get<string>( "coordinate" );
-    } catch ( ... ) {
-	setError( "Problem regarding coordinate" );
-	return false;
-    }
-    try {
-	(void)pt.get<string>( "filename" );
-    } catch ( ... ) {
-	setError( "Problem regarding filename" );
-	return false;
-    }
-    try {
-	(void)pt.get<string>( "shutdownscript", "" );
-    } catch ( ... ) {
-	setError( "Problem regarding " );
-	return false;
-    }
-    try {
-	(void)pt.get<string>( "startupscript", "" );
-    } catch ( ... ) {
-	setError( "Problem regarding " );
-	return false;
-    }
-    try {
-	(void)pt.get<string>( "url" );
-    } catch ( ... ) {
-	setError( "Problem regarding url" );
-	return false;
-    }
-
-    return true;
+    return d->ok;
 }
 
 
-/*! Writes \a s as startupscript on the ServerSpec. No sanity checking
-    is performed.
+/*! Makes this ServerSpec use \a script with \a options as startup
+    script, instead of what the JSON specified. No sanity checking is
+    performed.
+
+    The change affects only this ServerSpec and copies made from it
+    later. The rest of the specification remains shared.
 */
 
 void ServerSpec::setStartupScript( const string & script,
 				   const map<string,string> & options )
 {
-    pt.put( "startupscript", script );
-    o = options;
+    Overlay * o = new Overlay;
+    o->script = script;
+    o->options = options;
+    overlay.reset( o );
 }
 
 
@@ -384,25 +769,65 @@ void ServerSpec::setStartupScript( const string & script,
     and options cannot be repeated. OK.
 */
 
-map<string,string> ServerSpec::startupOptions()
+const map<string,string> & ServerSpec::startupOptions() const
+{
+    if ( overlay )
+	return overlay->options;
+    return d->options;
+}
+
+
+/*! Returns the MD5 sum specified, or an empty string if none is
+    specified.
+*/
+
+string ServerSpec::md5() const
 {
-    return o;
+    return d->sum;
 }
 
 
-/*! Constructs an deep copy of \a other. */
+/*! Returns the signal the service wants when the host is short of
+    memory, or 0 if it doesn't want any. A service that receives this
+    signal should drop caches and generally shrink, so ChoreKeeper
+    doesn't have to kill anything.
+*/
 
-ServerSpec::ServerSpec( const ServerSpec & other )
-    : pt( other.pt ), o( other.o ), e( other.e )
+int ServerSpec::pressureSignal() const
 {
+    return d->sig;
 }
 
 
-/*! Returns the MD5 sum specified, or an empty string if none is
-    specified.
+/*! Returns the URL nodee should POST to when the host is short of
+    memory, or an empty string if none is specified. Same purpose as
+    pressureSignal().
 */
 
-string ServerSpec::md5() const
+string ServerSpec::pressureUrl() const
+{
+    return d->purl;
+}
+
+
+/*! Returns the shell patterns for the files the service reads as
+    it starts, relative to its root, e.g. lib/id-*.jar. Warmup reads
+    these into the page cache before the service starts. The list is
+    empty if none are specified.
+*/
+
+list<string> ServerSpec::warmupFiles() const
+{
+    return d->warm;
+}
+
+
+/*! Returns the size in kilobytes up to which Warmup reads all of the
+    service's files, whether warmupFiles() names them or not, or 0 if
+    none is specified.
+*/
+
+int ServerSpec::warmupLimit() const
 {
-    return pt.get<string>( "md5", "" );
+    return d->warmLimit;
 }
@@ -3,12 +3,11 @@
 #ifndef SERVERSPEC_H
 #define SERVERSPEC_H
 
+#include <list>
 #include <map>
 #include <string>
 
-#include <boost/property_tree/ptree.hpp>
-
-
+#include <boost/shared_ptr.hpp>
 
 using namespace std;
 
@@ -17,12 +16,14 @@ class ServerSpec
 {
 public:
     ServerSpec();
-    ServerSpec( const ServerSpec & );
 
-    static ServerSpec parseJson( const string &, class Init & );
+    static ServerSpec parseJson( const string &, class Init &,
+				 bool = true );
     string json() const;
+    void write( class Writer & ) const;
 
     string coordinate() const;
+    unsigned int coordinateId() const;
     string artifact() const;
     string artifactUrl() const;
     string artifactFilename() const;
@@ -32,23 +33,33 @@ public:
     int value() const;
     int restartPeriod() const;
     int maxRestarts() const;
+    bool restartWhenLeaking() const;
     string md5() const;
 
+    int pressureSignal() const;
+    string pressureUrl() const;
+
+    list<string> warmupFiles() const;
+    int warmupLimit() const;
+
     void setStartupScript( const string &, const map<string,string> & );
 
     string startupScript() const;
     string shutdownScript() const;
 
-    map<string,string> startupOptions();
+    const map<string,string> & startupOptions() const;
 
-    bool valid();
+    bool valid() const;
 
     void setError( const string & );
     string error() const;
 
 private:
-    ::boost::property_tree::ptree pt;
-    map<string,string> o;
+    struct Data;
+    struct Overlay;
+
+    boost::shared_ptr<const Data> d;
+    boost::shared_ptr<const Overlay> overlay;
     string e;
 };
 
@@ -4,6 +4,8 @@
 
 #include "serverspec.h"
 #include "process.h"
+#include "download.h"
+#include "json.h"
 
 #include <stdio.h>
 
@@ -11,11 +13,6 @@
 
 #include <list>
 
-#include <boost/property_tree/ptree.hpp>
-#include <boost/property_tree/json_parser.hpp>
-#include <boost/lexical_cast.hpp>
-
-using boost::property_tree::ptree;
 
 // for some reason, using the type directly instead of via the hack
 // typedef bothers the compiler. I see nothing wrong. the expression
@@ -40,39 +37,83 @@ typedef list<Process *> hack;
 
 std::string Service::list( Init & init )
 {
-    ostringstream os;
+    string r;
+    JsonWriter w( r );
+    list( init, w );
+    return r;
+}
+
 
-    ptree pt;
+/*! Writes an object describing the processes managed by \a init
+    using \a w. The processes are keyed by pid.
+
+    The output is sized for a typical service up front, so that a
+    list of hundreds of services costs only a few allocations.
+*/
 
+void Service::list( Init & init, Writer & w )
+{
     hack & pl = init.processes(); // compiler protest at this line
     hack::iterator m( pl.begin() );
 
+    w.reserve( 64 + 256 * pl.size() );
+    w.startObject();
+    w.member( "services" );
+    w.startObject();
 
+    char pid[16];
     while ( m != pl.end() ) {
-	string prefix = "services." +
-			boost::lexical_cast<string>( (*m)->pid() );
-	try {
-	    pt.put( prefix + ".coordinate", (*m)->spec().coordinate() );
-	} catch ( ... ) {
-	    // if no coordinate is specified, we just don't emit any
+	::snprintf( pid, sizeof( pid ), "%d", (*m)->pid() );
+	w.member( pid );
+	w.startObject();
+	// helpers and the unit tests' processes may lack these
+	if ( !(*m)->spec().coordinate().empty() ) {
+	    w.member( "coordinate" );
+	    w.text( (*m)->spec().coordinate() );
+	}
+	if ( (*m)->spec().port() ) {
+	    w.member( "port" );
+	    w.number( (*m)->spec().port() );
+	}
+	if ( !(*m)->spec().artifact().empty() ) {
+	    w.member( "artifact" );
+	    w.text( (*m)->spec().artifact() );
 	}
-	try {
-	    pt.put( prefix + ".port", (*m)->spec().port() );
-	} catch ( ... ) {
-	    // ditto port
+	w.member( "value" );
+	w.number( (*m)->spec().value() );
+	w.member( "rss" );
+	w.number( (*m)->currentRss() );
+	w.member( "recentfaults" );
+	w.number( (*m)->recentPageFaults() );
+	w.member( "cpu" );
+	w.number( (*m)->cpuUsage() );
+	w.member( "io" );
+	w.number( (*m)->ioRate() );
+	if ( (*m)->throttled() ) {
+	    w.member( "throttled" );
+	    w.boolean( true );
 	}
-	try {
-	    pt.put( prefix + ".artifact", (*m)->spec().artifact() );
-	} catch ( ... ) {
-	    // not emitting artifact is a bit shady, though
+	Download * d = dynamic_cast<Download *>( *m );
+	if ( d ) {
+	    w.member( "downloaded" );
+	    w.number( d->received() );
+	    w.member( "size" );
+	    w.number( d->size() );
 	}
-	pt.put( prefix + ".value", (*m)->spec().value() );
-	pt.put( prefix + ".rss", (*m)->currentRss() );
-	pt.put( prefix + ".recentfaults", (*m)->recentPageFaults() );
+	if ( (*m)->leaking() ) {
+	    w.member( "leaking" );
+	    w.boolean( true );
+	    w.member( "rsstrend" );
+	    w.number( (*m)->rssTrend() );
+	    w.member( "faulttrend" );
+	    w.number( (*m)->faultTrend() );
+	    w.member( "secondsuntilpeak" );
+	    w.number( (*m)->secondsUntilPeak() );
+	}
+	w.endObject();
 	++m;
     }
 
-    write_json( os, pt );
-
-    return os.str();
+    w.endObject();
+    w.endObject();
 }
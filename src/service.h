@@ -13,6 +13,7 @@ class Service
 {
 public:
     static string list( Init & );
+    static void list( Init &, class Writer & );
 };
 
 #endif
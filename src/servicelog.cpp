@@ -0,0 +1,456 @@
+// Copyright Arnt Gulbrandsen <arnt@gulbrandsen.priv.no>; BSD-licensed.
+
+#include "servicelog.h"
+
+#include "conf.h"
+#include "metrics.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <list>
+#include <map>
+#include <vector>
+
+#include <boost/lexical_cast.hpp>
+#include <boost/thread.hpp>
+
+
+// one log file, written to by one or more pipes. the drainer thread
+// adds to backlog, the writer thread takes it and owns fd and size.
+struct Sink {
+    Sink( const string & p )
+	: path( p ), fd( -1 ), size( 0 ), sources( 0 ), done( false ) {}
+
+    string path;
+    int fd;
+    long long size;
+    int sources;
+    string backlog;
+    bool done;
+};
+
+
+// one pipe, and the part of a line read from it so far
+struct Source {
+    Source(): sink( 0 ) {}
+
+    Sink * sink;
+    string partial;
+};
+
+
+static boost::mutex mutex;
+static list< pair<int,string> > pending;
+static int wake[2] = { -1, -1 };
+
+// these are used only by the drainer thread
+static map<string,Sink*> sinks;
+static map<int,Source> sources;
+
+// this hands the backlogs from the drainer to the writer
+static boost::mutex backlogs;
+static boost::condition_variable written;
+static list<Sink*> active;
+static bool dirty = false;
+
+
+/*! \class ServiceLog servicelog.h
+
+  The ServiceLog class captures the stdout and stderr of each
+  service into a log file of its own, instead of letting them
+  inherit nodee's.
+
+  Process::fork() gives the service a pipe and hands the reading end
+  to capture(). One thread, started by the first capture(), polls
+  all the pipes and queues each complete line for the service's log
+  file, typically console.log in Process::root(). Another thread
+  writes the queued lines to disk. Lines longer than LongestLine are
+  split.
+
+  When a log file would grow past Conf::servicelogsize kilobytes, it
+  is renamed to console.log.1 and a new one started, and so on;
+  Rotations old files are kept.
+
+  The draining thread never touches the disk, so it always empties
+  the pipes and a service never blocks on its stdout. If the disk
+  can't keep up and a log file has Backlog bytes queued, further
+  lines are dropped and counted, as are lines that cannot be
+  written, e.g. because the disk is full.
+
+  A ServiceLog object reads one log file: tail() returns its end, and
+  more() what's been written since, so HttpServer can show and
+  follow a log.
+
+  The log files live in the service's root, where the service can
+  replace them. Since nodee usually runs as root, neither side
+  follows symbolic links, and both ignore files that nodee didn't
+  create or that have other names (see owned()). The writer deletes
+  such a file and starts a new one.
+*/
+
+
+/*! Returns true if \a fd is a regular file that belongs to nodee and
+    has only one name, i.e. one that the service cannot have put in
+    place of its log file.
+*/
+
+static bool owned( int fd )
+{
+    struct stat st;
+    return fd >= 0 && ::fstat( fd, &st ) == 0 && S_ISREG( st.st_mode ) &&
+	st.st_uid == ::geteuid() && st.st_nlink == 1;
+}
+
+
+/*! Opens the log file \a path for reading as ServiceLog does, or
+    returns -1.
+*/
+
+static int openLog( const string & path )
+{
+    int fd = ::open( path.c_str(),
+		     O_RDONLY | O_NOFOLLOW | O_NONBLOCK | O_CLOEXEC );
+    if ( fd >= 0 && !owned( fd ) ) {
+	::close( fd );
+	fd = -1;
+    }
+    return fd;
+}
+
+
+/*! Writes \a n bytes at \a data to \a sink, rotating first if the
+    file would become too large. Counts the lines that cannot be
+    written. Called only by the writer thread.
+*/
+
+static void append( Sink * sink, const char * data, int n )
+{
+    long long limit = Conf::servicelogsize * 1024LL;
+    if ( sink->fd >= 0 && limit > 0 && sink->size > 0 &&
+	 sink->size + n > limit ) {
+	::close( sink->fd );
+	sink->fd = -1;
+	int i = ServiceLog::Rotations;
+	while ( i > 0 ) {
+	    string from = sink->path;
+	    if ( i > 1 )
+		from += "." + boost::lexical_cast<string>( i - 1 );
+	    string to = sink->path + "." + boost::lexical_cast<string>( i );
+	    ::rename( from.c_str(), to.c_str() );
+	    i--;
+	}
+    }
+
+    if ( sink->fd < 0 ) {
+	const char * path = sink->path.c_str();
+	sink->fd = ::open( path, O_WRONLY | O_CREAT | O_APPEND |
+			   O_NOFOLLOW | O_NONBLOCK | O_CLOEXEC, 0644 );
+	if ( !owned( sink->fd ) &&
+	     ( sink->fd >= 0 || errno == ELOOP || errno == ENXIO ) ) {
+	    if ( sink->fd >= 0 )
+		::close( sink->fd );
+	    ::unlink( path );
+	    sink->fd = ::open( path, O_WRONLY | O_CREAT | O_EXCL | O_APPEND |
+			       O_NOFOLLOW | O_CLOEXEC, 0644 );
+	}
+	struct stat st;
+	if ( sink->fd >= 0 && ::fstat( sink->fd, &st ) == 0 )
+	    sink->size = st.st_size;
+	else
+	    sink->size = 0;
+    }
+
+    int done = 0;
+    while ( sink->fd >= 0 && done < n ) {
+	int r = ::write( sink->fd, data + done, n - done );
+	if ( r > 0 )
+	    done += r;
+	else if ( r < 0 && errno != EINTR )
+	    break;
+    }
+    sink->size += done;
+    if ( done < n )
+	Metrics::add( Metrics::ServiceLogDrops,
+		      std::count( data + done, data + n, '\n' ) );
+}
+
+
+/*! Queues the \a n bytes (whole lines) at \a data for \a sink, or
+    drops and counts them if its backlog is full. Never blocks on the
+    disk.
+*/
+
+static void queue( Sink * sink, const char * data, int n )
+{
+    boost::lock_guard<boost::mutex> lock( backlogs );
+    if ( sink->backlog.size() + n > ServiceLog::Backlog ) {
+	Metrics::add( Metrics::ServiceLogDrops,
+		      std::count( data, data + n, '\n' ) );
+	return;
+    }
+    sink->backlog.append( data, n );
+    dirty = true;
+    written.notify_one();
+}
+
+
+/*! Adds \a n bytes at \a data to what's been read from \a source,
+    and queues all complete lines. If \a eof is true, the source is
+    done, and any incomplete last line is queued too.
+*/
+
+static void take( Source & source, const char * data, int n, bool eof )
+{
+    source.partial.append( data, n );
+    size_t end = source.partial.rfind( '\n' );
+    if ( end != string::npos ) {
+	queue( source.sink, source.partial.data(), end + 1 );
+	source.partial.erase( 0, end + 1 );
+    }
+    while ( source.partial.size() > ServiceLog::LongestLine ) {
+	string line = source.partial.substr( 0, ServiceLog::LongestLine );
+	line += '\n';
+	queue( source.sink, line.data(), line.size() );
+	source.partial.erase( 0, ServiceLog::LongestLine );
+    }
+    if ( eof && !source.partial.empty() ) {
+	source.partial += '\n';
+	queue( source.sink, source.partial.data(), source.partial.size() );
+	source.partial.erase();
+    }
+}
+
+
+/*! Starts capturing the pipe \a fd into the log file \a path. \a fd
+    is closed when the service (and any child that inherited the
+    pipe) closes it. Several pipes may write to the same \a path, for
+    instance when a service restarts.
+*/
+
+void ServiceLog::capture( int fd, const string & path )
+{
+    // a large pipe gives the thread more leeway; the default is
+    // only 64k on Linux
+    (void)::fcntl( fd, F_SETPIPE_SZ, 1024 * 1024 );
+    (void)::fcntl( fd, F_SETFL, ::fcntl( fd, F_GETFL ) | O_NONBLOCK );
+
+    boost::lock_guard<boost::mutex> lock( mutex );
+    pending.push_back( make_pair( fd, path ) );
+    if ( wake[0] < 0 ) {
+	if ( ::pipe2( wake, O_CLOEXEC | O_NONBLOCK ) < 0 ) {
+	    wake[0] = -1;
+	    return;
+	}
+	boost::thread t( run );
+	boost::thread w( write );
+    } else {
+	(void)::write( wake[1], "", 1 );
+    }
+}
+
+
+/*! Drains the pipes forever. */
+
+void ServiceLog::run()
+{
+    vector<struct pollfd> fds;
+    char buffer[65536];
+    while ( true ) {
+	{
+	    boost::lock_guard<boost::mutex> lock( mutex );
+	    while ( !pending.empty() ) {
+		Sink * & sink = sinks[pending.front().second];
+		if ( !sink ) {
+		    sink = new Sink( pending.front().second );
+		    boost::lock_guard<boost::mutex> l( backlogs );
+		    active.push_back( sink );
+		}
+		sink->sources++;
+		sources[pending.front().first].sink = sink;
+		pending.pop_front();
+	    }
+	}
+
+	fds.clear();
+	struct pollfd p;
+	p.fd = wake[0];
+	p.events = POLLIN;
+	p.revents = 0;
+	fds.push_back( p );
+	map<int,Source>::iterator s( sources.begin() );
+	while ( s != sources.end() ) {
+	    p.fd = s->first;
+	    fds.push_back( p );
+	    ++s;
+	}
+
+	if ( ::poll( &fds[0], fds.size(), -1 ) < 0 )
+	    continue;
+
+	if ( fds[0].revents )
+	    while ( ::read( wake[0], buffer, sizeof( buffer ) ) > 0 )
+		;
+
+	unsigned int i = 1;
+	while ( i < fds.size() ) {
+	    if ( fds[i].revents ) {
+		int fd = fds[i].fd;
+		Source & source = sources[fd];
+		int n = ::read( fd, buffer, sizeof( buffer ) );
+		if ( n > 0 ) {
+		    take( source, buffer, n, false );
+		} else if ( n == 0 ||
+			    ( errno != EAGAIN && errno != EINTR ) ) {
+		    take( source, buffer, 0, true );
+		    ::close( fd );
+		    Sink * sink = source.sink;
+		    sources.erase( fd );
+		    if ( --sink->sources == 0 ) {
+			// the writer closes and deletes it
+			sinks.erase( sink->path );
+			boost::lock_guard<boost::mutex> l( backlogs );
+			sink->done = true;
+			dirty = true;
+			written.notify_one();
+		    }
+		}
+	    }
+	    i++;
+	}
+    }
+}
+
+
+/*! Writes the queued lines to disk forever, and closes the log
+    files that no pipe writes to any more.
+*/
+
+void ServiceLog::write()
+{
+    while ( true ) {
+	list< pair<Sink*,string> > work;
+	list<Sink*> finished;
+	{
+	    boost::unique_lock<boost::mutex> lock( backlogs );
+	    while ( !dirty )
+		written.wait( lock );
+	    dirty = false;
+	    list<Sink*>::iterator i( active.begin() );
+	    while ( i != active.end() ) {
+		Sink * sink = *i;
+		if ( !sink->backlog.empty() ) {
+		    work.push_back( make_pair( sink, string() ) );
+		    work.back().second.swap( sink->backlog );
+		}
+		if ( sink->done ) {
+		    finished.push_back( sink );
+		    i = active.erase( i );
+		} else {
+		    ++i;
+		}
+	    }
+	}
+
+	list< pair<Sink*,string> >::iterator w( work.begin() );
+	while ( w != work.end() ) {
+	    append( w->first, w->second.data(), w->second.size() );
+	    ++w;
+	}
+
+	list<Sink*>::iterator f( finished.begin() );
+	while ( f != finished.end() ) {
+	    if ( (*f)->fd >= 0 )
+		::close( (*f)->fd );
+	    delete *f;
+	    ++f;
+	}
+    }
+}
+
+
+/*! Constructs a ServiceLog to read the log file \a name. */
+
+ServiceLog::ServiceLog( const string & name )
+    : path( name ), fd( -1 ), offset( 0 )
+{
+}
+
+
+/*! Closes the log file, if open. */
+
+ServiceLog::~ServiceLog()
+{
+    if ( fd >= 0 )
+	::close( fd );
+}
+
+
+/*! Returns the last \a bytes or fewer of the log file, starting at
+    the beginning of a line if possible, and positions more() after
+    that. Returns an empty string if there is no such file.
+*/
+
+string ServiceLog::tail( int bytes )
+{
+    string r;
+    if ( fd < 0 )
+	fd = openLog( path );
+    struct stat st;
+    if ( fd < 0 || ::fstat( fd, &st ) < 0 )
+	return r;
+
+    off_t start = st.st_size > bytes ? st.st_size - bytes : 0;
+    r.resize( st.st_size - start );
+    int n = r.empty() ? 0 : ::pread( fd, &r[0], r.size(), start );
+    r.resize( n > 0 ? n : 0 );
+    offset = start + r.size();
+    if ( start > 0 ) {
+	size_t nl = r.find( '\n' );
+	if ( nl != string::npos && nl + 1 < r.size() )
+	    r.erase( 0, nl + 1 );
+    }
+    return r;
+}
+
+
+/*! Returns whatever has been written to the log since tail() or the
+    last call to more(). If the log has been rotated meanwhile, this
+    returns the rest of the old file followed by the new one.
+*/
+
+string ServiceLog::more()
+{
+    string r;
+    int rounds = 0;
+    while ( rounds++ < 2 ) {
+	if ( fd < 0 ) {
+	    fd = openLog( path );
+	    offset = 0;
+	    if ( fd < 0 )
+		return r;
+	}
+
+	char buffer[65536];
+	int n;
+	while ( ( n = ::pread( fd, buffer, sizeof( buffer ), offset ) ) > 0 ) {
+	    r.append( buffer, n );
+	    offset += n;
+	}
+
+	struct stat now;
+	struct stat current;
+	if ( ::lstat( path.c_str(), &now ) == 0 &&
+	     ::fstat( fd, &current ) == 0 &&
+	     now.st_ino == current.st_ino && now.st_dev == current.st_dev )
+	    return r;
+	::close( fd );
+	fd = -1;
+    }
+    return r;
+}
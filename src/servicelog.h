@@ -0,0 +1,39 @@
+// Copyright Arnt Gulbrandsen <arnt@gulbrandsen.priv.no>; BSD-licensed.
+
+#ifndef SERVICELOG_H
+#define SERVICELOG_H
+
+#include <string>
+
+#include <sys/types.h>
+
+using namespace std;
+
+
+class ServiceLog
+{
+public:
+    ServiceLog( const string & );
+    ~ServiceLog();
+
+    string tail( int );
+    string more();
+
+    static void capture( int, const string & );
+
+    enum { Rotations = 2, LongestLine = 4096, Backlog = 4 * 1024 * 1024 };
+
+private:
+    static void run();
+    static void write();
+
+    ServiceLog( const ServiceLog & );
+    void operator=( const ServiceLog & );
+
+    string path;
+    int fd;
+    off_t offset;
+};
+
+
+#endif
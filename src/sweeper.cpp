@@ -0,0 +1,309 @@
+// Copyright Arnt Gulbrandsen <arnt@gulbrandsen.priv.no>; BSD-licensed.
+
+#include "sweeper.h"
+
+#include "log.h"
+#include "conf.h"
+#include "metrics.h"
+#include "artifact.h"
+#include "mount.h"
+#include "uid.h"
+#include "kernel.h"
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+#include <sys/syscall.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sched.h>
+
+#include <fstream>
+
+#include <boost/thread.hpp>
+#include <boost/filesystem.hpp>
+#include <boost/lexical_cast.hpp>
+
+
+/*! \class Sweeper sweeper.h
+
+    The Sweeper class deletes what nodee no longer needs, so that the
+    disk doesn't fill up and make launches fail. It runs in a thread
+    of its own at idle CPU and I/O priority, and sweeps once per
+    Interval seconds.
+
+    Each sweep evicts the least recently used artifacts until the
+    store fits in Conf::diskbudget megabytes and the disk is less than
+    95% full (see Artifact::evict()). Artifacts used by any Process
+    Init manages are kept. Then it deletes the working directories of
+    services that have been gone for Conf::workexpiry minutes, and the
+    shared software trees whose artifact is gone and which no managed
+    Process uses. Artifacts that are filesystem images are mounted
+    rather than unpacked (see Mount), and Sweeper unmounts those once
+    no managed Process has used them for Interval seconds. Finally,
+    it tells IdPool to reread /proc.
+
+    Download also evicts artifacts if there isn't room for the file
+    it's about to fetch, so a launch needn't wait for the next sweep.
+*/
+
+
+/*! Constructs a Sweeper for the processes managed by \a i, and
+    starts its thread.
+*/
+
+Sweeper::Sweeper( Init & i )
+    : init( i )
+{
+    boost::thread t( *this );
+}
+
+
+/*! Does all there is to do. */
+
+void Sweeper::operator()()
+{
+    start();
+}
+
+
+/*! Sets this thread's CPU and I/O priority to idle if \a idle is
+    true, and to normal if not.
+*/
+
+static void prioritise( bool idle )
+{
+    struct sched_param sp;
+    sp.sched_priority = 0;
+    (void)::sched_setscheduler( 0, idle ? SCHED_IDLE : SCHED_OTHER, &sp );
+    (void)::syscall( SYS_ioprio_set, IoprioWhoProcess, 0,
+		     idle ? IoprioClassIdle << IoprioClassShift : 0 );
+}
+
+
+/*! Lowers this thread's priority and sweeps forever. */
+
+void Sweeper::start()
+{
+    prioritise( true );
+
+    while ( true ) {
+	sweep();
+	::sleep( Interval );
+    }
+}
+
+
+/*! Sweeps once.
+
+    Init may delete Processes meanwhile, so this notes what they use
+    while holding Init::lock(). Evicting holds the artifact index's
+    lock, which use() and release() need in Init's thread, so that's
+    done at normal priority.
+*/
+
+void Sweeper::sweep()
+{
+    string artifacts = Artifact::directory();
+    set<string> files = init.artifactFiles();
+    set<string> roots;
+    set<string> trees;
+    {
+	boost::lock_guard<boost::mutex> lock( Init::lock() );
+	list<Process *> & pl = init.processes();
+	list<Process *>::iterator m( pl.begin() );
+	while ( m != pl.end() ) {
+	    try {
+		roots.insert( (*m)->root() );
+		trees.insert( (*m)->software() );
+	    } catch ( ... ) {
+		// a Process without a complete ServerSpec uses nothing
+	    }
+	    ++m;
+	}
+    }
+
+    prioritise( false );
+    long long freed = Artifact::evict( artifacts,
+				       Conf::diskbudget * 1024LL * 1024,
+				       0, files );
+    prioritise( true );
+    if ( freed ) {
+	Metrics::add( Metrics::EvictedBytes, freed );
+	debug << "nodee: Evicted " << freed
+	      << " bytes of artifacts" << endl;
+    }
+
+    expireWork( roots );
+    unmountImages( trees );
+
+    // the software trees record which blob they came from
+    set<string> sources;
+    boost::system::error_code ec;
+    boost::filesystem::directory_iterator b( artifacts + "/sha256", ec );
+    while ( !ec && b != boost::filesystem::directory_iterator() ) {
+	struct stat st;
+	if ( ::stat( b->path().string().c_str(), &st ) == 0 )
+	    sources.insert( boost::lexical_cast<string>( st.st_dev ) + ":" +
+			    boost::lexical_cast<string>( st.st_ino ) );
+	b.increment( ec );
+    }
+    expireSoftware( Conf::basedir + "/" + Conf::softwaredir,
+		    trees, sources, 0 );
+
+    // only root runs services as other users
+    if ( !::getuid() ) {
+	IdPool::uids().reconcile();
+	IdPool::gids().reconcile();
+    }
+}
+
+
+/*! Deletes the service roots in the work directory that aren't in
+    \a roots and haven't been for Conf::workexpiry minutes. Roots
+    that haven't been seen in use since nodee started are judged by
+    their modification time.
+*/
+
+void Sweeper::expireWork( const set<string> & roots )
+{
+    time_t now = ::time( 0 );
+    boost::system::error_code ec;
+    boost::filesystem::directory_iterator
+	i( Conf::basedir + "/" + Conf::workdir, ec );
+    while ( !ec && i != boost::filesystem::directory_iterator() ) {
+	string root = i->path().string();
+	i.increment( ec );
+
+	if ( roots.count( root ) ) {
+	    lastSeen[root] = now;
+	    continue;
+	}
+	time_t seen = 0;
+	if ( lastSeen.count( root ) ) {
+	    seen = lastSeen[root];
+	} else {
+	    struct stat st;
+	    if ( ::lstat( root.c_str(), &st ) < 0 || !S_ISDIR( st.st_mode ) )
+		continue;
+	    seen = st.st_mtime;
+	}
+	if ( now - seen < Conf::workexpiry * 60 )
+	    continue;
+
+	boost::system::error_code ignored;
+	boost::filesystem::remove_all( root, ignored );
+	lastSeen.erase( root );
+	Metrics::add( Metrics::ExpiredDirectories );
+	debug << "nodee: Deleted the unused work directory " << root << endl;
+    }
+}
+
+
+/*! Unmounts the images mounted in the software directory that
+    aren't in \a trees and haven't been for Interval seconds.
+*/
+
+void Sweeper::unmountImages( const set<string> & trees )
+{
+    time_t now = ::time( 0 );
+    list<string> mounts = Mount::below( Conf::basedir + "/" +
+					Conf::softwaredir,
+					"/proc/self/mountinfo" );
+    list<string>::iterator i( mounts.begin() );
+    while ( i != mounts.end() ) {
+	string tree = *i;
+	++i;
+	if ( trees.count( tree ) || !lastSeen.count( tree ) ) {
+	    lastSeen[tree] = now;
+	    continue;
+	}
+	if ( now - lastSeen[tree] < Interval )
+	    continue;
+
+	int fd = ::open( ( tree + ".lock" ).c_str(), O_RDWR );
+	if ( fd >= 0 && ::flock( fd, LOCK_EX | LOCK_NB ) < 0 ) {
+	    ::close( fd );
+	    continue;
+	}
+	if ( Mount::unmount( tree ) ) {
+	    ::unlink( ( tree + ".image" ).c_str() );
+	    ::rmdir( tree.c_str() );
+	    lastSeen.erase( tree );
+	    debug << "nodee: Unmounted the unused image on " << tree << endl;
+	} else {
+	    // perhaps a FUSE mount; Init has to reap fusermount. if
+	    // it fails, the next sweep sees the mount and tries again
+	    // after Interval.
+	    Unmounter * u = new Unmounter( tree );
+	    init.manage( u );
+	    u->fork();
+	    lastSeen.erase( tree );
+	}
+	if ( fd >= 0 )
+	    ::close( fd );
+    }
+}
+
+
+/*! Deletes the software trees below \a dir that aren't in \a trees
+    and whose .nodee-source isn't in \a sources, i.e. whose artifact
+    has been evicted. Also deletes directories left behind by
+    unpacking that was interrupted. \a depth is used to limit
+    recursion.
+*/
+
+void Sweeper::expireSoftware( const string & dir, const set<string> & trees,
+			      const set<string> & sources, int depth )
+{
+    if ( depth > 8 )
+	return;
+    time_t now = ::time( 0 );
+    boost::system::error_code ec;
+    boost::filesystem::directory_iterator i( dir, ec );
+    while ( !ec && i != boost::filesystem::directory_iterator() ) {
+	string tree = i->path().string();
+	string name = i->path().filename().string();
+	i.increment( ec );
+
+	struct stat st;
+	if ( ::lstat( tree.c_str(), &st ) < 0 || !S_ISDIR( st.st_mode ) ||
+	     Mount::mounted( tree ) )
+	    continue;
+
+	bool leftover = name.find( ".tmp." ) != string::npos ||
+			name.find( ".old." ) != string::npos;
+	string source;
+	std::ifstream marker( ( tree + "/.nodee-source" ).c_str() );
+	std::getline( marker, source );
+	if ( !leftover && source.empty() ) {
+	    expireSoftware( tree, trees, sources, depth + 1 );
+	    continue;
+	}
+	if ( trees.count( tree ) ||
+	     ( leftover && now - st.st_mtime < Conf::workexpiry * 60 ) ||
+	     ( !leftover && sources.count( source ) ) )
+	    continue;
+
+	// the install script and Download hold this lock while
+	// they replace the tree
+	string base = tree;
+	if ( leftover ) {
+	    string::size_type suffix = name.rfind( ".tmp." );
+	    if ( suffix == string::npos )
+		suffix = name.rfind( ".old." );
+	    base = dir + "/" + name.substr( 0, suffix );
+	}
+	int fd = ::open( ( base + ".lock" ).c_str(), O_RDWR );
+	if ( fd >= 0 && ::flock( fd, LOCK_EX | LOCK_NB ) < 0 ) {
+	    ::close( fd );
+	    continue;
+	}
+	boost::system::error_code ignored;
+	boost::filesystem::remove_all( tree, ignored );
+	if ( fd >= 0 )
+	    ::close( fd );
+	Metrics::add( Metrics::ExpiredDirectories );
+	debug << "nodee: Deleted the unused software tree " << tree << endl;
+    }
+}
@@ -0,0 +1,41 @@
+// Copyright Arnt Gulbrandsen <arnt@gulbrandsen.priv.no>; BSD-licensed.
+
+#ifndef SWEEPER_H
+#define SWEEPER_H
+
+#include "init.h"
+
+#include <map>
+#include <set>
+#include <string>
+
+#include <time.h>
+
+using namespace std;
+
+
+class Sweeper
+{
+public:
+    Sweeper( Init & );
+
+    void operator()();
+
+    void start();
+    void sweep();
+
+    enum { Interval = 60 };
+
+private:
+    void expireWork( const set<string> & );
+    void unmountImages( const set<string> & );
+    void expireSoftware( const string &, const set<string> &,
+			 const set<string> &, int );
+
+private:
+    Init & init;
+    map<string,time_t> lastSeen;
+};
+
+
+#endif
@@ -30,6 +30,17 @@ BOOST_AUTO_TEST_CASE( HttpParsing )
     BOOST_CHECK_EQUAL( x.operation(), HttpServer::Post );
     BOOST_CHECK_EQUAL( x.path(), "/asdf/" );
     BOOST_CHECK_EQUAL( x.contentLength(), 1000000 );
+    BOOST_CHECK( !x.wantsCbor() );
+
+    x.parseRequest( "GET /service/list HTTP/1.0\r\n"
+		    "Accept: application/cbor\r\n\r\n" );
+    BOOST_CHECK( x.wantsCbor() );
+    x.parseRequest( "GET /service/list HTTP/1.0\r\n"
+		    "accept: application/json, application/cbor;q=0.5\r\n\r\n" );
+    BOOST_CHECK( !x.wantsCbor() );
+    x.parseRequest( "GET /service/list HTTP/1.0\r\n"
+		    "Accept: */*;q=0.1, application/cbor\r\n\r\n" );
+    BOOST_CHECK( x.wantsCbor() );
 }
 
 BOOST_AUTO_TEST_CASE( HttpResponse )
@@ -161,7 +172,7 @@ BOOST_AUTO_TEST_CASE( ReadProcVmstat )
 	"thp_collapse_alloc_failed 0\n"
 	"thp_split 0\n";
 
-    int nfp = 1, pgmf = 2, pgpo = 3;
+    long long nfp = 1, pgmf = 2, pgpo = 3;
     x.readProcVmstat( "/tmp/vmstat", nfp, pgmf, pgpo );
     BOOST_CHECK_EQUAL( nfp, 741357 );
     BOOST_CHECK_EQUAL( pgmf, 7814 );
@@ -179,6 +190,7 @@ BOOST_AUTO_TEST_CASE( ParseProcStat )
     BOOST_CHECK_EQUAL( r.ppid, 0 );
     BOOST_CHECK_EQUAL( r.rss, 603 );
     BOOST_CHECK_EQUAL( r.majflt, 27 + 5186 );
+    BOOST_CHECK_EQUAL( r.cpu, 129 + 133 + 929507 + 187524 );
 
     // next, with a trailing newline
     r = x.parseProcStat( "14654 (zsh) S 13820 14654 14654 34818 14658 4202496 1470 793 0 0 6 2 0 0 20 0 1 0 20880374 39575552 731 18446744073709551615 4194304 4849052 140737478282368 140737478280640 140637896447738 0 2 3686404 134291459 18446744071579325599 0 0 17 0 0 0 0 0 0\r" );
@@ -186,6 +198,56 @@ BOOST_AUTO_TEST_CASE( ParseProcStat )
     BOOST_CHECK_EQUAL( r.ppid, 13820 );
     BOOST_CHECK_EQUAL( r.rss, 731 );
     BOOST_CHECK_EQUAL( r.majflt, 0 );
+    BOOST_CHECK_EQUAL( r.cpu, 8 );
+}
+
+
+BOOST_AUTO_TEST_CASE( ScanInterval )
+{
+    // calm and roomy: rarely
+    BOOST_CHECK_EQUAL( ChoreKeeper::scanInterval( false, 500, 0, false ),
+		       5000 );
+    BOOST_CHECK_EQUAL( ChoreKeeper::scanInterval( false, 500, -1, false ),
+		       5000 );
+    // busy squeezing or a little pressure: every second
+    BOOST_CHECK_EQUAL( ChoreKeeper::scanInterval( false, 500, 0, true ),
+		       1000 );
+    BOOST_CHECK_EQUAL( ChoreKeeper::scanInterval( false, 500, 50, false ),
+		       1000 );
+    // rising pressure or little RAM left: often
+    BOOST_CHECK_EQUAL( ChoreKeeper::scanInterval( false, 40, 0, false ),
+		       250 );
+    BOOST_CHECK_EQUAL( ChoreKeeper::scanInterval( false, 500, 200, false ),
+		       250 );
+    // thrashing: very often
+    BOOST_CHECK_EQUAL( ChoreKeeper::scanInterval( true, 500, 0, false ),
+		       100 );
+    BOOST_CHECK_EQUAL( ChoreKeeper::scanInterval( false, 5, 0, false ),
+		       100 );
+}
+
+
+BOOST_AUTO_TEST_CASE( ReadPressure )
+{
+    Init i;
+    ChoreKeeper x( i );
+
+    ofstream o( "/tmp/pressure" );
+    o << "some avg10=40.12 avg60=2.50 avg300=0.57 total=1234567\n"
+	 "full avg10=1.00 avg60=0.00 avg300=0.00 total=1234\n";
+    o.flush();
+    BOOST_CHECK_EQUAL( x.readPressure( "/tmp/pressure" ), 4012 );
+    BOOST_CHECK_EQUAL( x.readPressure( "/tmp/nonexistent-pressure" ), -1 );
+
+    ofstream s( "/tmp/stat" );
+    s << "cpu  10 20 30 400 50 6 7 8 0 0\n"
+	 "cpu0 10 20 30 400 50 6 7 8 0 0\n";
+    s.flush();
+    long long busy, iowait, total;
+    x.readProcStat( "/tmp/stat", busy, iowait, total );
+    BOOST_CHECK_EQUAL( busy, 10 + 20 + 30 + 6 + 7 + 8 );
+    BOOST_CHECK_EQUAL( iowait, 50 );
+    BOOST_CHECK_EQUAL( total, 10 + 20 + 30 + 400 + 50 + 6 + 7 + 8 );
 }
 
 
@@ -292,6 +354,186 @@ BOOST_AUTO_TEST_CASE( ScanProcesses )
 }
 
 
+// counts the allocations made by the thread that sets
+// countingAllocations, i.e. the ChoreKeeper thread in KillLatency
+
+static __thread bool countingAllocations = false;
+static int allocations = 0;
+
+void * operator new( size_t n ) throw ( std::bad_alloc )
+{
+    if ( countingAllocations )
+	allocations++;
+    void * p = ::malloc( n ? n : 1 );
+    if ( !p )
+	throw std::bad_alloc();
+    return p;
+}
+
+void operator delete( void * p ) throw ()
+{
+    ::free( p );
+}
+
+
+#include <sys/mman.h>
+#include <sys/time.h>
+#include <signal.h>
+
+#include <boost/bind.hpp>
+#include <boost/thread.hpp>
+
+
+// writes a /proc in which \a pid is the only process, a big one, and
+// \a majfaults thousand pages have been faulted in since boot, with
+// almost no free RAM. a few calls with increasing \a majfaults look
+// like thrashing.
+
+static void makeThrashingProc( int pid, int majfaults )
+{
+    string dir = "/tmp/nodee-thrashing/" +
+		 boost::lexical_cast<string>( pid );
+    boost::filesystem::create_directories( dir );
+    ofstream stat( ( dir + "/stat" ).c_str() );
+    stat << pid << " (hog) R 0 0 0 0 0 0 0 0 0 0 0 0 0 0 0 0 0 0 0 0 "
+	 << 4 * 1024 * 1024 << " 0" << endl;
+    ofstream vmstat( "/tmp/nodee-thrashing/vmstat" );
+    vmstat << "nr_free_pages 100" << endl
+	   << "nr_inactive_file 0" << endl
+	   << "pgmajfault " << majfaults * 1000 << endl
+	   << "pgpgout " << majfaults * 1000 << endl;
+}
+
+
+// the ChoreKeeper thread's part of KillLatency: harden, then three
+// scans, the last one after eight seconds of thrashing. stores the
+// time the last scan took in \a us.
+
+static void killDrill( ChoreKeeper * x, int hog, long * us )
+{
+    x->harden();
+
+    countingAllocations = true;
+    x->scan();
+    countingAllocations = false;
+
+    makeThrashingProc( hog, 2 );
+    ::usleep( 10000 );
+    countingAllocations = true;
+    x->scan();
+    countingAllocations = false;
+
+    x->backdate( 8000 );
+    makeThrashingProc( hog, 3 );
+    ::usleep( 10000 );
+    struct timeval before, after;
+    ::gettimeofday( &before, 0 );
+    countingAllocations = true;
+    x->scan();
+    countingAllocations = false;
+    ::gettimeofday( &after, 0 );
+    *us = ( after.tv_sec - before.tv_sec ) * 1000000 +
+	  after.tv_usec - before.tv_usec;
+}
+
+
+BOOST_AUTO_TEST_CASE( KillLatency )
+{
+    int hog = ::fork();
+    if ( !hog ) {
+	::pause();
+	::_exit( 0 );
+    }
+
+    Init i;
+    ChoreKeeper x( i );
+    Process * p = new Process;
+    p->fakefork( hog );
+    i.manage( p );
+
+    boost::filesystem::remove_all( "/tmp/nodee-thrashing" );
+    makeThrashingProc( hog, 1 );
+    x.setProc( "/tmp/nodee-thrashing" );
+
+    // the scans look at the made-up /proc, find the host thrashing,
+    // squeeze, and when it goes on, pick the hog and kill it. none
+    // of that may allocate.
+    allocations = 0;
+    long us = -1;
+    boost::thread t( boost::bind( &killDrill, &x, hog, &us ) );
+    t.join();
+    ::munlockall();
+
+    BOOST_CHECK_EQUAL( allocations, 0 );
+    BOOST_CHECK( us >= 0 && us < 250000 );
+
+    // Init reaps the hog once it's dead
+    int n = 0;
+    while ( ::kill( hog, 0 ) == 0 && n++ < 100 )
+	::usleep( 10000 );
+    BOOST_CHECK( n <= 100 );
+    if ( n > 100 )
+	::kill( hog, 9 );
+    boost::filesystem::remove_all( "/tmp/nodee-thrashing" );
+}
+
+
+BOOST_AUTO_TEST_CASE( StopKills )
+{
+    int child = ::fork();
+    if ( child == 0 ) {
+	::pause();
+	::_exit( 0 );
+    }
+    BOOST_REQUIRE( child > 0 );
+
+    Process p;
+    p.fakefork( child );
+    p.stop();
+
+    int status = 0;
+    int n = 0;
+    while ( ::waitpid( child, &status, WNOHANG ) == 0 && n++ < 100 )
+	::usleep( 20000 );
+    if ( n > 100 ) {
+	::kill( child, SIGKILL );
+	::waitpid( child, &status, 0 );
+    }
+    BOOST_CHECK( n <= 100 );
+    BOOST_CHECK( WIFSIGNALED( status ) && WTERMSIG( status ) == SIGKILL );
+}
+
+
+BOOST_AUTO_TEST_CASE( MemoryTrend )
+{
+    Process p;
+    p.fakefork( 100 );
+
+    // too little history says nothing
+    p.setCurrentRss( 1000 );
+    p.recordHistory( 0 );
+    BOOST_CHECK_EQUAL( p.rssTrend(), 0 );
+    BOOST_CHECK_EQUAL( p.faultTrend(), 0 );
+
+    // growing 500kB and 10 faults per five seconds, more often than
+    // the ring records, and for longer than the ring holds
+    int n = 1;
+    while ( n < 200 ) {
+	p.setCurrentRss( 1000 + n * 500 );
+	p.setPageFaults( n * 10 );
+	p.recordHistory( n * 5000 - 2500 );
+	p.recordHistory( n * 5000 );
+	n++;
+    }
+    BOOST_CHECK_EQUAL( p.rssTrend(), 6000 );
+    BOOST_CHECK_EQUAL( p.faultTrend(), 120 );
+
+    // without an expected peak it cannot be leaking
+    BOOST_CHECK_EQUAL( p.secondsUntilPeak(), -1 );
+    BOOST_CHECK( !p.leaking() );
+}
+
+
 #include "service.h"
 
 
@@ -307,13 +549,13 @@ BOOST_AUTO_TEST_CASE( ServiceList )
     i.manage( p1 );
 
     BOOST_CHECK_EQUAL( Service::list( i ), "{\n"
-		       "    \"services\":\n"
-		       "    {\n"
-		       "        \"100\":\n"
-		       "        {\n"
-		       "            \"value\": \"0\",\n"
-		       "            \"rss\": \"100\",\n"
-		       "            \"recentfaults\": \"29\"\n"
+		       "    \"services\": {\n"
+		       "        \"100\": {\n"
+		       "            \"value\": 0,\n"
+		       "            \"rss\": 100,\n"
+		       "            \"recentfaults\": 29,\n"
+		       "            \"cpu\": 0,\n"
+		       "            \"io\": 0\n"
 		       "        }\n"
 		       "    }\n"
 		       "}\n" );
@@ -383,6 +625,32 @@ BOOST_AUTO_TEST_CASE( ReadProcUids )
 }
 
 
+BOOST_AUTO_TEST_CASE( UidLeases )
+{
+    set<int> passwd = inPasswd( false, "/etc/passwd" );
+    int a = IdPool::uids().lease();
+    int b = IdPool::uids().lease();
+    BOOST_CHECK( a >= IdPool::First && a < IdPool::Last );
+    BOOST_CHECK( b > a );
+    BOOST_CHECK( passwd.find( a ) == passwd.end() );
+    BOOST_CHECK( passwd.find( b ) == passwd.end() );
+
+    // a released ID is quarantined, not handed out again at once
+    IdPool::uids().release( a );
+    IdPool::uids().release( a );
+    int c = IdPool::uids().lease();
+    BOOST_CHECK( c != a );
+    BOOST_CHECK( c != b );
+
+    // the GID pool is separate
+    int g = IdPool::gids().lease();
+    BOOST_CHECK( g >= IdPool::First && g < IdPool::Last );
+    IdPool::uids().release( b );
+    IdPool::uids().release( c );
+    IdPool::gids().release( g );
+}
+
+
 #include "hoststatus.h"
 
 BOOST_AUTO_TEST_CASE( CpuCounter )
@@ -437,6 +705,9 @@ BOOST_AUTO_TEST_CASE( MemSizeEstimator )
 
 #include "port.h"
 
+#include <netinet/in.h>
+#include <sys/socket.h>
+
 BOOST_AUTO_TEST_CASE( FreePorts ) {
     ofstream ptt( "/tmp/tcp" );
     ptt << "sl  local_address rem_address   st tx_queue rx_queue tr tm->when retrnsmt   uid  timeout inode\n"
@@ -466,20 +737,182 @@ BOOST_AUTO_TEST_CASE( FreePorts ) {
 }
 
 
+BOOST_AUTO_TEST_CASE( PortLeases ) {
+    BOOST_CHECK( !Port::addRange( "porttest.example=1000" ) );
+    BOOST_CHECK( !Port::addRange( "porttest.example=2000-1000" ) );
+    BOOST_CHECK( Port::addRange( "porttest.example=61990-61992" ) );
+
+    // round-robin, and nothing is handed out twice
+    int a = Port::lease( "1.svc.porttest.example" );
+    int b = Port::lease( "2.svc.porttest.example" );
+    BOOST_CHECK_EQUAL( a, 61990 );
+    BOOST_CHECK_EQUAL( b, 61991 );
+    Port::release( a );
+    BOOST_CHECK_EQUAL( Port::lease( "3.svc.porttest.example" ), 61992 );
+    BOOST_CHECK_EQUAL( Port::lease( "4.svc.porttest.example" ), 61990 );
+    BOOST_CHECK_EQUAL( Port::lease( "5.svc.porttest.example" ), 0 );
+
+    // other coordinates don't use the group's range
+    int c = Port::lease( "1.svc.otherporttest.example" );
+    BOOST_CHECK( c < 61990 || c > 61992 );
+    BOOST_CHECK( !Port::reserve( 61991 ) );
+    Port::release( c );
+    Port::release( 61990 );
+    Port::release( 61991 );
+    Port::release( 61992 );
+
+    // a ServerSpec holds its port until the last copy is gone
+    Init i;
+    {
+	ServerSpec s = ServerSpec::parseJson(
+	    "{ \"coordinate\" : \"1.svc.porttest.example\","
+	    "  \"artifact\" : \"a:b:1\", \"filename\" : \"f\","
+	    "  \"url\" : \"http://depot/f\" }", i );
+	BOOST_REQUIRE( s.valid() );
+	BOOST_CHECK_EQUAL( s.port(), 61991 );
+	BOOST_CHECK( !Port::reserve( 61991 ) );
+    }
+    BOOST_CHECK( Port::reserve( 61991 ) );
+    Port::release( 61991 );
+
+    // a spec parsed for prefetching leases nothing
+    ServerSpec prefetch = ServerSpec::parseJson(
+	"{ \"coordinate\" : \"1.svc.porttest.example\","
+	"  \"artifact\" : \"a:b:1\", \"filename\" : \"f\","
+	"  \"url\" : \"http://depot/f\" }", i, false );
+    BOOST_REQUIRE( prefetch.valid() );
+    BOOST_CHECK_EQUAL( prefetch.port(), -1 );
+
+    // and the kernel's view is respected
+    int fd = ::socket( AF_INET, SOCK_STREAM, 0 );
+    struct sockaddr_in sin;
+    ::memset( &sin, 0, sizeof( sin ) );
+    sin.sin_family = AF_INET;
+    sin.sin_addr.s_addr = htonl( INADDR_LOOPBACK );
+    socklen_t l = sizeof( sin );
+    BOOST_REQUIRE( ::bind( fd, (struct sockaddr *)&sin, l ) == 0 );
+    BOOST_REQUIRE( ::listen( fd, 1 ) == 0 );
+    BOOST_REQUIRE( ::getsockname( fd, (struct sockaddr *)&sin, &l ) == 0 );
+    bitset<65536> taken;
+    Port::inUse( taken );
+    BOOST_CHECK( taken.test( ntohs( sin.sin_port ) ) );
+    BOOST_CHECK( taken.count() < 65536 );
+    ::close( fd );
+}
+
+
 #include "artifact.h"
 #include "conf.h"
+#include "digest.h"
+
+
+static string sha256( const string & s )
+{
+    Sha256 h;
+    h.add( s.data(), s.size() );
+    return h.hex();
+}
 
 
 BOOST_AUTO_TEST_CASE( ArtifactLister )
 {
-    makeFakeProc();
-    Conf::artefactdir = "/tmp/uglehack/1";
+    string d( "/tmp/nodee-artefacts" );
+    boost::filesystem::remove_all( d );
+    boost::filesystem::create_directory( d );
+    Conf::artefactdir = d;
+
+    {
+	ofstream b( ( d + "/b.zip.part" ).c_str() );
+	b << "same";
+	ofstream a( ( d + "/a.jar.part" ).c_str() );
+	a << "same";
+	ofstream c( ( d + "/c.zip" ).c_str() );
+	c << "other";
+    }
+
+    BOOST_CHECK( Artifact::add( d + "/b.zip.part", d + "/b.zip",
+				sha256( "same" ), "", "http://depot/b.zip" ) );
+    BOOST_CHECK( Artifact::add( d + "/a.jar.part", d + "/a.jar",
+				sha256( "same" ), "", "" ) );
+    BOOST_CHECK( Artifact::add( d + "/c.zip", d + "/c.zip",
+				sha256( "other" ), "", "" ) );
 
     BOOST_CHECK_EQUAL( Artifact::list(),
 		       "{\n"
-		       "    \"1\": \"stat\",\n"
-		       "    \"2\": \"status\"\n"
+		       "    \"1\": \"a.jar\",\n"
+		       "    \"2\": \"b.zip\",\n"
+		       "    \"3\": \"c.zip\"\n"
 		       "}\n" );
+
+    // a.jar and b.zip are stored once
+    Artifact::Blob b;
+    BOOST_REQUIRE( Artifact::find( d + "/a.jar", b ) );
+    BOOST_CHECK_EQUAL( b.digest, sha256( "same" ) );
+    BOOST_CHECK_EQUAL( b.size, 4 );
+    BOOST_CHECK_EQUAL( b.source, "http://depot/b.zip" );
+    BOOST_CHECK_EQUAL( b.aliases.size(), 2u );
+    BOOST_CHECK( Artifact::intact( d + "/a.jar", b ) );
+    BOOST_CHECK( Artifact::intact( d + "/b.zip", b ) );
+    BOOST_CHECK( !Artifact::intact( d + "/c.zip", b ) );
+    BOOST_CHECK( ::access( ( d + "/a.jar.part" ).c_str(), F_OK ) < 0 );
+    BOOST_CHECK( ::access( ( d + "/b.zip.part" ).c_str(), F_OK ) < 0 );
+
+    // references are counted per blob
+    Artifact::use( d + "/a.jar" );
+    Artifact::use( d + "/b.zip" );
+    Artifact::release( d + "/a.jar" );
+    BOOST_REQUIRE( Artifact::find( d + "/b.zip", b ) );
+    BOOST_CHECK_EQUAL( b.refs, 1 );
+    BOOST_CHECK( !Artifact::find( d + "/d.zip", b ) );
+}
+
+
+BOOST_AUTO_TEST_CASE( ArtifactEviction )
+{
+    string d( "/tmp/nodee-evict" );
+    boost::filesystem::remove_all( d );
+    boost::filesystem::create_directory( d );
+    Conf::artefactdir = d;
+
+    const char * names[] = { "a.zip", "b.zip", "c.zip" };
+    int i = 0;
+    while ( i < 3 ) {
+	string contents = string( 1000, 'a' + i );
+	{
+	    ofstream f( ( d + "/" + names[i] ).c_str() );
+	    f << contents;
+	}
+	BOOST_CHECK( Artifact::add( d + "/" + names[i], d + "/" + names[i],
+				    sha256( contents ), "", "" ) );
+	i++;
+    }
+
+    // a.zip is used by a service and b.zip by a download, so only
+    // c.zip can go
+    Artifact::use( d + "/a.zip" );
+    set<string> busy;
+    busy.insert( d + "/b.zip" );
+    BOOST_CHECK_EQUAL( Artifact::evict( d, 1500, 0, busy ), 1000 );
+    BOOST_CHECK_EQUAL( Artifact::evict( d, 1500, 0, busy ), 0 );
+    Artifact::Blob b;
+    BOOST_CHECK( !Artifact::find( d + "/c.zip", b ) );
+    BOOST_CHECK( ::access( ( d + "/c.zip" ).c_str(), F_OK ) < 0 );
+    BOOST_CHECK( ::access( ( d + "/sha256/" + sha256( string( 1000, 'c' ) ) )
+			   .c_str(), F_OK ) < 0 );
+    BOOST_CHECK( Artifact::find( d + "/b.zip", b ) );
+
+    // an artifact in use cannot be removed, neither by a service nor
+    // by a download, others can
+    BOOST_CHECK( !Artifact::remove( d + "/a.zip", set<string>() ) );
+    BOOST_CHECK( !Artifact::remove( d + "/b.zip", busy ) );
+    BOOST_CHECK( Artifact::find( d + "/b.zip", b ) );
+    BOOST_CHECK( Artifact::remove( d + "/b.zip", set<string>() ) );
+    BOOST_CHECK( !Artifact::remove( d + "/b.zip", set<string>() ) );
+    Artifact::release( d + "/a.zip" );
+    BOOST_CHECK( Artifact::remove( d + "/a.zip", set<string>() ) );
+    BOOST_CHECK_EQUAL( Artifact::list(), "{\n}\n" );
+
+    boost::filesystem::remove_all( d );
 }
 
 
@@ -518,3 +951,956 @@ BOOST_AUTO_TEST_CASE( ServerOptions )
     BOOST_CHECK_EQUAL( o["--someoption"], "some value" );
     BOOST_CHECK_EQUAL( o["--anotheroption"], "more config" );
 }
+
+
+BOOST_AUTO_TEST_CASE( ServerSpecParsing )
+{
+    Init i;
+    ServerSpec s = ServerSpec::parseJson(
+	"{"
+	"  \"coordinate\" : \"1.idee-prod.ideeuser.ie\","
+	"  \"artefact\" : \"com.telenor:id-server:1.4.2\","
+	"  \"filename\" : \"id-server-1.4.2-shaded.jar\","
+	"  \"url\" : \"http://haw-lin.com\","
+	"  \"port\" : \"8080\","
+	"  \"value\" : 7,"
+	"  \"owner\" : { \"team\" : \"id\", \"pager\" : [ 1, 2 ] },"
+	"  \"restart\" : { \"period\" : 120, \"enabled\" : true }"
+	"}", i
+	);
+    BOOST_REQUIRE( s.valid() );
+    BOOST_CHECK_EQUAL( s.port(), 8080 );
+    BOOST_CHECK_EQUAL( s.value(), 7 );
+    BOOST_CHECK_EQUAL( s.restartPeriod(), 120 );
+    BOOST_CHECK_EQUAL( s.artifact(), "com.telenor:id-server:1.4.2" );
+
+    // unknown members survive a round trip
+    ServerSpec again = ServerSpec::parseJson( s.json(), i );
+    BOOST_REQUIRE( again.valid() );
+    BOOST_CHECK_EQUAL( again.json(), s.json() );
+    BOOST_CHECK( s.json().find( "\"owner\": { \"team\" : \"id\", "
+				"\"pager\" : [ 1, 2 ] }" ) != string::npos );
+    BOOST_CHECK( s.json().find( "\"enabled\": true" ) != string::npos );
+    BOOST_CHECK( s.json().find( "\"artefact\"" ) != string::npos );
+
+    // all the problems are reported at once
+    ServerSpec bad = ServerSpec::parseJson(
+	"{ \"artifact\" : \"a:b:1\", \"port\" : \"eighty\","
+	"  \"value\" : 1.5, \"url\" : [], \"filename\" : \"f\","
+	"  \"coordinate\" : \"c\" }", i );
+    BOOST_CHECK( !bad.valid() );
+    BOOST_CHECK_EQUAL( bad.error(), "Problem regarding port; "
+		       "Problem regarding value; Problem regarding url" );
+
+    ServerSpec broken = ServerSpec::parseJson( "{ \"port\" : 80, }", i );
+    BOOST_CHECK( !broken.valid() );
+    BOOST_CHECK_EQUAL( broken.error(),
+		       "JSON syntax error: Expected member name at offset 15" );
+    BOOST_CHECK_EQUAL( broken.json(), "{\n}\n" );
+}
+
+
+#include "json.h"
+
+BOOST_AUTO_TEST_CASE( JsonWriting )
+{
+    string r;
+    JsonWriter w( r );
+    w.startObject();
+    w.member( "name" );
+    w.text( "tab\there \"q\" \\ \x01 bl\xc3\xa5 \xff\xc3" );
+    w.member( "big" );
+    w.number( 1LL << 40 );
+    w.member( "list" );
+    w.startArray();
+    w.number( -1 );
+    w.boolean( false );
+    w.raw( "null" );
+    w.endArray();
+    w.member( "empty" );
+    w.startArray();
+    w.endArray();
+    w.member( "nested" );
+    w.startObject();
+    w.member( "ok" );
+    w.boolean( true );
+    w.endObject();
+    w.endObject();
+    BOOST_CHECK_EQUAL( r, "{\n"
+		       "    \"name\": \"tab\\there \\\"q\\\" \\\\ \\u0001 "
+		       "bl\xc3\xa5 \xef\xbf\xbd\xef\xbf\xbd\",\n"
+		       "    \"big\": 1099511627776,\n"
+		       "    \"list\": [ -1, false, null ],\n"
+		       "    \"empty\": [],\n"
+		       "    \"nested\": {\n"
+		       "        \"ok\": true\n"
+		       "    }\n"
+		       "}\n" );
+
+    // and what it writes, the parser reads
+    JsonParser j( r );
+    string name, text;
+    BOOST_REQUIRE( j.startObject() );
+    BOOST_REQUIRE( j.member( name ) );
+    BOOST_REQUIRE( j.text( text ) );
+    BOOST_CHECK_EQUAL( text, "tab\there \"q\" \\ \x01 bl\xc3\xa5 "
+		       "\xef\xbf\xbd\xef\xbf\xbd" );
+    while ( j.member( name ) )
+	j.skip();
+    BOOST_CHECK( j.atEnd() );
+}
+
+
+#include "cbor.h"
+
+BOOST_AUTO_TEST_CASE( CborEncoding )
+{
+    string c;
+    CborWriter w( c );
+    w.startObject();
+    w.member( "a" );
+    w.number( 1 );
+    w.member( "b" );
+    w.startArray();
+    w.number( -500 );
+    w.boolean( true );
+    w.raw( "[ 1.5, null, \"x\" ]" );
+    w.endArray();
+    w.endObject();
+    BOOST_CHECK_EQUAL( c, string( "\xbf\x61" "a\x01\x61" "b\x9f\x39\x01\xf3\xf5"
+				  "\x9f\xfb\x3f\xf8\0\0\0\0\0\0\xf6\x61" "x"
+				  "\xff\xff\xff", 27 ) );
+
+    // and back to JSON
+    string j;
+    JsonWriter jw( j );
+    CborReader r( c );
+    BOOST_REQUIRE( r.read( jw ) );
+    BOOST_CHECK_EQUAL( j, "{\n"
+		       "    \"a\": 1,\n"
+		       "    \"b\": [ -500, true, [ 1.5, null, \"x\" ] ]\n"
+		       "}\n" );
+
+    // definite lengths, as other encoders use
+    string d( "\xa1\x63key\x82\x18\x64\x7f\x62" "ab\x61" "c\xff", 15 );
+    j.clear();
+    CborReader dr( d );
+    BOOST_REQUIRE( dr.read( jw ) );
+    BOOST_CHECK_EQUAL( j, "{\n    \"key\": [ 100, \"abc\" ]\n}\n" );
+
+    // truncated input and trailing garbage are rejected
+    string trunc( c, 0, c.size() - 1 );
+    string extra = c + "\x01";
+    string ignored;
+    JsonWriter iw( ignored );
+    CborReader tr( trunc );
+    BOOST_CHECK( !tr.read( iw ) );
+    CborReader er( extra );
+    BOOST_CHECK( !er.read( iw ) );
+
+    // the service list has the same content in both forms
+    Init i;
+    Process * p = new Process;
+    p->fakefork( 100 );
+    p->setCurrentRss( 70000 );
+    i.manage( p );
+    string services;
+    CborWriter sw( services );
+    Service::list( i, sw );
+    j.clear();
+    CborReader sr( services );
+    BOOST_REQUIRE( sr.read( jw ) );
+    BOOST_CHECK_EQUAL( j, Service::list( i ) );
+    BOOST_CHECK( services.size() < j.size() / 2 );
+}
+
+
+#include "download.h"
+
+BOOST_AUTO_TEST_CASE( SingleFlight )
+{
+    Init i;
+
+    Download * d = new Download( 0, 0, "http://depot/a.zip", "/tmp/a.zip",
+				 "0123456789ABCDEF0123456789ABCDEF" );
+    i.manage( d );
+
+    // only a running download can be joined
+    BOOST_CHECK( !Download::find( i, "/tmp/a.zip",
+				  "0123456789abcdef0123456789abcdef" ) );
+    d->fakefork( 4711 );
+    BOOST_CHECK_EQUAL( Download::find( i, "/tmp/a.zip",
+				       "0123456789abcdef0123456789abcdef" ),
+		       d );
+    BOOST_CHECK( !Download::find( i, "/tmp/b.zip",
+				  "0123456789abcdef0123456789abcdef" ) );
+    BOOST_CHECK( !Download::find( i, "/tmp/a.zip", "" ) );
+}
+
+
+BOOST_AUTO_TEST_CASE( Md5Digest )
+{
+    Md5 m;
+    BOOST_CHECK_EQUAL( m.hex(), "d41d8cd98f00b204e9800998ecf8427e" );
+    m.add( "abc", 3 );
+    BOOST_CHECK_EQUAL( m.hex(), "900150983cd24fb0d6963f7d28e17f72" );
+
+    // the same 80 bytes in one go and in awkward pieces
+    string s( "12345678901234567890123456789012345678901234567890"
+	      "123456789012345678901234567890" );
+    m.add( s.data(), s.size() );
+    BOOST_CHECK_EQUAL( m.hex(), "57edf4a22be3c955ac49da2e2107b67a" );
+    m.add( s.data(), 1 );
+    m.add( s.data() + 1, 63 );
+    m.add( s.data() + 64, 16 );
+    BOOST_CHECK_EQUAL( m.hex(), "57edf4a22be3c955ac49da2e2107b67a" );
+
+    Sha256 h;
+    BOOST_CHECK_EQUAL( h.hex(), "e3b0c44298fc1c149afbf4c8996fb924"
+				"27ae41e4649b934ca495991b7852b855" );
+    h.add( "abc", 3 );
+    BOOST_CHECK_EQUAL( h.hex(), "ba7816bf8f01cfea414140de5dae2223"
+				"b00361a396177a9cb410ff61f20015ad" );
+    string t( "abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq" );
+    h.add( t.data(), 7 );
+    h.add( t.data() + 7, t.size() - 7 );
+    BOOST_CHECK_EQUAL( h.hex(), "248d6a61d20638b8e5c026930c3e6039"
+				"a33ce45964ff2167f6ecedd419db06c1" );
+}
+
+
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+// a stand-in for an artifact depot. it serves depotBody, hangs up
+// after depotCut bytes of each response (if nonzero), stops serving
+// altogether once depotBudget bytes have been sent (if not
+// negative), and is slow throughout.
+
+static string depotBody;
+static int depotCut;
+static long long depotBudget = -1;
+static long long depotServed;
+static boost::mutex depotLock;
+
+
+static void depotConnection( int fd )
+{
+    char req[4096];
+    int used = 0;
+    while ( used < (int)sizeof( req ) - 1 ) {
+	int n = ::read( fd, req + used, sizeof( req ) - 1 - used );
+	if ( n <= 0 )
+	    break;
+	used += n;
+	req[used] = 0;
+	if ( ::strstr( req, "\r\n\r\n" ) )
+	    break;
+    }
+    req[used] = 0;
+
+    long long from = 0;
+    long long to = depotBody.size() - 1;
+    const char * range = ::strstr( req, "Range: bytes=" );
+    if ( range )
+	::sscanf( range + 13, "%lld-%lld", &from, &to );
+
+    char h[512];
+    int hl;
+    if ( range )
+	hl = ::snprintf( h, sizeof( h ),
+			 "HTTP/1.0 206 Partial\r\n"
+			 "Content-Length: %lld\r\n"
+			 "Content-Range: bytes %lld-%lld/%d\r\n\r\n",
+			 to + 1 - from, from, to, (int)depotBody.size() );
+    else
+	hl = ::snprintf( h, sizeof( h ),
+			 "HTTP/1.0 200 OK\r\n"
+			 "Accept-Ranges: bytes\r\n"
+			 "Content-Length: %d\r\n\r\n",
+			 (int)depotBody.size() );
+    if ( depotBudget != 0 )
+	(void)::send( fd, h, hl, MSG_NOSIGNAL );
+
+    long long sent = 0;
+    while ( !::strncmp( req, "GET", 3 ) && from <= to ) {
+	int n = 16384;
+	if ( n > to + 1 - from )
+	    n = to + 1 - from;
+	if ( depotCut && sent + n > depotCut )
+	    n = depotCut - sent;
+	{
+	    boost::lock_guard<boost::mutex> l( depotLock );
+	    if ( depotBudget >= 0 && n > depotBudget )
+		n = depotBudget;
+	    if ( depotBudget > 0 )
+		depotBudget -= n;
+	    depotServed += n;
+	}
+	if ( n <= 0 ||
+	     ::send( fd, depotBody.data() + from, n, MSG_NOSIGNAL ) != n )
+	    break;
+	from += n;
+	sent += n;
+	::usleep( 500 );
+    }
+    ::close( fd );
+}
+
+
+static void depot( int listener )
+{
+    while ( true ) {
+	int fd = ::accept( listener, 0, 0 );
+	if ( fd < 0 )
+	    return;
+	boost::thread t( boost::bind( depotConnection, fd ) );
+	t.detach();
+    }
+}
+
+
+static string slurp( const char * name )
+{
+    ifstream f( name, ios::binary );
+    ostringstream s;
+    s << f.rdbuf();
+    return s.str();
+}
+
+
+BOOST_AUTO_TEST_CASE( FlakyDownload )
+{
+    int n = 0;
+    while ( n < 3 * 1024 * 1024 ) {
+	depotBody += (char)( ( n * 7919 ) >> 3 ^ n );
+	n++;
+    }
+    Md5 m;
+    m.add( depotBody.data(), depotBody.size() );
+    string digest = m.hex();
+
+    int listener = ::socket( AF_INET, SOCK_STREAM, 0 );
+    struct sockaddr_in a;
+    ::memset( &a, 0, sizeof( a ) );
+    a.sin_family = AF_INET;
+    a.sin_addr.s_addr = htonl( INADDR_LOOPBACK );
+    socklen_t al = sizeof( a );
+    BOOST_REQUIRE( !::bind( listener, (struct sockaddr *)&a, al ) );
+    BOOST_REQUIRE( !::listen( listener, 16 ) );
+    ::getsockname( listener, (struct sockaddr *)&a, &al );
+    boost::thread server( boost::bind( depot, listener ) );
+
+    string url = "http://127.0.0.1:" +
+		 boost::lexical_cast<string>( ntohs( a.sin_port ) ) +
+		 "/id-server.zip";
+    boost::filesystem::remove_all( "/tmp/nodee-download" );
+    boost::filesystem::create_directory( "/tmp/nodee-download" );
+    const char * fn = "/tmp/nodee-download/id-server.zip";
+
+    // every response breaks off early, but each retry makes progress
+    depotCut = 300000;
+    Download d1( 0, 0, url, fn, digest );
+    d1.setRetries( 3, 10 );
+    BOOST_CHECK( d1.fetch() );
+    BOOST_CHECK( slurp( fn ) == depotBody );
+    BOOST_CHECK( ::access( "/tmp/nodee-download/id-server.zip.part",
+			   F_OK ) < 0 );
+    BOOST_CHECK( ::access( "/tmp/nodee-download/id-server.zip.state",
+			   F_OK ) < 0 );
+
+    // the depot disappears after a megabyte, so the download fails
+    // and leaves its state behind
+    ::unlink( fn );
+    depotCut = 0;
+    depotBudget = 1024 * 1024;
+    Download d2( 0, 0, url, fn, digest );
+    d2.setRetries( 2, 10 );
+    BOOST_CHECK( !d2.fetch() );
+    BOOST_CHECK_EQUAL( d2.size(), 3 * 1024 * 1024 );
+    BOOST_CHECK( d2.received() >= 1024 * 1024 );
+    BOOST_CHECK( d2.received() < 3 * 1024 * 1024 );
+
+    // when it comes back, the next attempt fetches only the rest
+    depotBudget = -1;
+    depotServed = 0;
+    Download d3( 0, 0, url, fn, digest );
+    d3.setRetries( 2, 10 );
+    BOOST_CHECK( d3.fetch() );
+    BOOST_CHECK( depotServed <= 2 * 1024 * 1024 );
+    BOOST_CHECK( slurp( fn ) == depotBody );
+
+    // a file with the wrong digest is refetched, and then rejected
+    Download d4( 0, 0, url, fn, "0123456789abcdef0123456789abcdef" );
+    d4.setRetries( 1, 10 );
+    BOOST_CHECK( !d4.fetch() );
+    BOOST_CHECK( ::access( fn, F_OK ) < 0 );
+
+    // two downloads of the same file at once fetch it once
+    depotServed = 0;
+    Download d5( 0, 0, url, fn, digest );
+    Download d6( 0, 0, url, fn, digest );
+    boost::thread t5( boost::bind( &Download::fetch, &d5 ) );
+    boost::thread t6( boost::bind( &Download::fetch, &d6 ) );
+    t5.join();
+    t6.join();
+    BOOST_CHECK_EQUAL( depotServed, 3 * 1024 * 1024 );
+    BOOST_CHECK( slurp( fn ) == depotBody );
+
+    // the index knows the file, so checking it needs no hashing
+    Artifact::Blob b;
+    BOOST_REQUIRE( Artifact::find( fn, b ) );
+    BOOST_CHECK_EQUAL( b.md5, digest );
+    BOOST_CHECK_EQUAL( b.source, url );
+    BOOST_CHECK( Artifact::intact( fn, b ) );
+
+    // a prefetch keeps to its rate...
+    ::unlink( fn );
+    Download d7( 0, 0, url, fn, digest );
+    d7.setRate( 2 * 1024 * 1024 );
+    struct timeval before, after;
+    ::gettimeofday( &before, 0 );
+    BOOST_CHECK( d7.fetch() );
+    ::gettimeofday( &after, 0 );
+    BOOST_CHECK( after.tv_sec - before.tv_sec >= 1 );
+
+    // ...until a service needs the file
+    ::unlink( fn );
+    Download d8( 0, 0, url, fn, digest );
+    d8.setRate( 16 * 1024 );
+    ::gettimeofday( &before, 0 );
+    boost::thread t8( boost::bind( &Download::fetch, &d8 ) );
+    ::usleep( 200000 );
+    d8.hurry();
+    t8.join();
+    ::gettimeofday( &after, 0 );
+    BOOST_CHECK( after.tv_sec - before.tv_sec < 10 );
+    BOOST_CHECK( slurp( fn ) == depotBody );
+    BOOST_CHECK( ::access( "/tmp/nodee-download/id-server.zip.hurry",
+			   F_OK ) < 0 );
+
+    ::shutdown( listener, SHUT_RDWR );
+    ::close( listener );
+    server.join();
+}
+
+
+#include "extract.h"
+
+static int mode( const string & name )
+{
+    struct stat st;
+    if ( ::lstat( name.c_str(), &st ) < 0 )
+	return -1;
+    return st.st_mode & 07777;
+}
+
+
+BOOST_AUTO_TEST_CASE( Extract )
+{
+    boost::filesystem::remove_all( "/tmp/nodee-extract" );
+    boost::filesystem::create_directories( "/tmp/nodee-extract/src/bin" );
+    {
+	ofstream run( "/tmp/nodee-extract/src/bin/run" );
+	run << "#!/bin/sh\n";
+	ofstream readme( "/tmp/nodee-extract/src/README" );
+	readme << string( 100000, 'x' );
+    }
+    ::chmod( "/tmp/nodee-extract/src/bin/run", 0700 );
+    BOOST_REQUIRE( ::symlink( "bin/run", "/tmp/nodee-extract/src/go" ) == 0 );
+    BOOST_REQUIRE( ::system( "cd /tmp/nodee-extract/src && "
+			     "tar czf ../a.tar.gz . && "
+			     "zip -qry ../a.zip bin README go && "
+			     "tar cPf ../evil.tar ../a.zip" ) == 0 );
+
+    BOOST_CHECK_EQUAL( Extractor::guess( "a.tgz" ), Extractor::TarGz );
+    BOOST_CHECK_EQUAL( Extractor::guess( "a.jar" ), Extractor::Plain );
+    BOOST_CHECK_EQUAL( Extractor::guess( "a.rpm" ), Extractor::Unknown );
+
+    // a tar.gz file fed in dribs and drabs, as a download would
+    string archive = slurp( "/tmp/nodee-extract/a.tar.gz" );
+    Extractor t( "/tmp/nodee-extract/a.tar.gz", "/tmp/nodee-extract/t" );
+    BOOST_CHECK( t.streaming() );
+    unsigned int i = 0;
+    while ( i < archive.size() ) {
+	int n = archive.size() - i < 97 ? archive.size() - i : 97;
+	BOOST_REQUIRE( t.feed( archive.data() + i, n ) );
+	i += n;
+    }
+    BOOST_CHECK( t.finish( "/tmp/nodee-extract/a.tar.gz" ) );
+
+    // a zip file, in parallel
+    Extractor z( "/tmp/nodee-extract/a.zip", "/tmp/nodee-extract/z" );
+    BOOST_CHECK( !z.streaming() );
+    BOOST_CHECK( z.extract( "/tmp/nodee-extract/a.zip" ) );
+
+    const char * dirs[] = { "/tmp/nodee-extract/t", "/tmp/nodee-extract/z" };
+    int d = 0;
+    while ( d < 2 ) {
+	string root = dirs[d++];
+	BOOST_CHECK_EQUAL( slurp( ( root + "/README" ).c_str() ),
+			   string( 100000, 'x' ) );
+	BOOST_CHECK_EQUAL( slurp( ( root + "/go" ).c_str() ),
+			   "#!/bin/sh\n" );
+	BOOST_CHECK_EQUAL( mode( root + "/README" ), 0444 );
+	BOOST_CHECK_EQUAL( mode( root + "/bin/run" ), 0555 );
+	BOOST_CHECK_EQUAL( mode( root + "/bin" ), 0555 );
+	BOOST_CHECK_EQUAL( mode( root ), 0555 );
+    }
+
+    // a Download unpacks a verified file into the shared tree, and
+    // marks the tree so the install script leaves it alone
+    Download u( 0, 0, "http://127.0.0.1:1/a.tar.gz",
+		"/tmp/nodee-extract/a.tar.gz", "" );
+    u.setSoftware( "/tmp/nodee-extract/software/a" );
+    BOOST_CHECK( u.fetch() );
+    BOOST_CHECK_EQUAL( mode( "/tmp/nodee-extract/software/a/bin/run" ),
+		       0555 );
+    BOOST_CHECK( !slurp( "/tmp/nodee-extract/software/a/"
+			 ".nodee-source" ).empty() );
+
+    // nothing may land outside the tree
+    Extractor e( "/tmp/nodee-extract/evil.tar", "/tmp/nodee-extract/e" );
+    BOOST_CHECK( !e.extract( "/tmp/nodee-extract/evil.tar" ) );
+
+    boost::filesystem::remove_all( "/tmp/nodee-extract" );
+}
+
+
+#include "mount.h"
+
+BOOST_AUTO_TEST_CASE( MountedImages )
+{
+    {
+	ofstream m( "/tmp/nodee-mountinfo" );
+	m << "22 1 0:21 / /proc rw,nosuid - proc proc rw\n"
+	  << "90 25 7:0 / /opt/nodee/software/g/a/1.0 ro,nodev - "
+	     "squashfs /dev/loop0 ro\n"
+	  << "91 25 7:1 / /opt/nodee/software/g/my\\040app/2.0 ro - "
+	     "erofs /dev/loop1 ro\n"
+	  << "92 25 8:1 / /opt/nodee/softwarex ro - ext4 /dev/sda1 rw\n";
+    }
+    list<string> l = Mount::below( "/opt/nodee/software",
+				   "/tmp/nodee-mountinfo" );
+    BOOST_REQUIRE_EQUAL( l.size(), 2u );
+    BOOST_CHECK_EQUAL( l.front(), "/opt/nodee/software/g/my app/2.0" );
+    BOOST_CHECK_EQUAL( l.back(), "/opt/nodee/software/g/a/1.0" );
+    ::unlink( "/tmp/nodee-mountinfo" );
+
+    {
+	ofstream s( "/tmp/nodee-image.squashfs" );
+	s << "hsqs" << string( 2000, 0 );
+	string erofs( 2000, 0 );
+	erofs[1024] = (char)0xe2;
+	erofs[1025] = (char)0xe1;
+	erofs[1026] = (char)0xf5;
+	erofs[1027] = (char)0xe0;
+	ofstream e( "/tmp/nodee-image.erofs" );
+	e << erofs;
+    }
+    BOOST_CHECK_EQUAL( Mount::type( "/tmp/nodee-image.squashfs" ), "squashfs" );
+    BOOST_CHECK_EQUAL( Mount::type( "/tmp/nodee-image.erofs" ), "erofs" );
+    BOOST_CHECK_EQUAL( Mount::type( "/tmp/nodee-mountinfo" ), "" );
+    ::unlink( "/tmp/nodee-image.squashfs" );
+    ::unlink( "/tmp/nodee-image.erofs" );
+
+    ::mkdir( "/tmp/nodee-mountpoint", 0755 );
+    BOOST_CHECK( !Mount::mounted( "/tmp/nodee-mountpoint" ) );
+    ::rmdir( "/tmp/nodee-mountpoint" );
+    BOOST_CHECK( Mount::mounted( "/proc" ) );
+}
+
+
+#include "delta.h"
+
+BOOST_AUTO_TEST_CASE( DeltaUpdate )
+{
+    string before;
+    unsigned int x = 4711;
+    while ( before.size() < 200000 ) {
+	x = x * 1103515245 + 12345;
+	before += (char)( x >> 16 );
+    }
+    // the new version has a few bytes inserted, one block changed
+    // and a different length
+    string after = before.substr( 0, 50000 ) + "inserted" +
+		   before.substr( 50000, 100000 ) + string( 4096, 'x' ) +
+		   before.substr( 154096 ) + "tail";
+    {
+	ofstream b( "/tmp/nodee-basis" );
+	b << before;
+	ofstream a( "/tmp/nodee-after" );
+	a << after;
+    }
+
+    Delta d;
+    BOOST_REQUIRE( d.parse( Delta::index( "/tmp/nodee-after", 4096 ) ) );
+    BOOST_CHECK_EQUAL( d.size(), (long long)after.size() );
+    BOOST_CHECK_EQUAL( d.blockSize(), 4096 );
+    Sha256 s;
+    s.add( after.data(), after.size() );
+    BOOST_CHECK_EQUAL( d.sha256(), s.hex() );
+
+    int fd = ::open( "/tmp/nodee-result", O_RDWR | O_CREAT | O_TRUNC, 0644 );
+    BOOST_REQUIRE( fd >= 0 );
+    BOOST_REQUIRE( ::ftruncate( fd, after.size() ) == 0 );
+    long long reused = d.reuse( "/tmp/nodee-basis", fd );
+    BOOST_CHECK( reused > (long long)after.size() * 9 / 10 );
+
+    long long fetched = 0;
+    list< pair<long long,long long> > missing( d.missing( 0 ) );
+    list< pair<long long,long long> >::iterator m( missing.begin() );
+    while ( m != missing.end() ) {
+	long long n = m->second + 1 - m->first;
+	BOOST_CHECK( ::pwrite( fd, after.data() + m->first, n, m->first ) == n );
+	fetched += n;
+	++m;
+    }
+    BOOST_CHECK_EQUAL( reused + fetched, (long long)after.size() );
+    BOOST_CHECK_EQUAL( missing.size(), 3u );
+    ::close( fd );
+
+    // with enough slack, nearby ranges become one request
+    list< pair<long long,long long> > merged( d.missing( 1 << 20 ) );
+    BOOST_REQUIRE_EQUAL( merged.size(), 1u );
+    BOOST_CHECK_EQUAL( merged.front().first, missing.front().first );
+    BOOST_CHECK_EQUAL( merged.front().second, missing.back().second );
+
+    ifstream r( "/tmp/nodee-result" );
+    string result( ( istreambuf_iterator<char>( r ) ),
+		   istreambuf_iterator<char>() );
+    BOOST_CHECK( result == after );
+
+    BOOST_CHECK( !d.parse( "nodee-blocks 1\nsize 5000\nblock-size 4096\n" ) );
+
+    ::unlink( "/tmp/nodee-basis" );
+    ::unlink( "/tmp/nodee-after" );
+    ::unlink( "/tmp/nodee-result" );
+}
+
+
+#include "warmup.h"
+
+BOOST_AUTO_TEST_CASE( WarmupFiles )
+{
+    Init i;
+    ServerSpec s = ServerSpec::parseJson(
+	"{"
+	"  \"coordinate\" : \"1.warm.example.com\","
+	"  \"artifact\" : \"com.example:warm:1.0\","
+	"  \"filename\" : \"warm-1.0.tar\","
+	"  \"url\" : \"http://depot.example.com/warm-1.0.tar\","
+	"  \"warmup\" : {"
+	"    \"files\" : [ \"lib/*.jar\", \"bin/warm\" ],"
+	"    \"limit\" : 1"
+	"  }"
+	"}", i
+	);
+    BOOST_REQUIRE( s.valid() );
+    list<string> patterns = s.warmupFiles();
+    BOOST_REQUIRE_EQUAL( patterns.size(), 2u );
+    BOOST_CHECK_EQUAL( patterns.front(), "lib/*.jar" );
+    BOOST_CHECK_EQUAL( s.warmupLimit(), 1 );
+
+    boost::filesystem::remove_all( "/tmp/nodee-warm" );
+    ::mkdir( "/tmp/nodee-warm", 0755 );
+    ::mkdir( "/tmp/nodee-warm/lib", 0755 );
+    ::mkdir( "/tmp/nodee-warm/lib/sub", 0755 );
+    ::mkdir( "/tmp/nodee-warm/bin", 0755 );
+    ::mkdir( "/tmp/nodee-warm/tmp", 0755 );
+    {
+	ofstream a( "/tmp/nodee-warm/lib/big.jar" );
+	a << string( 5000, 'j' );
+	ofstream b( "/tmp/nodee-warm/lib/sub/deep.jar" );
+	b << string( 5000, 'j' );
+	ofstream c( "/tmp/nodee-warm/bin/warm" );
+	c << string( 5000, 'b' );
+	ofstream d( "/tmp/nodee-warm/small.conf" );
+	d << "x=1\n";
+	ofstream e( "/tmp/nodee-warm/large.dat" );
+	e << string( 5000, 'd' );
+	ofstream f( "/tmp/nodee-warm/tmp/scratch" );
+	f << "y\n";
+    }
+    ::link( "/tmp/nodee-warm/lib/big.jar", "/tmp/nodee-warm/lib/same.jar" );
+
+    // empty files, and links anywhere but into the software tree, are
+    // skipped
+    ::mkdir( "/tmp/nodee-warm-software", 0755 );
+    {
+	ofstream g( "/tmp/nodee-warm-software/image.conf" );
+	g << "z=1\n";
+	ofstream h( "/tmp/nodee-warm/empty.conf" );
+    }
+    ::symlink( "/tmp/nodee-warm-software/image.conf",
+	       "/tmp/nodee-warm/image.conf" );
+    ::symlink( "/proc/kmsg", "/tmp/nodee-warm/kmsg" );
+    ::symlink( "/proc/self", "/tmp/nodee-warm/lib/proc" );
+
+    list<string> hot = Warmup::hotFiles( "/tmp/nodee-warm",
+					 "/tmp/nodee-warm-software",
+					 patterns, 1024 );
+    BOOST_REQUIRE_EQUAL( hot.size(), 4u );
+    BOOST_CHECK( std::find( hot.begin(), hot.end(),
+			    "/tmp/nodee-warm/small.conf" ) != hot.end() );
+    BOOST_CHECK( std::find( hot.begin(), hot.end(),
+			    "/tmp/nodee-warm/image.conf" ) != hot.end() );
+    BOOST_CHECK( std::find( hot.begin(), hot.end(),
+			    "/tmp/nodee-warm/bin/warm" ) != hot.end() );
+
+    BOOST_CHECK( Warmup::hotFiles( "/tmp/nodee-warm", "",
+				   list<string>(), 0 ).empty() );
+    boost::filesystem::remove_all( "/tmp/nodee-warm" );
+    boost::filesystem::remove_all( "/tmp/nodee-warm-software" );
+}
+
+
+#include "log.h"
+
+#include <fcntl.h>
+
+#include <boost/bind.hpp>
+#include <boost/thread.hpp>
+
+static void logLines( int n )
+{
+    int i = 0;
+    while ( i < 1000 ) {
+	debug << "nodee: Test line " << n << " " << i
+	      << Log::kv( "thread", n ) << endl;
+	i++;
+    }
+}
+
+
+BOOST_AUTO_TEST_CASE( Logging )
+{
+    Log::flush();
+    cout.flush();
+    int saved = ::dup( 1 );
+    int fd = ::open( "/tmp/nodee-log", O_WRONLY|O_CREAT|O_TRUNC, 0644 );
+    ::dup2( fd, 1 );
+    ::close( fd );
+
+    Log::start();
+    unsigned long long before = Log::dropped();
+    boost::thread_group threads;
+    int t = 0;
+    while ( t < 4 )
+	threads.create_thread( boost::bind( logLines, t++ ) );
+    threads.join_all();
+
+    debug << "nodee: Quoting" << Log::kv( "a", "b c" )
+	  << Log::kv( "d", "\"" ) << Log::kv( "e", "" ) << endl;
+    Log::setLevel( Log::Info );
+    debug << "nodee: Invisible" << endl;
+    Log::setLevel( "debug" );
+    BOOST_CHECK( !Log::setLevel( "verbose" ) );
+    Log::flush();
+
+    ::dup2( saved, 1 );
+    ::close( saved );
+
+    ifstream in( "/tmp/nodee-log" );
+    string line;
+    unsigned long long lines = 0;
+    bool whole = true;
+    string quoting;
+    while ( getline( in, line ) ) {
+	if ( line.substr( 0, 17 ) == "nodee: Test line " ) {
+	    lines++;
+	    if ( line.size() < 27 ||
+		 line.substr( line.size() - 9, 8 ) != " thread=" )
+		whole = false;
+	} else if ( line.substr( 0, 14 ) == "nodee: Quoting" ) {
+	    quoting = line;
+	}
+	BOOST_CHECK( line != "nodee: Invisible" );
+    }
+    BOOST_CHECK( whole );
+    BOOST_CHECK( lines > 0 );
+    BOOST_CHECK_EQUAL( lines + Log::dropped() - before, 4000u );
+    BOOST_CHECK_EQUAL( quoting,
+		       "nodee: Quoting a=\"b c\" d=\"\\\"\" e=\"\"" );
+    ::unlink( "/tmp/nodee-log" );
+}
+
+
+#include "recorder.h"
+
+BOOST_AUTO_TEST_CASE( FlightRecorder )
+{
+    ::unlink( "/tmp/nodee-recorder" );
+    BOOST_REQUIRE( Recorder::open( "/tmp/nodee-recorder" ) );
+    unsigned int id = Recorder::id( "1.idee-prod.ideeuser.ie" );
+    BOOST_CHECK( id != 0 );
+    BOOST_CHECK( id != Recorder::id( "2.idee-prod.ideeuser.ie" ) );
+
+    Recorder::name( "1.idee-prod.ideeuser.ie" );
+    Recorder::record( Recorder::Forked, 4711, id, 2001, 1 );
+    Recorder::record( Recorder::Exited, 4711, id, -1, 9 );
+    Recorder::close();
+    Recorder::record( Recorder::Stopped, 4711, id );
+
+    // reopening keeps what's there, e.g. after a reboot
+    BOOST_REQUIRE( Recorder::open( "/tmp/nodee-recorder" ) );
+    Recorder::record( Recorder::Killed, 4712, 77, 123456, 250 );
+    Recorder::close();
+
+    list<Recorder::Record> r = Recorder::read( "/tmp/nodee-recorder" );
+    BOOST_REQUIRE_EQUAL( r.size(), 4u );
+    map<unsigned int,string> names;
+    vector<string> lines;
+    list<Recorder::Record>::iterator i( r.begin() );
+    while ( i != r.end() ) {
+	string s = Recorder::describe( *i, names );
+	BOOST_REQUIRE( s.size() > 28 );
+	BOOST_CHECK_EQUAL( s[26], 'Z' );
+	lines.push_back( s.substr( 28 ) );
+	++i;
+    }
+    BOOST_CHECK_EQUAL( lines[0], "named coordinate=1.idee-prod.ideeuser.ie" );
+    BOOST_CHECK_EQUAL( lines[1], "forked pid=4711 "
+		       "coordinate=1.idee-prod.ideeuser.ie uid=2001 starts=1" );
+    BOOST_CHECK_EQUAL( lines[2], "exited pid=4711 "
+		       "coordinate=1.idee-prod.ideeuser.ie status=-1 signal=9" );
+    BOOST_CHECK_EQUAL( lines[3], "killed pid=4712 coordinate=0000004d "
+		       "rsskb=123456 reactionms=250" );
+
+    // the ring wraps, and a record being written when nodee died is
+    // ignored
+    BOOST_REQUIRE( Recorder::open( "/tmp/nodee-recorder" ) );
+    int n = 0;
+    while ( n < Recorder::Records + 10 )
+	Recorder::record( Recorder::Responded, 0, 0, 0, 200, n++ );
+    Recorder::close();
+    {
+	fstream f( "/tmp/nodee-recorder",
+		   ios::in | ios::out | ios::binary );
+	f.seekp( sizeof( Recorder::Record ) * 20 );
+	unsigned long long torn = 0;
+	f.write( (const char *)&torn, sizeof( torn ) );
+    }
+    r = Recorder::read( "/tmp/nodee-recorder" );
+    BOOST_CHECK_EQUAL( r.size(), (unsigned int)Recorder::Records - 1 );
+    BOOST_CHECK_EQUAL( r.front().values[2], 10 );
+    BOOST_CHECK_EQUAL( r.back().values[2], Recorder::Records + 9 );
+
+    BOOST_CHECK( Recorder::read( "/etc/passwd" ).empty() );
+    ::unlink( "/tmp/nodee-recorder" );
+}
+
+
+#include "servicelog.h"
+
+static string readLog( ServiceLog & log, const string & sofar, int size )
+{
+    string r = sofar;
+    int i = 0;
+    while ( (int)r.size() < size && i++ < 250 ) {
+	::usleep( 20000 );
+	r += log.more();
+    }
+    return r;
+}
+
+
+BOOST_AUTO_TEST_CASE( ServiceLogs )
+{
+    boost::filesystem::remove_all( "/tmp/nodee-servicelog" );
+    ::mkdir( "/tmp/nodee-servicelog", 0755 );
+    string path = "/tmp/nodee-servicelog/console.log";
+    int saved = Conf::servicelogsize;
+    Conf::servicelogsize = 1;
+
+    int fds[2];
+    BOOST_REQUIRE( ::pipe( fds ) == 0 );
+    ServiceLog::capture( fds[0], path );
+
+    ServiceLog log( path );
+    BOOST_CHECK_EQUAL( log.tail( 100 ), "" );
+
+    // complete lines are written as they come
+    string written;
+    int i = 0;
+    while ( i < 50 ) {
+	string line = "line " + boost::lexical_cast<string>( i++ ) + "\n";
+	written += line;
+	BOOST_REQUIRE( ::write( fds[1], line.data(), line.size() ) > 0 );
+    }
+    BOOST_REQUIRE( ::write( fds[1], "incomplete", 10 ) == 10 );
+    string seen = readLog( log, "", written.size() );
+    BOOST_CHECK_EQUAL( seen, written );
+
+    // tail starts at a line
+    ServiceLog other( path );
+    BOOST_CHECK_EQUAL( other.tail( 10 ), "line 49\n" );
+
+    // the file is rotated at 1k, and more() follows that
+    string more = string( 300, 'x' ) + "\n";
+    i = 0;
+    while ( i++ < 4 ) {
+	BOOST_REQUIRE( ::write( fds[1], more.data(), more.size() ) > 0 );
+	written += ( i == 1 ? "incomplete" : "" ) + more;
+	seen = readLog( log, seen, written.size() );
+    }
+    BOOST_CHECK_EQUAL( seen, written );
+    BOOST_CHECK( boost::filesystem::exists( path + ".1" ) );
+    BOOST_CHECK( !boost::filesystem::exists( path + ".3" ) );
+
+    // overlong lines are split, and the last line is completed at eof
+    string lng( ServiceLog::LongestLine + 100, 'y' );
+    BOOST_REQUIRE( ::write( fds[1], lng.data(), lng.size() ) > 0 );
+    seen = readLog( log, "", ServiceLog::LongestLine + 1 );
+    BOOST_REQUIRE( ::write( fds[1], "end", 3 ) == 3 );
+    ::close( fds[1] );
+    seen = readLog( log, seen, lng.size() + 5 );
+    BOOST_CHECK_EQUAL( seen.size(), lng.size() + 5 );
+    BOOST_CHECK_EQUAL( seen[ServiceLog::LongestLine], '\n' );
+    BOOST_CHECK_EQUAL( seen.substr( seen.size() - 4 ), "end\n" );
+    BOOST_CHECK_EQUAL( std::count( seen.begin(), seen.end(), '\n' ), 2 );
+
+    Conf::servicelogsize = saved;
+    boost::filesystem::remove_all( "/tmp/nodee-servicelog" );
+}
+
+
+BOOST_AUTO_TEST_CASE( ServiceLogLinks )
+{
+    boost::filesystem::remove_all( "/tmp/nodee-servicelog" );
+    ::mkdir( "/tmp/nodee-servicelog", 0755 );
+    string path = "/tmp/nodee-servicelog/console.log";
+    string victim = "/tmp/nodee-servicelog/victim";
+    {
+	ofstream f( victim.c_str() );
+	f << "secret\n";
+    }
+
+    // a service may replace its log with a link to some other file,
+    // which nodee must neither show nor write to
+    BOOST_REQUIRE( ::symlink( victim.c_str(), path.c_str() ) == 0 );
+    ServiceLog log( path );
+    BOOST_CHECK_EQUAL( log.tail( 100 ), "" );
+    BOOST_REQUIRE( ::unlink( path.c_str() ) == 0 );
+    BOOST_REQUIRE( ::link( victim.c_str(), path.c_str() ) == 0 );
+    ServiceLog hard( path );
+    BOOST_CHECK_EQUAL( hard.tail( 100 ), "" );
+    BOOST_REQUIRE( ::unlink( path.c_str() ) == 0 );
+    BOOST_REQUIRE( ::symlink( victim.c_str(), path.c_str() ) == 0 );
+
+    int fds[2];
+    BOOST_REQUIRE( ::pipe( fds ) == 0 );
+    ServiceLog::capture( fds[0], path );
+    BOOST_REQUIRE( ::write( fds[1], "hello\n", 6 ) == 6 );
+    ::close( fds[1] );
+    BOOST_CHECK_EQUAL( readLog( log, "", 6 ), "hello\n" );
+
+    std::ifstream f( victim.c_str() );
+    string line;
+    std::getline( f, line );
+    BOOST_CHECK_EQUAL( line, "secret" );
+    struct stat st;
+    BOOST_CHECK( ::lstat( path.c_str(), &st ) == 0 && S_ISREG( st.st_mode ) );
+
+    boost::filesystem::remove_all( "/tmp/nodee-servicelog" );
+}
@@ -7,9 +7,12 @@
 #include <boost/tokenizer.hpp>
 #include <boost/filesystem.hpp>
 #include <boost/lexical_cast.hpp>
+#include <boost/thread.hpp>
 
 #include "uid.h"
 
+#include <sys/stat.h>
+
 using namespace std;
 using namespace boost::filesystem;
 
@@ -130,34 +133,167 @@ set<int> inProc( bool gid, const char * proc ) {
 }
 
 
-// return the smallest integer 2000 <= x <= 60000 that's not in use
-// either in /etc/passwd or for a running process. 60000 means
-// failure. in that case we're managing 58000 services, which seems
-// high.
-
-int chooseFreeUid() {
-    set<int> passwd = inPasswd( false, "/etc/passwd" );
-    set<int> running = inProc( false, "/proc" );
-    int i = 2000;
-    while ( i < 60000 &&
-	    ( passwd.find( i ) != passwd.end() ||
-	      running.find( i ) != running.end() ) )
-	i++;
-    return i;
+/*! \class IdPool uid.h
+
+    The IdPool class hands out UIDs (or GIDs) for services to run as,
+    without scanning /etc and /proc for each launch.
+
+    There are two pools, uids() and gids(). Each reads /etc/passwd
+    (and /etc/group, for GIDs) and the IDs of all running processes
+    once, and keeps bitmaps of the IDs in the range First-Last that
+    are listed, running or leased. lease() then finds a free ID by
+    looking at the bitmaps, round-robin, and release() puts an ID in
+    quarantine for Quarantine seconds before it can be leased again,
+    so a new service won't share its UID with a dying one's leftover
+    children.
+
+    The bitmaps are kept up to date lazily: lease() rereads the files
+    if they've changed, which costs a stat(), and Sweeper calls
+    reconcile() once a minute to reread /proc.
+*/
+
+
+/*! Returns the pool of UIDs. */
+
+IdPool & IdPool::uids()
+{
+    static IdPool * p = new IdPool( false );
+    return *p;
+}
+
+
+/*! Returns the pool of GIDs. */
+
+IdPool & IdPool::gids()
+{
+    static IdPool * p = new IdPool( true );
+    return *p;
+}
+
+
+/*! Constructs an empty pool for GIDs if \a g is true, UIDs if not.
+    Nothing is read until the pool is used.
+*/
+
+IdPool::IdPool( bool g )
+    : gid( g ), scanned( false ),
+      listed( Last + 1 ), running( Last + 1 ),
+      leased( Last + 1 ), cooling( Last + 1 ),
+      next( First ), filesChanged( 0 )
+{
+}
+
+
+/*! Returns an ID that's not listed in /etc, used by any process or
+    leased, and leases it. The ID stays leased until release().
+    Returns Last if there is no such ID, which means that nodee
+    manages tens of thousands of services and seems unlikely.
+*/
+
+int IdPool::lease()
+{
+    if ( !scanned )
+	reconcile();
+
+    time_t now = ::time( 0 );
+    boost::lock_guard<boost::mutex> l( mutex );
+
+    while ( !quarantined.empty() && quarantined.front().first <= now ) {
+	int id = quarantined.front().second;
+	leased[id] = false;
+	cooling[id] = false;
+	quarantined.pop_front();
+    }
+
+    readFiles();
+
+    int n = Last - First;
+    int id = next;
+    while ( n > 0 ) {
+	if ( id >= Last )
+	    id = First;
+	if ( !listed[id] && !running[id] && !leased[id] ) {
+	    leased[id] = true;
+	    next = id + 1;
+	    return id;
+	}
+	id++;
+	n--;
+    }
+    return Last;
+}
+
+
+/*! Puts \a id, which lease() returned, in quarantine. It can be
+    leased again after Quarantine seconds. Does nothing if \a id
+    isn't leased, so it's harmless to release an ID twice or to
+    release one that wasn't leased.
+*/
+
+void IdPool::release( int id )
+{
+    if ( id < First || id >= Last )
+	return;
+    boost::lock_guard<boost::mutex> l( mutex );
+    if ( !leased[id] || cooling[id] )
+	return;
+    cooling[id] = true;
+    quarantined.push_back( make_pair( ::time( 0 ) + Quarantine, id ) );
 }
 
-// as for chooseFreeUid(), except a gid, and anything mentioned in
-// /etc/group is used, too.
-
-int chooseFreeGid() {
-    set<int> group = inGroup();
-    set<int> passwd = inPasswd( true, "/etc/passwd" );
-    set<int> running = inProc( true, "/proc" );
-    int i = 2000;
-    while ( i < 60000 &&
-	    ( group.find( i ) != group.end() ||
-	      passwd.find( i ) != passwd.end() ||
-	      running.find( i ) != running.end() ) )
-	i++;
-    return i;
+
+/*! Rereads /etc and /proc, so that IDs others have started using
+    aren't leased, and IDs that still are used after quarantine
+    aren't leased again until the processes using them are gone.
+*/
+
+void IdPool::reconcile()
+{
+    std::set<int> r = inProc( gid, "/proc" );
+    boost::lock_guard<boost::mutex> l( mutex );
+    set( running, r );
+    filesChanged = 0;
+    readFiles();
+    scanned = true;
+}
+
+
+/*! Rereads /etc/passwd and, for GIDs, /etc/group, if either has
+    changed since the last time.
+*/
+
+void IdPool::readFiles()
+{
+    struct stat st;
+    time_t changed = 0;
+    if ( ::stat( "/etc/passwd", &st ) == 0 )
+	changed = st.st_mtime;
+    if ( gid && ::stat( "/etc/group", &st ) == 0 && st.st_mtime > changed )
+	changed = st.st_mtime;
+    if ( changed && changed == filesChanged )
+	return;
+    filesChanged = changed;
+
+    std::set<int> l = inPasswd( gid, "/etc/passwd" );
+    if ( gid ) {
+	std::set<int> g = inGroup();
+	l.insert( g.begin(), g.end() );
+    }
+    set( listed, l );
+}
+
+
+/*! Sets the bits in \a bitmap that are in \a ids, and clears the
+    others.
+*/
+
+void IdPool::set( vector<bool> & bitmap, const std::set<int> & ids )
+{
+    bitmap.assign( bitmap.size(), false );
+    std::set<int>::const_iterator i( ids.begin() );
+    while ( i != ids.end() ) {
+	if ( *i >= 0 && *i < (int)bitmap.size() )
+	    bitmap[*i] = true;
+	++i;
+    }
 }
@@ -3,10 +3,44 @@
 #ifndef UID_H
 #define UID_H
 
+#include <list>
 #include <set>
+#include <vector>
 
-int chooseFreeUid();
-int chooseFreeGid();
+#include <time.h>
+
+#include <boost/thread/mutex.hpp>
+
+
+class IdPool
+{
+public:
+    static IdPool & uids();
+    static IdPool & gids();
+
+    int lease();
+    void release( int );
+    void reconcile();
+
+    enum { First = 2000, Last = 60000, Quarantine = 600 };
+
+private:
+    IdPool( bool );
+    void readFiles();
+    void set( std::vector<bool> &, const std::set<int> & );
+
+private:
+    bool gid;
+    bool scanned;
+    std::vector<bool> listed;
+    std::vector<bool> running;
+    std::vector<bool> leased;
+    std::vector<bool> cooling;
+    std::list< std::pair<time_t,int> > quarantined;
+    int next;
+    time_t filesChanged;
+    boost::mutex mutex;
+};
 
 // only for testing:
 std::set<int> inPasswd( bool gid, const char * filename );
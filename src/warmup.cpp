@@ -0,0 +1,192 @@
+// Copyright Arnt Gulbrandsen <arnt@gulbrandsen.priv.no>; BSD-licensed.
+
+#include "warmup.h"
+
+#include "log.h"
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <fnmatch.h>
+#include <limits.h>
+#include <stdlib.h>
+
+#include <vector>
+
+
+/*! \class Warmup warmup.h
+
+    The Warmup class is an optional stage between installing a
+    service and starting it, which reads the service's files into the
+    page cache. A JVM that starts right after install otherwise
+    spends its first seconds taking major faults on jar files and
+    native libraries, which is slow and looks like thrashing to
+    ChoreKeeper.
+
+    The ServerSpec says which files are hot, using shell patterns
+    relative to the service's root, and/or that all files up to a
+    certain size should be read. hotFiles() finds them. start() asks
+    the kernel to read them all using posix_fadvise(), so the reads
+    run in parallel, and then reads through each to wait for the
+    data. At most a quarter of the host's RAM is read.
+
+    Warmup runs as the service's user, since the root belongs to the
+    service, and it never fails: Whatever happens, the service starts
+    afterwards. It reads only regular files that aren't empty, and
+    follows only the symbolic links the install script makes into a
+    mounted image, so a link to e.g. /proc/kmsg cannot make it hang.
+*/
+
+
+/*! Constructs a Warmup which will run as \a uid and \a gid.
+    Process::launch() gives it a ServerSpec and puts it between the
+    install stage and the service.
+*/
+
+Warmup::Warmup( int uid, int gid )
+    : Process( uid, gid )
+{
+}
+
+
+/*! Called in the child process; reads the hot files and exits. */
+
+void Warmup::start()
+{
+    if ( !inChild() )
+	return;
+
+    long long budget = (long long)::sysconf( _SC_PHYS_PAGES ) *
+		       ::sysconf( _SC_PAGESIZE ) / 4;
+    list<string> files = hotFiles( root(), software(),
+				   spec().warmupFiles(),
+				   spec().warmupLimit() * 1024LL );
+
+    // first let the kernel queue all the reads, then wait for them
+    list<string> queued;
+    long long total = 0;
+    list<string>::iterator i( files.begin() );
+    while ( i != files.end() && total < budget ) {
+	// the file may have been replaced since hotFiles() looked
+	int fd = ::open( i->c_str(), O_RDONLY | O_NONBLOCK );
+	struct stat st;
+	if ( fd >= 0 && ::fstat( fd, &st ) == 0 &&
+	     S_ISREG( st.st_mode ) && st.st_size > 0 ) {
+	    (void)::posix_fadvise( fd, 0, 0, POSIX_FADV_WILLNEED );
+	    total += st.st_size;
+	    queued.push_back( *i );
+	}
+	if ( fd >= 0 )
+	    ::close( fd );
+	++i;
+    }
+
+    vector<char> buffer( 1024 * 1024 );
+    i = queued.begin();
+    while ( i != queued.end() ) {
+	int fd = ::open( i->c_str(), O_RDONLY | O_NONBLOCK );
+	if ( fd >= 0 ) {
+	    while ( ::read( fd, &buffer[0], buffer.size() ) > 0 )
+		;
+	    ::close( fd );
+	}
+	++i;
+    }
+
+    debug << "nodee: Warmed up " << queued.size() << " files, "
+	  << total / 1024 << "kB, for " << spec().coordinate() << endl;
+    ::exit( 0 );
+}
+
+
+/*! Returns the files below \a root that match one of \a patterns,
+    followed by the other files of at most \a limit bytes. The
+    patterns are matched against the path relative to \a root, as by
+    the shell. Empty files and anything but regular files are
+    skipped, and each file is listed once even if it has several
+    names.
+
+    Symbolic links are followed only if they're in \a root itself and
+    point directly into \a software, as the install script links a
+    mounted image into the root.
+*/
+
+list<string> Warmup::hotFiles( const string & root,
+			       const string & software,
+			       const list<string> & patterns,
+			       long long limit )
+{
+    list<string> hot;
+    list<string> small;
+    set< pair<dev_t,ino_t> > seen;
+    collect( root, "", software, patterns, -1, seen, hot, 0 );
+    if ( limit > 0 )
+	collect( root, "", software, list<string>(), limit, seen, small, 0 );
+    hot.splice( hot.end(), small );
+    return hot;
+}
+
+
+/*! Adds the files in \a dir (called \a relative relative to the
+    root) that match \a patterns or are at most \a limit bytes to \a
+    result, skipping those in \a seen. Symbolic links in the root
+    into \a software are followed. \a depth guards against loops.
+*/
+
+void Warmup::collect( const string & dir, const string & relative,
+		      const string & software,
+		      const list<string> & patterns, long long limit,
+		      set< pair<dev_t,ino_t> > & seen,
+		      list<string> & result, int depth )
+{
+    if ( depth > 16 || ( patterns.empty() && limit < 0 ) )
+	return;
+    DIR * d = ::opendir( dir.c_str() );
+    if ( !d )
+	return;
+    struct dirent * e;
+    while ( ( e = ::readdir( d ) ) != 0 ) {
+	string name = e->d_name;
+	if ( name == "." || name == ".." || ( name == "tmp" && depth == 0 ) )
+	    continue;
+	string path = dir + "/" + name;
+	string rel = relative.empty() ? name : relative + "/" + name;
+	struct stat st;
+	if ( ::lstat( path.c_str(), &st ) < 0 )
+	    continue;
+	if ( S_ISLNK( st.st_mode ) ) {
+	    char target[PATH_MAX];
+	    int n = ::readlink( path.c_str(), target, sizeof( target ) - 1 );
+	    if ( depth > 0 || software.empty() || n <= 0 )
+		continue;
+	    target[n] = 0;
+	    string t( target );
+	    if ( t.compare( 0, software.size() + 1, software + "/" ) ||
+		 t.find( "/.." ) != string::npos ||
+		 ::lstat( target, &st ) < 0 || S_ISLNK( st.st_mode ) )
+		continue;
+	}
+	if ( S_ISDIR( st.st_mode ) ) {
+	    collect( path, rel, software, patterns, limit, seen, result,
+		     depth + 1 );
+	    continue;
+	}
+	if ( !S_ISREG( st.st_mode ) || st.st_size == 0 ||
+	     seen.count( make_pair( st.st_dev, st.st_ino ) ) )
+	    continue;
+	bool wanted = limit >= 0 && st.st_size <= limit;
+	list<string>::const_iterator p( patterns.begin() );
+	while ( !wanted && p != patterns.end() ) {
+	    if ( !::fnmatch( p->c_str(), rel.c_str(), FNM_PATHNAME ) )
+		wanted = true;
+	    ++p;
+	}
+	if ( wanted ) {
+	    seen.insert( make_pair( st.st_dev, st.st_ino ) );
+	    result.push_back( path );
+	}
+    }
+    ::closedir( d );
+}
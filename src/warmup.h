@@ -0,0 +1,34 @@
+// Copyright Arnt Gulbrandsen <arnt@gulbrandsen.priv.no>; BSD-licensed.
+
+#ifndef WARMUP_H
+#define WARMUP_H
+
+#include "process.h"
+
+#include <sys/types.h>
+
+#include <list>
+#include <set>
+#include <string>
+
+using namespace std;
+
+
+class Warmup: public Process
+{
+public:
+    Warmup( int, int );
+
+    void start();
+
+    static list<string> hotFiles( const string &, const string &,
+				  const list<string> &, long long );
+
+private:
+    static void collect( const string &, const string &, const string &,
+			 const list<string> &, long long,
+			 set< pair<dev_t,ino_t> > &, list<string> &, int );
+};
+
+
+#endif
@@ -0,0 +1,139 @@
+// Copyright Arnt Gulbrandsen <arnt@gulbrandsen.priv.no>; BSD-licensed.
+
+#include "writer.h"
+
+
+/*! \class Writer writer.h
+
+    The Writer class is the interface shared by JsonWriter and
+    CborWriter. The code that produces API responses and the
+    zookeeper node (Service::list(), HostStatus::write() and so on)
+    does so using a Writer, so the JSON and CBOR forms of each
+    response have the same structure and cannot drift apart.
+
+    A Writer appends to a string supplied by the caller.
+    CborReader::read() can feed any Writer, which is how CBOR is
+    turned back into JSON.
+*/
+
+
+/*! Constructs a Writer which appends to \a output. */
+
+Writer::Writer( string & output )
+    : o( output )
+{
+}
+
+
+/*! Destroys the Writer without touching its output. */
+
+Writer::~Writer()
+{
+}
+
+
+/*! \fn void Writer::startObject()
+
+    Starts an object. Each member must then be written using member()
+    and a value, and the object finished using endObject().
+*/
+
+/*! \fn void Writer::member( const string & name )
+
+    Writes the \a name of the next member of the current object. The
+    next call must write its value.
+*/
+
+/*! \fn void Writer::endObject()
+
+    Finishes the current object.
+*/
+
+/*! \fn void Writer::startArray()
+
+    Starts an array. Each element must then be written using one of
+    the value functions, and the array finished using endArray().
+*/
+
+/*! \fn void Writer::endArray()
+
+    Finishes the current array.
+*/
+
+/*! \fn void Writer::text( const string & s )
+
+    Writes \a s as a string. Bytes that aren't part of valid UTF-8
+    are replaced by U+FFFD.
+*/
+
+/*! \fn void Writer::number( long long n )
+
+    Writes the integer \a n.
+*/
+
+/*! \fn void Writer::boolean( bool b )
+
+    Writes \a b as true or false.
+*/
+
+/*! \fn void Writer::raw( const string & json )
+
+    Writes \a json, which must be a complete JSON value, such as one
+    returned by JsonParser::raw(). This is how values nodee doesn't
+    understand are passed on.
+*/
+
+
+/*! Makes room for \a n more bytes of output, so a caller that knows
+    roughly how much it'll write can avoid repeated reallocation.
+*/
+
+void Writer::reserve( string::size_type n )
+{
+    o.reserve( o.size() + n );
+}
+
+
+/*! Returns the length of the valid UTF-8 sequence starting at \a i
+    in \a s, or 0 if the byte there doesn't start one. Overlong forms
+    and surrogates are invalid.
+*/
+
+unsigned int Writer::utf8( const string & s, string::size_type i )
+{
+    unsigned char c = s[i];
+    if ( c < 0x80 )
+	return 1;
+
+    // figure out how long a sequence c starts, and the smallest code
+    // point that may use that length
+    unsigned int n = 0;
+    unsigned long u = 0;
+    unsigned long min = 0;
+    if ( c >= 0xc2 && c < 0xe0 ) {
+	n = 2;
+	u = c & 0x1f;
+	min = 0x80;
+    } else if ( c >= 0xe0 && c < 0xf0 ) {
+	n = 3;
+	u = c & 0x0f;
+	min = 0x800;
+    } else if ( c >= 0xf0 && c < 0xf5 ) {
+	n = 4;
+	u = c & 0x07;
+	min = 0x10000;
+    } else {
+	return 0;
+    }
+
+    unsigned int l = 1;
+    while ( l < n ) {
+	if ( i + l >= s.size() || ( (unsigned char)s[i+l] & 0xc0 ) != 0x80 )
+	    return 0;
+	u = ( u << 6 ) | ( s[i+l] & 0x3f );
+	l++;
+    }
+    if ( u < min || u >= 0x110000 || ( u >= 0xd800 && u < 0xe000 ) )
+	return 0;
+    return n;
+}
@@ -0,0 +1,38 @@
+// Copyright Arnt Gulbrandsen <arnt@gulbrandsen.priv.no>; BSD-licensed.
+
+#ifndef WRITER_H
+#define WRITER_H
+
+#include <string>
+
+using namespace std;
+
+
+class Writer
+{
+public:
+    Writer( string & );
+    virtual ~Writer();
+
+    virtual void startObject() = 0;
+    virtual void member( const string & ) = 0;
+    virtual void endObject() = 0;
+    virtual void startArray() = 0;
+    virtual void endArray() = 0;
+
+    virtual void text( const string & ) = 0;
+    virtual void number( long long ) = 0;
+    virtual void boolean( bool ) = 0;
+    virtual void raw( const string & ) = 0;
+
+    void reserve( string::size_type );
+
+protected:
+    static unsigned int utf8( const string &, string::size_type );
+
+protected:
+    string & o;
+};
+
+
+#endif
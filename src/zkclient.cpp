@@ -4,6 +4,7 @@
 #include "log.h"
 
 #include "hoststatus.h"
+#include "conf.h"
 
 #include <sysexits.h>
 
@@ -22,6 +23,16 @@ static boost::mutex zkmutex; // we don't need it, but we must fill in forms
 static boost::condition_variable zkwaiter; // what we do need
 
 
+// the content of our zk node, in the format --zookeeper-cbor asks for
+static string status()
+{
+    HostStatus s;
+    if ( Conf::zkcbor )
+	return s.cbor();
+    return s;
+}
+
+
 static void watcher( zhandle_t * zzh,
 		     int type, int state,
 		     const char *, void* )
@@ -127,7 +138,7 @@ ZkClient::ZkClient( const std::string & server )
     ::gethostname( tmp, 1024 );
     tmp[1024] = 0;
     path += tmp; // by this time path is right for start() to use
-    string status = HostStatus();
+    string status = ::status();
     r = zoo_create( zh,
 		    path.c_str(),
 		    status.c_str(), status.length(),
@@ -198,7 +209,7 @@ void ZkClient::start()
     while( true ) {
 	::sleep( 128 );
 
-	string status = HostStatus();
+	string status = ::status();
 	int r = zoo_set( zh, path.c_str(),
 			 status.data(), status.length(),
 			 -1 );